@@ -130,6 +130,7 @@ typedef struct _Type {
     int align;
     bool usig; // true if unsigned
     bool isstatic;
+    bool isvolatile;
     // pointer or array
     struct _Type* ptr;
     // array length
@@ -176,6 +177,8 @@ typedef struct _Node {
             // local
             int loff;
             Vector* lvarinit;
+            // Register the variable lives in, or NULL if it is in memory
+            char* lreg;
             // global
             char* glabel;
         };
@@ -199,6 +202,7 @@ typedef struct _Node {
             Vector* params;
             Vector* localvars;
             struct _Node* body;
+            bool hasvolatile;  // Accesses a volatile object
         };
         // Declaration
         struct {
@@ -235,6 +239,42 @@ typedef struct _Node {
     };
 } Node;
 
+// IR line kinds
+#define INST_OP        0 // An instruction such as "add A, B"
+#define INST_LABEL     1 // A label definition
+#define INST_NOTE      2 // Comments, .file and .loc; no effect on the code
+#define INST_DIRECTIVE 3 // Any other directive
+
+// A line of IR, buffered while a function is being generated so that it
+// can be optimized before being written out.
+typedef struct _Inst {
+    int kind;
+    char* op;        // Mnemonic for INST_OP, name for INST_LABEL
+    char* args[3];
+    int nargs;
+    char* text;      // The line as emitted, or NULL if it was rewritten
+} Inst;
+
+// A basic block of a function's IR.
+typedef struct _Block {
+    int id;
+    int begin, end;  // Indexes of its first line and the line after it
+    Vector* succs;   // Blocks control can flow to
+    Vector* preds;
+    int live_in;     // Registers live on entry and exit, as reg_bit masks
+    int live_out;
+} Block;
+
+// The control flow graph of a function's IR, built by make_cfg.
+typedef struct {
+    Vector* insts;
+    Vector* blocks;
+    Map* labels;     // Label name to the Block it starts
+    int nwords;      // Size of a row of dom in words
+    uint64_t* dom;   // Row b has a bit set for each block dominating b
+    bool indirect;   // Some label may be reached by a computed goto
+} Cfg;
+
 enum {
     AST_LITERAL = 256,
     AST_LVAR,
@@ -296,16 +336,29 @@ extern Type* type_ldouble;
 #define EMPTY_VECTOR ((Vector){})
 
 #include "headers/buffer.h"
+#include "headers/cfg.h"
 #include "headers/cpp.h"
+#include "headers/dce.h"
 #include "headers/debug.h"
+#include "headers/dse.h"
 #include "headers/dict.h"
 #include "headers/encoding.h"
 #include "headers/error.h"
+#include "headers/eval.h"
 #include "headers/file.h"
+#include "headers/fold.h"
+#include "headers/fpo.h"
 #include "headers/gen.h"
+#include "headers/inline.h"
+#include "headers/ir.h"
 #include "headers/lex.h"
+#include "headers/loop.h"
+#include "headers/lvn.h"
 #include "headers/map.h"
 #include "headers/parse.h"
+#include "headers/pass.h"
+#include "headers/peephole.h"
+#include "headers/sccp.h"
 #include "headers/set.h"
 #include "headers/vector.h"
 
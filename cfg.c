@@ -0,0 +1,326 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Control flow graph of a function's IR.
+//
+// A block starts at a label, or after a jump, and ends before the next
+// one. Jumps to local labels and conditional jumps have the obvious
+// successors. A jump anywhere else is a call, a return or a computed
+// goto. A call is followed by the label it returns to, which is its
+// successor. The others may reach any label whose address is taken
+// other than return addresses; they leave the function with B and the
+// registers it has to preserve live.
+
+#include <stdlib.h>
+#include <string.h>
+#include "headers/cfg.h"
+
+// Registers live after a call, for the callee, and after a return, for
+// the caller.
+static int call_live;
+static int exit_live;
+
+static Block* make_block(Cfg* cfg, int begin) {
+    Block* b = calloc(1, sizeof(Block));
+    b->id = vec_len(cfg->blocks);
+    b->begin = begin;
+    b->end = begin;
+    b->succs = make_vector();
+    b->preds = make_vector();
+    vec_push(cfg->blocks, b);
+    return b;
+}
+
+// Returns the last instruction of the block, or NULL if it has none.
+Inst* block_last(Cfg* cfg, Block* b) {
+    for (int i = b->end - 1; i >= b->begin; i--) {
+        Inst* inst = vec_get(cfg->insts, i);
+        if (inst->kind == INST_OP)
+            return inst;
+    }
+    return NULL;
+}
+
+static bool has_op(Cfg* cfg, Block* b) {
+    return block_last(cfg, b) != NULL;
+}
+
+// Returns the first label of the block, or NULL if it has none.
+char* block_label(Cfg* cfg, Block* b) {
+    for (int i = b->begin; i < b->end; i++) {
+        Inst* inst = vec_get(cfg->insts, i);
+        if (inst->kind == INST_LABEL)
+            return inst->op;
+        if (inst->kind != INST_NOTE)
+            return NULL;
+    }
+    return NULL;
+}
+
+static void add_edge(Block* from, Block* to) {
+    if (!to)
+        return;
+    for (int i = 0; i < vec_len(from->succs); i++)
+        if (vec_get(from->succs, i) == to)
+            return;
+    vec_push(from->succs, to);
+    vec_push(to->preds, from);
+}
+
+// A jump to somewhere else than a label of this function.
+static bool is_far_jump(Cfg* cfg, Inst* inst) {
+    return inst_is(inst, "jmp") && !map_get(cfg->labels, inst->args[0]);
+}
+
+static void split_blocks(Cfg* cfg) {
+    Block* b = make_block(cfg, 0);
+    for (int i = 0; i < vec_len(cfg->insts); i++) {
+        Inst* inst = vec_get(cfg->insts, i);
+        if (inst->kind == INST_LABEL && has_op(cfg, b))
+            b = make_block(cfg, i);
+        b->end = i + 1;
+        if (inst->kind == INST_LABEL)
+            map_put(cfg->labels, inst->op, b);
+        if (inst_is(inst, "jmp") || is_cond_jump(inst))
+            b = make_block(cfg, i + 1);
+    }
+}
+
+static void add_edges(Cfg* cfg, Map* addr_taken) {
+    // Labels whose address is taken, by data or by an instruction.
+    // The value is the index of the instruction taking it plus one, or -1
+    // if there are several or data takes it.
+    Vector* targets = make_vector();
+    Map* is_target = make_map();
+    for (int i = 0; i < vec_len(cfg->insts); i++) {
+        Inst* inst = vec_get(cfg->insts, i);
+        if (inst->kind == INST_LABEL && map_get(addr_taken, inst->op))
+            map_put(is_target, inst->op, (void*)-1);
+        if (inst->kind != INST_OP || inst_is(inst, "jmp") || is_cond_jump(inst))
+            continue;
+        for (int j = 0; j < inst->nargs; j++)
+            if (map_get(cfg->labels, inst->args[j]))
+                map_put(is_target, inst->args[j], map_get(is_target, inst->args[j]) ? (void*)-1 : (void*)(intptr_t)(i + 1));
+    }
+    int n = vec_len(cfg->blocks);
+    for (int i = 0; i < n; i++) {
+        Block* b = vec_get(cfg->blocks, i);
+        char* label = block_label(cfg, b);
+        Block* prev = i ? vec_get(cfg->blocks, i - 1) : NULL;
+        bool is_return_site = prev && is_far_jump(cfg, block_last(cfg, prev));
+        intptr_t taker = label ? (intptr_t)map_get(is_target, label) : 0;
+        if (taker && !is_return_site)
+            vec_push(targets, b);
+        // A return address is pushed right before the call.
+        if (taker && (!is_return_site || taker <= prev->begin || taker > prev->end))
+            cfg->indirect = true;
+    }
+    for (int i = 0; i < n; i++) {
+        Block* b = vec_get(cfg->blocks, i);
+        Block* next = (i + 1 < n) ? vec_get(cfg->blocks, i + 1) : NULL;
+        Inst* last = block_last(cfg, b);
+        if (is_cond_jump(last)) {
+            add_edge(b, map_get(cfg->labels, last->args[0]));
+            add_edge(b, next);
+        } else if (!is_far_jump(cfg, last)) {
+            add_edge(b, inst_is(last, "jmp") ? map_get(cfg->labels, last->args[0]) : next);
+        } else if (next && block_label(cfg, next) && map_get(is_target, block_label(cfg, next))) {
+            add_edge(b, next);
+            b->live_out = call_live;
+        } else {
+            for (int j = 0; j < vec_len(targets); j++)
+                add_edge(b, vec_get(targets, j));
+            b->live_out = exit_live;
+        }
+    }
+}
+
+static void compute_liveness(Cfg* cfg) {
+    int n = vec_len(cfg->blocks);
+    int* use = calloc(n, sizeof(int));
+    int* def = calloc(n, sizeof(int));
+    for (int i = 0; i < n; i++) {
+        Block* b = vec_get(cfg->blocks, i);
+        for (int j = b->begin; j < b->end; j++) {
+            Inst* inst = vec_get(cfg->insts, j);
+            if (inst->kind != INST_OP)
+                continue;
+            use[i] |= inst_read_mask(inst) & ~def[i];
+            def[i] |= inst_write_mask(inst);
+        }
+        b->live_in = use[i] | (b->live_out & ~def[i]);
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = n - 1; i >= 0; i--) {
+            Block* b = vec_get(cfg->blocks, i);
+            for (int j = 0; j < vec_len(b->succs); j++)
+                b->live_out |= ((Block*)vec_get(b->succs, j))->live_in;
+            int in = use[i] | (b->live_out & ~def[i]);
+            if (in != b->live_in) {
+                b->live_in = in;
+                changed = true;
+            }
+        }
+    }
+    free(use);
+    free(def);
+}
+
+static bool is_entry(Cfg* cfg, int i) {
+    return i == 0 || !vec_len(((Block*)vec_get(cfg->blocks, i))->preds);
+}
+
+static void compute_dominators(Cfg* cfg) {
+    int n = vec_len(cfg->blocks);
+    int w = cfg->nwords = (n + 63) / 64;
+    cfg->dom = malloc(n * w * sizeof(uint64_t));
+    uint64_t* tmp = malloc(w * sizeof(uint64_t));
+    // The first block and blocks without predecessors are entry points,
+    // dominated by nothing else; the others start out dominated by
+    // everything.
+    for (int i = 0; i < n; i++) {
+        memset(&cfg->dom[i * w], is_entry(cfg, i) ? 0 : 0xff, w * sizeof(uint64_t));
+        cfg->dom[i * w + i / 64] |= 1UL << (i % 64);
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < n; i++) {
+            Block* b = vec_get(cfg->blocks, i);
+            if (is_entry(cfg, i))
+                continue;
+            memset(tmp, 0xff, w * sizeof(uint64_t));
+            for (int j = 0; j < vec_len(b->preds); j++) {
+                Block* p = vec_get(b->preds, j);
+                for (int k = 0; k < w; k++)
+                    tmp[k] &= cfg->dom[p->id * w + k];
+            }
+            tmp[i / 64] |= 1UL << (i % 64);
+            if (memcmp(tmp, &cfg->dom[i * w], w * sizeof(uint64_t))) {
+                memcpy(&cfg->dom[i * w], tmp, w * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    }
+    free(tmp);
+}
+
+// Returns true if every path from an entry point to b goes through a.
+bool dominates(Cfg* cfg, Block* a, Block* b) {
+    return cfg->dom[b->id * cfg->nwords + a->id / 64] >> (a->id % 64) & 1;
+}
+
+// Functions that may return more than once. When they do, the memory of
+// the frame may have been written after the first return.
+static char* returns_twice[] = { "setjmp", "savectx", "vfork", "getcontext" };
+
+static bool is_returns_twice(char* name) {
+    for (int i = 0; i < sizeof(returns_twice) / sizeof(*returns_twice); i++)
+        if (strstr(name, returns_twice[i]))
+            return true;
+    return false;
+}
+
+// Updates `mask`, the registers that may hold an address in the frame,
+// for the instruction. Returns false if it lets such an address escape:
+// stores it, computes with it beyond adding offsets, or jumps to it.
+static bool frame_step(Cfg* cfg, Inst* inst, int* mask) {
+    if (inst->kind != INST_OP)
+        return true;
+    char* op = inst->op;
+    // SP points below the frame, but a copy of it may be moved up into it.
+    int src = *mask | reg_bit("SP");
+    int d = reg_bit(inst->args[0]);
+    if (!strcmp(op, "mov") || !strcmp(op, "add") || !strcmp(op, "sub")) {
+        bool frame = src & reg_bit(inst->args[1]);
+        if (strcmp(op, "mov"))
+            frame = frame || (src & d);
+        *mask = frame ? (*mask | d) : (*mask & ~d);
+        *mask &= ~reg_bit("SP");
+        return true;
+    }
+    if (is_comp_op(op)) {
+        *mask &= ~d;
+        return true;
+    }
+    if (op_width(op, "load")) {
+        *mask &= ~d;
+    } else if (op_width(op, "store") || is_rmw_op(op)) {
+        if (src & reg_bit(is_rmw_op(op) ? inst->args[1] : inst->args[0]))
+            return false;
+    } else if (is_cond_jump(inst) || !strcmp(op, "memcpy") || !strcmp(op, "memset")) {
+        return true;
+    } else if (!strcmp(op, "jmp")) {
+        // A function returning a struct returns its address in B, which
+        // may be in the frame the caller copies it from.
+        if (map_get(cfg->labels, inst->args[0]))
+            return true;
+        return !(src & (reg_bit(inst->args[0]) | reg_bit("B"))) && !is_returns_twice(inst->args[0]);
+    } else if (is_simple_inst(inst)) {
+        if (inst_read_mask(inst) & src)
+            return false;
+        *mask &= ~d;
+        return true;
+    } else {
+        return false;
+    }
+    if (has_mem_arg(inst))
+        *mask &= ~reg_bit("B");
+    return true;
+}
+
+// Returns, for each instruction, the registers that may hold an address
+// in the function's own frame when it runs, as a reg_bit mask. BP does
+// once the prologue has set it. Returns NULL if such an address may
+// escape, in which case anything may access the frame, or if memory of
+// the frame may change behind the function's back.
+int* frame_pointers(Cfg* cfg) {
+    int n = vec_len(cfg->blocks);
+    int* in = calloc(n, sizeof(int));
+    int* r = calloc(vec_len(cfg->insts), sizeof(int));
+    int clobbered = reg_bit("A") | reg_bit("B") | reg_bit("C") | reg_bit("D");
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < n; i++) {
+            Block* b = vec_get(cfg->blocks, i);
+            int mask = in[i];
+            for (int j = b->begin; j < b->end; j++) {
+                r[j] = mask;
+                if (!frame_step(cfg, vec_get(cfg->insts, j), &mask)) {
+                    free(in);
+                    free(r);
+                    return NULL;
+                }
+            }
+            if (is_far_jump(cfg, block_last(cfg, b)))
+                mask &= ~clobbered;
+            for (int j = 0; j < vec_len(b->succs); j++) {
+                Block* s = vec_get(b->succs, j);
+                if ((in[s->id] | mask) != in[s->id]) {
+                    in[s->id] |= mask;
+                    changed = true;
+                }
+            }
+        }
+    }
+    free(in);
+    return r;
+}
+
+// Builds the graph of `insts`, which must not have deleted entries.
+// `addr_taken` holds the labels referenced by data, such as switch jump
+// tables.
+Cfg* make_cfg(Vector* insts, Map* addr_taken) {
+    if (!exit_live) {
+        call_live = reg_bit("SP") | reg_bit("BP");
+        exit_live = call_live | reg_bit("B") | reg_bit("E") | reg_bit("F") | reg_bit("G") | reg_bit("H");
+    }
+    Cfg* cfg = calloc(1, sizeof(Cfg));
+    cfg->insts = insts;
+    cfg->blocks = make_vector();
+    cfg->labels = make_map();
+    split_blocks(cfg);
+    add_edges(cfg, addr_taken);
+    compute_liveness(cfg);
+    compute_dominators(cfg);
+    return cfg;
+}
@@ -1045,6 +1045,7 @@ static Token* maybe_convert_keyword(Token* tok) {
 void read_from_string(char* buf) {
     stream_stash(make_file_string(buf));
     Vector* toplevels = read_toplevels();
+    run_ast_passes(toplevels);
     for (int i = 0; i < vec_len(toplevels); i++)
         emit_toplevel(vec_get(toplevels, i));
     stream_unstash();
@@ -0,0 +1,83 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Unreachable code elimination.
+//
+// The code generator works one AST node at a time, so it emits code after
+// return, goto and break statements, both branches of an if whose
+// condition turned out to be constant, and the epilogue of functions that
+// already returned. This pass walks the control flow from the entry point
+// of a function and removes the instructions that are never reached.
+//
+// Labels whose address is taken, either by an instruction such as the
+// return address of a call or by data such as a switch jump table, may be
+// reached through an indirect jump and are entry points as well.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "headers/dce.h"
+
+typedef struct {
+    Vector* insts;
+    Map* labels;
+    bool* reached;
+    int* work;
+    int nwork;
+} Walk;
+
+static int label_index(Walk* w, char* name) {
+    return (intptr_t)map_get(w->labels, name) - 1;
+}
+
+static void reach(Walk* w, int i) {
+    if (i < 0 || i >= vec_len(w->insts) || w->reached[i])
+        return;
+    w->reached[i] = true;
+    w->work[w->nwork++] = i;
+}
+
+// Marks the instructions that control can flow to from index i.
+static void reach_succs(Walk* w, int i) {
+    Inst* inst = vec_get(w->insts, i);
+    if (inst->kind != INST_OP) {
+        reach(w, i + 1);
+        return;
+    }
+    if (inst_is(inst, "jmp")) {
+        reach(w, label_index(w, inst->args[0]));
+        return;
+    }
+    if (is_cond_jump(inst))
+        reach(w, label_index(w, inst->args[0]));
+    reach(w, i + 1);
+}
+
+void remove_unreachable(Vector* insts, Map* addr_taken) {
+    int n = vec_len(insts);
+    Walk w = { insts, make_map(), calloc(n, sizeof(bool)), malloc(n * sizeof(int)), 0 };
+    for (int i = 0; i < n; i++) {
+        Inst* inst = vec_get(insts, i);
+        if (inst->kind == INST_LABEL)
+            map_put(w.labels, inst->op, (void*)(intptr_t)(i + 1));
+    }
+    reach(&w, 0);
+    for (int i = 0; i < n; i++) {
+        Inst* inst = vec_get(insts, i);
+        if (inst->kind == INST_LABEL && (inst->op[0] != '.' || map_get(addr_taken, inst->op)))
+            reach(&w, i);
+        if (inst->kind != INST_OP || inst_is(inst, "jmp") || is_cond_jump(inst))
+            continue;
+        for (int j = 0; j < inst->nargs; j++)
+            reach(&w, label_index(&w, inst->args[j]));
+    }
+    while (w.nwork > 0)
+        reach_succs(&w, w.work[--w.nwork]);
+    // Notes are kept as they are; they do not generate any code.
+    for (int i = 0; i < n; i++) {
+        Inst* inst = vec_get(insts, i);
+        if (!w.reached[i] && inst->kind != INST_NOTE)
+            vec_set(insts, i, NULL);
+    }
+    ir_compact(insts);
+    free(w.reached);
+    free(w.work);
+}
@@ -0,0 +1,316 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Dead store elimination.
+//
+// The peephole optimizer drops a register write that is overwritten
+// within the same basic block. This pass uses the liveness of the whole
+// function instead, and also removes stores to local variables that are
+// never read again: the zeros a declaration stores before the variable is
+// assigned, the last value of a counter after its loop, and the stores
+// left behind once constant propagation has replaced the loads.
+//
+// Stores are only tracked in the slots of locals, below BP, and only if
+// nothing but the function itself can access them (see frame_pointers).
+// Nothing reads them once the function returns. An access is to a known
+// slot if it is based on BP, or on a register set from BP earlier in the
+// block; any other access through a register that may point into the
+// frame may read all of them.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers/dse.h"
+
+bool stats_dse = false;
+
+static char* regs[] = { "A", "B", "C", "D", "E", "F", "G", "H", "SP", "BP" };
+#define NREGS (sizeof(regs) / sizeof(*regs))
+
+enum { OTHER, SLOT, ANY };
+
+// Where an address operand points.
+typedef struct {
+    int kind;  // OTHER, a SLOT at BP+off, or ANYwhere in the frame
+    long off;
+} Addr;
+
+// A range of bytes below BP some instruction stores to.
+typedef struct {
+    long off;
+    int size;
+} Range;
+
+typedef struct {
+    Cfg* cfg;
+    int* fp;
+    Addr* dst;  // The address each instruction writes or reads
+    Addr* src;  // The address memcpy reads
+    Vector* ranges;
+    int nwords;  // Size of a set of ranges in words
+    uint64_t* live_in;
+    bool* dead;
+    int nstores, nwrites;
+} DSE;
+
+static int reg_index(char* s) {
+    for (int i = 0; i < NREGS; i++)
+        if (!strcmp(s, regs[i]))
+            return i;
+    return -1;
+}
+
+// Resolves the memory operand or address register `arg` of the
+// instruction at index i. `known` and `off` tell which registers hold BP
+// plus an offset.
+static Addr resolve(DSE* d, int i, char* arg, bool* known, long* off) {
+    char* base = is_mem_arg(arg) ? mem_base(arg) : arg;
+    if (!is_reg(base))
+        return (Addr){ OTHER };
+    long disp = 0;
+    if (is_mem_arg(arg) && arg[1 + strlen(base)] != ']')
+        disp = strtol(arg + 1 + strlen(base), NULL, 10);
+    int r = reg_index(base);
+    if (!strcmp(base, "BP") && (d->fp[i] & reg_bit("BP")))
+        return (Addr){ SLOT, disp };
+    if (known[r])
+        return (Addr){ SLOT, off[r] + disp };
+    // SP itself points below the frame.
+    if ((d->fp[i] & reg_bit(base)) || (!strcmp(base, "SP") && disp))
+        return (Addr){ ANY };
+    return (Addr){ OTHER };
+}
+
+static void resolve_block(DSE* d, Block* b) {
+    bool known[NREGS] = { 0 };
+    long off[NREGS];
+    for (int i = b->begin; i < b->end; i++) {
+        Inst* inst = vec_get(d->cfg->insts, i);
+        if (inst->kind != INST_OP)
+            continue;
+        char* op = inst->op;
+        if (op_width(op, "load") || op_width(op, "store"))
+            d->dst[i] = resolve(d, i, inst->args[1], known, off);
+        else if (is_rmw_op(op) || !strcmp(op, "memset") || !strcmp(op, "memcpy"))
+            d->dst[i] = resolve(d, i, inst->args[0], known, off);
+        if (!strcmp(op, "memcpy"))
+            d->src[i] = resolve(d, i, inst->args[1], known, off);
+        int w = inst_write_mask(inst);
+        int r = (inst->nargs > 0 && is_reg(inst->args[0])) ? reg_index(inst->args[0]) : -1;
+        long c;
+        if (inst_is(inst, "mov") && !strcmp(inst->args[1], "BP") && (d->fp[i] & reg_bit("BP"))) {
+            known[r] = true;
+            off[r] = 0;
+        } else if (inst_is(inst, "mov") && is_reg(inst->args[1])) {
+            known[r] = known[reg_index(inst->args[1])];
+            off[r] = off[reg_index(inst->args[1])];
+        } else if ((inst_is(inst, "add") || inst_is(inst, "sub")) && is_imm_arg(inst->args[1], &c)) {
+            off[r] += inst_is(inst, "add") ? c : -c;
+        } else {
+            for (int j = 0; j < NREGS; j++)
+                if (w & (1 << j))
+                    known[j] = false;
+        }
+    }
+}
+
+static void add_range(DSE* d, Addr a, int size) {
+    if (a.kind != SLOT || a.off + size > 0)
+        return;
+    for (int i = 0; i < vec_len(d->ranges); i++) {
+        Range* r = vec_get(d->ranges, i);
+        if (r->off == a.off && r->size == size)
+            return;
+    }
+    Range* r = malloc(sizeof(Range));
+    *r = (Range){ a.off, size };
+    vec_push(d->ranges, r);
+}
+
+// Returns the number of bytes the instruction writes to memory, or 0.
+static int store_size(Inst* inst) {
+    if (op_width(inst->op, "store"))
+        return op_width(inst->op, "store") / 8;
+    if (!strcmp(inst->op, "memset") || !strcmp(inst->op, "memcpy"))
+        return atoi(inst->args[2]);
+    return 0;
+}
+
+static void collect_ranges(DSE* d) {
+    Vector* insts = d->cfg->insts;
+    for (int i = 0; i < vec_len(insts); i++) {
+        Inst* inst = vec_get(insts, i);
+        if (inst->kind == INST_OP && store_size(inst))
+            add_range(d, d->dst[i], store_size(inst));
+    }
+}
+
+static void set_all(DSE* d, uint64_t* live) {
+    memset(live, 0xff, d->nwords * sizeof(uint64_t));
+}
+
+// Marks the ranges `a` may overlap as live.
+static void gen(DSE* d, uint64_t* live, Addr a, int size) {
+    if (a.kind == ANY) {
+        set_all(d, live);
+        return;
+    }
+    if (a.kind != SLOT)
+        return;
+    for (int i = 0; i < vec_len(d->ranges); i++) {
+        Range* r = vec_get(d->ranges, i);
+        if (r->off < a.off + size && a.off < r->off + r->size)
+            live[i / 64] |= 1UL << (i % 64);
+    }
+}
+
+// Returns true if any range overlapping [off, off+size) is live.
+static bool is_live(DSE* d, uint64_t* live, long off, int size) {
+    for (int i = 0; i < vec_len(d->ranges); i++) {
+        Range* r = vec_get(d->ranges, i);
+        if (r->off < off + size && off < r->off + r->size && (live[i / 64] >> (i % 64) & 1))
+            return true;
+    }
+    return false;
+}
+
+// Marks the ranges within [off, off+size) as dead.
+static void kill(DSE* d, uint64_t* live, long off, int size) {
+    for (int i = 0; i < vec_len(d->ranges); i++) {
+        Range* r = vec_get(d->ranges, i);
+        if (off <= r->off && r->off + r->size <= off + size)
+            live[i / 64] &= ~(1UL << (i % 64));
+    }
+}
+
+// Updates `live`, the ranges that may be read later, to what they are
+// before the instruction at index i. Returns true if the instruction is
+// a store nothing reads.
+static bool step(DSE* d, uint64_t* live, int i) {
+    Inst* inst = vec_get(d->cfg->insts, i);
+    char* op = inst->op;
+    Addr a = d->dst[i];
+    int size;
+    bool dead = false;
+    if (!strcmp(op, "jmp") || is_cond_jump(inst))
+        return false;
+    if ((size = store_size(inst)) != 0) {
+        if (a.kind == SLOT && a.off + size <= 0) {
+            dead = !is_live(d, live, a.off, size);
+            kill(d, live, a.off, size);
+        }
+        if (!strcmp(op, "memcpy"))
+            gen(d, live, d->src[i], size);
+        return dead;
+    }
+    if ((size = op_width(op, "load") / 8) != 0) {
+        gen(d, live, a, size);
+    } else if (is_rmw_op(op)) {
+        size = (op_width(op, "addm") ? op_width(op, "addm") : op_width(op, "subm")) / 8;
+        gen(d, live, a, size);
+    } else if (!is_simple_inst(inst)) {
+        set_all(d, live);
+    }
+    return false;
+}
+
+// Can the instruction be removed if nothing reads what it writes?
+static bool is_removable(Inst* inst) {
+    char* op = inst->op;
+    if (!strcmp(op, "mov") || !strcmp(op, "not") || is_crop_op(op) || is_arith_op(op) || op_width(op, "load"))
+        return strcmp(inst->args[0], "SP") && strcmp(inst->args[0], "BP");
+    return false;
+}
+
+// Walks block b backward from `out`, leaving what is live on entry in
+// `live`. Marks dead instructions if `mark` is true.
+static void walk_block(DSE* d, Block* b, uint64_t* out, uint64_t* live, bool mark) {
+    Vector* insts = d->cfg->insts;
+    int regs = b->live_out;
+    memcpy(live, out, d->nwords * sizeof(uint64_t));
+    for (int i = b->end - 1; i >= b->begin; i--) {
+        Inst* inst = vec_get(insts, i);
+        if (inst->kind != INST_OP)
+            continue;
+        bool dead_store = d->fp && step(d, live, i);
+        bool dead_write = is_removable(inst) && !(inst_write_mask(inst) & regs);
+        if (mark && (dead_store || dead_write)) {
+            d->dead[i] = true;
+            (*(dead_store ? &d->nstores : &d->nwrites))++;
+            continue;
+        }
+        if (!dead_write)
+            regs = (regs & ~inst_write_mask(inst)) | inst_read_mask(inst);
+    }
+}
+
+static void live_out(DSE* d, Block* b, uint64_t* out) {
+    memset(out, 0, d->nwords * sizeof(uint64_t));
+    for (int i = 0; i < vec_len(b->succs); i++) {
+        Block* s = vec_get(b->succs, i);
+        for (int k = 0; k < d->nwords; k++)
+            out[k] |= d->live_in[s->id * d->nwords + k];
+    }
+}
+
+static void remove_dead(DSE* d) {
+    int n = vec_len(d->cfg->blocks);
+    int w = d->nwords = vec_len(d->ranges) / 64 + 1;
+    d->live_in = calloc(n * w, sizeof(uint64_t));
+    uint64_t* out = malloc(w * sizeof(uint64_t));
+    uint64_t* in = malloc(w * sizeof(uint64_t));
+    for (bool changed = true; changed && d->fp;) {
+        changed = false;
+        for (int i = n - 1; i >= 0; i--) {
+            Block* b = vec_get(d->cfg->blocks, i);
+            live_out(d, b, out);
+            walk_block(d, b, out, in, false);
+            if (memcmp(in, &d->live_in[i * w], w * sizeof(uint64_t))) {
+                memcpy(&d->live_in[i * w], in, w * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        Block* b = vec_get(d->cfg->blocks, i);
+        live_out(d, b, out);
+        walk_block(d, b, out, in, true);
+    }
+    free(d->live_in);
+    free(out);
+    free(in);
+}
+
+bool eliminate_dead_stores(Vector* insts, Map* addr_taken, char* fname) {
+    DSE d = { 0 };
+    for (;;) {
+        d.cfg = make_cfg(insts, addr_taken);
+        if (d.cfg->indirect)
+            break;
+        int n = vec_len(insts);
+        d.fp = frame_pointers(d.cfg);
+        d.ranges = make_vector();
+        if (d.fp) {
+            d.dst = calloc(n, sizeof(Addr));
+            d.src = calloc(n, sizeof(Addr));
+            for (int i = 0; i < vec_len(d.cfg->blocks); i++)
+                resolve_block(&d, vec_get(d.cfg->blocks, i));
+            collect_ranges(&d);
+        }
+        int before = d.nstores + d.nwrites;
+        d.dead = calloc(n, sizeof(bool));
+        remove_dead(&d);
+        for (int i = 0; i < n; i++)
+            if (d.dead[i])
+                vec_set(insts, i, NULL);
+        ir_compact(insts);
+        free(d.fp);
+        free(d.dst);
+        free(d.src);
+        free(d.dead);
+        if (d.nstores + d.nwrites == before)
+            break;
+    }
+    if (stats_dse)
+        fprintf(stderr, "dse: %s: %d dead stores, %d dead writes\n", fname, d.nstores, d.nwrites);
+    return d.nstores || d.nwrites;
+}
@@ -0,0 +1,685 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Compile-time evaluation of calls.
+//
+// A call whose arguments are all constants, such as hash("abc") or
+// __builtin_bswap32(0x12345678), is evaluated by interpreting the AST of
+// the callee, and replaced by the value it returns. This pass runs after
+// constant folding and before inlining, so nested calls are evaluated
+// from the inside out and the literals they leave can be folded again.
+//
+// Nothing has to be known about the callee in advance. The interpreter
+// gives up as soon as the callee does something whose result is not
+// known at compile time: it reads or writes a global, calls a function
+// that is not defined in this file, uses floating point or reads a
+// variable before it is set. It also gives up on callees that access a
+// volatile object, on assignments through an lvalue with side effects,
+// such as *p++ += 1, and after EVAL_MAX_STEPS nodes.
+// None of what it does is visible outside, so giving up just leaves the
+// call as it was.
+//
+// Locals live in byte arrays, so that arrays, structs and pointers to
+// them behave as they would in memory. A pointer is an offset into one
+// of those arrays or into a string literal, and cannot be converted to
+// an integer. Arithmetic is that of the constant folder.
+
+#include <stdlib.h>
+#include <string.h>
+#include "headers/eval.h"
+
+bool stats_eval = false;
+
+// The evaluation of a call gives up after this many AST nodes,
+#define EVAL_MAX_STEPS 100000
+// this depth of nested calls,
+#define EVAL_MAX_DEPTH 64
+// or if it needs a local larger than this.
+#define EVAL_MAX_OBJ 16384
+
+typedef struct _Obj {
+    int size;
+    bool readonly;
+    uint8_t* bytes;
+    bool* set;              // Whether each byte has been written
+    struct _Obj** ptrs;     // What a pointer stored at each offset points to
+} Obj;
+
+// An integer, or a pointer to byte i of obj.
+typedef struct {
+    long i;
+    Obj* obj;
+} Value;
+
+typedef struct {
+    Vector* vars;
+    Vector* objs;
+} Frame;
+
+// How a statement completes.
+enum { NEXT, JUMP, RETURN, FAIL };
+
+static Map* funcs;     // function name -> AST_FUNC
+static Frame* frame;
+static int steps;
+static int depth;
+static char* target;   // The label of a JUMP
+static Value retval;   // The value of a RETURN
+static int nevaluated;
+
+static bool eval(Node* node, Value* v);
+static int exec(Node* node);
+
+static bool is_scalar(Type* ty) {
+    return (is_inttype(ty) && ty->bitsize <= 0) || ty->kind == KIND_PTR;
+}
+
+static Obj* make_obj(int size) {
+    if (size < 0 || size > EVAL_MAX_OBJ)
+        return NULL;
+    Obj* r = malloc(sizeof(Obj));
+    *r = (Obj){ size, false, calloc(size + 1, 1), calloc(size + 1, sizeof(bool)),
+                calloc(size + 1, sizeof(Obj*)) };
+    return r;
+}
+
+static Obj* string_obj(Node* node) {
+    Obj* r = make_obj(node->ty->size);
+    if (!r)
+        return NULL;
+    memcpy(r->bytes, node->sval, r->size);
+    memset(r->set, true, r->size);
+    r->readonly = true;
+    return r;
+}
+
+static Obj* var_obj(Node* var) {
+    if (!frame)
+        return NULL;
+    for (int i = 0; i < vec_len(frame->vars); i++)
+        if (vec_get(frame->vars, i) == var)
+            return vec_get(frame->objs, i);
+    Obj* r = make_obj(var->ty->size);
+    if (r) {
+        vec_push(frame->vars, var);
+        vec_push(frame->objs, r);
+    }
+    return r;
+}
+
+// Returns true if a pointer stored in `o` overlaps [off, off+size).
+static bool has_ptr(Obj* o, long off, int size) {
+    for (long j = (off < 7) ? 0 : off - 7; j < off + size; j++)
+        if (o->ptrs[j])
+            return true;
+    return false;
+}
+
+static bool load(Value p, Type* ty, Value* v) {
+    Obj* o = p.obj;
+    if (!o || p.i < 0 || p.i + ty->size > o->size)
+        return false;
+    unsigned long raw = 0;
+    for (int k = ty->size - 1; k >= 0; k--) {
+        if (!o->set[p.i + k])
+            return false;
+        raw = (raw << 8) | o->bytes[p.i + k];
+    }
+    if (ty->kind == KIND_PTR && o->ptrs[p.i]) {
+        *v = (Value){ raw, o->ptrs[p.i] };
+        return true;
+    }
+    if (has_ptr(o, p.i, ty->size))
+        return false;
+    *v = (Value){ truncate_value(ty, raw) };
+    return true;
+}
+
+static bool store(Value p, Type* ty, Value v) {
+    Obj* o = p.obj;
+    if (!o || o->readonly || p.i < 0 || p.i + ty->size > o->size)
+        return false;
+    if (v.obj && ty->kind != KIND_PTR)
+        return false;
+    for (long j = (p.i < 7) ? 0 : p.i - 7; j < p.i + ty->size; j++)
+        o->ptrs[j] = NULL;
+    unsigned long raw = v.obj ? v.i : truncate_value(ty, v.i);
+    for (int k = 0; k < ty->size; k++) {
+        o->bytes[p.i + k] = raw >> (k * 8);
+        o->set[p.i + k] = true;
+    }
+    o->ptrs[p.i] = v.obj;
+    return true;
+}
+
+// Converts `v` to `ty`. Pointers cannot become integers.
+static bool convert(Type* ty, Value* v) {
+    if (ty->kind == KIND_VOID || ty->kind == KIND_PTR)
+        return true;
+    if (!is_scalar(ty) || v->obj)
+        return false;
+    v->i = truncate_value(ty, v->i);
+    return true;
+}
+
+static bool is_true(Value v) {
+    return v.obj || v.i;
+}
+
+// Sets the variable `var` as the initializers `inits` say.
+static bool init_var(Node* var, Vector* inits) {
+    Obj* o = var_obj(var);
+    if (!o)
+        return false;
+    memset(o->bytes, 0, o->size);
+    memset(o->set, true, o->size);
+    memset(o->ptrs, 0, o->size * sizeof(Obj*));
+    for (int i = 0; i < vec_len(inits); i++) {
+        Node* init = vec_get(inits, i);
+        Value v;
+        if (!is_scalar(init->totype) || !eval(init->initval, &v) || !convert(init->totype, &v) ||
+            !store((Value){ init->initoff, o }, init->totype, v))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Expressions
+ */
+
+static bool eval_addr(Node* node, Value* v) {
+    switch (node->kind) {
+        case AST_LVAR:
+            if (node->lvarinit && !init_var(node, node->lvarinit))
+                return false;
+            *v = (Value){ 0, var_obj(node) };
+            return v->obj;
+        case AST_LITERAL:
+            *v = (Value){ 0, node->ty->kind == KIND_ARRAY ? string_obj(node) : NULL };
+            return v->obj;
+        case AST_DEREF:
+            return eval(node->operand, v);
+        case AST_STRUCT_REF:
+            if (node->ty->bitsize > 0 || !eval_addr(node->struc, v))
+                return false;
+            v->i += node->ty->offset;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Returns true if evaluating `node` may do more than compute a value.
+//
+// The parser turns "a op= b" into "a = a op b" with both "a" being the
+// same node, and the code generator evaluates that node twice, as it does
+// the operand of ++ and --. Interpreting such an lvalue once would not
+// give the result of the compiled code if it has side effects, so calls
+// assigning through one are left to run time.
+static bool has_side_effects(Node* node) {
+    if (!node)
+        return false;
+    switch (node->kind) {
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case OP_LABEL_ADDR:
+            return false;
+        case AST_LVAR:
+            // A compound literal is initialized where it is evaluated.
+            return node->lvarinit;
+        case AST_ADDR:
+        case AST_DEREF:
+        case AST_CONV:
+        case OP_CAST:
+        case '!':
+        case '~':
+            return has_side_effects(node->operand);
+        case AST_STRUCT_REF:
+            return has_side_effects(node->struc);
+        case AST_TERNARY:
+            return has_side_effects(node->cond) || has_side_effects(node->then) ||
+                has_side_effects(node->els);
+        case '=':
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case AST_FUNCALL:
+        case AST_FUNCPTR_CALL:
+        case AST_COMPOUND_STMT:
+            return true;
+        default:
+            return has_side_effects(node->left) || has_side_effects(node->right);
+    }
+}
+
+static bool eval_inc_dec(Node* node, Value* v) {
+    Value p, old;
+    if (!is_scalar(node->ty) || has_side_effects(node->operand) || !eval_addr(node->operand, &p) ||
+        !load(p, node->ty, &old))
+        return false;
+    int step = (node->ty->kind == KIND_PTR) ? node->ty->ptr->size : 1;
+    if (node->kind == OP_PRE_DEC || node->kind == OP_POST_DEC)
+        step = -step;
+    Value val = { old.i + step, old.obj };
+    if (!val.obj)
+        val.i = truncate_value(node->ty, val.i);
+    if (!store(p, node->ty, val))
+        return false;
+    *v = (node->kind == OP_PRE_INC || node->kind == OP_PRE_DEC) ? val : old;
+    return true;
+}
+
+static bool is_comparison(int op) {
+    return op == '<' || op == OP_LE || op == OP_EQ || op == OP_NE;
+}
+
+// Compares or subtracts two pointers, which must point into the same
+// object; a pointer is only equal to no null pointer.
+static bool eval_pointer_binop(Node* node, Value l, Value r, Value* v) {
+    if (l.obj != r.obj) {
+        if ((node->kind != OP_EQ && node->kind != OP_NE) || (l.obj && r.obj) || (l.obj ? r.i : l.i))
+            return false;
+        *v = (Value){ node->kind == OP_NE };
+        return true;
+    }
+    long val;
+    if (node->kind == '-')
+        val = l.i - r.i;
+    else if (!eval_binop(node->kind, type_ulong, l.i, r.i, &val))
+        return false;
+    *v = (Value){ truncate_value(node->ty, val) };
+    return true;
+}
+
+static bool eval_binary(Node* node, Value* v) {
+    Value l, r;
+    if (node->kind == OP_LOGAND || node->kind == OP_LOGOR) {
+        if (!eval(node->left, &l))
+            return false;
+        if (is_true(l) == (node->kind == OP_LOGOR)) {
+            *v = (Value){ is_true(l) };
+            return true;
+        }
+        if (!eval(node->right, &r))
+            return false;
+        *v = (Value){ is_true(r) };
+        return true;
+    }
+    if (!eval(node->left, &l) || !eval(node->right, &r))
+        return false;
+    Type* lty = node->left->ty;
+    Type* rty = node->right->ty;
+    if (lty->kind == KIND_PTR && (rty->kind == KIND_PTR || is_comparison(node->kind)))
+        return eval_pointer_binop(node, l, r, v);
+    if (node->ty->kind == KIND_PTR) {
+        if (r.obj || (node->kind != '+' && node->kind != '-'))
+            return false;
+        long off = r.i * node->ty->ptr->size;
+        *v = (Value){ l.i + (node->kind == '+' ? off : -off), l.obj };
+        return true;
+    }
+    long val;
+    if (!is_inttype(node->ty) || !is_inttype(lty) || l.obj || r.obj ||
+        !eval_binop(node->kind, lty, l.i, r.i, &val))
+        return false;
+    *v = (Value){ truncate_value(node->ty, val) };
+    return true;
+}
+
+// The functions of the runtime that are known to be pure. They reverse
+// the bytes of a value of `size` bytes.
+static struct { char* name; int size; } bswaps[] = {
+    { "___builtin_bswap16", 2 },
+    { "___builtin_bswap32", 4 },
+    { "___builtin_bswap64", 8 },
+};
+
+static bool call_builtin(Node* node, Value* args, Value* v) {
+    for (int i = 0; i < sizeof(bswaps) / sizeof(*bswaps); i++) {
+        if (strcmp(node->fname, bswaps[i].name) || vec_len(node->args) != 1 || args[0].obj)
+            continue;
+        unsigned long r = 0;
+        for (int k = 0; k < bswaps[i].size; k++)
+            r = (r << 8) | ((unsigned long)args[0].i >> (k * 8) & 0xff);
+        *v = (Value){ r };
+        return convert(node->ty, v);
+    }
+    return false;
+}
+
+static bool call(Node* node, Value* v) {
+    int n = vec_len(node->args);
+    Value* args = malloc(n * sizeof(Value) + 1);
+    for (int i = 0; i < n; i++)
+        if (!eval(vec_get(node->args, i), &args[i]))
+            return false;
+    Node* func = map_get(funcs, node->fname);
+    if (!func)
+        return call_builtin(node, args, v);
+    Type* rettype = func->ty->rettype;
+    if (func->ty->hasva || func->hasvolatile || vec_len(func->params) != n || depth >= EVAL_MAX_DEPTH)
+        return false;
+    Frame* caller = frame;
+    frame = &(Frame){ make_vector(), make_vector() };
+    bool ok = true;
+    for (int i = 0; i < n && ok; i++) {
+        Node* param = vec_get(func->params, i);
+        Obj* o = var_obj(param);
+        ok = is_scalar(param->ty) && o && convert(param->ty, &args[i]) &&
+            store((Value){ 0, o }, param->ty, args[i]);
+    }
+    depth++;
+    int r = ok ? exec(func->body) : FAIL;
+    depth--;
+    frame = caller;
+    if (rettype->kind == KIND_VOID) {
+        *v = (Value){ 0 };
+        return r == NEXT || r == RETURN;
+    }
+    *v = retval;
+    return r == RETURN && convert(rettype, v);
+}
+
+static bool eval(Node* node, Value* v) {
+    if (++steps > EVAL_MAX_STEPS)
+        return false;
+    switch (node->kind) {
+        case AST_LITERAL:
+            *v = (Value){ node->ival };
+            return is_inttype(node->ty);
+        case AST_LVAR:
+        case AST_DEREF:
+        case AST_STRUCT_REF: {
+            Value p;
+            return is_scalar(node->ty) && eval_addr(node, &p) && load(p, node->ty, v);
+        }
+        case AST_ADDR:
+            return eval_addr(node->operand, v);
+        case AST_CONV:
+        case OP_CAST:
+            if (node->operand->ty->kind == KIND_ARRAY)
+                return eval_addr(node->operand, v);
+            return eval(node->operand, v) && convert(node->ty, v);
+        case '!':
+            if (!eval(node->operand, v))
+                return false;
+            *v = (Value){ !is_true(*v) };
+            return true;
+        case '~':
+            if (!eval(node->operand, v) || v->obj)
+                return false;
+            v->i = truncate_value(node->ty, ~v->i);
+            return true;
+        case '=': {
+            Value p;
+            return is_scalar(node->ty) && !has_side_effects(node->left) && eval_addr(node->left, &p) &&
+                eval(node->right, v) && convert(node->left->ty, v) && store(p, node->left->ty, *v);
+        }
+        case ',':
+            return eval(node->left, v) && eval(node->right, v);
+        case AST_TERNARY:
+            if (!eval(node->cond, v))
+                return false;
+            if (is_true(*v))
+                return !node->then || eval(node->then, v);
+            return eval(node->els, v);
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+            return eval_inc_dec(node, v);
+        case AST_FUNCALL:
+            return call(node, v);
+        case AST_COMPOUND_STMT: {
+            // A statement expression
+            int n = vec_len(node->stmts);
+            for (int i = 0; i < n - 1; i++)
+                if (exec(vec_get(node->stmts, i)) != NEXT)
+                    return false;
+            return n > 0 && eval(vec_tail(node->stmts), v);
+        }
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case AST_FUNCPTR_CALL:
+        case AST_DECL:
+        case AST_IF:
+        case AST_GOTO:
+        case AST_LABEL:
+        case AST_RETURN:
+        case AST_COMPUTED_GOTO:
+        case OP_LABEL_ADDR:
+            return false;
+        default:
+            return eval_binary(node, v);
+    }
+}
+
+/*
+ * Statements
+ */
+
+static bool contains_label(Node* node, char* label) {
+    if (!node)
+        return false;
+    steps++;
+    switch (node->kind) {
+        case AST_LABEL:
+            return node->newlabel && !strcmp(node->newlabel, label);
+        case AST_IF:
+            return contains_label(node->then, label) || contains_label(node->els, label);
+        case AST_COMPOUND_STMT:
+            for (int i = 0; i < vec_len(node->stmts); i++)
+                if (contains_label(vec_get(node->stmts, i), label))
+                    return true;
+            return false;
+        default:
+            return false;
+    }
+}
+
+static int find_stmt(Vector* stmts, char* label) {
+    for (int i = 0; i < vec_len(stmts); i++)
+        if (contains_label(vec_get(stmts, i), label))
+            return i;
+    return -1;
+}
+
+static int run_stmts(Vector* stmts, char* from);
+
+// Runs `node` from the label `from` inside it, or from its start if
+// `from` is NULL.
+static int run(Node* node, char* from) {
+    if (!from)
+        return exec(node);
+    switch (node->kind) {
+        case AST_COMPOUND_STMT:
+            return run_stmts(node->stmts, from);
+        case AST_IF:
+            return run(contains_label(node->then, from) ? node->then : node->els, from);
+        default:
+            return NEXT;
+    }
+}
+
+// Runs a list of statements. A jump to a label among them continues
+// there; any other one is left to the enclosing statements.
+static int run_stmts(Vector* stmts, char* from) {
+    for (;;) {
+        int i = from ? find_stmt(stmts, from) : 0;
+        int r = NEXT;
+        for (; i < vec_len(stmts) && r == NEXT; i++) {
+            r = run(vec_get(stmts, i), from);
+            from = NULL;
+        }
+        if (r != JUMP || find_stmt(stmts, target) < 0)
+            return r;
+        if (steps > EVAL_MAX_STEPS)
+            return FAIL;
+        from = target;
+    }
+}
+
+static int exec(Node* node) {
+    if (!node)
+        return NEXT;
+    if (++steps > EVAL_MAX_STEPS)
+        return FAIL;
+    Value v;
+    switch (node->kind) {
+        case AST_COMPOUND_STMT:
+            return run_stmts(node->stmts, NULL);
+        case AST_IF:
+            if (!eval(node->cond, &v))
+                return FAIL;
+            return exec(is_true(v) ? node->then : node->els);
+        case AST_GOTO:
+            target = node->newlabel;
+            return JUMP;
+        case AST_LABEL:
+            return NEXT;
+        case AST_RETURN:
+            if (node->retval && !eval(node->retval, &v))
+                return FAIL;
+            retval = node->retval ? v : (Value){ 0 };
+            return RETURN;
+        case AST_DECL:
+            if (node->declvar->kind != AST_LVAR)
+                return FAIL;
+            if (node->declinit && !init_var(node->declvar, node->declinit))
+                return FAIL;
+            return NEXT;
+        default:
+            return eval(node, &v) ? NEXT : FAIL;
+    }
+}
+
+/*
+ * Finding calls
+ */
+
+static bool is_const_arg(Node* node) {
+    if (node->kind == AST_LITERAL)
+        return is_inttype(node->ty);
+    return node->kind == AST_CONV && node->operand->kind == AST_LITERAL &&
+        node->operand->ty->kind == KIND_ARRAY;
+}
+
+// Returns the literal the call `node` evaluates to, or NULL.
+static Node* eval_call(Node* node) {
+    if (!is_inttype(node->ty) || node->ty->bitsize > 0)
+        return NULL;
+    for (int i = 0; i < vec_len(node->args); i++)
+        if (!is_const_arg(vec_get(node->args, i)))
+            return NULL;
+    steps = 0;
+    depth = 0;
+    frame = NULL;
+    Value v;
+    if (!call(node, &v) || v.obj)
+        return NULL;
+    Node* r = malloc(sizeof(Node));
+    *r = (Node){ AST_LITERAL, node->ty, node->sourceLoc, .ival = truncate_value(node->ty, v.i) };
+    nevaluated++;
+    if (stats_eval) {
+        SourceLoc* loc = node->sourceLoc;
+        fprintf(stderr, "eval: %s = %ld", node->fname + 1, r->ival);
+        if (loc)
+            fprintf(stderr, " at %s:%d", loc->file, loc->line);
+        fprintf(stderr, " (%d steps)\n", steps);
+    }
+    return r;
+}
+
+static Node* eval_calls(Node* node);
+
+static void eval_inits(Vector* inits) {
+    for (int i = 0; inits && i < vec_len(inits); i++) {
+        Node* init = vec_get(inits, i);
+        init->initval = eval_calls(init->initval);
+    }
+}
+
+static void eval_vector(Vector* nodes) {
+    for (int i = 0; nodes && i < vec_len(nodes); i++)
+        vec_set(nodes, i, eval_calls(vec_get(nodes, i)));
+}
+
+static Node* eval_calls(Node* node) {
+    if (!node)
+        return NULL;
+    switch (node->kind) {
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case AST_GOTO:
+        case AST_LABEL:
+        case OP_LABEL_ADDR:
+            return node;
+        case AST_LVAR:
+            eval_inits(node->lvarinit);
+            return node;
+        case AST_DECL:
+            eval_inits(node->declinit);
+            return node;
+        case AST_FUNCALL: {
+            eval_vector(node->args);
+            Node* r = eval_call(node);
+            return r ? r : node;
+        }
+        case AST_FUNCPTR_CALL:
+            node->fptr = eval_calls(node->fptr);
+            eval_vector(node->args);
+            return node;
+        case AST_IF:
+        case AST_TERNARY:
+            node->cond = eval_calls(node->cond);
+            node->then = eval_calls(node->then);
+            node->els = eval_calls(node->els);
+            return node;
+        case AST_RETURN:
+            node->retval = eval_calls(node->retval);
+            return node;
+        case AST_COMPOUND_STMT:
+            eval_vector(node->stmts);
+            return node;
+        case AST_STRUCT_REF:
+            node->struc = eval_calls(node->struc);
+            return node;
+        case AST_CONV:
+        case AST_ADDR:
+        case AST_DEREF:
+        case AST_COMPUTED_GOTO:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            node->operand = eval_calls(node->operand);
+            return node;
+        default:
+            node->left = eval_calls(node->left);
+            node->right = eval_calls(node->right);
+            return node;
+    }
+}
+
+// Returns true if some call was replaced.
+bool eval_toplevels(Vector* toplevels) {
+    nevaluated = 0;
+    funcs = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node* v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC)
+            map_put(funcs, v->fname, v);
+    }
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node* v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC)
+            v->body = eval_calls(v->body);
+    }
+    return nevaluated > 0;
+}
@@ -0,0 +1,276 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Constant folding.
+//
+// This pass rewrites function bodies in place between parsing and code
+// generation. Integer expressions whose operands are all literals are
+// replaced by a single literal, and operations that leave their operand
+// unchanged (x+0, x*1, x&-1 and the like) are dropped. Arithmetic is done
+// on 64-bit values which are then truncated to the type of the node being
+// replaced, so the result is exactly what C says the expression computes.
+//
+// Expressions with side effects are never removed: an identity only
+// drops its constant operand, never the other one.
+
+#include <stdlib.h>
+#include "headers/fold.h"
+
+static Node* fold(Node* node);
+
+static bool is_foldable_type(Type* ty) {
+    return is_inttype(ty) && ty->bitsize <= 0;
+}
+
+static bool is_intlit(Node* node) {
+    return node->kind == AST_LITERAL && is_foldable_type(node->ty);
+}
+
+// Truncates `val` to `ty`, sign- or zero-extending it back to 64 bits.
+long truncate_value(Type* ty, long val) {
+    if (ty->kind == KIND_BOOL)
+        return val != 0;
+    switch (ty->size) {
+        case 1: return ty->usig ? (long)(uint8_t)val : (long)(int8_t)val;
+        case 2: return ty->usig ? (long)(uint16_t)val : (long)(int16_t)val;
+        case 4: return ty->usig ? (long)(uint32_t)val : (long)(int32_t)val;
+        default: return val;
+    }
+}
+
+static Node* make_literal(Node* orig, Type* ty, long val) {
+    Node* r = malloc(sizeof(Node));
+    *r = (Node){ AST_LITERAL, ty, .ival = truncate_value(ty, val) };
+    r->sourceLoc = orig->sourceLoc;
+    return r;
+}
+
+static bool is_value(Node* node, long val) {
+    return is_intlit(node) && node->ival == truncate_value(node->ty, val);
+}
+
+static bool same_type(Type* a, Type* b) {
+    return a->kind == b->kind && a->usig == b->usig;
+}
+
+static Node* fold_unary(Node* node) {
+    Node* op = node->operand;
+    if (!is_foldable_type(node->ty) || !is_intlit(op))
+        return node;
+    switch (node->kind) {
+        case '!':
+            return make_literal(node, node->ty, !op->ival);
+        case '~':
+            return make_literal(node, node->ty, ~op->ival);
+        case AST_CONV:
+        case OP_CAST:
+            return make_literal(node, node->ty, op->ival);
+        default:
+            return node;
+    }
+}
+
+// Evaluates the binary operator `op` over two values of type `ty`. Returns
+// false if the result is undefined, in which case the expression is left
+// for runtime.
+bool eval_binop(int op, Type* ty, long L, long R, long* r) {
+    bool usig = ty->usig;
+    switch (op) {
+        case '+': *r = (unsigned long)L + R; return true;
+        case '-': *r = (unsigned long)L - R; return true;
+        case '*': *r = (unsigned long)L * R; return true;
+        case '&': *r = L & R; return true;
+        case '|': *r = L | R; return true;
+        case '^': *r = L ^ R; return true;
+        case '/':
+        case '%':
+            if (R == 0 || (!usig && R == -1 && L == INT64_MIN))
+                return false;
+            if (usig)
+                *r = op == '/' ? (unsigned long)L / R : (unsigned long)L % R;
+            else
+                *r = op == '/' ? L / R : L % R;
+            return true;
+        case OP_SAL:
+        case OP_SAR:
+        case OP_SHR:
+            if (R < 0 || R >= ty->size * 8)
+                return false;
+            if (op == OP_SAL)
+                *r = (unsigned long)L << R;
+            else if (op == OP_SAR)
+                *r = L >> R;
+            else
+                *r = (unsigned long)L >> R;
+            return true;
+        case '<':
+            *r = usig ? (unsigned long)L < R : L < R;
+            return true;
+        case OP_LE:
+            *r = usig ? (unsigned long)L <= R : L <= R;
+            return true;
+        case OP_EQ: *r = L == R; return true;
+        case OP_NE: *r = L != R; return true;
+        case OP_LOGAND: *r = L && R; return true;
+        case OP_LOGOR:  *r = L || R; return true;
+        default:
+            return false;
+    }
+}
+
+// Returns the non-constant operand of an operation that leaves it as is,
+// or NULL.
+static Node* fold_identity(Node* node) {
+    Node* left = node->left;
+    Node* right = node->right;
+    Node* r = NULL;
+    switch (node->kind) {
+        case '+': case '|': case '^':
+            r = is_value(right, 0) ? left : is_value(left, 0) ? right : NULL;
+            break;
+        case '*':
+            r = is_value(right, 1) ? left : is_value(left, 1) ? right : NULL;
+            break;
+        case '&':
+            r = is_value(right, -1) ? left : is_value(left, -1) ? right : NULL;
+            break;
+        case '-': case OP_SAL: case OP_SAR: case OP_SHR:
+            r = is_value(right, 0) ? left : NULL;
+            break;
+        case '/':
+            r = is_value(right, 1) ? left : NULL;
+            break;
+    }
+    return (r && same_type(r->ty, node->ty)) ? r : NULL;
+}
+
+// Folds constant offsets of pointer arithmetic: p+0 becomes p, and
+// (p+c1)+c2 becomes p+(c1+c2).
+static Node* fold_pointer_arith(Node* node) {
+    if ((node->kind != '+' && node->kind != '-') || !is_intlit(node->right))
+        return node;
+    long off = (node->kind == '+') ? node->right->ival : -node->right->ival;
+    Node* left = node->left;
+    if (off == 0)
+        return left;
+    if ((left->kind != '+' && left->kind != '-') || left->ty->kind != KIND_PTR ||
+        left->ty->ptr->size != node->ty->ptr->size || !is_intlit(left->right))
+        return node;
+    off += (left->kind == '+') ? left->right->ival : -left->right->ival;
+    left = left->left;
+    if (off == 0)
+        return left;
+    Node* r = malloc(sizeof(Node));
+    *r = *node;
+    r->kind = '+';
+    r->left = left;
+    r->right = make_literal(node->right, type_long, off);
+    return r;
+}
+
+static Node* fold_binop(Node* node) {
+    if (node->ty->kind == KIND_PTR)
+        return fold_pointer_arith(node);
+    if (!is_foldable_type(node->ty))
+        return node;
+    Node* left = node->left;
+    Node* right = node->right;
+    // 0 && x and 1 || x do not depend on x, which is never evaluated.
+    if (node->kind == OP_LOGAND && is_value(left, 0))
+        return make_literal(node, node->ty, 0);
+    if (node->kind == OP_LOGOR && is_intlit(left) && left->ival)
+        return make_literal(node, node->ty, 1);
+    long val;
+    if (is_intlit(left) && is_intlit(right) && eval_binop(node->kind, left->ty, left->ival, right->ival, &val))
+        return make_literal(node, node->ty, val);
+    Node* r = fold_identity(node);
+    return r ? r : node;
+}
+
+static void fold_inits(Vector* inits) {
+    for (int i = 0; inits && i < vec_len(inits); i++) {
+        Node* init = vec_get(inits, i);
+        init->initval = fold(init->initval);
+    }
+}
+
+static void fold_vector(Vector* nodes) {
+    for (int i = 0; nodes && i < vec_len(nodes); i++)
+        vec_set(nodes, i, fold(vec_get(nodes, i)));
+}
+
+static Node* fold(Node* node) {
+    if (!node)
+        return NULL;
+    switch (node->kind) {
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case AST_GOTO:
+        case AST_LABEL:
+        case OP_LABEL_ADDR:
+            return node;
+        case AST_LVAR:
+            fold_inits(node->lvarinit);
+            return node;
+        case AST_DECL:
+            fold_inits(node->declinit);
+            return node;
+        case AST_FUNCALL:
+            fold_vector(node->args);
+            return node;
+        case AST_FUNCPTR_CALL:
+            node->fptr = fold(node->fptr);
+            fold_vector(node->args);
+            return node;
+        case AST_IF:
+            node->cond = fold(node->cond);
+            node->then = fold(node->then);
+            node->els = fold(node->els);
+            return node;
+        case AST_TERNARY:
+            node->cond = fold(node->cond);
+            node->then = fold(node->then);
+            node->els = fold(node->els);
+            if (is_intlit(node->cond) && node->then)
+                return node->cond->ival ? node->then : node->els;
+            return node;
+        case AST_RETURN:
+            node->retval = fold(node->retval);
+            return node;
+        case AST_COMPOUND_STMT:
+            fold_vector(node->stmts);
+            return node;
+        case AST_STRUCT_REF:
+            node->struc = fold(node->struc);
+            return node;
+        case AST_ADDR:
+        case AST_DEREF:
+        case AST_COMPUTED_GOTO:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+            node->operand = fold(node->operand);
+            return node;
+        case AST_CONV:
+        case OP_CAST:
+        case '!':
+        case '~':
+            node->operand = fold(node->operand);
+            return fold_unary(node);
+        case '=':
+        case ',':
+            node->left = fold(node->left);
+            node->right = fold(node->right);
+            return node;
+        default:
+            node->left = fold(node->left);
+            node->right = fold(node->right);
+            return fold_binop(node);
+    }
+}
+
+void fold_toplevel(Node* v) {
+    if (v->kind == AST_FUNC)
+        v->body = fold(v->body);
+}
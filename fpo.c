@@ -0,0 +1,495 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Frame pointer omission.
+//
+// Every function saves BP in its prologue and points it at its frame, and
+// restores it before returning, so that the code generator can address
+// parameters and locals relative to BP while SP moves. Once the code of a
+// function is final, the distance between SP and the frame is known at
+// each instruction as long as SP only moves by constants. This pass then
+// addresses the frame relative to SP and drops the saving, setting and
+// restoring of BP.
+//
+// A function without locals in memory, such as a leaf computing from its
+// parameters, loses its frame altogether: the slot for the caller's BP is
+// not allocated, and the parameters are found right above the return
+// address.
+//
+// BP is then free. If a local in memory is only accessed by plain loads
+// and stores, and often enough to pay for saving BP again, it is kept in
+// BP instead.
+//
+// The offset of SP is followed along the control flow. A call jumps away
+// with its return address pushed and comes back to the label pushed, with
+// the return address popped; a computed goto may reach any other label
+// whose address is taken. The pass leaves a function alone if SP is set
+// to anything but a constant offset from itself, or is not the same on
+// every path to an instruction.
+
+#include <stdlib.h>
+#include <string.h>
+#include "headers/fpo.h"
+
+bool stats_fpo = false;
+
+// A memory access at BP+off.
+typedef struct {
+    int index;  // The instruction
+    long off;
+    int size;   // In bytes
+    bool slot;  // A load, store, addm or subm of its own at [BP+off]
+} Access;
+
+typedef struct {
+    Vector* insts;
+    Cfg* cfg;
+    long* sp;         // SP minus SP on entry before each instruction
+    bool* fixed;      // Part of the prologue or of a teardown
+    int prologue;     // Index of the "sub SP, 8" making room for BP
+    Vector* teardowns;  // Indexes of the "mov SP, BP" of each teardown
+    Vector* accesses;
+    int addr_moves;   // "mov X, BP" but those restoring saved registers
+    bool frameless;   // Nothing is below the slot of the caller's BP
+    Access* kept;     // The local kept in BP, or NULL
+    Vector** repl;    // What replaces each instruction, or NULL
+} FPO;
+
+// Keeping a local in BP costs a store in the prologue and three
+// instructions to restore BP in each teardown. An access in memory costs
+// about as much as three in registers, less one for sign-extending BP
+// after a write.
+#define ACCESS_GAIN 2
+#define TEARDOWN_COST 3
+
+static bool is_inst(Vector* insts, int i, char* op, char* a0, char* a1) {
+    if (i < 0)
+        return false;
+    Inst* inst = vec_get(insts, i);
+    return inst_is(inst, op) && inst->nargs == 2 && !strcmp(inst->args[0], a0) &&
+        (!a1 || !strcmp(inst->args[1], a1));
+}
+
+static bool is_call(Inst* inst) {
+    return inst && inst_is(inst, "jmp") && inst->args[0][0] != '.';
+}
+
+// Finds "sub SP, 8", "store64 BP, SP", "mov BP, SP" at the beginning.
+static bool find_prologue(FPO* f) {
+    int i = 0;
+    while (i < vec_len(f->insts) && ((Inst*)vec_get(f->insts, i))->kind != INST_OP)
+        i++;
+    if (i == vec_len(f->insts) || !is_inst(f->insts, i, "sub", "SP", "8"))
+        return false;
+    int j = ir_next(f->insts, i);
+    int k = ir_next(f->insts, j < 0 ? i : j);
+    if (!is_inst(f->insts, j, "store64", "BP", "SP") || !is_inst(f->insts, k, "mov", "BP", "SP"))
+        return false;
+    f->prologue = i;
+    f->fixed[i] = f->fixed[j] = f->fixed[k] = true;
+    return true;
+}
+
+// Finds each "mov SP, BP", "load64 A, SP", "sub SP, -8", "mov BP, A"
+// restoring SP and the caller's BP. Returns false if SP is set from BP
+// anywhere else.
+static bool find_teardowns(FPO* f) {
+    static char* ops[][3] = { { "load64", "A", "SP" }, { "sub", "SP", "-8" }, { "mov", "BP", "A" } };
+    for (int i = 0; i < vec_len(f->insts); i++) {
+        if (!is_inst(f->insts, i, "mov", "SP", "BP"))
+            continue;
+        int j = i;
+        for (int k = 0; k < 3; k++) {
+            j = ir_next(f->insts, j);
+            if (!is_inst(f->insts, j, ops[k][0], ops[k][1], ops[k][2]))
+                return false;
+            f->fixed[j] = true;
+        }
+        f->fixed[i] = true;
+        vec_push(f->teardowns, (void*)(intptr_t)i);
+    }
+    return true;
+}
+
+static void add_access(FPO* f, int i, long off, int size, bool slot) {
+    Access* a = malloc(sizeof(Access));
+    *a = (Access){ i, off, size, slot };
+    vec_push(f->accesses, a);
+}
+
+// Returns true if "mov X, BP" at index i is followed by "add X, c" and
+// "load64 R, X", restoring a saved register.
+static bool is_restore(FPO* f, int i) {
+    Inst* inst = vec_get(f->insts, i);
+    char* x = inst->args[0];
+    int j = ir_next(f->insts, i);
+    int k = j < 0 ? -1 : ir_next(f->insts, j);
+    long c;
+    if (!is_inst(f->insts, j, "add", x, NULL) || !is_imm_arg(((Inst*)vec_get(f->insts, j))->args[1], &c))
+        return false;
+    if (k < 0 || !inst_is(vec_get(f->insts, k), "load64"))
+        return false;
+    Inst* load = vec_get(f->insts, k);
+    if (strcmp(load->args[1], x) || !strcmp(load->args[0], x))
+        return false;
+    add_access(f, k, c, 8, false);
+    return true;
+}
+
+// Returns the number of bytes the instruction with a memory operand
+// accesses.
+static int access_size(char* op) {
+    char* prefixes[] = { "load", "store", "addm", "subm" };
+    for (int i = 0; i < 4; i++)
+        if (op_width(op, prefixes[i]))
+            return op_width(op, prefixes[i]) / 8;
+    return 0;
+}
+
+// Collects the uses of BP outside the prologue and the teardowns. Returns
+// false if BP is used other than as the base of memory operands or copied
+// to a register, or if the slot of the caller's BP is accessed.
+static bool scan(FPO* f) {
+    for (int i = 0; i < vec_len(f->insts); i++) {
+        Inst* inst = vec_get(f->insts, i);
+        if (inst->kind != INST_OP || f->fixed[i])
+            continue;
+        if (inst_write_mask(inst) & reg_bit("BP"))
+            return false;
+        for (int k = 0; k < inst->nargs; k++) {
+            char* arg = inst->args[k];
+            if (is_mem_arg(arg) && !strcmp(mem_base(arg), "BP")) {
+                long off = strtol(arg + 3, NULL, 10);
+                int size = access_size(inst->op);
+                if (!size || (off < 8 && off + size > 0))
+                    return false;
+                add_access(f, i, off, size, true);
+            } else if (!strcmp(arg, "BP")) {
+                if (!inst_is(inst, "mov") || k != 1)
+                    return false;
+                if (!is_restore(f, i))
+                    f->addr_moves++;
+            }
+        }
+    }
+    return true;
+}
+
+// Updates `d`, the offset of SP, past the instruction at index i. Returns
+// false if SP is set to what is not known.
+static bool step(FPO* f, int i, long* d) {
+    Inst* inst = vec_get(f->insts, i);
+    long c;
+    if (!(inst_write_mask(inst) & reg_bit("SP")))
+        return true;
+    if ((inst_is(inst, "sub") || inst_is(inst, "add")) && is_imm_arg(inst->args[1], &c)) {
+        *d += inst_is(inst, "add") ? c : -c;
+        return true;
+    }
+    // BP points at the slot of the caller's BP below the return address.
+    if (f->fixed[i] && inst_is(inst, "mov")) {
+        *d = -8;
+        return true;
+    }
+    return false;
+}
+
+// Returns, for each label, the index of the instruction taking its
+// address plus one, or -1 if data or several instructions take it.
+static Map* label_takers(FPO* f, Map* addr_taken) {
+    Map* r = make_map();
+    for (int i = 0; i < vec_len(f->insts); i++) {
+        Inst* inst = vec_get(f->insts, i);
+        if (inst->kind == INST_LABEL && map_get(addr_taken, inst->op))
+            map_put(r, inst->op, (void*)-1);
+        if (inst->kind != INST_OP || inst_is(inst, "jmp") || is_cond_jump(inst))
+            continue;
+        for (int j = 0; j < inst->nargs; j++)
+            if (map_get(f->cfg->labels, inst->args[j]))
+                map_put(r, inst->args[j], map_get(r, inst->args[j]) ? (void*)-1 : (void*)(intptr_t)(i + 1));
+    }
+    return r;
+}
+
+// Returns the block following block i if it is where the call ending
+// block i returns to, or NULL.
+static Block* return_site(FPO* f, Map* takers, int i) {
+    Block* b = vec_get(f->cfg->blocks, i);
+    if (i + 1 == vec_len(f->cfg->blocks) || !is_call(block_last(f->cfg, b)))
+        return NULL;
+    Block* next = vec_get(f->cfg->blocks, i + 1);
+    char* label = block_label(f->cfg, next);
+    intptr_t taker = label ? (intptr_t)map_get(takers, label) : 0;
+    return (taker > b->begin && taker <= b->end) ? next : NULL;
+}
+
+static bool merge(long* in, bool* seen, Block* b, long d, bool* changed) {
+    if (seen[b->id])
+        return in[b->id] == d;
+    seen[b->id] = true;
+    in[b->id] = d;
+    *changed = true;
+    return true;
+}
+
+// Computes the offset of SP before each instruction. Returns false if it
+// is not the same on every path.
+static bool compute_sp(FPO* f, Map* addr_taken) {
+    Cfg* cfg = f->cfg;
+    int n = vec_len(cfg->blocks);
+    Map* takers = label_takers(f, addr_taken);
+    // The blocks a computed goto may jump to.
+    Vector* targets = make_vector();
+    for (int i = 1; i < n; i++) {
+        char* label = block_label(cfg, vec_get(cfg->blocks, i));
+        if (label && map_get(takers, label) && !return_site(f, takers, i - 1))
+            vec_push(targets, vec_get(cfg->blocks, i));
+    }
+    long* in = calloc(n, sizeof(long));
+    bool* seen = calloc(n, sizeof(bool));
+    bool ok = true;
+    seen[0] = true;
+    for (bool changed = true; changed && ok;) {
+        changed = false;
+        for (int i = 0; i < n && ok; i++) {
+            Block* b = vec_get(cfg->blocks, i);
+            if (!seen[i])
+                continue;
+            long d = in[i];
+            for (int j = b->begin; j < b->end && ok; j++) {
+                f->sp[j] = d;
+                if (((Inst*)vec_get(f->insts, j))->kind == INST_OP)
+                    ok = step(f, j, &d);
+            }
+            Inst* last = block_last(cfg, b);
+            if (!ok || !is_call(last)) {
+                for (int j = 0; ok && j < vec_len(b->succs); j++)
+                    ok = merge(in, seen, vec_get(b->succs, j), d, &changed);
+                continue;
+            }
+            // The callee pops the return address. A jump through a
+            // register while the frame is still allocated is a computed
+            // goto; any other jump leaves the function.
+            Block* next = return_site(f, takers, i);
+            if (next)
+                ok = merge(in, seen, next, d + 8, &changed);
+            else if (is_reg(last->args[0]) && d < 0)
+                for (int j = 0; ok && j < vec_len(targets); j++)
+                    ok = merge(in, seen, vec_get(targets, j), d, &changed);
+        }
+    }
+    for (int i = 0; i < n && ok; i++)
+        ok = seen[i] || !block_last(cfg, vec_get(cfg->blocks, i));
+    free(in);
+    free(seen);
+    return ok;
+}
+
+// Returns true if the write of the access leaves BP to be sign-extended
+// from the size of the local: the value is not a constant that fits, nor
+// sign-extended from that size or less right before.
+static bool needs_crop(FPO* f, Access* a) {
+    Inst* inst = vec_get(f->insts, a->index);
+    if (a->size == 8 || op_width(inst->op, "load"))
+        return false;
+    if (!op_width(inst->op, "store"))
+        return true;
+    char* src = inst->args[0];
+    int bits = a->size * 8;
+    long c;
+    if (is_imm_arg(src, &c))
+        return c != (c << (64 - bits)) >> (64 - bits);
+    int i = ir_prev(f->insts, a->index);
+    if (i < 0)
+        return true;
+    Inst* prev = vec_get(f->insts, i);
+    int w = op_width(prev->op, "icrop") ? op_width(prev->op, "icrop") : op_width(prev->op, "load");
+    return !(w && w <= bits && !strcmp(prev->args[0], src));
+}
+
+// Picks the local to keep in BP: the one gaining the most, if all its
+// accesses are plain and nothing else may access it.
+static void pick_kept(FPO* f) {
+    if (f->addr_moves)
+        return;
+    int best = 0;
+    for (int i = 0; i < vec_len(f->accesses); i++) {
+        Access* a = vec_get(f->accesses, i);
+        if (!a->slot || a->off >= 0)
+            continue;
+        int gain = 0;
+        bool ok = true;
+        for (int j = 0; j < vec_len(f->accesses) && ok; j++) {
+            Access* b = vec_get(f->accesses, j);
+            if (b->slot && b->off == a->off && b->size == a->size)
+                gain += needs_crop(f, b) ? ACCESS_GAIN - 1 : ACCESS_GAIN;
+            else if (b->off < a->off + a->size && a->off < b->off + b->size)
+                ok = false;
+        }
+        if (ok && gain > best) {
+            best = gain;
+            f->kept = a;
+        }
+    }
+    if (f->kept && best <= 1 + TEARDOWN_COST * vec_len(f->teardowns))
+        f->kept = NULL;
+}
+
+static void replace(FPO* f, int i, Inst* a, Inst* b) {
+    Vector* v = make_vector();
+    if (a)
+        vec_push(v, a);
+    if (b)
+        vec_push(v, b);
+    f->repl[i] = v;
+}
+
+static Inst* sub_sp(long d) {
+    return d ? make_inst("sub", 2, "SP", format("%ld", d)) : NULL;
+}
+
+static Inst* crop_bp(FPO* f, Access* a) {
+    return needs_crop(f, a) ? make_inst(format("icrop%d", a->size * 8), 1, "BP") : NULL;
+}
+
+// The offset from SP of BP+off before the instruction at index i.
+static long sp_offset(FPO* f, int i, long off) {
+    return off - 8 - f->sp[i] - (f->frameless ? 8 : 0);
+}
+
+// Rewrites an access of the local kept in BP into register operations.
+static void rewrite_kept(FPO* f, Access* a) {
+    Inst* inst = vec_get(f->insts, a->index);
+    char* op = inst->op;
+    if (op_width(op, "load"))
+        replace(f, a->index, make_inst("mov", 2, inst->args[0], "BP"), NULL);
+    else if (op_width(op, "store"))
+        replace(f, a->index, make_inst("mov", 2, "BP", inst->args[0]), crop_bp(f, a));
+    else
+        replace(f, a->index, make_inst(op_width(op, "addm") ? "add" : "sub", 2, "BP", inst->args[1]),
+                crop_bp(f, a));
+}
+
+static void rewrite_prologue(FPO* f) {
+    int i = f->prologue;
+    int j = ir_next(f->insts, i);
+    int k = ir_next(f->insts, j);
+    replace(f, k, NULL, NULL);
+    if (f->kept)
+        return;
+    replace(f, j, NULL, NULL);
+    int next = ir_next(f->insts, k);
+    long size;
+    if (f->frameless) {
+        replace(f, i, NULL, NULL);
+    } else if (is_inst(f->insts, next, "sub", "SP", NULL) &&
+               is_imm_arg(((Inst*)vec_get(f->insts, next))->args[1], &size)) {
+        replace(f, i, NULL, NULL);
+        replace(f, next, sub_sp(size + 8), NULL);
+    }
+}
+
+static void rewrite_teardowns(FPO* f) {
+    for (int i = 0; i < vec_len(f->teardowns); i++) {
+        int j = (intptr_t)vec_get(f->teardowns, i);
+        // SP goes back to the slot of the caller's BP, or above it.
+        long d = f->sp[j] + (f->frameless ? 8 : 0);
+        if (f->kept) {
+            replace(f, j, sub_sp(d + 8), NULL);
+            continue;
+        }
+        replace(f, j, sub_sp(d), NULL);
+        for (int k = 0; k < 3; k++)
+            replace(f, j = ir_next(f->insts, j), NULL, NULL);
+    }
+}
+
+// Rewrites "mov X, BP", merging the "add X, c" following it.
+static void rewrite_move(FPO* f, int i) {
+    char* x = ((Inst*)vec_get(f->insts, i))->args[0];
+    long off = sp_offset(f, i, 0);
+    int j = ir_next(f->insts, i);
+    long c;
+    if (is_inst(f->insts, j, "add", x, NULL) && is_imm_arg(((Inst*)vec_get(f->insts, j))->args[1], &c)) {
+        off += c;
+        replace(f, j, NULL, NULL);
+    }
+    replace(f, i, make_inst("mov", 2, x, "SP"), off ? make_inst("add", 2, x, format("%ld", off)) : NULL);
+}
+
+static void rewrite(FPO* f) {
+    rewrite_prologue(f);
+    rewrite_teardowns(f);
+    for (int i = 0; i < vec_len(f->accesses); i++) {
+        Access* a = vec_get(f->accesses, i);
+        if (f->kept && a->off == f->kept->off && a->slot)
+            rewrite_kept(f, a);
+    }
+    for (int i = 0; i < vec_len(f->insts); i++) {
+        Inst* inst = vec_get(f->insts, i);
+        if (inst->kind != INST_OP || f->fixed[i] || f->repl[i])
+            continue;
+        if (inst_is(inst, "mov") && !strcmp(inst->args[1], "BP")) {
+            rewrite_move(f, i);
+            continue;
+        }
+        Inst* r = NULL;
+        for (int k = 0; k < inst->nargs; k++) {
+            char* arg = inst->args[k];
+            if (!is_mem_arg(arg) || strcmp(mem_base(arg), "BP"))
+                continue;
+            if (!r) {
+                r = malloc(sizeof(Inst));
+                *r = *inst;
+                r->text = NULL;
+            }
+            long off = sp_offset(f, i, strtol(arg + 3, NULL, 10));
+            r->args[k] = off ? format("[SP%+ld]", off) : "[SP]";
+        }
+        if (r)
+            replace(f, i, r, NULL);
+    }
+    Vector* insts = make_vector();
+    for (int i = 0; i < vec_len(f->insts); i++) {
+        if (f->repl[i])
+            vec_append(insts, f->repl[i]);
+        else
+            vec_push(insts, vec_get(f->insts, i));
+    }
+    while (vec_len(f->insts))
+        vec_pop(f->insts);
+    vec_append(f->insts, insts);
+}
+
+// Addresses the frame of the function `fname` relative to SP. Returns
+// true if it did.
+bool omit_frame_pointer(Vector* insts, Map* addr_taken, char* fname) {
+    int n = vec_len(insts);
+    FPO f = { insts };
+    f.sp = calloc(n, sizeof(long));
+    f.fixed = calloc(n, sizeof(bool));
+    f.teardowns = make_vector();
+    f.accesses = make_vector();
+    bool ok = find_prologue(&f) && find_teardowns(&f) && scan(&f);
+    if (ok) {
+        f.cfg = make_cfg(insts, addr_taken);
+        ok = compute_sp(&f, addr_taken);
+    }
+    if (ok) {
+        bool below = f.addr_moves > 0;
+        for (int i = 0; i < vec_len(f.accesses); i++)
+            below |= ((Access*)vec_get(f.accesses, i))->off < 0;
+        f.frameless = !below;
+        pick_kept(&f);
+        f.repl = calloc(n, sizeof(Vector*));
+        rewrite(&f);
+        free(f.repl);
+    }
+    if (stats_fpo && ok)
+        fprintf(stderr, "fpo: %s: %d accesses relative to SP%s\n", fname, vec_len(f.accesses),
+                f.frameless ? ", no frame" : f.kept ? format(", local at BP%+ld in BP", f.kept->off) : "");
+    else if (stats_fpo)
+        fprintf(stderr, "fpo: %s: frame pointer kept\n", fname);
+    free(f.sp);
+    free(f.fixed);
+    return ok;
+}
@@ -1,6 +1,9 @@
 // Copyright 2012 Rui Ueyama. Released under the MIT license.
 
+#include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -10,6 +13,8 @@
 #define nlprintf(...) printf("\n"__VA_ARGS__)
 bool dumpstack = false;
 bool dumpsource = true;
+bool stats_regalloc = false;
+bool stats_frame = false;
 
 static int TAB = 8;
 static Vector* functions = &EMPTY_VECTOR;
@@ -24,13 +29,57 @@ static int is_main;
 static Map* source_files = &EMPTY_MAP;
 static Map* source_lines = &EMPTY_MAP;
 static char* last_loc = "";
-static char* current_func_name;
+static Node* current_func;
+
+// Registers that can hold an expression temporary while another
+// subexpression is being evaluated. A always receives the value being
+// computed and B is clobbered by every load and store, so neither of them
+// is in this list. Temporaries are allocated and released in LIFO order.
+//
+// Local variables promoted to registers take the registers at the end of
+// the list, which are not available to temporaries in that function.
+static char* tmpregs[] = { "C", "D", "E", "F", "G", "H" };
+static int ntmpregs;
+static int tmpdepth;
+static int nkept;
+static int nspilled;
+
+// E to H keep their values across calls: a function that uses any of them
+// saves it in its prologue and restores it before returning. This lets
+// promoted variables live through calls, including native ones, since
+// E to H are callee-saved in the backends' calling conventions too.
+#define FIRST_SAVED_REG 2
+#define MAX_VAR_REGS 4
+
+// Instructions it takes to access a stack slot: computing its address off
+// BP and loading or storing it. A variable in a register takes one.
+#define SLOT_ACCESS_COST 3
+
+static int nvarregs;
+static char* ret_label;
+static int localarea;
+
+// Functions defined in the file being compiled. Only calls to them are
+// turned into tail calls; native functions are left to the backends'
+// calling sequences, which expect a return address of their own.
+static Map* defined_funcs = &EMPTY_MAP;
+
+// Tail calls of the current function jump to a stub per callee, emitted
+// with the epilogue, that tears down the frame and jumps to the callee.
+static Map* tail_labels;
+static Vector* tail_callees;
+
+// The compound statement that ends the current function, or ends such a
+// statement, as the copy of an inlined call does.
+static Node* tail_block;
 
 static void emit_addr(Node* node);
 static void emit_expr(Node* node);
+static void emit_assign(Node* node);
 static void emit_decl_init(Vector* inits, int off, int totalsize);
 static void do_emit_data(Vector* inits, int size, int off, int depth);
 static void emit_data(Node* v, int off, int depth);
+static void maybe_print_source_loc(Node* node);
 
 #define REGAREA_SIZE 176
 
@@ -78,8 +127,22 @@ void close_output_file() {
     fclose(outputfp);
 }
 
+// IR of the function being generated, or NULL outside of functions.
+static Vector* func_ir;
+
+// Code labels whose address is stored in data, such as the entries of
+// switch jump tables. They may be reached through an indirect jump.
+static Map* data_labels = &EMPTY_MAP;
+
+static void emit_line(char* line) {
+    if (func_ir)
+        vec_push(func_ir, parse_inst(line));
+    else
+        fprintf(outputfp, "%s\n", line);
+}
+
 static void emitf(int line, char* fmt, ...) {
-    // Replace "#" with "%%" so that vfprintf prints out "#" as "%".
+    // Replace "#" with "%%" so that vformat prints out "#" as "%".
     char buf[256];
     int i = 0;
     for (char* p = fmt; *p; p++) {
@@ -95,31 +158,93 @@ static void emitf(int line, char* fmt, ...) {
 
     va_list args;
     va_start(args, fmt);
-    int col = vfprintf(outputfp, buf, args);
+    char* s = vformat(buf, args);
     va_end(args);
 
     if (dumpstack) {
+        int col = strlen(s);
         for (char* p = fmt; *p; p++)
             if (*p == '\t')
                 col += TAB - 1;
         int space = (28 - col) > 0 ? (30 - col) : 2;
-        fprintf(outputfp, "%*c %s:%d", space, '#', get_caller_list(), line);
+        s = format("%s%*c %s:%d", s, space, '#', get_caller_list(), line);
     }
-    fprintf(outputfp, "\n");
+    emit_line(s);
 }
 
 static void emit_nostack(char* fmt, ...) {
-    fprintf(outputfp, "\t");
     va_list args;
     va_start(args, fmt);
-    vfprintf(outputfp, fmt, args);
+    char* s = vformat(fmt, args);
     va_end(args);
-    fprintf(outputfp, "\n");
+    emit_line(format("\t%s", s));
+}
+
+static bool is_directive(Inst* inst, char* name) {
+    if (inst->kind != INST_DIRECTIVE)
+        return false;
+    char* dir = inst->text + strspn(inst->text, "\t ");
+    return !strncmp(dir, name, strlen(name));
+}
+
+// Removes the string literals that only dead code referred to. Each of
+// them is a ".data" directive followed by its label and the string.
+static void remove_unused_strings(Vector* data, Vector* code) {
+    Map* used = make_map();
+    for (int i = 0; i < vec_len(code); i++) {
+        Inst* inst = vec_get(code, i);
+        for (int j = 0; inst->kind == INST_OP && j < inst->nargs; j++) {
+            char* arg = inst->args[j];
+            map_put(used, is_mem_arg(arg) ? mem_base(arg) : arg, (void*)1);
+        }
+    }
+    bool drop = false;
+    for (int i = 0; i < vec_len(data); i++) {
+        Inst* inst = vec_get(data, i);
+        if (is_directive(inst, ".data")) {
+            Inst* next = (i + 1 < vec_len(data)) ? vec_get(data, i + 1) : NULL;
+            char* rest = strstr(inst->text, ".data") + 5;
+            rest += strspn(rest, "\t ");
+            drop = (!*rest || *rest == '#') && next && next->kind == INST_LABEL &&
+                !map_get(used, next->op);
+        }
+        if (drop)
+            vec_set(data, i, NULL);
+    }
+    ir_compact(data);
+}
+
+// Writes out the IR of the current function after optimizing it. String
+// literals emitted in the middle of the function are moved after it, and
+// the function ends back in .text, where nativecalls.py adds its stubs.
+// `hasvolatile` tells whether the function accesses a volatile object.
+static void flush_func_ir(char* fname, bool hasvolatile) {
+    Vector* code = make_vector();
+    Vector* data = make_vector();
+    bool indata = false;
+    for (int i = 0; i < vec_len(func_ir); i++) {
+        Inst* inst = vec_get(func_ir, i);
+        if (is_directive(inst, ".data")) {
+            indata = true;
+        } else if (is_directive(inst, ".text") && indata) {
+            indata = false;
+            continue;
+        }
+        vec_push(indata ? data : code, inst);
+    }
+    func_ir = NULL;
+    run_ir_passes(code, data_labels, fname, hasvolatile);
+    remove_unused_strings(data, code);
+    for (int i = 0; i < vec_len(code); i++)
+        print_inst(outputfp, vec_get(code, i));
+    for (int i = 0; i < vec_len(data); i++)
+        print_inst(outputfp, vec_get(data, i));
+    if (vec_len(data))
+        emit_noindent(".text");
 }
 
 static void push(char* reg) {
     SAVE;
-    assert(strcmp(reg, "D"));
     emit("sub SP, 8");
     emit("store64 %s, SP", reg);
     stackpos += 1;
@@ -133,6 +258,263 @@ static void pop(char* reg) {
     assert(stackpos >= 0);
 }
 
+// Returns true if evaluating the node may call a function. A callee is free
+// to use every register but SP and BP, so no temporary survives a call.
+static bool has_call(Node* node) {
+    if (!node)
+        return false;
+    switch (node->kind) {
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case AST_GOTO:
+        case AST_LABEL:
+        case OP_LABEL_ADDR:
+            return false;
+        case AST_LVAR:
+            if (!node->lvarinit)
+                return false;
+            for (int i = 0; i < vec_len(node->lvarinit); i++)
+                if (has_call(((Node*)vec_get(node->lvarinit, i))->initval))
+                    return true;
+            return false;
+        case AST_FUNCALL:
+            return strcmp(node->fname, "___builtin_gadget_addr");
+        case AST_FUNCPTR_CALL:
+            return true;
+        case AST_DECL:
+            if (!node->declinit)
+                return false;
+            for (int i = 0; i < vec_len(node->declinit); i++)
+                if (has_call(((Node*)vec_get(node->declinit, i))->initval))
+                    return true;
+            return false;
+        case AST_IF:
+        case AST_TERNARY:
+            return has_call(node->cond) || has_call(node->then) || has_call(node->els);
+        case AST_RETURN:
+            return has_call(node->retval);
+        case AST_COMPOUND_STMT:
+            for (int i = 0; i < vec_len(node->stmts); i++)
+                if (has_call(vec_get(node->stmts, i)))
+                    return true;
+            return false;
+        case AST_STRUCT_REF:
+            return has_call(node->struc);
+        case AST_CONV:
+        case AST_ADDR:
+        case AST_DEREF:
+        case AST_COMPUTED_GOTO:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            return has_call(node->operand);
+        default:
+            return has_call(node->left) || has_call(node->right);
+    }
+}
+
+// Returns true if the node contains a label, through which control may
+// enter it from elsewhere.
+static bool has_label(Node* node) {
+    if (!node)
+        return false;
+    switch (node->kind) {
+        case AST_LABEL:
+            return true;
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_LVAR:
+        case AST_FUNCDESG:
+        case AST_GOTO:
+        case AST_DECL:
+        case AST_FUNCALL:
+        case AST_FUNCPTR_CALL:
+        case OP_LABEL_ADDR:
+            return false;
+        case AST_IF:
+        case AST_TERNARY:
+            return has_label(node->cond) || has_label(node->then) || has_label(node->els);
+        case AST_RETURN:
+            return has_label(node->retval);
+        case AST_COMPOUND_STMT:
+            for (int i = 0; i < vec_len(node->stmts); i++)
+                if (has_label(vec_get(node->stmts, i)))
+                    return true;
+            return false;
+        case AST_STRUCT_REF:
+            return has_label(node->struc);
+        case AST_CONV:
+        case AST_ADDR:
+        case AST_DEREF:
+        case AST_COMPUTED_GOTO:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            return has_label(node->operand);
+        default:
+            return has_label(node->left) || has_label(node->right);
+    }
+}
+
+// State of the scan that finds which local variables are worth promoting.
+// Every use gets a sequence number; a goto back to an earlier label closes
+// a loop, and the uses in between weigh more.
+typedef struct {
+    Vector* vars;
+    bool* escaped;
+    Vector* use_var;
+    Vector* use_seq;
+    Vector* loop_beg;
+    Vector* loop_end;
+    Map* labels;
+    int seq;
+} LvarScan;
+
+#define LOOP_WEIGHT 8
+
+static void scan_lvars(LvarScan* sc, Node* node);
+
+static void scan_inits(LvarScan* sc, Vector* inits) {
+    for (int i = 0; inits && i < vec_len(inits); i++)
+        scan_lvars(sc, ((Node*)vec_get(inits, i))->initval);
+}
+
+static void scan_lvars(LvarScan* sc, Node* node) {
+    if (!node)
+        return;
+    switch (node->kind) {
+        case AST_LVAR:
+            for (int i = 0; i < vec_len(sc->vars); i++) {
+                if (vec_get(sc->vars, i) == node) {
+                    vec_push(sc->use_var, (void*)(intptr_t)i);
+                    vec_push(sc->use_seq, (void*)(intptr_t)sc->seq++);
+                }
+            }
+            scan_inits(sc, node->lvarinit);
+            return;
+        case AST_LABEL:
+            if (node->newlabel)
+                map_put(sc->labels, node->newlabel, (void*)(intptr_t)(sc->seq + 1));
+            return;
+        case AST_GOTO: {
+            intptr_t beg = (intptr_t)map_get(sc->labels, node->newlabel);
+            if (beg) {
+                vec_push(sc->loop_beg, (void*)(beg - 1));
+                vec_push(sc->loop_end, (void*)(intptr_t)sc->seq);
+            }
+            return;
+        }
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case OP_LABEL_ADDR:
+            return;
+        case AST_FUNCALL:
+        case AST_FUNCPTR_CALL:
+            if (node->kind == AST_FUNCPTR_CALL)
+                scan_lvars(sc, node->fptr);
+            for (int i = 0; i < vec_len(node->args); i++)
+                scan_lvars(sc, vec_get(node->args, i));
+            return;
+        case AST_DECL:
+            scan_lvars(sc, node->declvar);
+            scan_inits(sc, node->declinit);
+            return;
+        case AST_IF:
+        case AST_TERNARY:
+            scan_lvars(sc, node->cond);
+            scan_lvars(sc, node->then);
+            scan_lvars(sc, node->els);
+            return;
+        case AST_RETURN:
+            scan_lvars(sc, node->retval);
+            return;
+        case AST_COMPOUND_STMT:
+            for (int i = 0; i < vec_len(node->stmts); i++)
+                scan_lvars(sc, vec_get(node->stmts, i));
+            return;
+        case AST_STRUCT_REF:
+            scan_lvars(sc, node->struc);
+            return;
+        case AST_ADDR:
+            for (int i = 0; i < vec_len(sc->vars); i++)
+                if (vec_get(sc->vars, i) == node->operand)
+                    sc->escaped[i] = true;
+            // fall through
+        case AST_CONV:
+        case AST_DEREF:
+        case AST_COMPUTED_GOTO:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            scan_lvars(sc, node->operand);
+            return;
+        default:
+            scan_lvars(sc, node->left);
+            scan_lvars(sc, node->right);
+    }
+}
+
+// Returns the uses of each variable in `sc`, weighted by loop nesting.
+static long* weigh_lvar_uses(LvarScan* sc) {
+    long* r = calloc(vec_len(sc->vars), sizeof(long));
+    for (int i = 0; i < vec_len(sc->use_var); i++) {
+        intptr_t seq = (intptr_t)vec_get(sc->use_seq, i);
+        long w = 1;
+        for (int j = 0; j < vec_len(sc->loop_beg); j++)
+            if ((intptr_t)vec_get(sc->loop_beg, j) <= seq && seq < (intptr_t)vec_get(sc->loop_end, j) &&
+                w < (1L << 40))
+                w *= LOOP_WEIGHT;
+        r[(intptr_t)vec_get(sc->use_var, i)] += w;
+    }
+    return r;
+}
+
+// Moves A to a place where it survives the evaluation of `next`: a free
+// temporary register if `next` makes no calls, the stack otherwise. Returns
+// the register holding the value, or NULL if it was spilled.
+static char* save_temp(Node* next) {
+    if (tmpdepth < ntmpregs && !has_call(next)) {
+        char* reg = tmpregs[tmpdepth++];
+        emit("mov %s, A", reg);
+        nkept++;
+        return reg;
+    }
+    push("A");
+    nspilled++;
+    return NULL;
+}
+
+// Releases a temporary register obtained from save_temp without moving
+// its value anywhere. The value stays readable until the next save_temp.
+static void release_temp(char* reg) {
+    assert(tmpdepth > 0 && reg == tmpregs[tmpdepth - 1]);
+    tmpdepth--;
+}
+
+// Moves a value saved by save_temp to `dst`.
+static void restore_temp(char* reg, char* dst) {
+    if (!reg) {
+        pop(dst);
+        return;
+    }
+    release_temp(reg);
+    emit("mov %s, %s", dst, reg);
+}
+
 #if 0
 static void maybe_emit_bitshift_load(Type* ty) {
     SAVE;
@@ -163,28 +545,66 @@ static void maybe_emit_bitshift_save(Type* ty, char* addr) {
 }
 #endif
 
+// Returns the memory operand addressing `off` bytes past `base`, which is
+// a register or a label.
+static char* mem_arg(char* base, int off) {
+    if (!off)
+        return format("[%s]", base);
+    return format("[%s%+d]", base, MOD24(off));
+}
+
+// Loads `bits` bits at `off` bytes past `base` into `dst`. Without memory
+// operands the address is computed into a register first: B for loads
+// into A, `dst` itself for the others.
+static void emit_load(int bits, char* dst, char* base, int off) {
+    if (pass_enabled(PASS_MEM_OPERANDS)) {
+        emit("load%d %s, %s", bits, dst, mem_arg(base, off));
+        return;
+    }
+    char* addr = strcmp(dst, "A") ? dst : "B";
+    if (strcmp(addr, base))
+        emit("mov %s, %s", addr, base);
+    if (off)
+        emit("add %s, %d", addr, MOD24(off));
+    emit("load%d %s, %s", bits, dst, addr);
+}
+
+// Stores `bits` bits of `src` at `off` bytes past `base`. Without memory
+// operands the address is computed into B, or into `base` itself if it is
+// A or B, which the callers are done with.
+static void emit_store_mem(int bits, char* src, char* base, int off) {
+    if (pass_enabled(PASS_MEM_OPERANDS)) {
+        emit("store%d %s, %s", bits, src, mem_arg(base, off));
+        return;
+    }
+    char* addr = (!strcmp(base, "A") || !strcmp(base, "B")) ? base : "B";
+    assert(strcmp(src, addr));
+    if (strcmp(addr, base))
+        emit("mov %s, %s", addr, base);
+    if (off)
+        emit("add %s, %d", addr, MOD24(off));
+    emit("store%d %s, %s", bits, src, addr);
+}
+
 static void emit_gload(Type* ty, char* label, int off) {
     SAVE;
-    if (ty->kind == KIND_ARRAY) {
+    if (ty->kind == KIND_ARRAY || ty->kind == KIND_STRUCT) {
         emit("mov A, %s", label);
         if (off)
             emit("add A, %d", MOD24(off));
         return;
     }
-    emit("mov B, %s", label);
-    if (off)
-        emit("add B, %d", MOD24(off));
-    emit("load%d A, B", ty->size * 8);
+    emit_load(ty->size * 8, "A", label, off);
 #if 0
     maybe_emit_bitshift_load(ty);
 #endif
 }
 
-static void emit_intcast(Type* ty) {
+static void emit_crop(Type* ty, char* reg) {
     if (ty->usig)
-        emit("crop%d A", 8 * ty->size);
+        emit("crop%d %s", 8 * ty->size, reg);
     else
-        emit("icrop%d A", 8 * ty->size);
+        emit("icrop%d %s", 8 * ty->size, reg);
 }
 
 static void emit_toint(Type* ty) {
@@ -199,6 +619,7 @@ static void emit_lload(Type* ty, char* base, int off) {
     SAVE;
     switch (ty->kind) {
         case KIND_ARRAY:
+        case KIND_STRUCT:
             emit("mov A, %s", base);
             if (off) { emit("add A, %d", MOD24(off)); }
             break;
@@ -207,9 +628,7 @@ static void emit_lload(Type* ty, char* base, int off) {
         case KIND_LDOUBLE:
             assert_float(); break;
         default:
-            emit("mov B, %s", base);
-            if (off) { emit("add B, %d", MOD24(off)); }
-            emit("load%d A, B", ty->size * 8);
+            emit_load(ty->size * 8, "A", base, off);
             break;
     };
 }
@@ -229,10 +648,7 @@ static void emit_gsave(char* varname, Type* ty, int off) {
     char* addr = format("%s+%d(%%rip)", varname, off);
     maybe_emit_bitshift_save(ty, addr);
 #endif
-    emit("mov B, %s", varname);
-    if (off)
-        emit("add B, %d", MOD24(off));
-    emit("store%d A, B", ty->size * 8);
+    emit_store_mem(ty->size * 8, "A", varname, off);
 }
 
 static void emit_lsave(Type* ty, int off) {
@@ -241,62 +657,515 @@ static void emit_lsave(Type* ty, int off) {
         assert_float();
     } else if (ty->kind == KIND_DOUBLE) {
         assert_float();
-    } else {
+    } else if (ty->kind == KIND_STRUCT) {
         emit("mov B, BP");
         if (off)
             emit("add B, %d", MOD24(off));
-        emit("store%d A, B", ty->size * 8);
+        emit("memcpy B, A, %d", ty->size);
+    } else {
+        emit_store_mem(ty->size * 8, "A", "BP", off);
     }
 }
 
-static void do_emit_assign_deref(Type* ty, int off) {
+// Operands that can be loaded into a register without touching any other
+// register, so evaluating them never needs a temporary.
+static bool is_leaf(Node* node) {
+    if (!pass_enabled(PASS_REGALLOC))
+        return false;
+    bool scalar = is_inttype(node->ty) || node->ty->kind == KIND_PTR;
+    switch (node->kind) {
+        case AST_LITERAL: return scalar;
+        case AST_LVAR:    return scalar && !node->lvarinit;
+        case AST_GVAR:    return scalar;
+        default:          return false;
+    }
+}
+
+static void emit_leaf(Node* node, char* reg) {
     SAVE;
-    emit("load64 B, SP");
+    maybe_print_source_loc(node);
+    switch (node->kind) {
+        case AST_LITERAL:
+            emit("mov %s, %ld", reg, MOD24(node->ival));
+            return;
+        case AST_LVAR:
+            if (node->lreg) {
+                emit("mov %s, %s", reg, node->lreg);
+                return;
+            }
+            emit_load(node->ty->size * 8, reg, "BP", node->loff);
+            return;
+        case AST_GVAR:
+            emit_load(node->ty->size * 8, reg, node->glabel, 0);
+            return;
+        default:
+            error("internal error: %s", node2s(node));
+    }
+}
+
+static char* swap_comp(char* inst) {
+    if (!strcmp(inst, "lt"))
+        return "gt";
+    if (!strcmp(inst, "le"))
+        return "ge";
+    return inst;
+}
+
+static char* negate_comp(char* inst) {
+    static char* pairs[][2] = {
+        { "eq", "ne" }, { "lt", "ge" }, { "le", "gt" },
+    };
+    for (int i = 0; i < 3; i++) {
+        if (!strcmp(inst, pairs[i][0])) return pairs[i][1];
+        if (!strcmp(inst, pairs[i][1])) return pairs[i][0];
+    }
+    error("internal error: %s", inst);
+}
+
+// Returns the comparison instruction for an operator, or NULL.
+static char* comp_inst(int kind) {
+    switch (kind) {
+        case '<':   return "lt";
+        case OP_LE: return "le";
+        case OP_EQ: return "eq";
+        case OP_NE: return "ne";
+        default:    return NULL;
+    }
+}
+
+// Truncates `val` the way emit_crop(ty, ...) would at runtime.
+static long crop_value(long val, Type* ty) {
+    switch (ty->size) {
+        case 1: return ty->usig ? (long)(uint8_t)val : (long)(int8_t)val;
+        case 2: return ty->usig ? (long)(uint16_t)val : (long)(int16_t)val;
+        case 4: return ty->usig ? (long)(uint32_t)val : (long)(int32_t)val;
+        default: return val;
+    }
+}
+
+// Computes the value an integer constant expression leaves in A. This
+// mirrors emit_expr rather than C semantics: integer conversions only crop
+// to their source type.
+static bool eval_const(Node* node, long* val) {
+    switch (node->kind) {
+        case AST_LITERAL:
+            if (!is_inttype(node->ty))
+                return false;
+            *val = node->ival;
+            return true;
+        case AST_CONV:
+        case OP_CAST: {
+            Type* from = node->operand->ty;
+            Type* to = node->ty;
+            if ((!is_inttype(from) && from->kind != KIND_PTR) ||
+                (!is_inttype(to) && to->kind != KIND_PTR))
+                return false;
+            if (!eval_const(node->operand, val))
+                return false;
+            if (to->kind == KIND_BOOL)
+                *val = (*val != 0);
+            else if (is_inttype(from) && is_inttype(to))
+                *val = crop_value(*val, from);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Value ranges.
+//
+// Integers narrower than 64 bits are only brought back to their canonical
+// sign- or zero-extended form where an operation looks at the upper bits;
+// arithmetic leaves whatever the 64-bit result is in them. value_range
+// bounds what emit_expr leaves in A for a node, so that crops of values
+// which already fit, such as loads, comparison results or small
+// literals, can be skipped.
+
+// Range of the values that are left as they are by emit_crop(ty, ...).
+static void type_range(Type* ty, long* lo, long* hi) {
+    int bits = ty->size * 8;
+    if (bits >= 64) {
+        *lo = INT64_MIN;
+        *hi = INT64_MAX;
+    } else if (ty->usig) {
+        *lo = 0;
+        *hi = (1L << bits) - 1;
+    } else {
+        *lo = -(1L << (bits - 1));
+        *hi = (1L << (bits - 1)) - 1;
+    }
+}
+
+static bool fits_type(Type* ty, long lo, long hi) {
+    long tlo, thi;
+    type_range(ty, &tlo, &thi);
+    return tlo <= lo && hi <= thi;
+}
+
+// loadN sign-extends whatever the type is.
+static void load_range(Type* ty, long* lo, long* hi) {
+    type_range(&(Type){ .size = ty->size, .usig = false }, lo, hi);
+}
+
+static void crop_range(Type* ty, long* lo, long* hi) {
+    if (!fits_type(ty, *lo, *hi))
+        type_range(ty, lo, hi);
+}
+
+// Mirrors emit_load_convert.
+static void convert_range(Type* to, Type* from, long* lo, long* hi) {
+    if (to->kind == KIND_BOOL) {
+        *lo = 0;
+        *hi = 1;
+    } else if (is_inttype(from) && is_inttype(to)) {
+        crop_range(from, lo, hi);
+    }
+}
+
+// Bounds that products and sums of are computed without overflow.
+static bool is_small_range(long lo, long hi) {
+    return INT32_MIN <= lo && hi <= INT32_MAX;
+}
+
+static bool is_bitfield(Type* ty) {
+    return ty->bitsize > 0;
+}
+
+static void value_range(Node* node, long* lo, long* hi) {
+    *lo = INT64_MIN;
+    *hi = INT64_MAX;
+    if (!node->ty || !is_inttype(node->ty) || is_bitfield(node->ty))
+        return;
+    long llo, lhi, rlo, rhi, val;
+    switch (node->kind) {
+        case AST_LITERAL:
+            *lo = *hi = node->ival;
+            return;
+        case AST_LVAR:
+        case AST_GVAR:
+        case AST_STRUCT_REF:
+            load_range(node->ty, lo, hi);
+            return;
+        case AST_DEREF:
+            load_range(node->operand->ty->ptr, lo, hi);
+            convert_range(node->ty, node->operand->ty->ptr, lo, hi);
+            return;
+        case AST_CONV:
+        case OP_CAST:
+            value_range(node->operand, lo, hi);
+            convert_range(node->ty, node->operand->ty, lo, hi);
+            return;
+        case '=':
+            if (is_bitfield(node->left->ty))
+                return;
+            value_range(node->right, lo, hi);
+            convert_range(node->ty, node->right->ty, lo, hi);
+            return;
+        case ',':
+            value_range(node->right, lo, hi);
+            return;
+        case AST_TERNARY:
+            if (!node->then || !node->els)
+                return;
+            value_range(node->then, &llo, &lhi);
+            value_range(node->els, &rlo, &rhi);
+            *lo = (llo < rlo) ? llo : rlo;
+            *hi = (lhi > rhi) ? lhi : rhi;
+            return;
+        case '<': case OP_LE: case OP_EQ: case OP_NE:
+        case '!': case OP_LOGAND: case OP_LOGOR:
+            *lo = 0;
+            *hi = 1;
+            return;
+    }
+    switch (node->kind) {
+        case '&': case '|': case '^': case '+': case '-': case '*':
+        case '/': case '%': case OP_SAR: case OP_SHR:
+            break;
+        default:
+            return;
+    }
+    value_range(node->left, &llo, &lhi);
+    value_range(node->right, &rlo, &rhi);
+    Type* lty = node->left->ty;
+    switch (node->kind) {
+        case '&':
+            // Masking with a non-negative value bounds the result by it.
+            if (llo >= 0 || rlo >= 0) {
+                *lo = 0;
+                *hi = (llo < 0) ? rhi : (rlo < 0) ? lhi : (lhi < rhi) ? lhi : rhi;
+            }
+            return;
+        case '|':
+        case '^':
+            if (llo >= 0 && rlo >= 0) {
+                long mask = lhi | rhi;
+                for (int i = 1; i < 64; i *= 2)
+                    mask |= mask >> i;
+                *lo = 0;
+                *hi = mask;
+            }
+            return;
+        case '+':
+            if (is_small_range(llo, lhi) && is_small_range(rlo, rhi)) {
+                *lo = llo + rlo;
+                *hi = lhi + rhi;
+            }
+            return;
+        case '-':
+            if (is_small_range(llo, lhi) && is_small_range(rlo, rhi)) {
+                *lo = llo - rhi;
+                *hi = lhi - rlo;
+            }
+            return;
+        case '*':
+            if (is_small_range(llo, lhi) && is_small_range(rlo, rhi)) {
+                long p[] = { llo * rlo, llo * rhi, lhi * rlo, lhi * rhi };
+                *lo = *hi = p[0];
+                for (int i = 1; i < 4; i++) {
+                    *lo = (p[i] < *lo) ? p[i] : *lo;
+                    *hi = (p[i] > *hi) ? p[i] : *hi;
+                }
+            }
+            return;
+        case '/':
+        case '%': {
+            // Division by a positive constant, see emit_binop_int_arith for
+            // how the operands are cropped.
+            Type* rcast = &(Type){ .size = node->right->ty->size, .usig = lty->usig };
+            if (!eval_const(node->right, &val) || (val = crop_value(val, rcast)) <= 0)
+                return;
+            crop_range(lty, &llo, &lhi);
+            if (llo < 0 && lty->usig)
+                return;
+            if (node->kind == '/') {
+                *lo = llo / val;
+                *hi = lhi / val;
+            } else {
+                *lo = (llo < 0) ? -(val - 1) : 0;
+                *hi = val - 1;
+            }
+            return;
+        }
+        case OP_SAR:
+        case OP_SHR: {
+            // The left operand is cropped to its size first.
+            if (!eval_const(node->right, &val) || val < 0 || val > 63)
+                return;
+            Type* cast = &(Type){ .size = lty->size, .usig = node->kind == OP_SHR };
+            crop_range(cast, &llo, &lhi);
+            if (llo < 0 && node->kind == OP_SHR)
+                return;
+            *lo = llo >> val;
+            *hi = lhi >> val;
+            return;
+        }
+        default:
+            return;
+    }
+}
+
+// Returns true if cropping what emit_expr leaves in A for `node` to `ty`
+// would not change it.
+static bool is_cropped(Node* node, Type* ty) {
+    if (!pass_enabled(PASS_ELIDE_CROPS))
+        return false;
+    long lo, hi;
+    value_range(node, &lo, &hi);
+    return fits_type(ty, lo, hi);
+}
+
+// Crops the value of `node` in `reg` to `ty` if it may not fit.
+static void emit_crop_value(Node* node, Type* ty, char* reg) {
+    if (ty && !is_cropped(node, ty))
+        emit_crop(ty, reg);
+}
+
+// Crops the value of `node` in A to its type.
+static void emit_intcast(Node* node) {
+    emit_crop_value(node, node->ty, "A");
+}
+
+// Returns `node` formatted as an immediate operand, cropped to `cast` if
+// given, or NULL if it is not a constant that fits in one.
+static char* imm_operand(Node* node, Type* cast) {
+    long val;
+    if (!pass_enabled(PASS_IMMEDIATES) || !eval_const(node, &val))
+        return NULL;
+    if (cast)
+        val = crop_value(val, cast);
+    return is_imm(val) ? format("%ld", val) : NULL;
+}
+
+static bool is_reg_operand(char* opnd) {
+    return isupper(opnd[0]);
+}
+
+// Evaluates the operands of a binary operator, cropping them to `lcast`
+// and `rcast` when those are given. The left operand ends up in A and the
+// right one in the returned operand, which is either a register or an
+// immediate. If `swapped` is given the operands may instead be returned
+// the other way around, which saves the register shuffle needed to put
+// them back in order; *swapped tells which happened.
+static char* emit_operands(Node* left, Node* right, Type* lcast, Type* rcast, bool* swapped) {
+    SAVE;
+    if (swapped)
+        *swapped = false;
+    char* imm = imm_operand(right, rcast);
+    if (!imm && swapped && (imm = imm_operand(left, lcast))) {
+        emit_expr(right);
+        emit_crop_value(right, rcast, "A");
+        *swapped = true;
+        return imm;
+    }
+    emit_expr(left);
+    emit_crop_value(left, lcast, "A");
+    if (imm)
+        return imm;
+    if (right->kind == AST_LVAR && right->lreg && (!rcast || is_cropped(right, rcast)))
+        return right->lreg;
+    if (is_leaf(right)) {
+        emit_leaf(right, "B");
+        emit_crop_value(right, rcast, "B");
+        return "B";
+    }
+    char* reg = save_temp(right);
+    emit_expr(right);
+    emit_crop_value(right, rcast, "A");
+    if (swapped) {
+        // The left operand goes straight to B from where it was saved.
+        *swapped = true;
+        if (!reg) {
+            pop("B");
+            return "B";
+        }
+        release_temp(reg);
+        return reg;
+    }
+    emit("mov B, A");
+    restore_temp(reg, "A");
+    return "B";
+}
+
+// Stores A to the address computed by `addr` plus `off`. A is preserved.
+static void emit_store_deref(Node* addr, Type* ty, int off) {
+    SAVE;
+    if (is_leaf(addr)) {
+        emit_leaf(addr, "B");
+        emit_store_mem(ty->size * 8, "A", "B", off);
+        return;
+    }
+    char* reg = save_temp(addr);
+    emit_expr(addr);
+    if (reg) {
+        emit_store_mem(ty->size * 8, reg, "A", off);
+        restore_temp(reg, "A");
+        return;
+    }
     if (off)
         emit("add A, %d", MOD24(off));
+    emit("load64 B, SP");
     emit("store%d B, A", ty->size * 8);
     pop("A");
 }
 
 static void emit_assign_deref(Node* var) {
     SAVE;
-    push("A");
-    emit_expr(var->operand);
-    do_emit_assign_deref(var->operand->ty->ptr, 0);
+    emit_store_deref(var->operand, var->operand->ty->ptr, 0);
 }
 
 static void emit_call_builtin(char* fname);
 
-static void emit_pointer_arith(char kind, Node* left, Node* right) {
+// Returns k if val is 2^k, or -1.
+static int exact_log2(long val) {
+    if (val <= 0 || (val & (val - 1)))
+        return -1;
+    int k = 0;
+    while (val >>= 1)
+        k++;
+    return k;
+}
+
+// Divides A by `d`, or takes it modulo `d`, with shifts and masks if `d`
+// is a power of two. A signed dividend gets 2^k-1 added when negative,
+// so that the quotient rounds toward zero. Returns false if `d` is not a
+// power of two.
+static bool emit_div_pow2(int kind, bool usig, long d) {
     SAVE;
-    emit_expr(left);
-    push("B");
-    push("A");
-    emit_expr(right);
+    int k = exact_log2(d);
+    if (k <= 0)
+        return false;
+    if (usig) {
+        if (kind == '/')
+            emit("shr A, %d", k);
+        else
+            emit("and A, %ld", d - 1);
+        return true;
+    }
+    emit("mov B, A");
+    emit("sar B, 63");
+    emit("shr B, %d", 64 - k);
+    emit("add A, B");
+    if (kind == '/') {
+        emit("sar A, %d", k);
+    } else {
+        emit("and A, %ld", d - 1);
+        emit("sub A, B");
+    }
+    return true;
+}
 
-    if (left->ty->ptr->size == 2)
-        emit("add A, A");
-    if (left->ty->ptr->size > 2)
-        emit("mul A, %d", left->ty->ptr->size);
+static void emit_scale(char* reg, int size) {
+    int k = pass_enabled(PASS_STRENGTH_REDUCE) ? exact_log2(size) : -1;
+    if (size == 2)
+        emit("add %s, %s", reg, reg);
+    else if (k > 0)
+        emit("shl %s, %d", reg, k);
+    else if (size > 2)
+        emit("mul %s, %d", reg, size);
+}
 
-    emit("mov B, A");
-    pop("A");
-    switch (kind) {
-        case '+': emit("add A, B"); break;
-        case '-': emit("sub A, B"); break;
-        default: error("invalid operator '%d'", kind);
+static void emit_pointer_arith(char kind, Node* left, Node* right) {
+    SAVE;
+    if (kind != '+' && kind != '-')
+        error("invalid operator '%d'", kind);
+    int size = left->ty->ptr->size;
+    long val;
+    if (pass_enabled(PASS_IMMEDIATES) && eval_const(right, &val) && is_imm(val * size)) {
+        emit_expr(left);
+        if (val)
+            emit("%s A, %ld", kind == '+' ? "add" : "sub", val * size);
+        return;
     }
-    pop("B");
+    emit_expr(left);
+    if (is_leaf(right)) {
+        emit_leaf(right, "B");
+        emit_scale("B", size);
+    } else {
+        char* reg = save_temp(right);
+        emit_expr(right);
+        emit_scale("A", size);
+        if (reg && kind == '+') {
+            release_temp(reg);
+            emit("add A, %s", reg);
+            return;
+        }
+        emit("mov B, A");
+        restore_temp(reg, "A");
+    }
+    emit("%s A, B", kind == '+' ? "add" : "sub");
 }
 
+// Clears the local variable bytes between `start` and `end`, which are
+// offsets from BP.
 static void emit_zero_filler(int start, int end) {
     SAVE;
-    emit("mov A, 0");
-    emit("mov B, SP");
-    for (; start != end; start++) {
-        emit("store8 A, B");
-        emit("add B, 1");
-    }
+    if (start == end)
+        return;
+    emit("mov B, BP");
+    emit("add B, %d", MOD24(start));
+    emit("memset B, 0, %d", end - start);
 }
 
 static void ensure_lvar_init(Node* node) {
@@ -321,9 +1190,7 @@ static void emit_assign_struct_ref(Node* struc, Type* field, int off) {
             emit_assign_struct_ref(struc->struc, field, off + struc->ty->offset);
             break;
         case AST_DEREF:
-            push("A");
-            emit_expr(struc->operand);
-            do_emit_assign_deref(field, field->offset + off);
+            emit_store_deref(struc->operand, field, field->offset + off);
             break;
         default:
             error("internal error: %s", node2s(struc));
@@ -352,12 +1219,28 @@ static void emit_load_struct_ref(Node* struc, Type* field, int off) {
     }
 }
 
-static void emit_store(Node* var) {
+// Copies A to a promoted variable. The register is kept in the form a load
+// from memory would give, that is sign-extended from the variable's size.
+// `value` is the node whose value is in A, or NULL if unknown.
+static void emit_reg_save(Node* var, Node* value) {
+    SAVE;
+    emit("mov %s, A", var->lreg);
+    Type* cast = &(Type){ .size = var->ty->size, .usig = false };
+    if (!value || !is_cropped(value, cast))
+        emit_crop(cast, var->lreg);
+}
+
+// Stores A to `var`. `value` is the node whose value is in A, or NULL.
+static void emit_store(Node* var, Node* value) {
     SAVE;
     switch (var->kind) {
         case AST_DEREF: emit_assign_deref(var); break;
         case AST_STRUCT_REF: emit_assign_struct_ref(var->struc, var->ty, 0); break;
         case AST_LVAR:
+            if (var->lreg) {
+                emit_reg_save(var, value);
+                break;
+            }
             ensure_lvar_init(var);
             emit_lsave(var->ty, var->loff);
             break;
@@ -377,75 +1260,92 @@ static void emit_to_bool(Type* ty) {
 
 static void emit_comp(char* inst, Node* node) {
     SAVE;
-    if (is_flotype(node->left->ty)) {
+    if (is_flotype(node->left->ty))
         assert_float();
-    } else {
-        emit_expr(node->left);
-        emit_intcast(node->left->ty);
-        push("A");
-        emit_expr(node->right);
-        emit_intcast(node->right->ty);
-        emit("mov B, A");
-        pop("A");
+    bool swapped;
+    char* opnd = emit_operands(node->left, node->right, node->left->ty, node->right->ty, &swapped);
+    emit("%s A, %s", swapped ? swap_comp(inst) : inst, opnd);
+}
+
+// Returns the instruction for a commutative integer operator, or NULL.
+static char* commutative_inst(int kind) {
+    switch (kind) {
+        case '+': return "add";
+        case '*': return "mul";
+        case '^': return "xor";
+        default:  return NULL;
     }
-    emit("%s A, B", inst);
 }
 
-static void emit_binop_int_arith(Node* node) {
-    SAVE;
-    emit_expr(node->left);
-    push("A");
-    emit_expr(node->right);
-    emit("mov B, A");
-    pop("A");
+// Evaluates the operands of a shift. Constant counts outside 0..63 are
+// left to the backend's own masking and go through B like any other.
+static char* emit_shift_count(Node* node) {
+    char* opnd = emit_operands(node->left, node->right, NULL, NULL, NULL);
+    if (!is_reg_operand(opnd) && (atol(opnd) < 0 || atol(opnd) > 63)) {
+        emit("mov B, %s", opnd);
+        return "B";
+    }
+    return opnd;
+}
+
+static void emit_binop_int_arith(Node* node) {
+    SAVE;
+    char* inst = commutative_inst(node->kind);
+    if (inst) {
+        bool swapped;
+        char* opnd = emit_operands(node->left, node->right, NULL, NULL, &swapped);
+        int k = (is_reg_operand(opnd) || !pass_enabled(PASS_STRENGTH_REDUCE)) ? -1 : exact_log2(atol(opnd));
+        if (node->kind == '*' && k > 0)
+            emit("shl A, %d", k);
+        else
+            emit("%s A, %s", inst, opnd);
+        return;
+    }
+    Type* lty = node->left->ty;
+    Type* rty = node->right->ty;
     switch (node->kind) {
-        case '+':
-            emit("add A, B");
-            break;
         case '-':
-            emit("sub A, B");
-            break;
-        case '*':
-            emit("mul A, B");
+            emit("sub A, %s", emit_operands(node->left, node->right, NULL, NULL, NULL));
             break;
         case '/':
-            {
-                const char* sn;
-                if (node->left->ty->usig)
-                    sn = "";
-                else
-                    sn = "i";
-                emit("%scrop%d A", sn, 8 * node->left->ty->size);
-                emit("%scrop%d B", sn, 8 * node->right->ty->size);
-                emit("%sdiv A, B", sn);
-                break;
-            }
         case '%':
             {
-                const char* sn;
-                if (node->left->ty->usig)
-                    sn = "";
-                else
-                    sn = "i";
-                emit("%scrop%d A", sn, 8 * node->left->ty->size);
-                emit("%scrop%d B", sn, 8 * node->right->ty->size);
-                emit("%smod A, B", sn);
+                // Both operands are cropped with the signedness of the left one.
+                const char* sn = lty->usig ? "" : "i";
+                Type* rcast = &(Type){ .size = rty->size, .usig = lty->usig };
+                char* opnd = emit_operands(node->left, node->right, lty, rcast, NULL);
+                if (!is_reg_operand(opnd) && pass_enabled(PASS_STRENGTH_REDUCE) &&
+                    emit_div_pow2(node->kind, lty->usig, atol(opnd)))
+                    break;
+                // Other constant divisors are left as is: that is the
+                // cheapest form for s2rop, and s2x64 expands it into a
+                // multiplication by itself. It only does so for an
+                // immediate divisor, which is kept out of its way here
+                // when strength reduction is off.
+                if (!is_reg_operand(opnd) && !pass_enabled(PASS_STRENGTH_REDUCE)) {
+                    emit("mov B, %s", opnd);
+                    opnd = "B";
+                }
+                emit("%s%s A, %s", sn, node->kind == '/' ? "div" : "mod", opnd);
                 break;
             }
-        case '^':
-            emit("xor A, B");
-            break;
         case OP_SAL:
-            emit("shl A, B");
+            emit("shl A, %s", emit_shift_count(node));
             break;
         case OP_SAR:
-            emit("icrop%d A", 8 * node->left->ty->size);
-            emit("sar A, B");
-            break;
+            {
+                char* opnd = emit_shift_count(node);
+                emit_crop_value(node->left, &(Type){ .size = lty->size, .usig = false }, "A");
+                emit("sar A, %s", opnd);
+                break;
+            }
         case OP_SHR:
-            emit("crop%d A", 8 * node->left->ty->size);
-            emit("shr A, B");
-            break;
+            {
+                char* opnd = emit_shift_count(node);
+                emit_crop_value(node->left, &(Type){ .size = lty->size, .usig = true }, "A");
+                emit("shr A, %s", opnd);
+                break;
+            }
         default: error("invalid operator '%d'", node->kind);
     }
 }
@@ -455,7 +1355,9 @@ static void emit_binop_float_arith(Node* node) {
     assert_float();
 }
 
-static void emit_load_convert(Type* to, Type* from) {
+// Converts the value in A from `from` to `to`. `cropped` tells whether
+// it is already known to fit in `from`.
+static void emit_load_convert(Type* to, Type* from, bool cropped) {
     SAVE;
     if (is_inttype(from) && to->kind == KIND_FLOAT)
         emit("cvtsi2ss #eax, #xmm0");
@@ -467,25 +1369,16 @@ static void emit_load_convert(Type* to, Type* from) {
         emit("cvtpd2ps #xmm0, #xmm0");
     else if (to->kind == KIND_BOOL)
         emit_to_bool(from);
-    else if (is_inttype(from) && is_inttype(to))
-        emit_intcast(from);
+    else if (is_inttype(from) && is_inttype(to) && !cropped)
+        emit_crop(from, "A");
     else if (is_inttype(to))
         emit_toint(from);
 }
 
+// Jumps to the function's epilogue, which is emitted once at its end.
 static void emit_ret() {
     SAVE;
-    emit_nostack("#{pop:%s}", current_func_name);
-    /*if (is_main) {
-        emit("exit");
-    } else {*/
-    emit("mov SP, BP");
-    pop("A");
-    emit("mov BP, A");
-    pop("A");
-    emit("jmp A");
-    stackpos += 2;
-    //}
+    emit("jmp %s", ret_label);
 }
 
 static void emit_binop(Node* node) {
@@ -494,11 +1387,10 @@ static void emit_binop(Node* node) {
         emit_pointer_arith(node->kind, node->left, node->right);
         return;
     }
-    switch (node->kind) {
-        case '<': emit_comp("lt", node); return;
-        case OP_EQ: emit_comp("eq", node); return;
-        case OP_LE: emit_comp("le", node); return;
-        case OP_NE: emit_comp("ne", node); return;
+    char* comp = comp_inst(node->kind);
+    if (comp) {
+        emit_comp(comp, node);
+        return;
     }
     if (is_inttype(node->ty))
         emit_binop_int_arith(node);
@@ -509,7 +1401,7 @@ static void emit_binop(Node* node) {
 }
 
 static void emit_save_literal(Node* node, Type* totype, int off) {
-    int v = node->ival;
+    long v = node->ival;
     switch (totype->kind) {
         case KIND_BOOL:
             v = !!v;
@@ -520,11 +1412,8 @@ static void emit_save_literal(Node* node, Type* totype, int off) {
         case KIND_LLONG:
         case KIND_PTR:
             {
-                emit("mov B, BP");
-                if (off)
-                    emit("add B, %d", MOD24(off));
-                emit("mov A, %d", MOD24(v));
-                emit("store%d A, B", totype->size * 8);
+                emit("mov A, %ld", MOD24(v));
+                emit_store_mem(totype->size * 8, "A", "BP", off);
                 break;
             }
         case KIND_FLOAT:
@@ -538,6 +1427,7 @@ static void emit_save_literal(Node* node, Type* totype, int off) {
 static void emit_addr(Node* node) {
     switch (node->kind) {
         case AST_LVAR:
+            assert(!node->lreg);
             ensure_lvar_init(node);
             emit("mov A, BP");
             emit("add A, %d", node->loff);
@@ -560,26 +1450,17 @@ static void emit_addr(Node* node) {
     }
 }
 
+// Struct values are represented by their address, so the right-hand side
+// may be any struct expression, including a function call whose result
+// still lives in the callee's frame.
 static void emit_copy_struct(Node* left, Node* right) {
-    push("B");
-    push("C");
-    emit_addr(right);
-    push("A");
+    SAVE;
     emit_addr(left);
-    emit("mov C, A");
-    pop("A");
-    emit("mov B, A");
-    int i = 0;
-    for (; i < left->ty->size; i++) {
-        emit("load8 A, B");
-        emit("store8 A, C");
-        emit("add B, 1");
-        emit("add C, 1");
-    }
-    pop("A");
-    emit("mov C, A");
-    pop("A");
-    emit("mov B, A");
+    char* reg = save_temp(right);
+    emit_expr(right);
+    restore_temp(reg, "B");
+    emit("memcpy B, A, %d", left->ty->size);
+    emit("mov A, B");
 }
 
 static int cmpinit(const void* x, const void* y) {
@@ -622,29 +1503,152 @@ static void emit_decl_init(Vector* inits, int off, int totalsize) {
     }
 }
 
-static void emit_pre_inc_dec(Node* node, char* op) {
-    emit_expr(node->operand);
-    if (node->ty->kind == KIND_PTR)
-        emit("%s A, %d", op, node->ty->ptr->size);
+// Returns the memory operand of `node` if it is a scalar variable or a
+// field of one that lives at a fixed address, or NULL.
+static char* fixed_mem_arg(Node* node, int off) {
+    switch (node->kind) {
+        case AST_LVAR:
+            return node->lreg ? NULL : mem_arg("BP", node->loff + off);
+        case AST_GVAR:
+            return mem_arg(node->glabel, off);
+        case AST_STRUCT_REF:
+            return fixed_mem_arg(node->struc, node->ty->offset + off);
+        default:
+            return NULL;
+    }
+}
+
+// Returns the memory operand that addmN and submN can update `var`
+// through, or NULL.
+static char* rmw_mem_arg(Node* var) {
+    Type* ty = var->ty;
+    if (!pass_enabled(PASS_MEM_OPERANDS))
+        return NULL;
+    if ((!is_inttype(ty) && ty->kind != KIND_PTR) || ty->kind == KIND_BOOL || is_bitfield(ty))
+        return NULL;
+    char* r = fixed_mem_arg(var, 0);
+    if (!r)
+        return NULL;
+    while (var->kind == AST_STRUCT_REF)
+        var = var->struc;
+    if (var->kind == AST_LVAR)
+        ensure_lvar_init(var);
+    return r;
+}
+
+static bool is_same_lvalue(Node* a, Node* b) {
+    if (a == b)
+        return true;
+    if (a->kind != b->kind)
+        return false;
+    switch (a->kind) {
+        case AST_GVAR:
+            return !strcmp(a->glabel, b->glabel);
+        case AST_STRUCT_REF:
+            return a->ty->offset == b->ty->offset && is_same_lvalue(a->struc, b->struc);
+        default:
+            return false;
+    }
+}
+
+// Strips the integer conversions around `node` that keep at least `size`
+// bytes. They do not change the low `size` bytes of its value.
+static Node* strip_widening(Node* node, int size) {
+    while (node->kind == AST_CONV && is_inttype(node->ty) && node->ty->size >= size)
+        node = node->operand;
+    return node;
+}
+
+// Emits "x = x + y" and "x = x - y" as an in-place update of x when x
+// lives at a fixed address. Only the low bytes of the sum end up in x, so
+// conversions that widen x for the arithmetic are looked through.
+static bool emit_assign_rmw(Node* node) {
+    SAVE;
+    Node* var = node->left;
+    Node* expr = node->right;
+    if (expr->kind == AST_CONV && is_inttype(expr->operand->ty))
+        expr = expr->operand;
+    if (expr->kind != '+' && expr->kind != '-')
+        return false;
+    int size = var->ty->size;
+    bool ptr = (var->ty->kind == KIND_PTR);
+    if (ptr ? expr->ty->kind != KIND_PTR : (!is_inttype(expr->ty) || expr->ty->size < size))
+        return false;
+    Node* step;
+    if (is_same_lvalue(strip_widening(expr->left, size), var))
+        step = expr->right;
+    else if (expr->kind == '+' && !ptr && is_same_lvalue(strip_widening(expr->right, size), var))
+        step = expr->left;
     else
-        emit("%s A, 1", op);
-    emit_store(node->operand);
+        return false;
+    bool imm = (pass_enabled(PASS_IMMEDIATES) && step->kind == AST_LITERAL && is_inttype(step->ty) &&
+                INT32_MIN <= step->ival && step->ival <= INT32_MAX);
+    if (ptr && !imm)
+        return false;
+    char* addr = rmw_mem_arg(var);
+    if (!addr)
+        return false;
+    char* op = (expr->kind == '+') ? "addm" : "subm";
+    if (imm) {
+        long val = ptr ? step->ival * var->ty->ptr->size : step->ival;
+        emit("%s%d %s, %ld", op, size * 8, addr, MOD24(val));
+    } else {
+        emit_expr(step);
+        emit("%s%d %s, A", op, size * 8, addr);
+    }
+    emit("load%d A, %s", size * 8, addr);
+    emit_load_convert(node->ty, var->ty, is_cropped(var, var->ty));
+    return true;
 }
 
-static void emit_post_inc_dec(Node* node, char* op) {
+// Emits an increment or decrement as an in-place update of its operand
+// when it lives at a fixed address.
+static bool emit_inc_dec_rmw(Node* node, char* op, bool pre) {
     SAVE;
+    if (node->ty->kind == KIND_BOOL)
+        return false;
+    char* addr = rmw_mem_arg(node->operand);
+    if (!addr)
+        return false;
+    int step = (node->ty->kind == KIND_PTR) ? node->ty->ptr->size : 1;
+    int bits = node->ty->size * 8;
+    if (!pre)
+        emit("load%d A, %s", bits, addr);
+    emit("%sm%d %s, %d", op, bits, addr, step);
+    if (pre)
+        emit("load%d A, %s", bits, addr);
+    return true;
+}
+
+static void emit_pre_inc_dec(Node* node, char* op) {
+    if (emit_inc_dec_rmw(node, op, true))
+        return;
     emit_expr(node->operand);
-    push("A");
     if (node->ty->kind == KIND_PTR)
         emit("%s A, %d", op, node->ty->ptr->size);
     else
         emit("%s A, 1", op);
-    emit_store(node->operand);
-    pop("A");
+    emit_store(node->operand, NULL);
 }
 
-static void emit_je(char* label) {
-    emit("jeq %s, A, 0", label);
+static void emit_post_inc_dec(Node* node, char* op) {
+    SAVE;
+    if (emit_inc_dec_rmw(node, op, false))
+        return;
+    emit_expr(node->operand);
+    int step = (node->ty->kind == KIND_PTR) ? node->ty->ptr->size : 1;
+    if (node->ty->kind == KIND_BOOL || !pass_enabled(PASS_REGALLOC)) {
+        char* reg = save_temp(node->operand);
+        emit("%s A, %d", op, step);
+        emit_store(node->operand, NULL);
+        restore_temp(reg, "A");
+        return;
+    }
+    // Stores leave A untouched, so undoing the step yields the old value
+    // without keeping a copy of it around.
+    emit("%s A, %d", op, step);
+    emit_store(node->operand, NULL);
+    emit("%s A, %d", strcmp(op, "add") ? "add" : "sub", step);
 }
 
 static void emit_label(char* label) {
@@ -670,13 +1674,13 @@ static void emit_literal(Node* node) {
         case KIND_BOOL:
         case KIND_CHAR:
         case KIND_SHORT:
-            emit("mov A, %d", MOD24(node->ival));
+            emit("mov A, %ld", MOD24(node->ival));
             break;
         case KIND_INT:
         case KIND_LONG:
         case KIND_LLONG:
             {
-                emit("mov A, %d", MOD24(node->ival));
+                emit("mov A, %ld", MOD24(node->ival));
                 break;
             }
         case KIND_FLOAT:
@@ -815,6 +1819,10 @@ static void maybe_print_source_loc(Node* node) {
 
 static void emit_lvar(Node* node) {
     SAVE;
+    if (node->lreg) {
+        emit("mov A, %s", node->lreg);
+        return;
+    }
     ensure_lvar_init(node);
     emit_lload(node->ty, "BP", node->loff);
 }
@@ -883,6 +1891,10 @@ static void emit_builtin_gadget_address(Node* node) {
     emit(".gadget_addr A, %s", gadget);
 }
 
+static bool is_unreachable_call(Node* node) {
+    return node->kind == AST_FUNCALL && !strcmp(node->fname, "___builtin_unreachable");
+}
+
 static bool maybe_emit_builtin(Node* node) {
     SAVE;
 #if 0
@@ -903,6 +1915,8 @@ static bool maybe_emit_builtin(Node* node) {
         emit_builtin_gadget_address(node);
         return true;
     }
+    if (is_unreachable_call(node))
+        return true;
     return false;
 }
 
@@ -921,6 +1935,12 @@ static int emit_args(Vector* vals) {
     for (int i = 0; i < vec_len(vals); i++) {
         Node* v = vec_get(vals, i);
         emit_expr(v);
+        if (v->ty->kind == KIND_STRUCT) {
+            // Each argument takes one stack slot.
+            if (v->ty->size > 8)
+                error("struct argument larger than 8 bytes is not supported: %s", node2s(v));
+            emit("load64 A, A");
+        }
         push("A");
         r += 1;
     }
@@ -987,28 +2007,117 @@ static void emit_decl(Node* node) {
     SAVE;
     if (!node->declinit)
         return;
-    emit_decl_init(node->declinit, node->declvar->loff, node->declvar->ty->size);
+    if (node->declvar->kind == AST_GVAR) {
+        // Read-only data private to the function, such as switch jump
+        // tables. It is written out after the function's code.
+        emit_data(node, 0, 0);
+        emit(".text");
+        return;
+    }
+    Node* var = node->declvar;
+    if (var->lreg) {
+        Node* init = vec_len(node->declinit) ? vec_head(node->declinit) : NULL;
+        Node* val = init ? init->initval : &(Node){ AST_LITERAL, var->ty, .ival = 0 };
+        emit_assign(&(Node){ '=', var->ty, .left = var, .right = val });
+        return;
+    }
+    emit_decl_init(node->declinit, var->loff, var->ty->size);
 }
 
 static void emit_conv(Node* node) {
     SAVE;
     emit_expr(node->operand);
-    emit_load_convert(node->ty, node->operand->ty);
+    emit_load_convert(node->ty, node->operand->ty, is_cropped(node->operand, node->operand->ty));
 }
 
 static void emit_deref(Node* node) {
     SAVE;
     emit_expr(node->operand);
-    emit_lload(node->operand->ty->ptr, "A", 0);
-    emit_load_convert(node->ty, node->operand->ty->ptr);
+    Type* ty = node->operand->ty->ptr;
+    emit_lload(ty, "A", 0);
+    long lo, hi;
+    load_range(ty, &lo, &hi);
+    emit_load_convert(node->ty, ty, pass_enabled(PASS_ELIDE_CROPS) && fits_type(ty, lo, hi));
+}
+
+// Jumps to `label` if the truth value of `cond` is `jump_if`, and falls
+// through otherwise. Comparisons are folded into the conditional jump and
+// logical operators jump straight to their targets, so no boolean is
+// materialized on the way.
+static void emit_branch(Node* cond, char* label, bool jump_if) {
+    SAVE;
+    if (!pass_enabled(PASS_FUSE_BRANCHES)) {
+        emit_expr(cond);
+        emit_intcast(cond);
+        emit("%s %s, A, 0", jump_if ? "jne" : "jeq", label);
+        return;
+    }
+    char* comp = comp_inst(cond->kind);
+    if (comp && !is_flotype(cond->left->ty)) {
+        bool swapped;
+        char* opnd = emit_operands(cond->left, cond->right, cond->left->ty, cond->right->ty, &swapped);
+        if (swapped)
+            comp = swap_comp(comp);
+        emit("j%s %s, A, %s", jump_if ? comp : negate_comp(comp), label, opnd);
+        return;
+    }
+    switch (cond->kind) {
+        case '!':
+            emit_branch(cond->operand, label, !jump_if);
+            return;
+        case OP_LOGAND:
+        case OP_LOGOR:
+            // The left operand alone decides when it is false for && and
+            // when it is true for ||.
+            if (jump_if == (cond->kind == OP_LOGOR)) {
+                emit_branch(cond->left, label, jump_if);
+                emit_branch(cond->right, label, jump_if);
+            } else {
+                char* skip = make_label();
+                emit_branch(cond->left, skip, !jump_if);
+                emit_branch(cond->right, label, jump_if);
+                emit_label(skip);
+            }
+            return;
+        case ',':
+            emit_expr(cond->left);
+            emit_branch(cond->right, label, jump_if);
+            return;
+        case AST_CONV:
+            if (cond->ty->kind == KIND_BOOL && !is_flotype(cond->operand->ty)) {
+                emit_branch(cond->operand, label, jump_if);
+                return;
+            }
+            break;
+    }
+    long val;
+    if (eval_const(cond, &val)) {
+        if ((crop_value(val, cond->ty) != 0) == jump_if)
+            emit_jmp(label);
+        return;
+    }
+    emit_expr(cond);
+    emit_intcast(cond);
+    emit("%s %s, A, 0", jump_if ? "jne" : "jeq", label);
 }
 
 static void emit_ternary(Node* node) {
     SAVE;
-    emit_expr(node->cond);
-    emit_intcast(node->cond->ty);
+    // "if (c) goto L" and the "else goto L" that loops exit with branch to
+    // L directly instead of jumping over a jump.
+    bool fuse = pass_enabled(PASS_FUSE_BRANCHES);
+    if (fuse && node->kind == AST_IF && node->then && node->then->kind == AST_GOTO && !node->els) {
+        emit_branch(node->cond, node->then->newlabel, true);
+        return;
+    }
+    if (fuse && node->kind == AST_IF && node->els && node->els->kind == AST_GOTO) {
+        emit_branch(node->cond, node->els->newlabel, false);
+        if (node->then)
+            emit_expr(node->then);
+        return;
+    }
     char* ne = make_label();
-    emit_je(ne);
+    emit_branch(node->cond, ne, false);
     if (node->then)
         emit_expr(node->then);
     if (node->els) {
@@ -1028,8 +2137,55 @@ static void emit_goto(Node* node) {
     emit_jmp(node->newlabel);
 }
 
+// Returns the call `node` consists of if it can reuse the current frame:
+// the callee is defined in this file, takes no more stack slots than the
+// caller got, and returns its value in the form the caller would. The
+// slots the caller's caller pushed are then overwritten with the
+// arguments, and the callee returns straight to it.
+static Node* tail_call_of(Node* node) {
+    if (!pass_enabled(PASS_TAIL_CALLS))
+        return NULL;
+    Type* rettype = current_func->ty->rettype;
+    if (node && node->kind == AST_CONV && rettype->kind != KIND_VOID) {
+        Type* from = node->operand->ty;
+        if (from->kind != rettype->kind || from->usig != rettype->usig)
+            return NULL;
+        node = node->operand;
+    }
+    if (!node || node->kind != AST_FUNCALL || !map_get(defined_funcs, node->fname))
+        return NULL;
+    if (rettype->kind == KIND_STRUCT || node->ty->kind == KIND_STRUCT)
+        return NULL;
+    if (vec_len(node->args) > vec_len(current_func->params))
+        return NULL;
+    return node;
+}
+
+static void emit_tail_call(Node* node) {
+    SAVE;
+    Vector* ints = make_vector();
+    classify_args(ints, node->args);
+    int n = emit_args(vec_reverse(ints));
+    for (int i = 0; i < n; i++) {
+        pop("A");
+        emit_store_mem(64, "A", "BP", 16 + 8 * i);
+    }
+    char* label = map_get(tail_labels, node->fname);
+    if (!label) {
+        label = make_label();
+        map_put(tail_labels, node->fname, label);
+        vec_push(tail_callees, node->fname);
+    }
+    emit_jmp(label);
+}
+
 static void emit_return(Node* node) {
     SAVE;
+    Node* call = tail_call_of(node->retval);
+    if (call) {
+        emit_tail_call(call);
+        return;
+    }
     if (node->retval) {
         emit_expr(node->retval);
         maybe_booleanize_retval(node->retval->ty);
@@ -1040,63 +2196,76 @@ static void emit_return(Node* node) {
 
 static void emit_compound_stmt(Node* node) {
     SAVE;
-    for (int i = 0; i < vec_len(node->stmts); i++)
-        emit_expr(vec_get(node->stmts, i));
-}
-
-static void emit_logand(Node* node) {
-    SAVE;
-    char* end = make_label();
-    emit_expr(node->left);
-    emit_intcast(node->left->ty);
-    emit("mov B, 0");
-    emit("jeq %s, A, 0", end);
-    emit_expr(node->right);
-    emit_intcast(node->right->ty);
-    emit("mov B, A");
-    emit("ne B, 0");
-    emit_label(end);
-    emit("mov A, B");
+    bool dead = false;
+    for (int i = 0; i < vec_len(node->stmts); i++) {
+        Node* stmt = vec_get(node->stmts, i);
+        // Statements after __builtin_unreachable() are skipped up to the
+        // next label; the rest of the dead code is left to
+        // remove_unreachable.
+        if (dead && !has_label(stmt))
+            continue;
+        // A call that ends a function returning nothing is a tail call.
+        bool last = (node == tail_block && i == vec_len(node->stmts) - 1);
+        if (last && current_func->ty->rettype->kind == KIND_VOID && tail_call_of(stmt)) {
+            emit_tail_call(stmt);
+            continue;
+        }
+        if (last && stmt->kind == AST_COMPOUND_STMT)
+            tail_block = stmt;
+        emit_expr(stmt);
+        dead = is_unreachable_call(stmt);
+    }
 }
 
-static void emit_logor(Node* node) {
+// Materializes the truth value of a logical operator from its branches.
+// Without fused branches the value of each operand is computed and tested
+// against zero instead.
+static void emit_logical(Node* node) {
     SAVE;
+    if (!pass_enabled(PASS_FUSE_BRANCHES)) {
+        bool and = (node->kind == OP_LOGAND);
+        char* end = make_label();
+        emit_expr(node->left);
+        emit_intcast(node->left);
+        emit("mov B, %d", !and);
+        emit("%s %s, A, 0", and ? "jeq" : "jne", end);
+        emit_expr(node->right);
+        emit_intcast(node->right);
+        emit("mov B, A");
+        emit("ne B, 0");
+        emit_label(end);
+        emit("mov A, B");
+        return;
+    }
+    char* no = make_label();
     char* end = make_label();
-    emit_expr(node->left);
-    emit_intcast(node->left->ty);
-    emit("mov B, 1");
-    emit("jne %s, A, 0", end);
-    emit_expr(node->right);
-    emit_intcast(node->right->ty);
-    emit("mov B, A");
-    emit("ne B, 0");
+    emit_branch(node, no, false);
+    emit("mov A, 1");
+    emit_jmp(end);
+    emit_label(no);
+    emit("mov A, 0");
     emit_label(end);
-    emit("mov A, B");
 }
 
 static void emit_lognot(Node* node) {
     SAVE;
     emit_expr(node->operand);
-    emit_intcast(node->operand->ty);
+    emit_intcast(node->operand);
     emit("eq A, 0");
 }
 
 static void emit_bitand(Node* node) {
     SAVE;
-    emit_expr(node->left);
-    push("A");
-    emit_expr(node->right);
-    pop("B");
-    emit("and A, B");
+    bool swapped;
+    char* opnd = emit_operands(node->left, node->right, NULL, NULL, &swapped);
+    emit("and A, %s", opnd);
 }
 
 static void emit_bitor(Node* node) {
     SAVE;
-    emit_expr(node->left);
-    push("A");
-    emit_expr(node->right);
-    pop("B");
-    emit("or A, B");
+    bool swapped;
+    char* opnd = emit_operands(node->left, node->right, NULL, NULL, &swapped);
+    emit("or A, %s", opnd);
 }
 
 static void emit_bitnot(Node* node) {
@@ -1108,7 +2277,7 @@ static void emit_bitnot(Node* node) {
 static void emit_cast(Node* node) {
     SAVE;
     emit_expr(node->operand);
-    emit_load_convert(node->ty, node->operand->ty);
+    emit_load_convert(node->ty, node->operand->ty, is_cropped(node->operand, node->operand->ty));
     return;
 }
 
@@ -1122,22 +2291,22 @@ static void emit_assign(Node* node) {
     SAVE;
     if (node->left->ty->kind == KIND_STRUCT) {
         emit_copy_struct(node->left, node->right);
-    } else {
+    } else if (!emit_assign_rmw(node)) {
         emit_expr(node->right);
-        emit_load_convert(node->ty, node->right->ty);
-        emit_store(node->left);
+        emit_load_convert(node->ty, node->right->ty, is_cropped(node->right, node->right->ty));
+        emit_store(node->left, node);
     }
 }
 
 static void emit_label_addr(Node* node) {
     SAVE;
-    emit("mov $%s, #rax", node->newlabel);
+    emit("mov A, %s", node->newlabel);
 }
 
 static void emit_computed_goto(Node* node) {
     SAVE;
     emit_expr(node->operand);
-    emit("jmp *#rax");
+    emit("jmp A");
 }
 
 static void emit_expr(Node* node) {
@@ -1181,8 +2350,10 @@ static void emit_expr(Node* node) {
         case '&': emit_bitand(node); return;
         case '|': emit_bitor(node); return;
         case '~': emit_bitnot(node); return;
-        case OP_LOGAND: emit_logand(node); return;
-        case OP_LOGOR:  emit_logor(node); return;
+        case OP_LOGAND:
+        case OP_LOGOR:
+            emit_logical(node);
+            return;
         case OP_CAST:   emit_cast(node); return;
         case ',': emit_comma(node); return;
         case '=': emit_assign(node); return;
@@ -1195,9 +2366,8 @@ static void emit_expr(Node* node) {
 
 static void emit_zero(int size) {
     SAVE;
-    if (size == -1)
-        return;
-    for (; size > 0; size--)     emit(".byte 0");
+    if (size > 0)
+        emit(".zero %d", size);
 }
 
 static void emit_padding(Node* node, int off) {
@@ -1259,9 +2429,11 @@ static void emit_data_primtype(Type* ty, Node* val, int depth) {
             break;
         case KIND_LONG:
         case KIND_LLONG:
-            emit(".long %d", eval_intexpr(val, NULL));
+            emit(".long %ld", eval_intexpr(val, NULL));
+            break;
         case KIND_PTR:
             if (val->kind == OP_LABEL_ADDR) {
+                map_put(data_labels, val->newlabel, (void*)1);
                 emit(".ptr %s", val->newlabel);
                 break;
             }
@@ -1272,9 +2444,9 @@ static void emit_data_primtype(Type* ty, Node* val, int depth) {
                 emit(".ptr %s", val->glabel);
             } else {
                 Node* base = NULL;
-                int v = eval_intexpr(val, &base);
+                long v = eval_intexpr(val, &base);
                 if (base == NULL) {
-                    emit(".ptr %u", v);
+                    emit(".ptr %ld", v);
                     break;
                 }
                 Type* ty = base->ty;
@@ -1303,6 +2475,8 @@ static void do_emit_data(Vector* inits, int size, int off, int depth) {
         Node* node = vec_get(inits, i);
         Node* v = node->initval;
         emit_padding(node, off);
+        size -= node->initoff - off;
+        off = node->initoff;
         // TODO: Fix!
         //if (node->totype->bitsize > 0 && node->totype->bitsize != -1) {
         if (0) {
@@ -1359,11 +2533,8 @@ static void emit_bss(Node* v) {
         emit(".global %s", v->declvar->glabel);
     emit(".lcomm %s, %d", v->declvar->glabel, v->declvar->ty->size);
 #else
-    int i;
     emit("%s:\n", v->declvar->glabel);
-    for (i = 0; i < v->declvar->ty->size && v->declvar->ty->size != -1; i++) {
-        emit(".byte 0");
-    }
+    emit_zero(v->declvar->ty->size);
 #endif
 }
 
@@ -1386,32 +2557,348 @@ static void assign_func_param_offsets(Vector* params, int off) {
     }
 }
 
+static bool is_promotable(Node* var) {
+    return (is_inttype(var->ty) || var->ty->kind == KIND_PTR) &&
+        var->ty->bitsize <= 0 && !var->lvarinit && !var->ty->isvolatile;
+}
+
+// Keeps the most used scalar parameters and local variables whose address
+// is never taken in registers instead of the stack frame. A variable is
+// promoted if what its uses, weighted by loop nesting, save outweighs the
+// stack accesses promoting it adds: saving and restoring the register, and
+// loading it for a parameter.
+static void promote_lvars(Node* func) {
+    Vector* vars = make_vector();
+    vec_append(vars, func->params);
+    vec_append(vars, func->localvars);
+    int n = vec_len(vars);
+    LvarScan sc = {
+        vars, calloc(n, sizeof(bool)), make_vector(), make_vector(),
+        make_vector(), make_vector(), make_map(), 0,
+    };
+    scan_lvars(&sc, func->body);
+    long* uses = weigh_lvar_uses(&sc);
+    while (nvarregs < MAX_VAR_REGS) {
+        int best = -1;
+        for (int i = 0; i < n; i++) {
+            Node* v = vec_get(vars, i);
+            int accesses = (i < vec_len(func->params)) ? 3 : 2;
+            long gain = uses[i] * (SLOT_ACCESS_COST - 1);
+            if (!v->lreg && !sc.escaped[i] && is_promotable(v) && gain > accesses * SLOT_ACCESS_COST &&
+                (best < 0 || uses[i] > uses[best]))
+                best = i;
+        }
+        if (best < 0)
+            break;
+        Node* v = vec_get(vars, best);
+        v->lreg = tmpregs[--ntmpregs];
+        nvarregs++;
+    }
+    free(uses);
+    free(sc.escaped);
+}
+
+// State of the scan that finds where each local variable is used. Every
+// node gets a sequence number. A variable is only used within the
+// innermost compound statement that contains all of its uses, which is
+// the block declaring it for variables declared in the source, and is
+// dead outside of it, so variables of disjoint blocks can share a slot.
+typedef struct {
+    Vector* vars;
+    Vector** scope;    // Compound statements enclosing all uses, outermost first
+    Vector* open;      // Compound statements the scan is in
+    Vector* cbeg;      // First and last sequence numbers of each compound statement
+    Vector* cend;
+    int seq;
+} SlotScan;
+
+static void scan_slots(SlotScan* sc, Node* node);
+
+static void scan_slot_inits(SlotScan* sc, Vector* inits) {
+    for (int i = 0; inits && i < vec_len(inits); i++)
+        scan_slots(sc, ((Node*)vec_get(inits, i))->initval);
+}
+
+static void use_slot(SlotScan* sc, Node* var) {
+    for (int i = 0; i < vec_len(sc->vars); i++) {
+        if (vec_get(sc->vars, i) != var)
+            continue;
+        Vector* scope = sc->scope[i];
+        if (!scope) {
+            sc->scope[i] = vec_copy(sc->open);
+            continue;
+        }
+        int n = 0;
+        while (n < vec_len(scope) && n < vec_len(sc->open) && vec_get(scope, n) == vec_get(sc->open, n))
+            n++;
+        while (vec_len(scope) > n)
+            vec_pop(scope);
+    }
+}
+
+static void scan_slots(SlotScan* sc, Node* node) {
+    if (!node)
+        return;
+    sc->seq++;
+    switch (node->kind) {
+        case AST_LVAR:
+            use_slot(sc, node);
+            scan_slot_inits(sc, node->lvarinit);
+            return;
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case AST_LABEL:
+        case AST_GOTO:
+        case OP_LABEL_ADDR:
+            return;
+        case AST_FUNCALL:
+        case AST_FUNCPTR_CALL:
+            scan_slots(sc, node->fptr);
+            for (int i = 0; i < vec_len(node->args); i++)
+                scan_slots(sc, vec_get(node->args, i));
+            return;
+        case AST_DECL:
+            scan_slots(sc, node->declvar);
+            scan_slot_inits(sc, node->declinit);
+            return;
+        case AST_IF:
+        case AST_TERNARY:
+            scan_slots(sc, node->cond);
+            scan_slots(sc, node->then);
+            scan_slots(sc, node->els);
+            return;
+        case AST_RETURN:
+            scan_slots(sc, node->retval);
+            return;
+        case AST_COMPOUND_STMT: {
+            intptr_t id = vec_len(sc->cbeg);
+            vec_push(sc->cbeg, (void*)(intptr_t)sc->seq);
+            vec_push(sc->cend, NULL);
+            vec_push(sc->open, (void*)id);
+            for (int i = 0; i < vec_len(node->stmts); i++)
+                scan_slots(sc, vec_get(node->stmts, i));
+            vec_pop(sc->open);
+            vec_set(sc->cend, id, (void*)(intptr_t)sc->seq);
+            return;
+        }
+        case AST_STRUCT_REF:
+            scan_slots(sc, node->struc);
+            return;
+        case AST_ADDR:
+        case AST_CONV:
+        case AST_DEREF:
+        case AST_COMPUTED_GOTO:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            scan_slots(sc, node->operand);
+            return;
+        default:
+            scan_slots(sc, node->left);
+            scan_slots(sc, node->right);
+    }
+}
+
+// Returns the size of the frame if every local variable had a slot of its
+// own.
+static int unshared_frame_size(Vector* localvars) {
+    int off = 0;
+    for (int i = 0; i < vec_len(localvars); i++) {
+        Node* v = vec_get(localvars, i);
+        off -= v->ty->size;
+        off &= -v->ty->align;
+    }
+    return -(off & -8);
+}
+
+// Assigns stack slots to the local variables not kept in registers.
+// Variables whose scopes do not overlap may share a slot; each goes to
+// the highest offset that does not overlap the slot of a variable live at
+// the same time. Returns the size of the frame.
+static int assign_lvar_offsets(Node* func) {
+    Vector* vars = func->localvars;
+    int n = vec_len(vars);
+    SlotScan sc = { vars, calloc(n, sizeof(Vector*)), make_vector(), make_vector(), make_vector(), 0 };
+    scan_slots(&sc, func->body);
+    int* beg = malloc(n * sizeof(int));
+    int* end = malloc(n * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        Vector* scope = sc.scope[i];
+        beg[i] = end[i] = 0;
+        if (scope && vec_len(scope)) {
+            intptr_t id = (intptr_t)vec_tail(scope);
+            beg[i] = (intptr_t)vec_get(sc.cbeg, id);
+            end[i] = (intptr_t)vec_get(sc.cend, id);
+        } else if (scope) {
+            end[i] = sc.seq;
+        }
+        if (!pass_enabled(PASS_SHARE_SLOTS)) {
+            beg[i] = 0;
+            end[i] = sc.seq;
+        }
+    }
+    int off = 0;
+    for (int i = 0; i < n; i++) {
+        Node* v = vec_get(vars, i);
+        assert(v->ty->align);
+        if (v->lreg)
+            continue;
+        // Try right below 0 and below each slot live at the same time.
+        int best = INT_MIN;
+        for (int j = -1; j < i; j++) {
+            Node* u = (j < 0) ? NULL : vec_get(vars, j);
+            if (u && (u->lreg || end[j] < beg[i] || end[i] < beg[j]))
+                continue;
+            int cand = ((u ? u->loff : 0) - v->ty->size) & -v->ty->align;
+            if (cand <= best)
+                continue;
+            bool fits = true;
+            for (int k = 0; k < i && fits; k++) {
+                Node* w = vec_get(vars, k);
+                if (w->lreg || end[k] < beg[i] || end[i] < beg[k])
+                    continue;
+                fits = cand + v->ty->size <= w->loff || w->loff + w->ty->size <= cand;
+            }
+            if (fits)
+                best = cand;
+        }
+        v->loff = best;
+        if (best < off)
+            off = best;
+    }
+    free(beg);
+    free(end);
+    free(sc.scope);
+    off &= -8; // keep stack 8byte aligned
+    return -off;
+}
+
 static void emit_func_prologue(Node* func) {
     SAVE;
     emit(".text");
     emit_noindent("%s:", func->fname);
-    current_func_name = func->fname;
+    current_func = func;
+    tail_block = func->body;
     emit_nostack("#{push:%s}", func->fname);
 
     push("BP");
     emit("mov BP, SP");
-    int off = 0;
-    assign_func_param_offsets(func->params, off);
+    assign_func_param_offsets(func->params, 0);
+    ntmpregs = sizeof(tmpregs) / sizeof(*tmpregs);
+    nvarregs = 0;
+    if (pass_enabled(PASS_MEM2REG)) {
+        pass_start(PASS_MEM2REG);
+        promote_lvars(func);
+        pass_stop(PASS_MEM2REG);
+    }
+    // Without the allocator every temporary goes through the stack.
+    if (!pass_enabled(PASS_REGALLOC))
+        ntmpregs = 0;
+    localarea = assign_lvar_offsets(func);
+    if (stats_frame)
+        fprintf(stderr, "frame: %s: %d bytes of locals, %d without sharing slots\n",
+                func->fname + 1, localarea, unshared_frame_size(func->localvars));
+    ret_label = make_label();
+    tail_labels = make_map();
+    tail_callees = make_vector();
+}
+
+// Returns the registers among those kept across calls that the code from
+// index `start` of the function's IR uses.
+static Vector* used_saved_regs(int start) {
+    Vector* r = make_vector();
+    for (int k = FIRST_SAVED_REG; k < sizeof(tmpregs) / sizeof(*tmpregs); k++) {
+        for (int i = start; i < vec_len(func_ir); i++) {
+            Inst* inst = vec_get(func_ir, i);
+            bool used = false;
+            for (int j = 0; inst->kind == INST_OP && j < inst->nargs; j++) {
+                char* arg = inst->args[j];
+                used |= !strcmp(is_mem_arg(arg) ? mem_base(arg) : arg, tmpregs[k]);
+            }
+            if (used) {
+                vec_push(r, tmpregs[k]);
+                break;
+            }
+        }
+    }
+    return r;
+}
 
-    for (int i = 0; i < vec_len(func->localvars); i++) {
-        Node* v = vec_get(func->localvars, i);
-        long long e;
-        int size = v->ty->size;
-        off -= size;
-        assert(v->ty->align);
-        off &= -v->ty->align;
-        v->loff = off;
+// Emits the rest of the prologue once the body has been generated: the
+// frame is allocated, the registers in `saved` are saved below the local
+// variables and promoted parameters are loaded. The code goes to index
+// `pos` of the function's IR.
+static void emit_frame_setup(Node* func, int pos, Vector* saved) {
+    SAVE;
+    Vector* body = func_ir;
+    func_ir = make_vector();
+    int size = localarea + 8 * vec_len(saved);
+    if (size) {
+        emit("sub SP, %d", size);
+        stackpos += size;
     }
-    off &= -8; // keep stack 8byte aligned
-    int localarea = -off;
-    if (localarea) {
-        emit("sub SP, %d", localarea);
-        stackpos += localarea;
+    for (int i = 0; i < vec_len(saved); i++) {
+        emit_store_mem(64, vec_get(saved, i), "BP", -localarea - 8 * (i + 1));
+    }
+    for (int i = 0; i < vec_len(func->params); i++) {
+        Node* v = vec_get(func->params, i);
+        if (!v->lreg)
+            continue;
+        emit_load(v->ty->size * 8, v->lreg, "BP", v->loff);
+    }
+    Vector* setup = func_ir;
+    func_ir = make_vector();
+    for (int i = 0; i < vec_len(body); i++) {
+        if (i == pos)
+            vec_append(func_ir, setup);
+        vec_push(func_ir, vec_get(body, i));
+    }
+}
+
+// Restores the saved registers and the caller's frame pointer, leaving SP
+// at the return address.
+static void emit_frame_teardown(Vector* saved) {
+    SAVE;
+    emit_nostack("#{pop:%s}", current_func->fname);
+    for (int i = 0; i < vec_len(saved); i++) {
+        emit("mov A, BP");
+        emit("add A, %d", -localarea - 8 * (i + 1));
+        emit("load64 %s, A", vec_get(saved, i));
+    }
+    emit("mov SP, BP");
+    pop("A");
+    emit("mov BP, A");
+}
+
+// Restores the saved registers and returns to the caller. The return
+// value is in B. The stubs for tail calls follow.
+static void emit_func_epilogue(Node* func, Vector* saved) {
+    SAVE;
+    emit_label(ret_label);
+    emit_frame_teardown(saved);
+    pop("A");
+    emit("jmp A");
+    stackpos += 2;
+    for (int i = 0; i < vec_len(tail_callees); i++) {
+        char* callee = vec_get(tail_callees, i);
+        emit_label(map_get(tail_labels, callee));
+        emit_frame_teardown(saved);
+        emit("jmp %s", callee);
+        stackpos += 1;
+    }
+}
+
+void set_defined_functions(Vector* toplevels) {
+    defined_funcs = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node* v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC)
+            map_put(defined_funcs, v->fname, v);
     }
 }
 
@@ -1419,9 +2906,19 @@ void emit_toplevel(Node* v) {
     stackpos = 1;
     if (v->kind == AST_FUNC) {
         is_main = !strcmp(v->fname, "main");
+        tmpdepth = nkept = nspilled = 0;
+        func_ir = make_vector();
         emit_func_prologue(v);
+        int pos = vec_len(func_ir);
         emit_expr(v->body);
-        emit_ret();
+        Vector* saved = used_saved_regs(pos);
+        emit_func_epilogue(v, saved);
+        emit_frame_setup(v, pos, saved);
+        flush_func_ir(v->fname + 1, v->hasvolatile);
+        assert(tmpdepth == 0);
+        if (stats_regalloc)
+            fprintf(stderr, "regalloc: %s: %d variables and %d temporaries in registers, %d spilled\n",
+                v->fname + 1, nvarregs, nkept, nspilled);
         is_main = 0;
     } else if (v->kind == AST_DECL) {
         emit_global_var(v);
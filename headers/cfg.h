@@ -0,0 +1,10 @@
+#pragma once
+#ifndef _CFG_H
+#define _CFG_H
+#include "../8cc.h"
+Cfg* make_cfg(Vector* insts, Map* addr_taken);
+Inst* block_last(Cfg* cfg, Block* b);
+char* block_label(Cfg* cfg, Block* b);
+bool dominates(Cfg* cfg, Block* a, Block* b);
+int* frame_pointers(Cfg* cfg);
+#endif
\ No newline at end of file
@@ -0,0 +1,6 @@
+#pragma once
+#ifndef _DCE_H
+#define _DCE_H
+#include "../8cc.h"
+void remove_unreachable(Vector* insts, Map* addr_taken);
+#endif
@@ -0,0 +1,7 @@
+#pragma once
+#ifndef _DSE_H
+#define _DSE_H
+#include "../8cc.h"
+extern bool stats_dse;
+bool eliminate_dead_stores(Vector* insts, Map* addr_taken, char* fname);
+#endif
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+#ifndef _EVAL_H
+#define _EVAL_H
+#include "../8cc.h"
+extern bool stats_eval;
+bool eval_toplevels(Vector* toplevels);
+#endif
\ No newline at end of file
@@ -0,0 +1,8 @@
+#pragma once
+#ifndef _FOLD_H
+#define _FOLD_H
+#include "../8cc.h"
+long truncate_value(Type* ty, long val);
+bool eval_binop(int op, Type* ty, long L, long R, long* r);
+void fold_toplevel(Node* v);
+#endif
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+#ifndef _FPO_H
+#define _FPO_H
+#include "../8cc.h"
+extern bool stats_fpo;
+bool omit_frame_pointer(Vector* insts, Map* addr_taken, char* fname);
+#endif
\ No newline at end of file
@@ -2,7 +2,10 @@
 #ifndef _GEN_H
 #define _GEN_H
 #include "../8cc.h"
+extern bool stats_regalloc;
+extern bool stats_frame;
 void set_output_file(FILE* fp);
 void close_output_file(void);
+void set_defined_functions(Vector* toplevels);
 void emit_toplevel(Node* v);
 #endif
\ No newline at end of file
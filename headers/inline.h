@@ -0,0 +1,8 @@
+#pragma once
+#ifndef _INLINE_H
+#define _INLINE_H
+#include "../8cc.h"
+extern int inline_limit;
+extern bool stats_inline;
+void inline_toplevels(Vector* toplevels);
+#endif
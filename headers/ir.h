@@ -0,0 +1,31 @@
+#pragma once
+#ifndef _IR_H
+#define _IR_H
+#include "../8cc.h"
+Inst* parse_inst(char* line);
+Inst* make_inst(char* op, int nargs, ...);
+void print_inst(FILE* fp, Inst* inst);
+bool inst_is(Inst* inst, char* op);
+bool is_reg(char* s);
+bool is_imm_arg(char* s, long* val);
+bool is_imm(long val);
+bool is_mem_arg(char* s);
+bool has_mem_arg(Inst* inst);
+char* mem_base(char* s);
+bool is_rmw_op(char* op);
+int op_width(char* op, char* prefix);
+bool is_arith_op(char* op);
+bool is_comp_op(char* op);
+bool is_crop_op(char* op);
+bool is_cond_jump(Inst* inst);
+bool is_simple_inst(Inst* inst);
+bool inst_reads(Inst* inst, char* reg);
+bool inst_writes(Inst* inst, char* reg);
+int reg_bit(char* reg);
+int inst_read_mask(Inst* inst);
+int inst_write_mask(Inst* inst);
+int ir_next(Vector* insts, int i);
+int ir_prev(Vector* insts, int i);
+void ir_compact(Vector* insts);
+int ir_count_ops(Vector* insts);
+#endif
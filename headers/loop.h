@@ -0,0 +1,7 @@
+#pragma once
+#ifndef _LOOP_H
+#define _LOOP_H
+#include "../8cc.h"
+extern bool stats_loops;
+bool optimize_loops(Vector* insts, Map* addr_taken, char* fname);
+#endif
\ No newline at end of file
@@ -0,0 +1,7 @@
+#pragma once
+#ifndef _LVN_H
+#define _LVN_H
+#include "../8cc.h"
+extern bool stats_lvn;
+bool number_values(Vector* insts, char* fname);
+#endif
\ No newline at end of file
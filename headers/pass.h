@@ -0,0 +1,38 @@
+#pragma once
+#ifndef _PASS_H
+#define _PASS_H
+#include "../8cc.h"
+enum {
+    PASS_FOLD,
+    PASS_EVAL,
+    PASS_INLINE,
+    PASS_REGALLOC,
+    PASS_MEM2REG,
+    PASS_IMMEDIATES,
+    PASS_STRENGTH_REDUCE,
+    PASS_ELIDE_CROPS,
+    PASS_FUSE_BRANCHES,
+    PASS_MEM_OPERANDS,
+    PASS_SWITCH_TABLES,
+    PASS_SHARE_SLOTS,
+    PASS_TAIL_CALLS,
+    PASS_DCE,
+    PASS_PEEPHOLE,
+    PASS_LVN,
+    PASS_SCCP,
+    PASS_DSE,
+    PASS_LOOPS,
+    PASS_UNROLL_LOOPS,
+    PASS_OMIT_FRAME_POINTER,
+    NPASSES,
+};
+extern bool time_passes;
+void set_opt_level(char* arg);
+bool set_pass(char* name, bool on);
+bool pass_enabled(int pass);
+void pass_start(int pass);
+void pass_stop(int pass);
+void report_pass_times(void);
+void run_ast_passes(Vector* toplevels);
+void run_ir_passes(Vector* code, Map* addr_taken, char* fname, bool hasvolatile);
+#endif
\ No newline at end of file
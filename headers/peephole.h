@@ -0,0 +1,7 @@
+#pragma once
+#ifndef _PEEPHOLE_H
+#define _PEEPHOLE_H
+#include "../8cc.h"
+extern bool stats_peephole;
+void peephole(Vector* insts, char* fname);
+#endif
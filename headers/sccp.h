@@ -0,0 +1,7 @@
+#pragma once
+#ifndef _SCCP_H
+#define _SCCP_H
+#include "../8cc.h"
+extern bool stats_sccp;
+bool propagate_constants(Vector* insts, Map* addr_taken, char* fname);
+#endif
\ No newline at end of file
@@ -0,0 +1,664 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Function inlining.
+//
+// A call costs a lot more than the instructions of the call itself:
+// arguments are pushed one by one, a return address is pushed and jumped
+// back to, and the callee sets up and tears down its own frame. In the ROP
+// backend every one of those steps is a chain of gadgets.
+//
+// This pass runs on the AST after constant folding and before code
+// generation. A call to a small function defined in the same file is
+// replaced by a statement expression holding a copy of the callee's body:
+//
+//   f(a, b)  =>  ({ p1 = a; p2 = b; <body>; end: ret; })
+//
+// where the parameters and locals of the copy become locals of the caller,
+// and each "return e" becomes "ret = e; goto end". Static functions that
+// end up with no callers left are not emitted. Functions of other files
+// are always called, and that includes the crt the wrapper scripts link
+// in, such as __builtin_bswap16.
+//
+// The code generator turns a call in tail position into a jump (see
+// tail_call_of in gen.c). Expanded as above, the calls in tail position
+// of the callee would no longer be in that of the caller, and a mutual
+// recursion such as is_even/is_odd would grow the stack again. A call in
+// tail position is therefore replaced by a copy whose returns stay
+// returns, converted to the return type of the caller:
+//
+//   return f(a, b)  =>  { p1 = a; p2 = b; <body>; return; }
+//
+// A call ending a function returning nothing is in tail position as
+// well, and so is a call ending the copy of such a function there.
+//
+// A callee is inlined if its body is no larger than inline_limit nodes, or
+// half of that if it is not static, since then its out-of-line copy has to
+// be kept as well. A static function called from a single place is inlined
+// regardless of its size.
+
+#include <stdlib.h>
+#include <string.h>
+#include "headers/inline.h"
+
+int inline_limit = 50;
+bool stats_inline = false;
+
+// Calls are inlined into inlined bodies up to this depth.
+#define MAX_INLINE_DEPTH 8
+
+static Map* funcs;    // function name -> AST_FUNC
+static Map* refs;     // function name -> number of references
+static Map* addrs;    // function name -> address taken
+static Node* caller;
+static Vector* expanding;
+
+static void count_refs(Node* node);
+static Node* inline_calls(Node* node, int depth);
+static void inline_block(Node* node, bool tail, int depth);
+
+static void count_inits(Vector* inits) {
+    for (int i = 0; inits && i < vec_len(inits); i++)
+        count_refs(((Node*)vec_get(inits, i))->initval);
+}
+
+static void count_nodes(Vector* nodes) {
+    for (int i = 0; nodes && i < vec_len(nodes); i++)
+        count_refs(vec_get(nodes, i));
+}
+
+static void add_ref(Map* m, char* name) {
+    map_put(m, name, (void*)((intptr_t)map_get(m, name) + 1));
+}
+
+// Counts the calls to and the addresses taken of each function in `node`.
+static void count_refs(Node* node) {
+    if (!node)
+        return;
+    switch (node->kind) {
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_GOTO:
+        case AST_LABEL:
+        case OP_LABEL_ADDR:
+            return;
+        case AST_FUNCDESG:
+            add_ref(refs, node->fname);
+            add_ref(addrs, node->fname);
+            return;
+        case AST_LVAR:
+            count_inits(node->lvarinit);
+            return;
+        case AST_FUNC:
+            count_refs(node->body);
+            return;
+        case AST_FUNCALL:
+            add_ref(refs, node->fname);
+            count_nodes(node->args);
+            return;
+        case AST_FUNCPTR_CALL:
+            count_refs(node->fptr);
+            count_nodes(node->args);
+            return;
+        case AST_DECL:
+            count_inits(node->declinit);
+            return;
+        case AST_IF:
+        case AST_TERNARY:
+            count_refs(node->cond);
+            count_refs(node->then);
+            count_refs(node->els);
+            return;
+        case AST_RETURN:
+            count_refs(node->retval);
+            return;
+        case AST_COMPOUND_STMT:
+            count_nodes(node->stmts);
+            return;
+        case AST_STRUCT_REF:
+            count_refs(node->struc);
+            return;
+        case AST_CONV:
+        case AST_ADDR:
+        case AST_DEREF:
+        case AST_COMPUTED_GOTO:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            count_refs(node->operand);
+            return;
+        default:
+            count_refs(node->left);
+            count_refs(node->right);
+    }
+}
+
+// Returns the number of nodes in `node`, or -1 if it contains something
+// that cannot be moved into another function: label addresses and
+// computed gotos refer to the labels of the original copy, static
+// declarations inside the body would be defined twice, and the return
+// address is that of the caller's caller once inlined.
+static int body_size(Node* node);
+
+static int sum_sizes(int a, int b) {
+    return (a < 0 || b < 0) ? -1 : a + b;
+}
+
+static int inits_size(Vector* inits) {
+    int r = 0;
+    for (int i = 0; inits && i < vec_len(inits); i++)
+        r = sum_sizes(r, body_size(((Node*)vec_get(inits, i))->initval));
+    return r;
+}
+
+static int nodes_size(Vector* nodes) {
+    int r = 0;
+    for (int i = 0; nodes && i < vec_len(nodes); i++)
+        r = sum_sizes(r, body_size(vec_get(nodes, i)));
+    return r;
+}
+
+static int body_size(Node* node) {
+    if (!node)
+        return 0;
+    switch (node->kind) {
+        case OP_LABEL_ADDR:
+        case AST_COMPUTED_GOTO:
+            return -1;
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case AST_GOTO:
+        case AST_LABEL:
+            return 1;
+        case AST_LVAR:
+            return sum_sizes(1, inits_size(node->lvarinit));
+        case AST_FUNCALL:
+            if (!strcmp(node->fname, "___builtin_return_address"))
+                return -1;
+            return sum_sizes(1, nodes_size(node->args));
+        case AST_FUNCPTR_CALL:
+            return sum_sizes(sum_sizes(1, body_size(node->fptr)), nodes_size(node->args));
+        case AST_DECL:
+            if (node->declvar->kind != AST_LVAR)
+                return -1;
+            return sum_sizes(1, inits_size(node->declinit));
+        case AST_IF:
+        case AST_TERNARY:
+            return sum_sizes(sum_sizes(1, body_size(node->cond)),
+                             sum_sizes(body_size(node->then), body_size(node->els)));
+        case AST_RETURN:
+            return sum_sizes(1, body_size(node->retval));
+        case AST_COMPOUND_STMT:
+            return sum_sizes(1, nodes_size(node->stmts));
+        case AST_STRUCT_REF:
+            return sum_sizes(1, body_size(node->struc));
+        case AST_CONV:
+        case AST_ADDR:
+        case AST_DEREF:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            return sum_sizes(1, body_size(node->operand));
+        default:
+            return sum_sizes(sum_sizes(1, body_size(node->left)), body_size(node->right));
+    }
+}
+
+static bool is_scalar(Type* ty) {
+    return (is_inttype(ty) && ty->bitsize <= 0) || ty->kind == KIND_PTR;
+}
+
+// Returns true if calls to `func` may be replaced by its body.
+static bool is_inlinable(Node* func) {
+    Type* ty = func->ty;
+    if (ty->hasva || ty->oldstyle)
+        return false;
+    if (ty->rettype->kind != KIND_VOID && !is_scalar(ty->rettype))
+        return false;
+    for (int i = 0; i < vec_len(func->params); i++)
+        if (!is_scalar(((Node*)vec_get(func->params, i))->ty))
+            return false;
+    return body_size(func->body) >= 0;
+}
+
+static bool should_inline(Node* call, Node* func) {
+    if (func == caller || !is_inlinable(func) || vec_len(call->args) != vec_len(func->params))
+        return false;
+    for (int i = 0; i < vec_len(expanding); i++)
+        if (vec_get(expanding, i) == func)
+            return false;
+    int size = body_size(func->body);
+    if (!func->ty->isstatic)
+        return size <= inline_limit / 2;
+    if ((intptr_t)map_get(refs, func->fname) == 1 && !map_get(addrs, func->fname))
+        return true;
+    return size <= inline_limit;
+}
+
+/*
+ * Copying a function body
+ */
+
+typedef struct {
+    Map* vars;     // original variable -> copy, keyed by address
+    Map* labels;   // original label -> fresh label
+    Node* retvar;
+    char* end;
+    bool tail;     // Returns are returns of the caller
+    Type* conv;    // If tail, the type to convert their values to, if any
+} Copy;
+
+static Node* copy_node(Copy* c, Node* node);
+
+static char* ptr_key(void* p) {
+    return format("%p", p);
+}
+
+static Node* new_node(Node* tmpl) {
+    Node* r = malloc(sizeof(Node));
+    *r = *tmpl;
+    return r;
+}
+
+static Node* copy_var(Copy* c, Node* var) {
+    Node* r = map_get(c->vars, ptr_key(var));
+    if (!r)
+        error("internal error: %s is not a local of the inlined function", var->varname);
+    return r;
+}
+
+static char* copy_label(Copy* c, char* label) {
+    if (!label)
+        return NULL;
+    char* r = map_get(c->labels, label);
+    if (!r) {
+        r = make_label();
+        map_put(c->labels, label, r);
+    }
+    return r;
+}
+
+static Vector* copy_inits(Copy* c, Vector* inits) {
+    if (!inits)
+        return NULL;
+    Vector* r = make_vector();
+    for (int i = 0; i < vec_len(inits); i++) {
+        Node* init = new_node(vec_get(inits, i));
+        init->initval = copy_node(c, init->initval);
+        vec_push(r, init);
+    }
+    return r;
+}
+
+static Vector* copy_nodes(Copy* c, Vector* nodes) {
+    Vector* r = make_vector();
+    for (int i = 0; i < vec_len(nodes); i++)
+        vec_push(r, copy_node(c, vec_get(nodes, i)));
+    return r;
+}
+
+static Node* copy_return(Copy* c, Node* node) {
+    if (c->tail) {
+        Node* r = new_node(node);
+        r->retval = copy_node(c, node->retval);
+        if (r->retval && c->conv)
+            r->retval = new_node(&(Node){ AST_CONV, c->conv, node->sourceLoc, .operand = r->retval });
+        return r;
+    }
+    Node* jump = new_node(&(Node){ AST_GOTO, .label = c->end, .newlabel = c->end });
+    jump->sourceLoc = node->sourceLoc;
+    if (!node->retval)
+        return jump;
+    Node* val = copy_node(c, node->retval);
+    Vector* stmts = make_vector();
+    if (c->retvar)
+        vec_push(stmts, new_node(&(Node){ '=', c->retvar->ty, c->retvar->sourceLoc,
+                                          .left = c->retvar, .right = val }));
+    else
+        vec_push(stmts, val);
+    vec_push(stmts, jump);
+    return new_node(&(Node){ AST_COMPOUND_STMT, .stmts = stmts });
+}
+
+static Node* copy_node(Copy* c, Node* node) {
+    if (!node)
+        return NULL;
+    switch (node->kind) {
+        case AST_GVAR:
+        case AST_FUNCDESG:
+            return node;
+        case AST_LVAR:
+            return copy_var(c, node);
+        case AST_RETURN:
+            return copy_return(c, node);
+    }
+    Node* r = new_node(node);
+    switch (node->kind) {
+        case AST_LITERAL:
+            return r;
+        case AST_GOTO:
+        case AST_LABEL:
+            r->newlabel = copy_label(c, node->newlabel);
+            return r;
+        case AST_FUNCALL:
+            r->args = copy_nodes(c, node->args);
+            return r;
+        case AST_FUNCPTR_CALL:
+            r->fptr = copy_node(c, node->fptr);
+            r->args = copy_nodes(c, node->args);
+            return r;
+        case AST_DECL:
+            r->declvar = copy_var(c, node->declvar);
+            r->declinit = copy_inits(c, node->declinit);
+            return r;
+        case AST_IF:
+        case AST_TERNARY:
+            r->cond = copy_node(c, node->cond);
+            r->then = copy_node(c, node->then);
+            r->els = copy_node(c, node->els);
+            return r;
+        case AST_COMPOUND_STMT:
+            r->stmts = copy_nodes(c, node->stmts);
+            return r;
+        case AST_STRUCT_REF:
+            r->struc = copy_node(c, node->struc);
+            return r;
+        case AST_CONV:
+        case AST_ADDR:
+        case AST_DEREF:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            r->operand = copy_node(c, node->operand);
+            return r;
+        default:
+            r->left = copy_node(c, node->left);
+            r->right = copy_node(c, node->right);
+            return r;
+    }
+}
+
+// Makes a fresh local variable of the caller for `var` of the callee.
+static Node* add_local(Copy* c, Node* var) {
+    Node* r = new_node(&(Node){ AST_LVAR, var->ty, var->sourceLoc, .varname = var->varname });
+    map_put(c->vars, ptr_key(var), r);
+    vec_push(caller->localvars, r);
+    return r;
+}
+
+// Returns the statement expression that replaces `call` to `func`, or
+// the statement that replaces "return call" if `ret`, or the call ending
+// a function returning nothing if `tail`.
+static Node* expand_call(Node* call, Node* func, bool ret, bool tail) {
+    Copy c = { make_map(), make_map(), NULL, make_label(), ret || tail, NULL };
+    caller->hasvolatile |= func->hasvolatile;
+    Vector* stmts = make_vector();
+    for (int i = 0; i < vec_len(func->params); i++) {
+        Node* param = vec_get(func->params, i);
+        Node* var = add_local(&c, param);
+        Node* init = new_node(&(Node){ AST_INIT, .initval = vec_get(call->args, i), .totype = var->ty });
+        vec_push(stmts, new_node(&(Node){ AST_DECL, .declvar = var, .declinit = make_vector1(init) }));
+    }
+    for (int i = 0; i < vec_len(func->localvars); i++) {
+        Node* var = vec_get(func->localvars, i);
+        Node* copy = add_local(&c, var);
+        copy->lvarinit = copy_inits(&c, var->lvarinit);
+    }
+    Type* rettype = func->ty->rettype;
+    Type* callertype = caller->ty->rettype;
+    if (c.tail && (rettype->kind != callertype->kind || rettype->usig != callertype->usig))
+        c.conv = callertype;
+    if (rettype->kind != KIND_VOID && !c.tail)
+        c.retvar = new_node(&(Node){ AST_LVAR, rettype, call->sourceLoc, .varname = make_tempname() });
+    if (c.retvar)
+        vec_push(caller->localvars, c.retvar);
+    vec_push(stmts, copy_node(&c, func->body));
+    // Falling off the end of the copy returns from the caller, which is
+    // what happens after a call ending the caller anyway.
+    if (ret)
+        vec_push(stmts, new_node(&(Node){ AST_RETURN, .sourceLoc = call->sourceLoc }));
+    if (!c.tail)
+        vec_push(stmts, new_node(&(Node){ AST_LABEL, .label = c.end, .newlabel = c.end }));
+    if (c.retvar)
+        vec_push(stmts, c.retvar);
+    Node* r = new_node(&(Node){ AST_COMPOUND_STMT, c.tail ? type_void : rettype, call->sourceLoc,
+                                .stmts = stmts });
+    if (stats_inline) {
+        SourceLoc* loc = call->sourceLoc;
+        fprintf(stderr, "inline: %s: inlined %s", caller->fname + 1, func->fname + 1);
+        if (loc)
+            fprintf(stderr, " at %s:%d", loc->file, loc->line);
+        fprintf(stderr, " (size %d%s)\n", body_size(func->body), c.tail ? ", tail" : "");
+    }
+    return r;
+}
+
+/*
+ * Inlining
+ */
+
+static void inline_inits(Vector* inits, int depth) {
+    for (int i = 0; inits && i < vec_len(inits); i++) {
+        Node* init = vec_get(inits, i);
+        init->initval = inline_calls(init->initval, depth);
+    }
+}
+
+static void inline_vector(Vector* nodes, int depth) {
+    for (int i = 0; nodes && i < vec_len(nodes); i++)
+        vec_set(nodes, i, inline_calls(vec_get(nodes, i), depth));
+}
+
+static Node* strip_conv(Node* node) {
+    while (node->kind == AST_CONV)
+        node = node->operand;
+    return node;
+}
+
+static bool is_compound_op(int kind) {
+    switch (kind) {
+        case '+':
+        case '-':
+        case '*':
+        case '/':
+        case '%':
+        case '&':
+        case '|':
+        case '^':
+        case OP_SAL:
+        case OP_SAR:
+        case OP_SHR:
+            return true;
+    }
+    return false;
+}
+
+// The parser turns "a op= b" into "a = a op b", where both "a" are the
+// same node, and gen.c emits that node twice, once to load the value and
+// once to store it. The same goes for the operand of ++ and --. An
+// inlined body there would be emitted twice and define its end label
+// twice, so no call in such an lvalue is inlined. Only "b" is looked at.
+static Node* inline_assign(Node* node, int depth) {
+    Node* op = strip_conv(node->right);
+    if (op == node->left)
+        return node;
+    if (is_compound_op(op->kind) && strip_conv(op->left) == node->left) {
+        op->right = inline_calls(op->right, depth);
+        return node;
+    }
+    if (is_compound_op(op->kind) && strip_conv(op->right) == node->left) {
+        op->left = inline_calls(op->left, depth);
+        return node;
+    }
+    node->left = inline_calls(node->left, depth);
+    node->right = inline_calls(node->right, depth);
+    return node;
+}
+
+// Returns what replaces `call`: a copy of the callee, or the call itself
+// if it is not inlined. See expand_call for `ret` and `tail`.
+static Node* inline_call(Node* call, bool ret, bool tail, int depth) {
+    inline_vector(call->args, depth);
+    Node* func = map_get(funcs, call->fname);
+    if (!func || depth >= MAX_INLINE_DEPTH || !should_inline(call, func))
+        return call;
+    Node* r = expand_call(call, func, ret, tail);
+    vec_push(expanding, func);
+    inline_block(r, tail, depth + 1);
+    vec_pop(expanding);
+    return r;
+}
+
+// Inlines the calls in the statements of `node`. If `tail`, the block
+// ends a function returning nothing, and so does its last statement.
+static void inline_block(Node* node, bool tail, int depth) {
+    int n = vec_len(node->stmts);
+    for (int i = 0; i < n; i++) {
+        Node* stmt = vec_get(node->stmts, i);
+        if (tail && i == n - 1 && stmt->kind == AST_FUNCALL && stmt->ty->kind == KIND_VOID)
+            stmt = inline_call(stmt, false, true, depth);
+        else if (tail && i == n - 1 && stmt->kind == AST_COMPOUND_STMT)
+            inline_block(stmt, true, depth);
+        else
+            stmt = inline_calls(stmt, depth);
+        vec_set(node->stmts, i, stmt);
+    }
+}
+
+static Node* inline_calls(Node* node, int depth) {
+    if (!node)
+        return NULL;
+    switch (node->kind) {
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case AST_GOTO:
+        case AST_LABEL:
+        case OP_LABEL_ADDR:
+            return node;
+        case AST_LVAR:
+            inline_inits(node->lvarinit, depth);
+            return node;
+        case AST_DECL:
+            inline_inits(node->declinit, depth);
+            return node;
+        case AST_FUNCALL:
+            return inline_call(node, false, false, depth);
+        case AST_FUNCPTR_CALL:
+            node->fptr = inline_calls(node->fptr, depth);
+            inline_vector(node->args, depth);
+            return node;
+        case AST_IF:
+        case AST_TERNARY:
+            node->cond = inline_calls(node->cond, depth);
+            node->then = inline_calls(node->then, depth);
+            node->els = inline_calls(node->els, depth);
+            return node;
+        case AST_RETURN: {
+            Node* call = node->retval;
+            if (call && call->kind == AST_CONV)
+                call = call->operand;
+            if (!call || call->kind != AST_FUNCALL) {
+                node->retval = inline_calls(node->retval, depth);
+                return node;
+            }
+            Node* r = inline_call(call, true, false, depth);
+            return (r == call) ? node : r;
+        }
+        case AST_COMPOUND_STMT:
+            inline_block(node, false, depth);
+            return node;
+        case AST_STRUCT_REF:
+            node->struc = inline_calls(node->struc, depth);
+            return node;
+        case AST_CONV:
+        case AST_ADDR:
+        case AST_DEREF:
+        case AST_COMPUTED_GOTO:
+        case OP_CAST:
+        case '!':
+        case '~':
+            node->operand = inline_calls(node->operand, depth);
+            return node;
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+            return node;
+        case '=':
+            return inline_assign(node, depth);
+        default:
+            node->left = inline_calls(node->left, depth);
+            node->right = inline_calls(node->right, depth);
+            return node;
+    }
+}
+
+static void count_all_refs(Vector* toplevels) {
+    refs = make_map();
+    addrs = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node* v = vec_get(toplevels, i);
+        if (v->kind == AST_DECL)
+            count_inits(v->declinit);
+        else
+            count_refs(v);
+    }
+}
+
+// Removes static functions that are neither called nor referred to.
+static void remove_unused_funcs(Vector* toplevels) {
+    for (bool changed = true; changed;) {
+        changed = false;
+        count_all_refs(toplevels);
+        for (int i = 0; i < vec_len(toplevels); i++) {
+            Node* v = vec_get(toplevels, i);
+            if (v->kind != AST_FUNC || !v->ty->isstatic || map_get(refs, v->fname))
+                continue;
+            if (stats_inline)
+                fprintf(stderr, "inline: %s: removed\n", v->fname + 1);
+            vec_set(toplevels, i, NULL);
+            changed = true;
+        }
+        int n = 0;
+        for (int i = 0; i < vec_len(toplevels); i++)
+            if (vec_get(toplevels, i))
+                vec_set(toplevels, n++, vec_get(toplevels, i));
+        while (vec_len(toplevels) > n)
+            vec_pop(toplevels);
+    }
+}
+
+void inline_toplevels(Vector* toplevels) {
+    if (inline_limit <= 0)
+        return;
+    funcs = make_map();
+    expanding = make_vector();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node* v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC)
+            map_put(funcs, v->fname, v);
+    }
+    count_all_refs(toplevels);
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node* v = vec_get(toplevels, i);
+        if (v->kind != AST_FUNC)
+            continue;
+        caller = v;
+        inline_block(v->body, v->ty->rettype->kind == KIND_VOID, 0);
+    }
+    caller = NULL;
+    remove_unused_funcs(toplevels);
+}
@@ -0,0 +1,306 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// In-memory form of the IR.
+//
+// The code generator prints IR as text. While a function is being
+// generated its lines are parsed into Insts instead, so that passes such as
+// the peephole optimizer can rewrite them before they are written out.
+// Lines that are left alone keep their original text, including any
+// comments; rewritten instructions are printed in the canonical format.
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers/ir.h"
+
+static char* regs[] = { "A", "B", "C", "D", "E", "F", "G", "H", "SP", "BP" };
+
+static char* trim(char* s) {
+    while (isspace(*s))
+        s++;
+    char* e = s + strlen(s);
+    while (e > s && isspace(e[-1]))
+        e--;
+    *e = '\0';
+    return s;
+}
+
+Inst* parse_inst(char* line) {
+    Inst* r = calloc(1, sizeof(Inst));
+    r->text = line;
+    char* s = trim(strdup(line));
+    if (*s == '#' || !strncmp(s, ".loc ", 5) || !strncmp(s, ".file ", 6)) {
+        r->kind = INST_NOTE;
+        return r;
+    }
+    if (*s == '.' && !strchr(s, ':')) {
+        r->kind = INST_DIRECTIVE;
+        return r;
+    }
+    // Strip the call stack comment added by -fdump-stack.
+    char* p = strchr(s, '#');
+    if (p) {
+        *p = '\0';
+        s = trim(s);
+    }
+    int len = strlen(s);
+    if (len > 0 && s[len - 1] == ':' && !strchr(s, ' ')) {
+        s[len - 1] = '\0';
+        r->kind = INST_LABEL;
+        r->op = s;
+        return r;
+    }
+    if (*s == '.') {
+        r->kind = INST_DIRECTIVE;
+        return r;
+    }
+    r->kind = INST_OP;
+    r->op = s;
+    p = strchr(s, ' ');
+    if (!p)
+        return r;
+    *p++ = '\0';
+    for (;;) {
+        assert(r->nargs < 3);
+        r->args[r->nargs++] = p;
+        p = strchr(p, ',');
+        if (!p)
+            return r;
+        *p++ = '\0';
+        while (*p == ' ')
+            p++;
+    }
+}
+
+Inst* make_inst(char* op, int nargs, ...) {
+    Inst* r = calloc(1, sizeof(Inst));
+    r->kind = INST_OP;
+    r->op = op;
+    r->nargs = nargs;
+    va_list ap;
+    va_start(ap, nargs);
+    for (int i = 0; i < nargs; i++)
+        r->args[i] = va_arg(ap, char*);
+    va_end(ap);
+    return r;
+}
+
+void print_inst(FILE* fp, Inst* inst) {
+    if (inst->text) {
+        fprintf(fp, "%s\n", inst->text);
+        return;
+    }
+    if (inst->kind == INST_LABEL) {
+        fprintf(fp, "\t%s:\n", inst->op);
+        return;
+    }
+    fprintf(fp, "\t%s", inst->op);
+    for (int i = 0; i < inst->nargs; i++)
+        fprintf(fp, "%s%s", i ? ", " : " ", inst->args[i]);
+    fprintf(fp, "\n");
+}
+
+bool inst_is(Inst* inst, char* op) {
+    return inst && inst->kind == INST_OP && !strcmp(inst->op, op);
+}
+
+bool is_reg(char* s) {
+    for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++)
+        if (!strcmp(s, regs[i]))
+            return true;
+    return false;
+}
+
+bool is_imm_arg(char* s, long* val) {
+    char* end;
+    long v = strtol(s, &end, 0);
+    if (end == s || *end)
+        return false;
+    if (val)
+        *val = v;
+    return true;
+}
+
+// Returns true if `val` fits in the immediate operand of an instruction
+// other than mov, which the backends encode in 32 bits.
+bool is_imm(long val) {
+    return INT32_MIN <= val && val <= INT32_MAX;
+}
+
+// Memory operands are written "[base]" or "[base+off]", where the base is
+// a register or a label and the offset a signed decimal number. Loads and
+// stores take one in place of their address register, and "addmN" and
+// "submN" update memory in place. The backends may use B to compute the
+// address of any of them.
+bool is_mem_arg(char* s) {
+    return *s == '[';
+}
+
+// Returns the base of the memory operand `s`.
+char* mem_base(char* s) {
+    assert(is_mem_arg(s));
+    return strndup(s + 1, strcspn(s + 1, "+-]"));
+}
+
+// Returns true if `s` is `reg` or a memory operand based on it.
+static bool arg_reads(char* s, char* reg) {
+    if (!is_mem_arg(s))
+        return !strcmp(s, reg);
+    int len = strlen(reg);
+    return !strncmp(s + 1, reg, len) && strchr("+-]", s[len + 1]);
+}
+
+bool is_rmw_op(char* op) {
+    return op_width(op, "addm") || op_width(op, "subm");
+}
+
+// Returns true if `inst` takes a memory operand.
+bool has_mem_arg(Inst* inst) {
+    for (int i = 0; i < inst->nargs; i++)
+        if (is_mem_arg(inst->args[i]))
+            return true;
+    return false;
+}
+
+// Returns the size in bits encoded in a mnemonic such as "load32" or
+// "icrop8", or 0 if `op` does not start with `prefix`.
+int op_width(char* op, char* prefix) {
+    int len = strlen(prefix);
+    if (strncmp(op, prefix, len) || !isdigit(op[len]))
+        return 0;
+    return atoi(op + len);
+}
+
+// Two-operand arithmetic and comparison instructions: "op dst, src"
+// reads both operands and writes dst.
+bool is_arith_op(char* op) {
+    static char* ops[] = {
+        "add", "sub", "mul", "and", "or", "xor", "shl", "shr", "sar",
+        "div", "mod", "idiv", "imod", "eq", "ne", "lt", "le", "gt", "ge",
+    };
+    for (int i = 0; i < sizeof(ops) / sizeof(*ops); i++)
+        if (!strcmp(op, ops[i]))
+            return true;
+    return false;
+}
+
+bool is_comp_op(char* op) {
+    return !strcmp(op, "eq") || !strcmp(op, "ne") || !strcmp(op, "lt") ||
+        !strcmp(op, "le") || !strcmp(op, "gt") || !strcmp(op, "ge");
+}
+
+bool is_crop_op(char* op) {
+    return op_width(op, "crop") || op_width(op, "icrop");
+}
+
+// Conditional jumps: "jeq label, x, y" and friends.
+bool is_cond_jump(Inst* inst) {
+    return inst && inst->kind == INST_OP && inst->op[0] == 'j' && is_comp_op(inst->op + 1);
+}
+
+// Instructions whose effect is fully described by inst_reads and
+// inst_writes, apart from storeN, addmN and submN writing memory.
+bool is_simple_inst(Inst* inst) {
+    if (inst->kind != INST_OP)
+        return false;
+    char* op = inst->op;
+    return !strcmp(op, "mov") || !strcmp(op, "not") || is_arith_op(op) ||
+        is_crop_op(op) || op_width(op, "load") || op_width(op, "store") || is_rmw_op(op);
+}
+
+bool inst_reads(Inst* inst, char* reg) {
+    if (inst->kind != INST_OP)
+        return false;
+    char* op = inst->op;
+    if (!strcmp(op, "mov") || op_width(op, "load"))
+        return arg_reads(inst->args[1], reg);
+    if (!strcmp(op, "not") || is_crop_op(op))
+        return !strcmp(inst->args[0], reg);
+    if (is_arith_op(op) || op_width(op, "store") || is_rmw_op(op))
+        return arg_reads(inst->args[0], reg) || arg_reads(inst->args[1], reg);
+    if (is_cond_jump(inst))
+        return !strcmp(inst->args[1], reg) || !strcmp(inst->args[2], reg);
+    if (!strcmp(op, "jmp"))
+        return !strcmp(inst->args[0], reg);
+    return true;
+}
+
+bool inst_writes(Inst* inst, char* reg) {
+    if (!is_simple_inst(inst))
+        return false;
+    if (has_mem_arg(inst) && !strcmp(reg, "B"))
+        return true;
+    if (op_width(inst->op, "store") || is_rmw_op(inst->op))
+        return false;
+    return !strcmp(inst->args[0], reg);
+}
+
+// Registers as bits of a mask, in the order of regs[].
+int reg_bit(char* reg) {
+    for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++)
+        if (!strcmp(reg, regs[i]))
+            return 1 << i;
+    return 0;
+}
+
+int inst_read_mask(Inst* inst) {
+    int r = 0;
+    for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++)
+        if (inst_reads(inst, regs[i]))
+            r |= 1 << i;
+    return r;
+}
+
+int inst_write_mask(Inst* inst) {
+    int r = 0;
+    for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++)
+        if (inst_writes(inst, regs[i]))
+            r |= 1 << i;
+    return r;
+}
+
+// Returns the index of the instruction following `i` in the same basic
+// block, skipping deleted entries and notes, or -1 if a label, a directive
+// or the end of the function comes first.
+int ir_next(Vector* insts, int i) {
+    for (i++; i < vec_len(insts); i++) {
+        Inst* inst = vec_get(insts, i);
+        if (!inst || inst->kind == INST_NOTE)
+            continue;
+        return inst->kind == INST_OP ? i : -1;
+    }
+    return -1;
+}
+
+// Like ir_next, but looks backward.
+int ir_prev(Vector* insts, int i) {
+    for (i--; i >= 0; i--) {
+        Inst* inst = vec_get(insts, i);
+        if (!inst || inst->kind == INST_NOTE)
+            continue;
+        return inst->kind == INST_OP ? i : -1;
+    }
+    return -1;
+}
+
+// Removes the entries that passes have deleted by setting them to NULL.
+void ir_compact(Vector* insts) {
+    int n = 0;
+    for (int i = 0; i < vec_len(insts); i++) {
+        Inst* inst = vec_get(insts, i);
+        if (inst)
+            vec_set(insts, n++, inst);
+    }
+    while (vec_len(insts) > n)
+        vec_pop(insts);
+}
+
+int ir_count_ops(Vector* insts) {
+    int n = 0;
+    for (int i = 0; i < vec_len(insts); i++) {
+        Inst* inst = vec_get(insts, i);
+        if (inst && inst->kind == INST_OP)
+            n++;
+    }
+    return n;
+}
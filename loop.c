@@ -0,0 +1,1047 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Loop optimizations.
+//
+// Loops evaluate their bodies from scratch on every iteration, including
+// the parts whose value never changes, such as the address of a local
+// array or a product of a variable the loop does not modify, and compute
+// a[i] as a + i * size. This pass finds the natural loops of a function
+// and rewrites both:
+//
+//   - A value computed from registers the loop does not write, constants,
+//     labels and memory it does not store to is computed once into a
+//     spare register before the loop, and taken from there.
+//
+//   - A register the loop only ever adds constants to is an induction
+//     variable. A value of the form base + iv * scale is kept up to date
+//     in a spare register instead, which is advanced by the same
+//     constant times scale wherever the induction variable is.
+//
+// The values are found by following the instructions of each block of
+// the loop symbolically, as forms such as "load32 [BP+16] * 3 + 8" or
+// "F + H * 4". A computation is replaced where its value is used for
+// something that is not such a form, if that saves more instructions
+// than it adds. The instructions it leaves unused are removed by the
+// peephole optimizer.
+//
+// Loops containing calls or block moves are left alone, since they may
+// write any memory and clobber C and D. The hoisted code goes right
+// before the loop header, which must be entered from outside the loop
+// only by falling through from the preceding block.
+//
+// With -funroll-loops, counted loops are unrolled first: those that exit
+// at the header when an induction variable reaches an invariant bound.
+// If the variable starts from a constant and the number of iterations is
+// small, the loop is replaced by that many copies of its body. Otherwise
+// a loop running several copies of the body with a single test in front
+// is put before it, and the original loop runs the iterations left over.
+
+#include <stdlib.h>
+#include <string.h>
+#include "headers/loop.h"
+
+bool stats_loops = false;
+
+static char* regs[] = { "A", "B", "C", "D", "E", "F", "G", "H", "SP", "BP" };
+#define NREGS (sizeof(regs) / sizeof(*regs))
+
+// Registers tried, in order, to keep a value in.
+static char* spares[] = { "D", "C", "E", "F", "G", "H" };
+
+// base * bscale + iv * scale + c, where base is loaded from base + boff
+// if load is nonzero.
+typedef struct {
+    char* base;  // An invariant register or a label, or NULL
+    int load;
+    long boff;
+    long bscale;
+    char* iv;    // An induction variable, or NULL
+    long scale;
+    long c;
+    int cost;    // Instructions the loop spends computing the value
+} Form;
+
+// A computation at `index`, leaving `form` in `reg`, to be replaced.
+typedef struct {
+    int index;
+    char* reg;
+    Form form;
+} Use;
+
+// A write to the induction variable `iv` adding `step`.
+typedef struct {
+    int index;
+    char* iv;
+    long step;
+} Step;
+
+// Uses of the same value apart from the constant, kept in one register.
+typedef struct {
+    Form form;
+    Vector* uses;
+    int gain;
+    char* reg;
+} Group;
+
+typedef struct {
+    Cfg* cfg;
+    Block* header;
+    bool* body;      // Indexed by block id
+    int size;
+    int written;     // Registers the loop writes
+    int referenced;  // Registers the loop reads or writes
+    Vector* stores;
+    int ivs;
+    int bad_ivs;
+    bool recording;
+    Vector* uses;
+    Vector* steps;
+    // The operands of the conditional jump ending the header.
+    int test_index;
+    Form test[2];
+    bool test_known[2];
+    // State of the walk through a block.
+    Form form[NREGS];
+    bool known[NREGS];
+    int def[NREGS];
+} Loop;
+
+static int reg_index(char* s) {
+    for (int i = 0; i < NREGS; i++)
+        if (!strcmp(s, regs[i]))
+            return i;
+    return -1;
+}
+
+static bool is_const_form(Form* f) {
+    return !f->base && !f->iv;
+}
+
+// A value that is just a register: nothing to gain from keeping a copy.
+static bool is_plain_reg(Form* f) {
+    if (f->c)
+        return false;
+    if (f->base && !f->iv)
+        return !f->load && f->bscale == 1 && is_reg(f->base);
+    return !f->base && f->iv && f->scale == 1;
+}
+
+static void scale_form(Form* f, long k) {
+    f->bscale = (unsigned long)f->bscale * k;
+    f->scale = (unsigned long)f->scale * k;
+    f->c = (unsigned long)f->c * k;
+    if (!f->scale)
+        f->iv = NULL;
+}
+
+static bool add_forms(Form* x, Form* y, Form* r) {
+    if ((x->base && y->base) || (x->iv && y->iv && strcmp(x->iv, y->iv)))
+        return false;
+    *r = *x;
+    if (!r->base) {
+        r->base = y->base;
+        r->load = y->load;
+        r->boff = y->boff;
+        r->bscale = y->bscale;
+    }
+    if (y->iv) {
+        r->iv = y->iv;
+        r->scale = (unsigned long)r->scale + y->scale;
+        if (!r->scale)
+            r->iv = NULL;
+    }
+    r->c = (unsigned long)r->c + y->c;
+    r->cost = x->cost + y->cost + 1;
+    return true;
+}
+
+static bool arith_form(char* op, Form* x, Form* y, Form* r) {
+    if (!strcmp(op, "add"))
+        return add_forms(x, y, r);
+    if (!is_const_form(y) && !(!strcmp(op, "mul") && is_const_form(x)))
+        return false;
+    if (!strcmp(op, "sub")) {
+        *r = *x;
+        r->c = (unsigned long)r->c - y->c;
+    } else if (!strcmp(op, "mul")) {
+        *r = is_const_form(y) ? *x : *y;
+        scale_form(r, is_const_form(y) ? y->c : x->c);
+    } else if (!strcmp(op, "shl") && 0 <= y->c && y->c < 63) {
+        *r = *x;
+        scale_form(r, 1L << y->c);
+    } else {
+        return false;
+    }
+    r->cost = x->cost + y->cost + 1;
+    return true;
+}
+
+static bool operand_form(Loop* l, char* s, Form* f) {
+    long c;
+    if (is_reg(s)) {
+        int r = reg_index(s);
+        *f = l->form[r];
+        return l->known[r];
+    }
+    *f = (Form){ 0 };
+    if (is_imm_arg(s, &c)) {
+        f->c = c;
+    } else {
+        f->base = s;
+        f->bscale = 1;
+    }
+    return true;
+}
+
+static bool address_form(Loop* l, char* s, Form* f) {
+    if (!is_mem_arg(s))
+        return operand_form(l, s, f);
+    char* base = mem_base(s);
+    if (!operand_form(l, base, f))
+        return false;
+    char* p = s + 1 + strlen(base);
+    f->c += (*p == ']') ? 0 : strtol(p, NULL, 10);
+    return true;
+}
+
+// Is the memory at base + off, base being BP or a label, distinct from
+// what `store` writes?
+static bool is_untouched_by(Inst* store, char* base, long off, int size) {
+    bool rmw = is_rmw_op(store->op);
+    char* addr = store->args[rmw ? 0 : 1];
+    if (!is_mem_arg(addr))
+        return false;
+    char* sbase = mem_base(addr);
+    bool is_object = !strcmp(sbase, "BP") || !is_reg(sbase);
+    if (strcmp(sbase, base))
+        return is_object;
+    char* p = addr + 1 + strlen(sbase);
+    long soff = (*p == ']') ? 0 : strtol(p, NULL, 10);
+    int ssize = (rmw ? op_width(store->op, store->op[0] == 'a' ? "addm" : "subm") : op_width(store->op, "store")) / 8;
+    return soff + ssize <= off || off + size <= soff;
+}
+
+// Loads are hoisted only from the stack frame and from labels, which are
+// valid addresses even if the loop runs zero times.
+static bool load_form(Loop* l, int bits, Form* a, Form* r) {
+    if (!a->base || a->iv || a->load || a->bscale != 1)
+        return false;
+    if (strcmp(a->base, "BP") && is_reg(a->base))
+        return false;
+    for (int i = 0; i < vec_len(l->stores); i++)
+        if (!is_untouched_by(vec_get(l->stores, i), a->base, a->c, bits / 8))
+            return false;
+    *r = (Form){ .base = a->base, .load = bits, .boff = a->c, .bscale = 1, .cost = a->cost + 1 };
+    return true;
+}
+
+// icropN changes nothing on an int or long induction variable plus a
+// constant, since signed overflow is undefined, and on values loaded with
+// loadN. Narrower variables wrap around.
+static bool crop_form(char* op, Form* x, Form* r) {
+    int bits = op_width(op, "icrop");
+    if (!bits)
+        return false;
+    *r = *x;
+    r->cost = x->cost + 1;
+    if (is_const_form(x)) {
+        if (bits < 64) {
+            unsigned long m = 1UL << (bits - 1);
+            unsigned long u = (unsigned long)x->c & ((1UL << bits) - 1);
+            r->c = (long)((u ^ m) - m);
+        }
+        return true;
+    }
+    if (bits == 64)
+        return true;
+    if (x->iv && !x->base && x->scale == 1)
+        return bits >= 32;
+    return x->load && x->load <= bits && !x->iv && x->bscale == 1 && !x->c;
+}
+
+static void start_block(Loop* l) {
+    for (int r = 0; r < NREGS; r++) {
+        int bit = 1 << r;
+        l->def[r] = -1;
+        l->known[r] = !(l->written & bit) || (l->ivs & bit);
+        if (!(l->written & bit))
+            l->form[r] = (Form){ .base = regs[r], .bscale = 1 };
+        else
+            l->form[r] = (Form){ .iv = regs[r], .scale = 1 };
+    }
+}
+
+// Values worth computing elsewhere.
+static bool is_costly(Form* f) {
+    if (is_plain_reg(f) || is_const_form(f))
+        return false;
+    if (f->iv)
+        return f->cost >= 3;
+    return f->cost >= 2 || f->load;
+}
+
+static void use_value(Loop* l, int r) {
+    if (!l->recording || !l->known[r] || l->def[r] < 0 || !is_costly(&l->form[r]))
+        return;
+    for (int i = 0; i < vec_len(l->uses); i++)
+        if (((Use*)vec_get(l->uses, i))->index == l->def[r])
+            return;
+    Use* u = malloc(sizeof(Use));
+    *u = (Use){ l->def[r], regs[r], l->form[r] };
+    vec_push(l->uses, u);
+}
+
+// An induction variable was written with the form f. Returns false if
+// it is not an induction variable after all.
+static bool step_iv(Loop* l, int k, int r, Form* f, bool ok) {
+    if (!ok || !f->iv || strcmp(f->iv, regs[r]) || f->base || f->scale != 1) {
+        l->bad_ivs |= 1 << r;
+        return false;
+    }
+    long step = f->c;
+    for (int i = 0; i < NREGS; i++)
+        if (l->known[i] && l->form[i].iv && !strcmp(l->form[i].iv, regs[r]))
+            l->form[i].c = (unsigned long)l->form[i].c - (unsigned long)step * l->form[i].scale;
+    l->form[r] = (Form){ .iv = regs[r], .scale = 1 };
+    l->known[r] = true;
+    l->def[r] = -1;
+    if (l->recording && step) {
+        Step* s = malloc(sizeof(Step));
+        *s = (Step){ k, regs[r], step };
+        vec_push(l->steps, s);
+    }
+    return true;
+}
+
+static void walk_inst(Loop* l, int k) {
+    Inst* inst = vec_get(l->cfg->insts, k);
+    char* op = inst->op;
+    char* dst = NULL;
+    Form x, y, res;
+    bool ok = false;
+    int bits;
+    if (k == l->test_index)
+        for (int i = 0; i < 2; i++)
+            l->test_known[i] = operand_form(l, inst->args[i + 1], &l->test[i]);
+    if (!strcmp(op, "mov")) {
+        dst = inst->args[0];
+        ok = operand_form(l, inst->args[1], &res);
+        res.cost++;
+    } else if (is_arith_op(op)) {
+        dst = inst->args[0];
+        ok = operand_form(l, dst, &x) && operand_form(l, inst->args[1], &y) && arith_form(op, &x, &y, &res);
+    } else if (is_crop_op(op)) {
+        dst = inst->args[0];
+        ok = operand_form(l, dst, &x) && crop_form(op, &x, &res);
+    } else if (!strcmp(op, "not")) {
+        dst = inst->args[0];
+    } else if ((bits = op_width(op, "load")) != 0) {
+        dst = inst->args[0];
+        ok = address_form(l, inst->args[1], &x) && load_form(l, bits, &x, &res);
+    }
+    if (!ok) {
+        int reads = inst_read_mask(inst);
+        for (int r = 0; r < NREGS; r++)
+            if (reads & (1 << r))
+                use_value(l, r);
+    }
+    int writes = inst_write_mask(inst);
+    for (int r = 0; r < NREGS; r++) {
+        if (!(writes & (1 << r)))
+            continue;
+        bool mine = ok && !strcmp(dst, regs[r]);
+        if ((l->ivs & (1 << r)) && step_iv(l, k, r, &res, mine))
+            continue;
+        l->known[r] = mine;
+        l->form[r] = res;
+        l->def[r] = k;
+    }
+}
+
+static void walk_loop(Loop* l) {
+    for (int i = 0; i < vec_len(l->cfg->blocks); i++) {
+        if (!l->body[i])
+            continue;
+        Block* b = vec_get(l->cfg->blocks, i);
+        start_block(l);
+        for (int k = b->begin; k < b->end; k++)
+            if (((Inst*)vec_get(l->cfg->insts, k))->kind == INST_OP)
+                walk_inst(l, k);
+    }
+}
+
+// Checks that the loop can be optimized, and collects what it writes.
+static bool scan_loop(Loop* l) {
+    Cfg* cfg = l->cfg;
+    Block* h = l->header;
+    if (h->id == 0)
+        return false;
+    Block* pre = vec_get(cfg->blocks, h->id - 1);
+    if (l->body[pre->id] || !block_label(cfg, h))
+        return false;
+    for (int i = 0; i < vec_len(h->preds); i++) {
+        Block* p = vec_get(h->preds, i);
+        if (p != pre && !l->body[p->id])
+            return false;
+    }
+    Inst* last = block_last(cfg, pre);
+    if (inst_is(last, "jmp") || (is_cond_jump(last) && map_get(cfg->labels, last->args[0]) == h))
+        return false;
+    l->stores = make_vector();
+    for (int i = 0; i < vec_len(cfg->blocks); i++) {
+        if (!l->body[i])
+            continue;
+        Block* b = vec_get(cfg->blocks, i);
+        if (!dominates(cfg, h, b))
+            return false;
+        for (int k = b->begin; k < b->end; k++) {
+            Inst* inst = vec_get(cfg->insts, k);
+            if (inst->kind != INST_OP)
+                continue;
+            if (!is_simple_inst(inst) && !is_cond_jump(inst) &&
+                !(inst_is(inst, "jmp") && map_get(cfg->labels, inst->args[0])))
+                return false;
+            if (op_width(inst->op, "store") || is_rmw_op(inst->op))
+                vec_push(l->stores, inst);
+            l->written |= inst_write_mask(inst);
+            l->referenced |= inst_read_mask(inst) | inst_write_mask(inst);
+        }
+    }
+    return true;
+}
+
+// Finds the induction variables of the loop, and the values it computes.
+static bool analyze_loop(Loop* l) {
+    if (!scan_loop(l))
+        return false;
+    l->test_index = -1;
+    Block* h = l->header;
+    for (int k = h->end - 1; k >= h->begin && l->test_index < 0; k--)
+        if (is_cond_jump(vec_get(l->cfg->insts, k)))
+            l->test_index = k;
+    l->ivs = l->written & ~(reg_bit("B") | reg_bit("SP") | reg_bit("BP"));
+    do {
+        l->ivs &= ~l->bad_ivs;
+        l->bad_ivs = 0;
+        walk_loop(l);
+    } while (l->bad_ivs & l->ivs);
+    l->recording = true;
+    l->uses = make_vector();
+    l->steps = make_vector();
+    walk_loop(l);
+    return true;
+}
+
+static char* form_key(Form* f) {
+    return format("%s %d %ld %ld %s %ld %ld", f->base ? f->base : "", f->load, f->boff, f->bscale,
+                  f->iv ? f->iv : "", f->scale, f->iv ? 0 : f->c);
+}
+
+static Vector* group_uses(Loop* l) {
+    Vector* groups = make_vector();
+    Map* by_key = make_map();
+    for (int i = 0; i < vec_len(l->uses); i++) {
+        Use* u = vec_get(l->uses, i);
+        char* key = form_key(&u->form);
+        Group* g = map_get(by_key, key);
+        if (!g) {
+            g = calloc(1, sizeof(Group));
+            g->form = u->form;
+            g->uses = make_vector();
+            map_put(by_key, key, g);
+            vec_push(groups, g);
+            // The register is advanced at each step of the variable. That
+            // costs about as much as two instructions computing in A, which
+            // is what backends are good at.
+            for (int j = 0; g->form.iv && j < vec_len(l->steps); j++)
+                if (!strcmp(((Step*)vec_get(l->steps, j))->iv, g->form.iv))
+                    g->gain -= 2;
+        }
+        vec_push(g->uses, u);
+        g->gain += u->form.cost - (u->form.c == g->form.c ? 1 : 2);
+    }
+    return groups;
+}
+
+static int used_regs(Vector* insts) {
+    int r = 0;
+    for (int i = 0; i < vec_len(insts); i++) {
+        Inst* inst = vec_get(insts, i);
+        r |= inst_read_mask(inst) | inst_write_mask(inst);
+    }
+    return r;
+}
+
+// Returns a register that is not touched by the loop and whose value is
+// dead when it starts, so that the loop can have it. E to H are only
+// available if the function saves them already.
+static char* take_spare(Loop* l, int* taken, int used) {
+    for (int i = 0; i < sizeof(spares) / sizeof(*spares); i++) {
+        int bit = reg_bit(spares[i]);
+        bool saved = bit == reg_bit("C") || bit == reg_bit("D") || (used & bit);
+        if (saved && !((l->referenced | l->header->live_in | *taken) & bit)) {
+            *taken |= bit;
+            return spares[i];
+        }
+    }
+    return NULL;
+}
+
+static void emit_mul(Vector* code, char* reg, long k) {
+    if (k == 1)
+        return;
+    if (k > 0 && (k & (k - 1)) == 0)
+        vec_push(code, make_inst("shl", 2, reg, format("%d", __builtin_ctzl(k))));
+    else
+        vec_push(code, make_inst("mul", 2, reg, format("%ld", k)));
+}
+
+static void emit_base(Vector* code, char* reg, Form* f) {
+    vec_push(code, make_inst("mov", 2, reg, f->base));
+    if (f->load) {
+        if (f->boff)
+            vec_push(code, make_inst("add", 2, reg, format("%ld", f->boff)));
+        vec_push(code, make_inst(format("load%d", f->load), 2, reg, reg));
+    }
+    emit_mul(code, reg, f->bscale);
+}
+
+// Computes the value of `f` into `reg`, using `tmp` for the base.
+static void emit_form(Vector* code, char* reg, char* tmp, Form* f) {
+    if (f->iv) {
+        vec_push(code, make_inst("mov", 2, reg, f->iv));
+        emit_mul(code, reg, f->scale);
+        if (f->base) {
+            emit_base(code, tmp, f);
+            vec_push(code, make_inst("add", 2, reg, tmp));
+        }
+    } else if (f->base) {
+        emit_base(code, reg, f);
+    } else {
+        vec_push(code, make_inst("mov", 2, reg, format("%ld", f->c)));
+        return;
+    }
+    if (f->c)
+        vec_push(code, make_inst("add", 2, reg, format("%ld", f->c)));
+}
+
+// Returns true if a multiplication by k is a shift or takes k as an
+// immediate.
+static bool is_mul_imm(long k) {
+    return (k > 0 && (k & (k - 1)) == 0) || is_imm(k);
+}
+
+// Returns true if the constants that computing the value of the group and
+// stepping it put in immediate operands fit in them.
+static bool group_fits(Loop* l, Group* g) {
+    Form* f = &g->form;
+    long d;
+    if (!is_mul_imm(f->bscale) || !is_mul_imm(f->scale) || !is_imm(f->boff))
+        return false;
+    if ((f->iv || f->base) && !is_imm(f->c))
+        return false;
+    for (int j = 0; j < vec_len(g->uses); j++) {
+        Use* u = vec_get(g->uses, j);
+        if (__builtin_sub_overflow(u->form.c, f->c, &d) || !is_imm(d))
+            return false;
+    }
+    for (int j = 0; f->iv && j < vec_len(l->steps); j++) {
+        Step* s = vec_get(l->steps, j);
+        if (!strcmp(s->iv, f->iv) && (__builtin_mul_overflow(s->step, f->scale, &d) || !is_imm(d)))
+            return false;
+    }
+    return true;
+}
+
+static int cmp_gain(const void* a, const void* b) {
+    return (*(Group**)b)->gain - (*(Group**)a)->gain;
+}
+
+// Rewrites the loop, returning the number of values moved out of it.
+static int rewrite_loop(Loop* l, int used, int* nivs) {
+    Vector* groups = group_uses(l);
+    qsort(vec_body(groups), vec_len(groups), sizeof(Group*), cmp_gain);
+    Vector* pre = make_vector();
+    int n = vec_len(l->cfg->insts);
+    Vector** after = calloc(n, sizeof(Vector*));
+    int taken = 0;
+    int nvals = 0;
+    char* tmp = !(l->header->live_in & reg_bit("A")) ? "A" : !(l->header->live_in & reg_bit("B")) ? "B" : NULL;
+    for (int i = 0; i < vec_len(groups); i++) {
+        Group* g = vec_get(groups, i);
+        bool narrow_load = g->form.load && g->form.load < 64;
+        if (g->gain <= 0 && !(narrow_load && !g->form.iv))
+            continue;
+        if ((g->form.iv && g->form.base && !tmp) || !group_fits(l, g))
+            continue;
+        if (!(g->reg = take_spare(l, &taken, used)))
+            break;
+        emit_form(pre, g->reg, tmp, &g->form);
+        for (int j = 0; j < vec_len(g->uses); j++) {
+            Use* u = vec_get(g->uses, j);
+            vec_set(l->cfg->insts, u->index, make_inst("mov", 2, u->reg, g->reg));
+            if (u->form.c != g->form.c) {
+                after[u->index] = make_vector();
+                vec_push(after[u->index], make_inst("add", 2, u->reg, format("%ld", u->form.c - g->form.c)));
+            }
+        }
+        for (int j = 0; g->form.iv && j < vec_len(l->steps); j++) {
+            Step* s = vec_get(l->steps, j);
+            if (strcmp(s->iv, g->form.iv))
+                continue;
+            if (!after[s->index])
+                after[s->index] = make_vector();
+            vec_push(after[s->index], make_inst("add", 2, g->reg, format("%ld", s->step * g->form.scale)));
+        }
+        if (g->form.iv)
+            (*nivs)++;
+        else
+            nvals++;
+    }
+    if (!taken)
+        return 0;
+    Vector* insts = vec_copy(l->cfg->insts);
+    Vector* out = l->cfg->insts;
+    while (vec_len(out) > 0)
+        vec_pop(out);
+    for (int i = 0; i < n; i++) {
+        if (i == l->header->begin)
+            vec_append(out, pre);
+        vec_push(out, vec_get(insts, i));
+        if (after[i])
+            vec_append(out, after[i]);
+    }
+    return nvals + 1;
+}
+
+// Returns the loops of the graph, innermost first.
+static Vector* find_loops(Cfg* cfg) {
+    int n = vec_len(cfg->blocks);
+    Vector* loops = make_vector();
+    Loop** by_header = calloc(n, sizeof(Loop*));
+    int* work = malloc(n * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        Block* t = vec_get(cfg->blocks, i);
+        for (int j = 0; j < vec_len(t->succs); j++) {
+            Block* h = vec_get(t->succs, j);
+            if (!dominates(cfg, h, t))
+                continue;
+            Loop* l = by_header[h->id];
+            if (!l) {
+                l = by_header[h->id] = calloc(1, sizeof(Loop));
+                l->cfg = cfg;
+                l->header = h;
+                l->body = calloc(n, sizeof(bool));
+                l->body[h->id] = true;
+                l->size = 1;
+                vec_push(loops, l);
+            }
+            int nwork = 0;
+            if (!l->body[t->id]) {
+                l->body[t->id] = true;
+                l->size++;
+                work[nwork++] = t->id;
+            }
+            while (nwork > 0) {
+                Block* b = vec_get(cfg->blocks, work[--nwork]);
+                for (int k = 0; k < vec_len(b->preds); k++) {
+                    Block* p = vec_get(b->preds, k);
+                    if (!l->body[p->id]) {
+                        l->body[p->id] = true;
+                        l->size++;
+                        work[nwork++] = p->id;
+                    }
+                }
+            }
+        }
+    }
+    free(work);
+    free(by_header);
+    for (int i = 1; i < vec_len(loops); i++)
+        for (int j = i; j > 0 && ((Loop*)vec_get(loops, j - 1))->size > ((Loop*)vec_get(loops, j))->size; j--) {
+            void* t = vec_get(loops, j);
+            vec_set(loops, j, vec_get(loops, j - 1));
+            vec_set(loops, j - 1, t);
+        }
+    return loops;
+}
+
+// Optimizes one loop that is not in `done`, and returns true, or returns
+// false if there is none left.
+static bool optimize_next(Vector* insts, Map* addr_taken, Map* done, int* nloops, int* nvals, int* nivs) {
+    Cfg* cfg = make_cfg(insts, addr_taken);
+    Vector* loops = find_loops(cfg);
+    int used = used_regs(insts);
+    for (int i = 0; i < vec_len(loops); i++) {
+        Loop* l = vec_get(loops, i);
+        char* label = block_label(cfg, l->header);
+        if (!label || map_get(done, label))
+            continue;
+        map_put(done, label, (void*)1);
+        (*nloops)++;
+        if (!analyze_loop(l))
+            continue;
+        int r = rewrite_loop(l, used, nivs);
+        if (r) {
+            *nvals += r - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Unrolling
+ */
+
+// An unrolled loop has at most this many instructions.
+#define UNROLL_MAX_OPS 160
+#define UNROLL_FACTOR 4
+
+// The loop "for (; iv * 1 + c <op> bound; iv += step)", where op is the
+// comparison that exits, iv is in a register and bound is invariant.
+typedef struct {
+    Block* latch;
+    char* iv;
+    long c;
+    char* op;
+    Form bound;
+    long step;
+    char* reg;  // The register compared, holding iv + c
+} Counted;
+
+static bool compare(char* op, long x, long y) {
+    if (!strcmp(op, "eq")) return x == y;
+    if (!strcmp(op, "ne")) return x != y;
+    if (!strcmp(op, "lt")) return x < y;
+    if (!strcmp(op, "le")) return x <= y;
+    if (!strcmp(op, "gt")) return x > y;
+    return x >= y;
+}
+
+static char* swap_comparison(char* op) {
+    if (!strcmp(op, "lt")) return "gt";
+    if (!strcmp(op, "le")) return "ge";
+    if (!strcmp(op, "gt")) return "lt";
+    if (!strcmp(op, "ge")) return "le";
+    return op;
+}
+
+static Block* find_block(Cfg* cfg, int index) {
+    for (int i = 0; i < vec_len(cfg->blocks); i++) {
+        Block* b = vec_get(cfg->blocks, i);
+        if (b->begin <= index && index < b->end)
+            return b;
+    }
+    return NULL;
+}
+
+// Returns true if the loop is laid out as its header, its other blocks in
+// an order where jumps go forward, and a single latch jumping back, and
+// its labels are used only inside it.
+static bool is_straight(Loop* l, Map* addr_taken, Block** latch) {
+    Cfg* cfg = l->cfg;
+    Block* h = l->header;
+    int last = h->id + l->size - 1;
+    if (last >= vec_len(cfg->blocks))
+        return false;
+    for (int i = h->id; i <= last; i++) {
+        Block* b = vec_get(cfg->blocks, i);
+        if (!l->body[i])
+            return false;
+        for (int j = 0; j < vec_len(b->succs); j++) {
+            Block* s = vec_get(b->succs, j);
+            if (l->body[s->id] && s->id <= i && !(i == last && s == h))
+                return false;
+        }
+    }
+    *latch = vec_get(cfg->blocks, last);
+    Inst* jump = block_last(cfg, *latch);
+    if (*latch == h || !inst_is(jump, "jmp") || map_get(cfg->labels, jump->args[0]) != h)
+        return false;
+    int begin = h->begin, end = (*latch)->end;
+    Map* inside = make_map();
+    for (int k = begin; k < end; k++) {
+        Inst* inst = vec_get(cfg->insts, k);
+        if (inst->kind != INST_LABEL)
+            continue;
+        if (map_get(addr_taken, inst->op))
+            return false;
+        map_put(inside, inst->op, (void*)1);
+    }
+    for (int k = 0; k < vec_len(cfg->insts); k++) {
+        Inst* inst = vec_get(cfg->insts, k);
+        for (int j = 0; (k < begin || k >= end) && inst->kind == INST_OP && j < inst->nargs; j++)
+            if (map_get(inside, inst->args[j]))
+                return false;
+    }
+    return true;
+}
+
+// Recognizes a loop whose header exits when an induction variable,
+// stepped once per iteration after the test, reaches an invariant bound.
+static bool is_counted(Loop* l, Map* addr_taken, Counted* r) {
+    Cfg* cfg = l->cfg;
+    if (l->test_index < 0 || !is_straight(l, addr_taken, &r->latch))
+        return false;
+    Inst* test = vec_get(cfg->insts, l->test_index);
+    Block* exit = map_get(cfg->labels, test->args[0]);
+    if (!exit || l->body[exit->id] || !l->test_known[0] || !l->test_known[1])
+        return false;
+    int i = l->test[0].iv ? 0 : 1;
+    Form* x = &l->test[i];
+    Form* y = &l->test[1 - i];
+    if (!x->iv || x->base || x->scale != 1 || y->iv || !is_reg(test->args[i + 1]))
+        return false;
+    r->iv = x->iv;
+    r->c = x->c;
+    r->op = i ? swap_comparison(test->op + 1) : test->op + 1;
+    r->bound = *y;
+    r->reg = test->args[i + 1];
+    r->step = 0;
+    for (int j = 0; j < vec_len(l->steps); j++) {
+        Step* s = vec_get(l->steps, j);
+        if (strcmp(s->iv, r->iv))
+            continue;
+        Block* b = find_block(cfg, s->index);
+        if (r->step || b == l->header || !dominates(cfg, b, r->latch))
+            return false;
+        r->step = s->step;
+    }
+    return r->step != 0;
+}
+
+// Returns the value `reg` has when the loop is entered, if the block
+// before it sets it to a constant.
+static bool entry_value(Loop* l, char* reg, long* val) {
+    Cfg* cfg = l->cfg;
+    Block* pre = vec_get(cfg->blocks, l->header->id - 1);
+    long v[NREGS] = { 0 };
+    bool known[NREGS] = { 0 };
+    for (int k = pre->begin; k < pre->end; k++) {
+        Inst* inst = vec_get(cfg->insts, k);
+        if (inst->kind != INST_OP)
+            continue;
+        int d = inst->nargs ? reg_index(inst->args[0]) : -1;
+        int s = (inst->nargs > 1) ? reg_index(inst->args[1]) : -1;
+        long c = 0;
+        bool has_src = (s >= 0 && known[s]) || (inst->nargs > 1 && is_imm_arg(inst->args[1], &c));
+        if (s >= 0 && known[s])
+            c = v[s];
+        int writes = inst_write_mask(inst);
+        bool ok = d >= 0 && writes == (1 << d);
+        if (ok && inst_is(inst, "mov") && has_src)
+            v[d] = c;
+        else if (ok && inst_is(inst, "add") && known[d] && has_src)
+            v[d] = (unsigned long)v[d] + c;
+        else if (ok && inst_is(inst, "sub") && known[d] && has_src)
+            v[d] = (unsigned long)v[d] - c;
+        else if (ok && inst_is(inst, "icrop32") && known[d])
+            v[d] = (int)v[d];
+        else
+            ok = false;
+        for (int r = 0; r < NREGS; r++)
+            if (writes & (1 << r))
+                known[r] = ok;
+    }
+    int r = reg_index(reg);
+    *val = v[r];
+    return known[r];
+}
+
+// Returns the number of times the loop body runs, or -1 if it is not a
+// constant or larger than `limit`.
+static int trip_count(Loop* l, Counted* c, int limit) {
+    long v;
+    if (!is_const_form(&c->bound) || !entry_value(l, c->iv, &v))
+        return -1;
+    for (int n = 0; n <= limit; n++) {
+        if (compare(c->op, (unsigned long)v + c->c, c->bound.c))
+            return n;
+        v = (unsigned long)v + c->step;
+    }
+    return -1;
+}
+
+static int count_ops(Vector* insts, int begin, int end) {
+    int r = 0;
+    for (int k = begin; k < end; k++)
+        if (((Inst*)vec_get(insts, k))->kind == INST_OP)
+            r++;
+    return r;
+}
+
+static Inst* copy_inst(Inst* inst, Map* labels) {
+    if (inst->kind == INST_NOTE)
+        return inst;
+    Inst* r = malloc(sizeof(Inst));
+    *r = *inst;
+    r->text = NULL;
+    if (inst->kind == INST_LABEL) {
+        char* label = map_get(labels, inst->op);
+        if (!label) {
+            label = make_label();
+            map_put(labels, inst->op, label);
+        }
+        r->op = label;
+    }
+    return r;
+}
+
+// Appends a copy of the loop from its header to `end`, with fresh labels,
+// leaving out the header's test and the jump back to the header. Labels
+// nothing jumps to are left out too, so that they do not split the code
+// into blocks for the peephole optimizer. Returns the labels of the copy.
+static Map* copy_iteration(Vector* out, Loop* l, Counted* c, int end, char* keep) {
+    Vector* insts = l->cfg->insts;
+    Map* used = make_map();
+    for (int k = l->header->begin; k < c->latch->end - 1; k++) {
+        Inst* inst = vec_get(insts, k);
+        for (int j = 0; inst->kind == INST_OP && j < inst->nargs; j++)
+            map_put(used, inst->args[j], (void*)1);
+    }
+    if (keep)
+        map_put(used, keep, (void*)1);
+    Map* labels = make_map();
+    int begin = vec_len(out);
+    for (int k = l->header->begin; k < end; k++) {
+        Inst* inst = vec_get(insts, k);
+        if (k == l->test_index || k == c->latch->end - 1)
+            continue;
+        if (inst->kind != INST_LABEL || map_get(used, inst->op))
+            vec_push(out, copy_inst(inst, labels));
+    }
+    for (int k = begin; k < vec_len(out); k++) {
+        Inst* inst = vec_get(out, k);
+        for (int j = 0; inst->kind == INST_OP && j < inst->nargs; j++) {
+            char* label = map_get(labels, inst->args[j]);
+            if (label)
+                inst->args[j] = label;
+        }
+    }
+    return labels;
+}
+
+static void replace_loop(Loop* l, Counted* c, Vector* code) {
+    Vector* insts = l->cfg->insts;
+    Vector* rest = make_vector();
+    for (int k = c->latch->end; k < vec_len(insts); k++)
+        vec_push(rest, vec_get(insts, k));
+    while (vec_len(insts) > l->header->begin)
+        vec_pop(insts);
+    vec_append(insts, code);
+    vec_append(insts, rest);
+}
+
+// Replaces the loop by `trips` copies of its body, without the tests.
+static void unroll_fully(Loop* l, Counted* c, int trips) {
+    Inst* test = vec_get(l->cfg->insts, l->test_index);
+    Vector* code = make_vector();
+    for (int i = 0; i < trips; i++)
+        copy_iteration(code, l, c, c->latch->end, NULL);
+    copy_iteration(code, l, c, l->test_index, NULL);
+    vec_push(code, make_inst("jmp", 1, test->args[0]));
+    replace_loop(l, c, code);
+}
+
+// Header instructions are run again by the unrolled loop's test, so they
+// must not store to memory or depend on their own results.
+static bool is_repeatable_header(Loop* l) {
+    Block* h = l->header;
+    for (int k = h->begin; k < h->end; k++) {
+        Inst* inst = vec_get(l->cfg->insts, k);
+        if (inst->kind != INST_OP)
+            continue;
+        if (op_width(inst->op, "store") || is_rmw_op(inst->op) || (inst_write_mask(inst) & h->live_in))
+            return false;
+    }
+    return true;
+}
+
+// Puts a loop running `factor` copies of the body in front of the loop,
+// which runs the iterations that are left. The copies are entered if
+// the last of them would not exit yet; the step has to move the variable
+// towards the bound, so that the ones before would not either.
+static bool unroll_partially(Loop* l, Counted* c, int factor, char** label) {
+    Cfg* cfg = l->cfg;
+    Inst* test = vec_get(cfg->insts, l->test_index);
+    Block* body = vec_get(cfg->blocks, l->header->id + 1);
+    bool up = !strcmp(c->op, "ge") || !strcmp(c->op, "gt");
+    bool down = !strcmp(c->op, "le") || !strcmp(c->op, "lt");
+    int bit = reg_bit(c->reg);
+    if (!(up ? c->step > 0 : down && c->step < 0) || !strcmp(c->reg, c->iv))
+        return false;
+    if (((l->header->live_in | body->live_in) & bit) || !is_repeatable_header(l))
+        return false;
+    if (!is_imm(c->step * (factor - 1)))
+        return false;
+    Vector* code = make_vector();
+    char* header = block_label(cfg, l->header);
+    *label = map_get(copy_iteration(code, l, c, l->test_index, header), header);
+    vec_push(code, make_inst("add", 2, c->reg, format("%ld", c->step * (factor - 1))));
+    vec_push(code, make_inst(test->op, 3, block_label(cfg, l->header), test->args[1], test->args[2]));
+    for (int i = 0; i < factor; i++)
+        copy_iteration(code, l, c, c->latch->end, NULL);
+    vec_push(code, make_inst("jmp", 1, *label));
+    for (int k = l->header->begin; k < c->latch->end; k++)
+        vec_push(code, vec_get(cfg->insts, k));
+    replace_loop(l, c, code);
+    return true;
+}
+
+// Unrolls one loop that is not in `done`, and returns true, or returns
+// false if there is none left.
+static bool unroll_next(Vector* insts, Map* addr_taken, Map* done, int* nfull, int* npartial) {
+    Cfg* cfg = make_cfg(insts, addr_taken);
+    Vector* loops = find_loops(cfg);
+    for (int i = 0; i < vec_len(loops); i++) {
+        Loop* l = vec_get(loops, i);
+        char* label = block_label(cfg, l->header);
+        if (!label || map_get(done, label))
+            continue;
+        map_put(done, label, (void*)1);
+        Counted c;
+        if (!analyze_loop(l) || !is_counted(l, addr_taken, &c))
+            continue;
+        int ops = count_ops(insts, l->header->begin, c.latch->end);
+        int trips = trip_count(l, &c, UNROLL_MAX_OPS / ops);
+        if (trips >= 0) {
+            unroll_fully(l, &c, trips);
+            (*nfull)++;
+            return true;
+        }
+        for (int factor = UNROLL_FACTOR; factor > 1; factor /= 2) {
+            char* copy;
+            if (factor * ops <= UNROLL_MAX_OPS && unroll_partially(l, &c, factor, &copy)) {
+                map_put(done, copy, (void*)1);
+                (*npartial)++;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool optimize_loops(Vector* insts, Map* addr_taken, char* fname) {
+    int nfull = 0, npartial = 0;
+    bool changed = false;
+    Map* done = make_map();
+    if (pass_enabled(PASS_UNROLL_LOOPS)) {
+        pass_start(PASS_UNROLL_LOOPS);
+        while (unroll_next(insts, addr_taken, done, &nfull, &npartial))
+            changed = true;
+        pass_stop(PASS_UNROLL_LOOPS);
+    }
+    done = make_map();
+    int nloops = 0, nvals = 0, nivs = 0;
+    if (pass_enabled(PASS_LOOPS)) {
+        pass_start(PASS_LOOPS);
+        while (optimize_next(insts, addr_taken, done, &nloops, &nvals, &nivs))
+            changed = true;
+        pass_stop(PASS_LOOPS);
+    }
+    if (stats_loops)
+        fprintf(stderr, "loops: %s: %d loops, %d invariants hoisted, %d induction variables reduced, "
+                "%d unrolled, %d partially unrolled\n", fname, nloops, nvals, nivs, nfull, npartial);
+    return changed;
+}
@@ -0,0 +1,526 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Local value numbering.
+//
+// The code generator evaluates every expression from scratch, so the same
+// address computation is repeated for each field of a struct that is
+// accessed, the same scaled index for each a[i], and a local that has
+// just been stored is loaded right back. This pass numbers the values
+// computed within a basic block so that two computations with the same
+// operands get the same number, and rewrites an instruction whose value
+// is already at hand:
+//
+//   - if the destination register already holds it, it is deleted;
+//   - if it is a known constant, it becomes "mov dst, imm";
+//   - if another register holds it, it becomes "mov dst, reg";
+//   - if it was computed earlier but then overwritten, a copy is kept in
+//     a register that is unused in between and it is taken from there.
+//
+// Values are tracked as offsets from a root value, so "mov A, BP;
+// add A, -8" and "[BP-8]" name the same address. Loads are numbered by
+// the memory they read: a store records the value it wrote, and drops
+// what was known about memory it may overwrite. Popping the stack drops
+// what was known below SP, which the backends use as scratch space.
+// Different labels never overlap each other or the stack; anything else
+// reached through a pointer may overlap everything. Calls and other
+// jumps end the block, and with them everything that was known.
+//
+// The dead code this leaves behind is removed by the peephole optimizer,
+// which runs this pass.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers/lvn.h"
+
+bool stats_lvn = false;
+
+static char* regs[] = { "A", "B", "C", "D", "E", "F", "G", "H", "SP", "BP" };
+#define NREGS (sizeof(regs) / sizeof(*regs))
+
+// Registers tried, in order, to keep a copy of a value in.
+static char* spares[] = { "D", "C", "A", "B", "E", "F", "G", "H" };
+
+typedef struct {
+    int root;       // This value is root + off
+    long off;
+    bool is_const;  // Roots only: the value is off
+    bool is_object; // Roots only: the address of a label or the frame
+    int sext;       // Known to be sign-extended from this many bits, or 0
+    int def;        // Index of the instruction that computed it, or -1
+    char* defreg;
+} Value;
+
+// A range of memory known to hold a value.
+typedef struct {
+    int root;
+    long off;
+    int size;
+    int val;
+} Slot;
+
+typedef struct {
+    Vector* insts;
+    Vector* values;
+    Map* exprs;
+    Vector* slots;
+    int reg[NREGS];
+    // The last index at which the pass relied on what a register holds.
+    int busy[NREGS];
+    bool used[NREGS];
+    Inst** copies;
+    int* recomputed;
+    bool counting;
+    int nremoved, nconst, nmoved, ncopies;
+} LVN;
+
+static int reg_index(char* s) {
+    for (int i = 0; i < NREGS; i++)
+        if (!strcmp(s, regs[i]))
+            return i;
+    return -1;
+}
+
+static Value* value(LVN* l, int v) {
+    return vec_get(l->values, v);
+}
+
+static int new_value(LVN* l) {
+    Value* val = calloc(1, sizeof(Value));
+    int v = vec_len(l->values);
+    val->root = v;
+    val->def = -1;
+    vec_push(l->values, val);
+    return v;
+}
+
+// Returns the value for `key`, creating a new one if it is not known yet.
+static int lookup(LVN* l, char* key, bool* found) {
+    intptr_t v = (intptr_t)map_get(l->exprs, key);
+    *found = (v != 0);
+    if (*found)
+        return v - 1;
+    v = new_value(l);
+    map_put(l->exprs, key, (void*)(v + 1));
+    return v;
+}
+
+static int const_value(LVN* l, long c) {
+    bool found;
+    int v = lookup(l, format("#%ld", c), &found);
+    if (!found) {
+        value(l, v)->is_const = true;
+        value(l, v)->off = c;
+    }
+    return v;
+}
+
+static bool is_const(LVN* l, int v, long* c) {
+    Value* val = value(l, v);
+    if (val->is_const)
+        *c = val->off;
+    return val->is_const;
+}
+
+// Returns the value root + off.
+static int offset_value(LVN* l, int root, long off) {
+    if (value(l, root)->is_const)
+        return const_value(l, value(l, root)->off + off);
+    if (off == 0)
+        return root;
+    bool found;
+    int v = lookup(l, format("@%d%+ld", root, off), &found);
+    value(l, v)->root = root;
+    value(l, v)->off = off;
+    return v;
+}
+
+static int label_value(LVN* l, char* name) {
+    bool found;
+    int v = lookup(l, format("&%s", name), &found);
+    value(l, v)->is_object = true;
+    return v;
+}
+
+// Returns the value of a register, immediate or label operand.
+static int operand_value(LVN* l, char* s) {
+    long c;
+    if (is_reg(s))
+        return l->reg[reg_index(s)];
+    if (is_imm_arg(s, &c))
+        return const_value(l, c);
+    return label_value(l, s);
+}
+
+static void reset(LVN* l) {
+    l->values = make_vector();
+    l->exprs = make_map();
+    l->slots = make_vector();
+    for (int i = 0; i < NREGS; i++) {
+        l->reg[i] = new_value(l);
+        l->busy[i] = -1;
+    }
+    value(l, l->reg[reg_index("SP")])->is_object = true;
+    value(l, l->reg[reg_index("BP")])->is_object = true;
+}
+
+static long sign_extend(long c, int bits) {
+    if (bits >= 64)
+        return c;
+    unsigned long m = 1UL << (bits - 1);
+    unsigned long u = (unsigned long)c & ((1UL << bits) - 1);
+    return (long)((u ^ m) - m);
+}
+
+static bool fold(char* op, long a, long b, long* r) {
+    unsigned long ua = a, ub = b;
+    if (!strcmp(op, "add")) *r = ua + ub;
+    else if (!strcmp(op, "sub")) *r = ua - ub;
+    else if (!strcmp(op, "mul")) *r = ua * ub;
+    else if (!strcmp(op, "and")) *r = a & b;
+    else if (!strcmp(op, "or")) *r = a | b;
+    else if (!strcmp(op, "xor")) *r = a ^ b;
+    else if (!strcmp(op, "shl")) *r = ua << (b & 63);
+    else if (!strcmp(op, "shr")) *r = ua >> (b & 63);
+    else if (!strcmp(op, "sar")) *r = a >> (b & 63);
+    else if (!strcmp(op, "eq")) *r = a == b;
+    else if (!strcmp(op, "ne")) *r = a != b;
+    else if (!strcmp(op, "lt")) *r = a < b;
+    else if (!strcmp(op, "le")) *r = a <= b;
+    else if (!strcmp(op, "gt")) *r = a > b;
+    else if (!strcmp(op, "ge")) *r = a >= b;
+    else return false;
+    return true;
+}
+
+static bool is_commutative(char* op) {
+    return !strcmp(op, "add") || !strcmp(op, "mul") || !strcmp(op, "and") ||
+        !strcmp(op, "or") || !strcmp(op, "xor") || !strcmp(op, "eq") || !strcmp(op, "ne");
+}
+
+static int binary_value(LVN* l, char* op, int a, int b) {
+    long x, y, r;
+    bool ca = is_const(l, a, &x), cb = is_const(l, b, &y);
+    if (ca && cb && fold(op, x, y, &r))
+        return const_value(l, r);
+    if (!strcmp(op, "add") && ca) {
+        int t = a; a = b; b = t;
+        cb = ca; y = x;
+    }
+    if ((!strcmp(op, "add") || !strcmp(op, "sub")) && cb) {
+        Value* val = value(l, a);
+        return offset_value(l, val->root, val->off + (!strcmp(op, "add") ? y : -y));
+    }
+    if (is_commutative(op) && a > b) {
+        int t = a; a = b; b = t;
+    }
+    bool found;
+    return lookup(l, format("%s %d %d", op, a, b), &found);
+}
+
+static int unary_value(LVN* l, char* op, int a) {
+    long c;
+    int bits = op_width(op, "icrop");
+    if (bits) {
+        if (is_const(l, a, &c))
+            return const_value(l, sign_extend(c, bits));
+        if (value(l, a)->sext && value(l, a)->sext <= bits)
+            return a;
+    } else if ((bits = op_width(op, "crop")) != 0) {
+        if (is_const(l, a, &c))
+            return const_value(l, bits >= 64 ? c : (long)((unsigned long)c & ((1UL << bits) - 1)));
+    } else if (is_const(l, a, &c)) {
+        return const_value(l, ~c);
+    }
+    bool found;
+    int v = lookup(l, format("%s %d", op, a), &found);
+    if (!found && op_width(op, "icrop"))
+        value(l, v)->sext = bits;
+    return v;
+}
+
+// Splits a memory operand or address register into a root value and an
+// offset.
+static void address(LVN* l, char* s, int* root, long* off) {
+    int base;
+    if (is_mem_arg(s)) {
+        char* name = mem_base(s);
+        base = operand_value(l, name);
+        char* p = s + 1 + strlen(name);
+        *off = (*p == ']') ? 0 : strtol(p, NULL, 10);
+    } else {
+        base = operand_value(l, s);
+        *off = 0;
+    }
+    *root = value(l, base)->root;
+    *off += value(l, base)->off;
+}
+
+static bool may_overlap(LVN* l, Slot* s, int root, long off, int size) {
+    if (s->root == root)
+        return s->off < off + size && off < s->off + s->size;
+    return !value(l, s->root)->is_object || !value(l, root)->is_object;
+}
+
+static Slot* find_slot(LVN* l, int root, long off, int size) {
+    for (int i = 0; i < vec_len(l->slots); i++) {
+        Slot* s = vec_get(l->slots, i);
+        if (s->root == root && s->off == off && s->size == size)
+            return s;
+    }
+    return NULL;
+}
+
+// Forgets what was known about the memory a store may write.
+static void clobber(LVN* l, int root, long off, int size) {
+    Vector* slots = make_vector();
+    for (int i = 0; i < vec_len(l->slots); i++) {
+        Slot* s = vec_get(l->slots, i);
+        if (!may_overlap(l, s, root, off, size))
+            vec_push(slots, s);
+    }
+    l->slots = slots;
+}
+
+// Memory below SP is scratch space that the backends push to, so nothing
+// is known about what SP moved above. `old` is the value SP had.
+static void forget_below_sp(LVN* l, int old) {
+    Value* sp = value(l, l->reg[reg_index("SP")]);
+    int root = value(l, old)->root;
+    Vector* slots = make_vector();
+    for (int i = 0; i < vec_len(l->slots); i++) {
+        Slot* s = vec_get(l->slots, i);
+        if (s->root != root || (sp->root == root && s->off >= sp->off))
+            vec_push(slots, s);
+    }
+    l->slots = slots;
+}
+
+static void add_slot(LVN* l, int root, long off, int size, int val) {
+    Slot* s = malloc(sizeof(Slot));
+    *s = (Slot){ root, off, size, val };
+    vec_push(l->slots, s);
+}
+
+static bool is_block_end(Inst* inst) {
+    return !inst || inst->kind != INST_OP || (!is_simple_inst(inst) && !is_cond_jump(inst));
+}
+
+// A jump to a function or through a register: a call or a return. C and
+// D do not survive calls, and nothing reads them after a return.
+static bool is_call_or_return(Inst* inst) {
+    return inst_is(inst, "jmp") && inst->args[0][0] != '.';
+}
+
+// Can `reg` be written right after index i and read at index k, without
+// changing what the code does?
+static bool is_spare(LVN* l, int i, int k, char* reg) {
+    int r = reg_index(reg);
+    if (l->busy[r] >= i)
+        return false;
+    if (!l->used[r])
+        return strcmp(reg, "E") && strcmp(reg, "F") && strcmp(reg, "G") && strcmp(reg, "H");
+    for (int j = i; j < k; j++) {
+        Inst* inst = vec_get(l->insts, j);
+        if (l->copies[j] && !strcmp(l->copies[j]->args[0], reg))
+            return false;
+        if (j == i || !inst || inst->kind == INST_NOTE)
+            continue;
+        if (is_block_end(inst) || is_cond_jump(inst) || inst_reads(inst, reg) || inst_writes(inst, reg))
+            return false;
+    }
+    // The value the register held must be dead.
+    for (int j = ir_next(l->insts, k); j >= 0; j = ir_next(l->insts, j)) {
+        Inst* inst = vec_get(l->insts, j);
+        if (is_call_or_return(inst))
+            return !strcmp(reg, "C") || !strcmp(reg, "D");
+        if (!is_simple_inst(inst) || inst_reads(inst, reg))
+            return false;
+        if (inst_writes(inst, reg))
+            return true;
+    }
+    return false;
+}
+
+// Returns true if the instruction at k reads its destination as computed
+// by an instruction after i, which then dies with it.
+static bool has_feeder(LVN* l, int i, int k) {
+    Inst* inst = vec_get(l->insts, k);
+    char* dst = inst->args[0];
+    if (!inst_reads(inst, dst))
+        return false;
+    for (int j = ir_prev(l->insts, k); j > i; j = ir_prev(l->insts, j)) {
+        Inst* prev = vec_get(l->insts, j);
+        if (!prev)
+            continue;
+        if (inst_writes(prev, dst))
+            return !op_width(prev->op, "store") && !is_rmw_op(prev->op);
+        if (inst_reads(prev, dst))
+            return false;
+    }
+    return false;
+}
+
+// Keeping a copy takes an instruction. It pays off if the value is
+// recomputed more than once or with more than one instruction, or by a
+// load that has to be sign-extended, which the ROP backend turns into
+// dozens of gadgets.
+static char* keep_copy(LVN* l, Value* val, int k, char* dst) {
+    int i = val->def;
+    if (i < 0 || l->copies[i])
+        return NULL;
+    if (l->counting) {
+        l->recomputed[i]++;
+        return NULL;
+    }
+    Inst* inst = vec_get(l->insts, k);
+    bool narrow = op_width(inst->op, "load") && !inst_is(inst, "load64");
+    if (l->recomputed[i] < 2 && !narrow && !has_feeder(l, i, k))
+        return NULL;
+    for (int j = 0; j < sizeof(spares) / sizeof(*spares); j++) {
+        char* reg = spares[j];
+        if (strcmp(reg, val->defreg) && strcmp(reg, dst) && is_spare(l, i, k, reg)) {
+            l->copies[i] = make_inst("mov", 2, reg, val->defreg);
+            l->busy[reg_index(reg)] = k;
+            return reg;
+        }
+    }
+    return NULL;
+}
+
+static void rewrite(LVN* l, int k, Inst* inst, int* count) {
+    if (l->counting)
+        return;
+    vec_set(l->insts, k, inst);
+    (*count)++;
+}
+
+// The instruction at k computes `v` into `dst`.
+static void define(LVN* l, int k, char* dst, int v) {
+    Inst* inst = vec_get(l->insts, k);
+    int d = reg_index(dst);
+    Value* val = value(l, v);
+    long c;
+    if (l->reg[d] == v) {
+        rewrite(l, k, NULL, &l->nremoved);
+        l->busy[d] = k;
+        return;
+    }
+    l->reg[d] = v;
+    if (inst_is(inst, "mov"))
+        return;
+    if (is_const(l, v, &c)) {
+        rewrite(l, k, make_inst("mov", 2, dst, format("%ld", c)), &l->nconst);
+        return;
+    }
+    for (int r = 0; r < NREGS; r++) {
+        if (r != d && l->reg[r] == v) {
+            rewrite(l, k, make_inst("mov", 2, dst, regs[r]), &l->nmoved);
+            l->busy[r] = k;
+            return;
+        }
+    }
+    char* reg = keep_copy(l, val, k, dst);
+    if (reg) {
+        rewrite(l, k, make_inst("mov", 2, dst, reg), &l->ncopies);
+        l->reg[reg_index(reg)] = v;
+        return;
+    }
+    val->def = k;
+    val->defreg = dst;
+}
+
+static void number_inst(LVN* l, int k) {
+    Inst* inst = vec_get(l->insts, k);
+    char* op = inst->op;
+    int root, size;
+    long off;
+    if (!strcmp(op, "mov")) {
+        define(l, k, inst->args[0], operand_value(l, inst->args[1]));
+    } else if (!strcmp(op, "not") || is_crop_op(op)) {
+        define(l, k, inst->args[0], unary_value(l, op, l->reg[reg_index(inst->args[0])]));
+    } else if (is_arith_op(op)) {
+        int a = l->reg[reg_index(inst->args[0])];
+        define(l, k, inst->args[0], binary_value(l, op, a, operand_value(l, inst->args[1])));
+    } else if ((size = op_width(op, "load") / 8) != 0) {
+        address(l, inst->args[1], &root, &off);
+        if (is_mem_arg(inst->args[1]))
+            l->reg[reg_index("B")] = new_value(l);
+        Slot* s = find_slot(l, root, off, size);
+        int v;
+        if (s) {
+            v = s->val;
+        } else {
+            v = new_value(l);
+            value(l, v)->sext = size * 8;
+            add_slot(l, root, off, size, v);
+        }
+        define(l, k, inst->args[0], v);
+    } else if ((size = op_width(op, "store") / 8) != 0) {
+        address(l, inst->args[1], &root, &off);
+        int src = l->reg[reg_index(inst->args[0])];
+        int v = (size == 8) ? src : unary_value(l, format("icrop%d", size * 8), src);
+        Slot* s = find_slot(l, root, off, size);
+        if (s && s->val == v) {
+            rewrite(l, k, NULL, &l->nremoved);
+            return;
+        }
+        clobber(l, root, off, size);
+        add_slot(l, root, off, size, v);
+        if (is_mem_arg(inst->args[1]))
+            l->reg[reg_index("B")] = new_value(l);
+    } else {
+        assert(is_rmw_op(op));
+        address(l, inst->args[0], &root, &off);
+        size = (op_width(op, "addm") ? op_width(op, "addm") : op_width(op, "subm")) / 8;
+        clobber(l, root, off, size);
+        l->reg[reg_index("B")] = new_value(l);
+    }
+}
+
+static void insert_copies(LVN* l) {
+    Vector* insts = vec_copy(l->insts);
+    while (vec_len(l->insts) > 0)
+        vec_pop(l->insts);
+    for (int i = 0; i < vec_len(insts); i++) {
+        vec_push(l->insts, vec_get(insts, i));
+        if (l->copies[i])
+            vec_push(l->insts, l->copies[i]);
+    }
+}
+
+bool number_values(Vector* insts, char* fname) {
+    LVN l = { .insts = insts };
+    l.copies = calloc(vec_len(insts) + 1, sizeof(Inst*));
+    for (int i = 0; i < vec_len(insts); i++) {
+        Inst* inst = vec_get(insts, i);
+        for (int r = 0; r < NREGS; r++)
+            if (inst && (inst_reads(inst, regs[r]) || inst_writes(inst, regs[r])))
+                l.used[r] = true;
+    }
+    // The first run only counts how often each value is recomputed, which
+    // keep_copy needs to know before the second run rewrites anything.
+    l.recomputed = calloc(vec_len(insts), sizeof(int));
+    for (int run = 0; run < 2; run++) {
+        l.counting = (run == 0);
+        reset(&l);
+        for (int i = 0; i < vec_len(insts); i++) {
+            Inst* inst = vec_get(insts, i);
+            if (!inst || inst->kind == INST_NOTE || is_cond_jump(inst))
+                continue;
+            if (is_simple_inst(inst)) {
+                int sp = l.reg[reg_index("SP")];
+                number_inst(&l, i);
+                if (l.reg[reg_index("SP")] != sp)
+                    forget_below_sp(&l, sp);
+            } else
+                reset(&l);
+        }
+    }
+    insert_copies(&l);
+    ir_compact(insts);
+    if (stats_lvn)
+        fprintf(stderr, "lvn: %s: %d removed, %d constants, %d moved, %d copies kept\n",
+                fname, l.nremoved, l.nconst, l.nmoved, l.ncopies);
+    return l.nremoved + l.nconst + l.nmoved + l.ncopies > 0;
+}
@@ -33,11 +33,29 @@ static void usage(int exitcode) {
             "  -fdump-ast        print AST\n"
             "  -fdump-stack      Print stacktrace\n"
             "  -fno-dump-source  Do not emit source code as assembly comment\n"
+            "  -fstats-regalloc  Print per-function temporary spill counts\n"
+            "  -fstats-frame     Print per-function frame sizes\n"
+            "  -fstats-peephole  Print per-function peephole rule hit counts\n"
+            "  -fstats-inline    Print the calls that were inlined\n"
+            "  -fstats-eval      Print the calls that were evaluated at compile time\n"
+            "  -fstats-lvn       Print per-function value numbering counts\n"
+            "  -fstats-loops     Print per-function loop optimization counts\n"
+            "  -fstats-sccp      Print per-function constant propagation counts\n"
+            "  -fstats-dse       Print per-function dead store counts\n"
+            "  -fstats-fpo       Print per-function frame pointer omission results\n"
+            "  -f[no-]<pass>     Enable or disable an optimization pass: fold, eval,\n"
+            "                    inline, regalloc, mem2reg, immediates,\n"
+            "                    strength-reduce, elide-crops, fuse-branches,\n"
+            "                    mem-operands, switch-tables, share-slots,\n"
+            "                    tail-calls, dce, peephole, lvn, sccp, dse, loops,\n"
+            "                    unroll-loops, omit-frame-pointer\n"
+            "  -ftime-passes     Print the time spent in each optimization pass\n"
+            "  -finline-limit=<n> Inline functions of up to n AST nodes (0 disables)\n"
             "  -o filename       Output to the specified file\n"
             "  -g                Do nothing at this moment\n"
             "  -Wall             Enable all warnings\n"
             "  -Werror           Make all warnings into errors\n"
-            "  -O<number>        Does nothing at this moment\n"
+            "  -O<0|1|2|3|s>     Set the optimization level (default 0)\n"
             "  -m64              Output 64-bit code (default)\n"
             "  -w                Disable all warnings\n"
             "  -h                print this help\n"
@@ -95,7 +113,33 @@ static void parse_f_arg(char *s) {
         dumpstack = true;
     else if (!strcmp(s, "no-dump-source"))
         dumpsource = false;
-    else
+    else if (!strcmp(s, "stats-regalloc"))
+        stats_regalloc = true;
+    else if (!strcmp(s, "stats-frame"))
+        stats_frame = true;
+    else if (!strcmp(s, "stats-peephole"))
+        stats_peephole = true;
+    else if (!strcmp(s, "stats-inline"))
+        stats_inline = true;
+    else if (!strcmp(s, "stats-eval"))
+        stats_eval = true;
+    else if (!strcmp(s, "stats-lvn"))
+        stats_lvn = true;
+    else if (!strcmp(s, "stats-loops"))
+        stats_loops = true;
+    else if (!strcmp(s, "stats-sccp"))
+        stats_sccp = true;
+    else if (!strcmp(s, "stats-dse"))
+        stats_dse = true;
+    else if (!strcmp(s, "stats-fpo"))
+        stats_fpo = true;
+    else if (!strcmp(s, "time-passes"))
+        time_passes = true;
+    else if (!strncmp(s, "inline-limit=", 13))
+        inline_limit = atoi(s + 13);
+    else if (!strncmp(s, "no-", 3) && set_pass(s + 3, false))
+        ;
+    else if (!set_pass(s, true))
         usage(1);
 }
 
@@ -107,7 +151,7 @@ static void parse_m_arg(char *s) {
 static void parseopt(int argc, char **argv) {
     cppdefs = make_buffer();
     for (;;) {
-        int opt = getopt(argc, argv, "I:ED:O:SU:W:acd:f:gm:o:hw");
+        int opt = getopt(argc, argv, "I:ED:O::SU:W:acd:f:gm:o:hw");
         if (opt == -1)
             break;
         switch (opt) {
@@ -120,7 +164,7 @@ static void parseopt(int argc, char **argv) {
             buf_printf(cppdefs, "#define %s\n", optarg);
             break;
         }
-        case 'O': break;
+        case 'O': set_opt_level(optarg); break;
         case 'S': dumpasm = true; break;
         case 'U':
             buf_printf(cppdefs, "#undef %s\n", optarg);
@@ -188,6 +232,8 @@ int main(int argc, char **argv) {
         preprocess();
 
     Vector *toplevels = read_toplevels();
+    run_ast_passes(toplevels);
+    set_defined_functions(toplevels);
     for (int i = 0; i < vec_len(toplevels); i++) {
         Node *v = vec_get(toplevels, i);
         if (dumpast)
@@ -197,6 +243,7 @@ int main(int argc, char **argv) {
     }
 
     close_output_file();
+    report_pass_times();
 
 #ifndef __eir__
     if (!dumpast && !dumpasm) {
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <strings.h>
 #include "headers/parse.h"
+#include "headers/pass.h"
 
  // The largest alignment requirement on x86-64. When we are allocating memory
  // for an array whose type is unknown, the array will be aligned to this
@@ -37,6 +38,8 @@ static Vector* localvars;
 static Vector* gotos;
 static Vector* cases;
 static Type* current_func_type;
+// Set when the function being read accesses a volatile object.
+static bool volatile_access;
 
 static char* defaultcase;
 static char* lbreak;
@@ -89,8 +92,8 @@ static Token* get(void);
 static Token* peek(void);
 
 typedef struct {
-    int beg;
-    int end;
+    long beg;
+    long end;
     char* label;
 } Case;
 
@@ -139,7 +142,7 @@ static char* make_static_label(char* name) {
     return format(".S%d.%s", c++, name);
 }
 
-static Case* make_case(int beg, int end, char* label) {
+static Case* make_case(long beg, long end, char* label) {
     Case* r = malloc(sizeof(Case));
     r->beg = beg;
     r->end = end;
@@ -155,6 +158,8 @@ static Node* make_ast(Node* tmpl) {
     Node* r = malloc(sizeof(Node));
     *r = *tmpl;
     r->sourceLoc = source_loc;
+    if (r->ty && r->ty->isvolatile)
+        volatile_access = true;
     return r;
 }
 
@@ -645,7 +650,7 @@ static int eval_struct_ref(Node* node, int offset) {
     return eval_intexpr(node, NULL) + offset;
 }
 
-int eval_intexpr(Node* node, Node** addr) {
+long eval_intexpr(Node* node, Node** addr) {
     switch (node->kind) {
         case AST_LITERAL:
             if (is_inttype(node->ty))
@@ -704,7 +709,7 @@ int eval_intexpr(Node* node, Node** addr) {
     }
 }
 
-static int read_intexpr() {
+static long read_intexpr() {
     return eval_intexpr(read_conditional_expr(), NULL);
 }
 
@@ -824,9 +829,9 @@ static Vector* read_func_args(Vector* params) {
         if (i < vec_len(params)) {
             paramtype = vec_get(params, i++);
         } else {
-            paramtype = is_flotype(arg->ty) ? type_double :
-                is_inttype(arg->ty) ? type_int :
-                arg->ty;
+            // C11 6.5.2.2p6: Default argument promotions. Integers have
+            // already been promoted by conv().
+            paramtype = is_flotype(arg->ty) ? type_double : arg->ty;
         }
         ensure_assignable(paramtype, arg->ty);
         if (paramtype->kind != arg->ty->kind)
@@ -939,6 +944,8 @@ static Node* read_var_or_func(char* name) {
     }
     if (v->ty->kind == KIND_FUNC)
         return ast_funcdesg(v->ty, name);
+    if (v->ty->isvolatile)
+        volatile_access = true;
     return v;
 }
 
@@ -1207,7 +1214,9 @@ static Node* read_shift_expr() {
         Node* right = read_additive_expr();
         ensure_inttype(node);
         ensure_inttype(right);
-        node = ast_binop(node->ty, op, conv(node), conv(right));
+        // C11 6.5.7p3: The type of the result is that of the promoted left operand.
+        Node* left = conv(node);
+        node = ast_binop(left->ty, op, left, conv(right));
     }
     return node;
 }
@@ -1966,8 +1975,28 @@ static Type* read_declarator_tail(Type* basety, Vector* params) {
     return basety;
 }
 
-static void skip_type_qualifiers() {
-    while (next_token(KCONST) || next_token(KVOLATILE) || next_token(KRESTRICT));
+// C11 6.7.3p7: An object of volatile-qualified type may be modified in
+// ways unknown to the implementation, so each access to it must be done
+// as written. Only "volatile" among the qualifiers is kept in the type.
+// Structs and unions are left as they are: a copy would not see the
+// fields of a definition that comes later.
+static Type* make_volatile_type(Type* ty) {
+    if (ty->kind == KIND_STRUCT)
+        return ty;
+    Type* r = copy_type(ty);
+    r->isvolatile = true;
+    return r;
+}
+
+// Skips type qualifiers, and returns true if "volatile" was among them.
+static bool read_type_qualifiers() {
+    bool vol = false;
+    for (;;) {
+        if (next_token(KVOLATILE))
+            vol = true;
+        else if (!next_token(KCONST) && !next_token(KRESTRICT))
+            return vol;
+    }
 }
 
 // C11 6.7.6: Declarators
@@ -1990,8 +2019,10 @@ static Type* read_declarator(char** rname, Type* basety, Vector* params, int ctx
         return t;
     }
     if (next_token('*')) {
-        skip_type_qualifiers();
-        return read_declarator(rname, make_ptr_type(basety), params, ctx);
+        Type* ptr = make_ptr_type(basety);
+        if (read_type_qualifiers())
+            ptr = make_volatile_type(ptr);
+        return read_declarator(rname, ptr, params, ctx);
     }
     Token* tok = get();
     if (tok->kind == TIDENT) {
@@ -2062,6 +2093,7 @@ static Type* read_decl_spec(int* rsclass) {
     enum { kshort = 1, klong, kllong } size = 0;                        // size specifier
     enum { ksigned = 1, kunsigned } sig = 0;                           // sign specifier
     int align = -1;             // alignment specifier, default is -1 to indicate not specified
+    bool vol = false;           // volatile qualifier
 
     for (;;) {
         tok = get();            // get the next token in the input stream
@@ -2086,7 +2118,7 @@ static Type* read_decl_spec(int* rsclass) {
             case KAUTO:     if (sclass) goto err; sclass = S_AUTO; break;
             case KREGISTER: if (sclass) goto err; sclass = S_REGISTER; break;
             case KCONST:    break;
-            case KVOLATILE: break;
+            case KVOLATILE: vol = true; break;
             case KINLINE:   break;
             case KNORETURN: break;
             case KVOID:     if (kind) goto err; kind = kvoid; break;
@@ -2146,7 +2178,7 @@ done:
     if (rsclass)
         *rsclass = sclass;
     if (usertype)
-        return usertype;
+        return vol ? make_volatile_type(usertype) : usertype;
     if (align != -1 && !is_poweroftwo(align))
         errort(tok, "alignment must be power of 2, but got %d", align);
     Type* ty;
@@ -2173,7 +2205,7 @@ done:
 end:
     if (align != -1)
         ty->align = align;
-    return ty;
+    return vol ? make_volatile_type(ty) : ty;
 err:
     errort(tok, "type mismatch: %s", tok2s(tok));
 }
@@ -2290,11 +2322,13 @@ static Node* read_func_body(Type* functype, char* fname, Vector* params) {
     localenv = make_map_parent(localenv);
     localvars = make_vector();
     current_func_type = functype;
+    volatile_access = false;
     Node* funcname = ast_string(ENC_NONE, fname, strlen(fname) + 1);
     map_put(localenv, "__func__", funcname);
     map_put(localenv, "__FUNCTION__", funcname);
     Node* body = read_compound_stmt();
     Node* r = ast_func(functype, fname, params, body, localvars);
+    r->hasvolatile = volatile_access;
     current_func_type = NULL;
     localenv = NULL;
     localvars = NULL;
@@ -2518,31 +2552,140 @@ static Node* read_do_stmt() {
  * Switch
  */
 
+// Switches with at least this many cases covering at least a third of
+// their value range are dispatched through a jump table.
+#define SWITCH_TABLE_MIN_CASES 4
+#define SWITCH_TABLE_MAX_SIZE 1024
+// Case sets up to this size are tested one by one; larger sparse sets
+// are split in half by a comparison first.
+#define SWITCH_LINEAR_MAX_CASES 3
+
+static Node* switch_value(Node* var, long val) {
+    return ast_inttype(var->ty, val);
+}
+
 static Node* make_switch_jump(Node* var, Case* c) {
     Node* cond;
     if (c->beg == c->end) {
-        cond = ast_binop(type_int, OP_EQ, var, ast_inttype(type_int, c->beg));
+        cond = ast_binop(type_int, OP_EQ, var, switch_value(var, c->beg));
     } else {
         // [GNU] case i ... j is compiled to if (i <= cond && cond <= j) goto <label>.
-        Node* x = ast_binop(type_int, OP_LE, ast_inttype(type_int, c->beg), var);
-        Node* y = ast_binop(type_int, OP_LE, var, ast_inttype(type_int, c->end));
+        Node* x = ast_binop(type_int, OP_LE, switch_value(var, c->beg), var);
+        Node* y = ast_binop(type_int, OP_LE, var, switch_value(var, c->end));
         cond = ast_binop(type_int, OP_LOGAND, x, y);
     }
     return ast_if(cond, ast_jump(c->label), NULL);
 }
 
+// Converts the case labels to the promoted type of the controlling
+// expression (C11 6.8.4.2p5). GNU ranges that wrap around as a result
+// are split in two so that every case satisfies beg <= end.
+static void convert_cases(Vector* cases, Type* ty) {
+    if (ty->size != 4)
+        return;
+    int len = vec_len(cases);
+    for (int i = 0; i < len; i++) {
+        Case* c = vec_get(cases, i);
+        c->beg = ty->usig ? (long)(unsigned)c->beg : (long)(int)c->beg;
+        c->end = ty->usig ? (long)(unsigned)c->end : (long)(int)c->end;
+        if (c->beg > c->end) {
+            vec_push(cases, make_case(ty->usig ? 0 : INT_MIN, c->end, c->label));
+            c->end = ty->usig ? UINT_MAX : INT_MAX;
+        }
+    }
+}
+
+static int comp_case(const void* p, const void* q) {
+    long x = (*(Case**)p)->beg;
+    long y = (*(Case**)q)->beg;
+    if (x < y) return -1;
+    if (x > y) return 1;
+    return 0;
+}
+
 // C11 6.8.4.2p3: No two case constant expressions have the same value.
+// The cases must be sorted.
 static void check_case_duplicates(Vector* cases) {
-    int len = vec_len(cases);
-    Case* x = vec_get(cases, len - 1);
-    for (int i = 0; i < len - 1; i++) {
-        Case* y = vec_get(cases, i);
-        if (x->end < y->beg || y->end < x->beg)
+    for (int i = 1; i < vec_len(cases); i++) {
+        Case* x = vec_get(cases, i);
+        Case* y = vec_get(cases, i - 1);
+        if (y->end < x->beg)
             continue;
         if (x->beg == x->end)
-            error("duplicate case value: %d", x->beg);
-        error("duplicate case value: %d ... %d", x->beg, x->end);
+            error("duplicate case value: %ld", x->beg);
+        error("duplicate case value: %ld ... %ld", x->beg, x->end);
+    }
+}
+
+static bool is_dense_cases(Case** cs, int n) {
+    if (n < SWITCH_TABLE_MIN_CASES)
+        return false;
+    // Computed in unsigned arithmetic, as the span of cases from LONG_MIN
+    // to LONG_MAX does not fit in a long.
+    unsigned long span = (unsigned long)cs[n - 1]->end - (unsigned long)cs[0]->beg;
+    if (span >= SWITCH_TABLE_MAX_SIZE)
+        return false;
+    long covered = 0;
+    for (int i = 0; i < n; i++)
+        covered += cs[i]->end - cs[i]->beg + 1;
+    return (long)span + 1 <= covered * 3;
+}
+
+static Node* ast_label_value(char* label) {
+    return make_ast(&(Node) { OP_LABEL_ADDR, make_ptr_type(type_void), .label = label, .newlabel = label });
+}
+
+// Dispatches through a table of label addresses, which is emitted along
+// with the function:
+//
+//   if (var < min || max < var) goto default;
+//   goto *table[var - min];
+static void make_switch_table(Vector* v, Node* var, Case** cs, int n, char* dflt) {
+    long min = cs[0]->beg;
+    long max = cs[n - 1]->end;
+    Type* ptrtype = make_ptr_type(type_void);
+    Type* ty = make_array_type(ptrtype, max - min + 1);
+    char* name = make_label();
+    Node* table = make_ast(&(Node) { AST_GVAR, ty, .varname = name, .glabel = name });
+    Vector* inits = make_vector();
+    // Entries are counted from min, so that the loop ends for a case
+    // ending at LONG_MAX.
+    for (int i = 0; i < n; i++) {
+        for (long k = cs[i]->beg - min; k <= cs[i]->end - min; k++) {
+            while (vec_len(inits) < k)
+                vec_push(inits, ast_init(ast_label_value(dflt), ptrtype, vec_len(inits) * 8));
+            vec_push(inits, ast_init(ast_label_value(cs[i]->label), ptrtype, vec_len(inits) * 8));
+        }
     }
+    vec_push(v, ast_decl(table, inits));
+    vec_push(v, ast_if(ast_binop(type_int, '<', var, switch_value(var, min)), ast_jump(dflt), NULL));
+    vec_push(v, ast_if(ast_binop(type_int, '<', switch_value(var, max), var), ast_jump(dflt), NULL));
+    Node* idx = ast_binop(type_long, '-', ast_conv(type_long, var), ast_inttype(type_long, min));
+    Node* addr = ast_binop(make_ptr_type(ptrtype), '+', conv(table), idx);
+    vec_push(v, ast_computed_goto(ast_uop(AST_DEREF, ptrtype, addr)));
+}
+
+// Emits the dispatch code for the sorted cases cs[0..n-1]. Without
+// -fswitch-tables every case is tested in turn.
+static void make_switch_dispatch(Vector* v, Node* var, Case** cs, int n, char* dflt) {
+    bool lower_switch = pass_enabled(PASS_SWITCH_TABLES);
+    if (lower_switch && is_dense_cases(cs, n)) {
+        make_switch_table(v, var, cs, n, dflt);
+        return;
+    }
+    if (!lower_switch || n <= SWITCH_LINEAR_MAX_CASES) {
+        for (int i = 0; i < n; i++)
+            vec_push(v, make_switch_jump(var, cs[i]));
+        vec_push(v, ast_jump(dflt));
+        return;
+    }
+    // Binary search: test the upper half first, fall back to the lower one.
+    int mid = n / 2;
+    char* lower = make_label();
+    vec_push(v, ast_if(ast_binop(type_int, '<', var, switch_value(var, cs[mid]->beg)), ast_jump(lower), NULL));
+    make_switch_dispatch(v, var, cs + mid, n - mid, dflt);
+    vec_push(v, ast_dest(lower));
+    make_switch_dispatch(v, var, cs, mid, dflt);
 }
 
 #define SET_SWITCH_CONTEXT(brk)                 \
@@ -2568,11 +2711,14 @@ static Node* read_switch_stmt() {
     SET_SWITCH_CONTEXT(end);
     Node* body = read_stmt();
     Vector* v = make_vector();
-    Node* var = ast_lvar(expr->ty, make_tempname());
-    vec_push(v, ast_binop(expr->ty, '=', var, expr));
-    for (int i = 0; i < vec_len(cases); i++)
-        vec_push(v, make_switch_jump(var, vec_get(cases, i)));
-    vec_push(v, ast_jump(defaultcase ? defaultcase : end));
+    // The cases are sorted as longs, and the tests dispatching to them
+    // compare the value as one, whatever the signedness of its type.
+    Node* var = ast_lvar(type_long, make_tempname());
+    vec_push(v, ast_binop(type_long, '=', var, ast_conv(type_long, expr)));
+    convert_cases(cases, expr->ty);
+    qsort(vec_body(cases), vec_len(cases), sizeof(void*), comp_case);
+    check_case_duplicates(cases);
+    make_switch_dispatch(v, var, vec_body(cases), vec_len(cases), defaultcase ? defaultcase : end);
     if (body)
         vec_push(v, body);
     vec_push(v, ast_dest(end));
@@ -2593,18 +2739,17 @@ static Node* read_case_label(Token* tok) {
     if (!cases)
         errort(tok, "stray case label");
     char* label = make_label();
-    int beg = read_intexpr();
+    long beg = read_intexpr();
     if (next_token(KELLIPSIS)) {
-        int end = read_intexpr();
+        long end = read_intexpr();
         expect(':');
         if (beg > end)
-            errort(tok, "case region is not in correct order: %d ... %d", beg, end);
+            errort(tok, "case region is not in correct order: %ld ... %ld", beg, end);
         vec_push(cases, make_case(beg, end, label));
     } else {
         expect(':');
         vec_push(cases, make_case(beg, beg, label));
     }
-    check_case_duplicates(cases);
     return read_label_tail(ast_dest(label));
 }
 
@@ -2795,4 +2940,5 @@ void parse_init() {
     define_builtin("__builtin_reg_class", type_int, voidptr);
     define_builtin("__builtin_va_arg", type_void, two_voidptrs);
     define_builtin("__builtin_va_start", type_void, voidptr);
+    define_builtin("__builtin_unreachable", type_void, make_vector());
 }
@@ -0,0 +1,204 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Pass manager.
+//
+// Optimizations run in two places: on the AST once the whole file has
+// been parsed, and on the IR of each function once its code has been
+// generated, where dce.c, cfg.c and the passes built on them see the
+// control flow of the function. A few more are decisions the code
+// generator makes while it emits a function.
+//
+// Each pass has a name, by which -f<name> and -fno-<name> turn it on and
+// off, and the lowest -O level it runs at. -Os runs the passes of -O2
+// except those that make the code larger. Without an -O option none of
+// them runs, and the code generator falls back to the code it emitted
+// before the passes were added: temporaries pushed on the stack, every
+// address computed into a register before it is loaded from or stored
+// to, constant operands loaded into B, every value cropped, conditions
+// materialized as booleans before branching on them and switches testing
+// their cases one by one.
+//
+// What -O0 cannot turn back is the form of the output rather than an
+// optimization of it: struct copies and fills are memcpy and memset
+// instructions, zero-filled data is a .zero directive, a function returns
+// through a single epilogue, string literals follow the function using
+// them, the operands of an arithmetic operator are cropped as each is
+// computed, and commutative operators and comparisons take the left one
+// in B when that saves a move. The dead instructions the old code
+// generator left around zero fills and pointer arithmetic are gone too.
+//
+// -ftime-passes prints the time spent in each pass when the compiler
+// exits. Value numbering runs inside the peephole pass, so its time is
+// counted in both. The decisions the code generator makes are not timed
+// apart from the code around them, and are left out.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "headers/pass.h"
+
+bool time_passes = false;
+
+typedef struct {
+    char* name;
+    int level;   // Lowest -O level enabling the pass
+    bool grows;  // Left out by -Os
+    int state;   // Set by -f<name> (1) or -fno-<name> (0), or -1
+    bool timed;  // Set once the pass has been started
+    clock_t start;
+    clock_t total;
+} Pass;
+
+static Pass passes[] = {
+    [PASS_FOLD] = { "fold", 1, false, -1 },
+    [PASS_EVAL] = { "eval", 2, false, -1 },
+    [PASS_INLINE] = { "inline", 2, true, -1 },
+    [PASS_REGALLOC] = { "regalloc", 1, false, -1 },
+    [PASS_MEM2REG] = { "mem2reg", 1, false, -1 },
+    [PASS_IMMEDIATES] = { "immediates", 1, false, -1 },
+    [PASS_STRENGTH_REDUCE] = { "strength-reduce", 1, false, -1 },
+    [PASS_ELIDE_CROPS] = { "elide-crops", 1, false, -1 },
+    [PASS_FUSE_BRANCHES] = { "fuse-branches", 1, false, -1 },
+    [PASS_MEM_OPERANDS] = { "mem-operands", 1, false, -1 },
+    [PASS_SWITCH_TABLES] = { "switch-tables", 1, false, -1 },
+    [PASS_SHARE_SLOTS] = { "share-slots", 1, false, -1 },
+    [PASS_TAIL_CALLS] = { "tail-calls", 2, false, -1 },
+    [PASS_DCE] = { "dce", 1, false, -1 },
+    [PASS_PEEPHOLE] = { "peephole", 1, false, -1 },
+    [PASS_LVN] = { "lvn", 2, false, -1 },
+    [PASS_SCCP] = { "sccp", 2, false, -1 },
+    [PASS_DSE] = { "dse", 2, false, -1 },
+    [PASS_LOOPS] = { "loops", 2, false, -1 },
+    [PASS_UNROLL_LOOPS] = { "unroll-loops", 3, true, -1 },
+    [PASS_OMIT_FRAME_POINTER] = { "omit-frame-pointer", 2, false, -1 },
+};
+
+static int opt_level = 0;
+static bool opt_size = false;
+
+// Sets the level from the argument of -O: a number or "s".
+void set_opt_level(char* arg) {
+    if (!arg || !*arg) {
+        opt_level = 1;
+    } else if (!strcmp(arg, "s")) {
+        opt_level = 2;
+        opt_size = true;
+        return;
+    } else {
+        char* end;
+        opt_level = strtol(arg, &end, 10);
+        if (*end || opt_level < 0)
+            error("invalid optimization level: -O%s", arg);
+    }
+    opt_size = false;
+}
+
+// Turns the pass `name` on or off. Returns false if there is no such pass.
+bool set_pass(char* name, bool on) {
+    for (int i = 0; i < NPASSES; i++) {
+        if (!strcmp(passes[i].name, name)) {
+            passes[i].state = on;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool pass_enabled(int pass) {
+    Pass* p = &passes[pass];
+    if (p->state >= 0)
+        return p->state;
+    return p->level <= opt_level && !(opt_size && p->grows);
+}
+
+void pass_start(int pass) {
+    passes[pass].timed = true;
+    passes[pass].start = clock();
+}
+
+void pass_stop(int pass) {
+    passes[pass].total += clock() - passes[pass].start;
+}
+
+void report_pass_times() {
+    if (!time_passes)
+        return;
+    for (int i = 0; i < NPASSES; i++) {
+        if (!passes[i].timed)
+            continue;
+        fprintf(stderr, "time: %-18s %8.3fs\n", passes[i].name, (double)passes[i].total / CLOCKS_PER_SEC);
+    }
+}
+
+static void run_fold(Vector* toplevels) {
+    if (!pass_enabled(PASS_FOLD))
+        return;
+    pass_start(PASS_FOLD);
+    for (int i = 0; i < vec_len(toplevels); i++)
+        fold_toplevel(vec_get(toplevels, i));
+    pass_stop(PASS_FOLD);
+}
+
+void run_ast_passes(Vector* toplevels) {
+    run_fold(toplevels);
+    if (pass_enabled(PASS_EVAL)) {
+        pass_start(PASS_EVAL);
+        bool changed = eval_toplevels(toplevels);
+        pass_stop(PASS_EVAL);
+        // The values of the calls may fold further.
+        if (changed)
+            run_fold(toplevels);
+    }
+    if (pass_enabled(PASS_INLINE)) {
+        pass_start(PASS_INLINE);
+        inline_toplevels(toplevels);
+        pass_stop(PASS_INLINE);
+    }
+}
+
+static void run_peephole(Vector* code, char* fname) {
+    if (!pass_enabled(PASS_PEEPHOLE))
+        return;
+    pass_start(PASS_PEEPHOLE);
+    peephole(code, fname);
+    pass_stop(PASS_PEEPHOLE);
+}
+
+// Optimizes the code of the function `fname`. `addr_taken` holds the
+// labels its data refers to.
+//
+// The IR does not tell which memory is volatile, and the passes after DCE
+// remove, reuse or move loads and stores. A function that accesses a
+// volatile object, `hasvolatile`, is therefore only cleared of its
+// unreachable code.
+void run_ir_passes(Vector* code, Map* addr_taken, char* fname, bool hasvolatile) {
+    if (pass_enabled(PASS_DCE)) {
+        pass_start(PASS_DCE);
+        remove_unreachable(code, addr_taken);
+        pass_stop(PASS_DCE);
+    }
+    if (hasvolatile)
+        return;
+    run_peephole(code, fname);
+    bool changed = false;
+    if (pass_enabled(PASS_SCCP)) {
+        pass_start(PASS_SCCP);
+        changed |= propagate_constants(code, addr_taken, fname);
+        pass_stop(PASS_SCCP);
+    }
+    if (pass_enabled(PASS_DSE)) {
+        pass_start(PASS_DSE);
+        changed |= eliminate_dead_stores(code, addr_taken, fname);
+        pass_stop(PASS_DSE);
+    }
+    if (changed)
+        run_peephole(code, fname);
+    if (optimize_loops(code, addr_taken, fname))
+        run_peephole(code, fname);
+    // Comes last: the other passes take BP to point at the frame.
+    if (pass_enabled(PASS_OMIT_FRAME_POINTER)) {
+        pass_start(PASS_OMIT_FRAME_POINTER);
+        omit_frame_pointer(code, addr_taken, fname);
+        pass_stop(PASS_OMIT_FRAME_POINTER);
+    }
+}
@@ -0,0 +1,341 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Peephole optimizer.
+//
+// The code generator works one AST node at a time, so the IR it produces
+// is full of sequences that are obviously wasteful once they are seen next
+// to each other: values pushed and immediately popped, stores followed by
+// loads of the same slot, jumps to the next line and so on. Every IR
+// instruction turns into a sequence of gadgets in the ROP backend, so
+// removing them pays off.
+//
+// Each rule looks at the instruction at a given index and the ones around
+// it within the same basic block, and rewrites them in place. The rules
+// are applied repeatedly until none of them matches anymore.
+
+#include <string.h>
+#include "headers/peephole.h"
+
+bool stats_peephole = false;
+
+typedef struct {
+    char* name;
+    bool (*apply)(Vector* insts, int i);
+} Rule;
+
+static Inst* get(Vector* insts, int i) {
+    return (i < 0) ? NULL : vec_get(insts, i);
+}
+
+static void delete(Vector* insts, int i) {
+    vec_set(insts, i, NULL);
+}
+
+static bool is_label_arg(char* s) {
+    return !is_reg(s) && !is_imm_arg(s, NULL);
+}
+
+static bool is_imm_value(char* s, long val) {
+    long v;
+    return is_imm_arg(s, &v) && v == val;
+}
+
+static char* invert_comp(char* op) {
+    static char* pairs[][2] = {
+        { "eq", "ne" }, { "lt", "ge" }, { "le", "gt" },
+    };
+    for (int i = 0; i < 3; i++) {
+        if (!strcmp(op, pairs[i][0])) return pairs[i][1];
+        if (!strcmp(op, pairs[i][1])) return pairs[i][0];
+    }
+    return NULL;
+}
+
+// Is the label named `name` among the labels starting at index i?
+static bool label_follows(Vector* insts, int i, char* name) {
+    for (; i < vec_len(insts); i++) {
+        Inst* inst = vec_get(insts, i);
+        if (!inst || inst->kind == INST_NOTE)
+            continue;
+        if (inst->kind != INST_LABEL)
+            return false;
+        if (!strcmp(inst->op, name))
+            return true;
+    }
+    return false;
+}
+
+// sub SP, 8; store64 X, SP; load64 Y, SP; sub SP, -8  =>  mov Y, X
+static bool push_pop(Vector* insts, int i) {
+    Inst* sub = get(insts, i);
+    if (!inst_is(sub, "sub") || strcmp(sub->args[0], "SP") || !is_imm_value(sub->args[1], 8))
+        return false;
+    int j = ir_next(insts, i);
+    Inst* store = get(insts, j);
+    if (!inst_is(store, "store64") || strcmp(store->args[1], "SP"))
+        return false;
+    int k = ir_next(insts, j);
+    Inst* load = get(insts, k);
+    if (!inst_is(load, "load64") || strcmp(load->args[1], "SP"))
+        return false;
+    int l = ir_next(insts, k);
+    Inst* add = get(insts, l);
+    if (!inst_is(add, "sub") || strcmp(add->args[0], "SP") || !is_imm_value(add->args[1], -8))
+        return false;
+    delete(insts, i);
+    delete(insts, j);
+    delete(insts, l);
+    if (strcmp(load->args[0], store->args[0]))
+        vec_set(insts, k, make_inst("mov", 2, load->args[0], store->args[0]));
+    else
+        delete(insts, k);
+    return true;
+}
+
+// store64 X, R; load64 Y, R  =>  store64 X, R; mov Y, X
+static bool store_load(Vector* insts, int i) {
+    Inst* store = get(insts, i);
+    if (!inst_is(store, "store64"))
+        return false;
+    int j = ir_next(insts, i);
+    Inst* load = get(insts, j);
+    if (!inst_is(load, "load64") || strcmp(load->args[1], store->args[1]))
+        return false;
+    if (strcmp(load->args[0], store->args[0]))
+        vec_set(insts, j, make_inst("mov", 2, load->args[0], store->args[0]));
+    else
+        delete(insts, j);
+    return true;
+}
+
+// mov X, X  =>  (nothing)
+static bool mov_self(Vector* insts, int i) {
+    Inst* mov = get(insts, i);
+    if (!inst_is(mov, "mov") || strcmp(mov->args[0], mov->args[1]))
+        return false;
+    delete(insts, i);
+    return true;
+}
+
+// mov X, Y; mov Y, X  =>  mov X, Y
+static bool mov_back(Vector* insts, int i) {
+    Inst* mov = get(insts, i);
+    if (!inst_is(mov, "mov") || !is_reg(mov->args[1]))
+        return false;
+    int j = ir_next(insts, i);
+    Inst* back = get(insts, j);
+    if (!inst_is(back, "mov") || strcmp(back->args[0], mov->args[1]) ||
+        strcmp(back->args[1], mov->args[0]))
+        return false;
+    delete(insts, j);
+    return true;
+}
+
+// add X, 0 / mul X, 1 / and X, -1 / crop64 X and the like  =>  (nothing)
+static bool nop_arith(Vector* insts, int i) {
+    Inst* inst = get(insts, i);
+    char* op = inst->op;
+    bool nop = false;
+    if (!strcmp(op, "add") || !strcmp(op, "sub") || !strcmp(op, "or") ||
+        !strcmp(op, "xor") || !strcmp(op, "shl") || !strcmp(op, "shr") || !strcmp(op, "sar"))
+        nop = is_imm_value(inst->args[1], 0);
+    else if (!strcmp(op, "mul"))
+        nop = is_imm_value(inst->args[1], 1);
+    else if (!strcmp(op, "and"))
+        nop = is_imm_value(inst->args[1], -1);
+    else if (!strcmp(op, "crop64") || !strcmp(op, "icrop64"))
+        nop = true;
+    if (nop)
+        delete(insts, i);
+    return nop;
+}
+
+// add X, a; add X, b  =>  add X, a+b (likewise for sub)
+static bool merge_add(Vector* insts, int i) {
+    Inst* first = get(insts, i);
+    long a, b;
+    if ((!inst_is(first, "add") && !inst_is(first, "sub")) || !is_imm_arg(first->args[1], &a))
+        return false;
+    int j = ir_next(insts, i);
+    Inst* second = get(insts, j);
+    if ((!inst_is(second, "add") && !inst_is(second, "sub")) ||
+        strcmp(first->args[0], second->args[0]) || !is_imm_arg(second->args[1], &b))
+        return false;
+    long sum = (inst_is(first, "add") ? a : -a) + (inst_is(second, "add") ? b : -b);
+    // Keep the instruction of the first one; "sub SP, imm" is what the
+    // backends special-case for stack adjustments.
+    long val = inst_is(first, "add") ? sum : -sum;
+    if (!is_imm(val))
+        return false;
+    vec_set(insts, i, make_inst(first->op, 2, first->args[0], format("%ld", val)));
+    delete(insts, j);
+    return true;
+}
+
+// Returns true if `reg` is overwritten before being read after index i,
+// within the same basic block.
+static bool is_dead_after(Vector* insts, int i, char* reg) {
+    for (int j = ir_next(insts, i); j >= 0; j = ir_next(insts, j)) {
+        Inst* next = get(insts, j);
+        if (!is_simple_inst(next) || inst_reads(next, reg))
+            return false;
+        if (inst_writes(next, reg))
+            return true;
+    }
+    return false;
+}
+
+// A register write that is overwritten before being read is dropped.
+static bool dead_write(Vector* insts, int i) {
+    Inst* inst = get(insts, i);
+    if (!is_simple_inst(inst) || op_width(inst->op, "store") || is_rmw_op(inst->op))
+        return false;
+    char* reg = inst->args[0];
+    if (!strcmp(reg, "SP") || !strcmp(reg, "BP") || !is_dead_after(insts, i, reg))
+        return false;
+    delete(insts, i);
+    return true;
+}
+
+// jmp L; L:  =>  L:  (likewise for conditional jumps)
+static bool jump_next(Vector* insts, int i) {
+    Inst* inst = get(insts, i);
+    if (!inst_is(inst, "jmp") && !is_cond_jump(inst))
+        return false;
+    if (!is_label_arg(inst->args[0]) || !label_follows(insts, i + 1, inst->args[0]))
+        return false;
+    delete(insts, i);
+    return true;
+}
+
+// jeq L1, X, Y; jmp L2; L1:  =>  jne L2, X, Y; L1:
+static bool branch_over_jump(Vector* insts, int i) {
+    Inst* cond = get(insts, i);
+    if (!is_cond_jump(cond))
+        return false;
+    int j = ir_next(insts, i);
+    Inst* jmp = get(insts, j);
+    if (!inst_is(jmp, "jmp") || !is_label_arg(jmp->args[0]))
+        return false;
+    if (!label_follows(insts, j + 1, cond->args[0]))
+        return false;
+    char* op = format("j%s", invert_comp(cond->op + 1));
+    vec_set(insts, i, make_inst(op, 3, jmp->args[0], cond->args[1], cond->args[2]));
+    delete(insts, j);
+    return true;
+}
+
+// Returns true if the instruction before i sets `reg` to 0 or 1.
+static bool is_bool_before(Vector* insts, int i, char* reg) {
+    Inst* prev = get(insts, ir_prev(insts, i));
+    return prev && is_comp_op(prev->op) && !strcmp(prev->args[0], reg);
+}
+
+// lt X, Y; ne X, 0  =>  lt X, Y (likewise for crops of a boolean)
+static bool bool_nop(Vector* insts, int i) {
+    Inst* inst = get(insts, i);
+    if (!(inst_is(inst, "ne") && is_imm_value(inst->args[1], 0)) && !is_crop_op(inst->op))
+        return false;
+    if (!is_bool_before(insts, i, inst->args[0]))
+        return false;
+    delete(insts, i);
+    return true;
+}
+
+// lt X, Y; eq X, 0  =>  ge X, Y
+static bool bool_not(Vector* insts, int i) {
+    Inst* inst = get(insts, i);
+    if (!inst_is(inst, "eq") || !is_imm_value(inst->args[1], 0))
+        return false;
+    if (!is_bool_before(insts, i, inst->args[0]))
+        return false;
+    int p = ir_prev(insts, i);
+    Inst* prev = get(insts, p);
+    vec_set(insts, p, make_inst(invert_comp(prev->op), 2, prev->args[0], prev->args[1]));
+    delete(insts, i);
+    return true;
+}
+
+// Two crops of the same register in a row, where one of them has no
+// effect given the other.
+static bool crop_crop(Vector* insts, int i) {
+    Inst* inst = get(insts, i);
+    if (!is_crop_op(inst->op))
+        return false;
+    int p = ir_prev(insts, i);
+    Inst* prev = get(insts, p);
+    if (!prev || !is_crop_op(prev->op) || strcmp(prev->args[0], inst->args[0]))
+        return false;
+    int n = op_width(prev->op, "crop");
+    int in = op_width(prev->op, "icrop");
+    int m = op_width(inst->op, "crop");
+    int im = op_width(inst->op, "icrop");
+    if ((n && m && n <= m) || (n && im && n < im) || (in && im && in <= im)) {
+        // The value already fits; the second crop keeps it as is.
+        delete(insts, i);
+        return true;
+    }
+    if ((n && m) || (im && im <= (n ? n : in)) || (in && m && m <= in)) {
+        // The second crop only looks at bits the first one left alone.
+        delete(insts, p);
+        return true;
+    }
+    return false;
+}
+
+static Rule rules[] = {
+    { "push-pop", push_pop },
+    { "store-load", store_load },
+    { "mov-self", mov_self },
+    { "mov-back", mov_back },
+    { "nop-arith", nop_arith },
+    { "merge-add", merge_add },
+    { "dead-write", dead_write },
+    { "jump-next", jump_next },
+    { "branch-over-jump", branch_over_jump },
+    { "bool-nop", bool_nop },
+    { "bool-not", bool_not },
+    { "crop-crop", crop_crop },
+};
+
+#define NRULES (sizeof(rules) / sizeof(*rules))
+
+void peephole(Vector* insts, char* fname) {
+    int hits[NRULES] = { 0 };
+    int before = ir_count_ops(insts);
+    bool numbered = false;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < vec_len(insts); i++) {
+            Inst* inst = vec_get(insts, i);
+            if (!inst || inst->kind != INST_OP)
+                continue;
+            for (int r = 0; r < NRULES; r++) {
+                if (rules[r].apply(insts, i)) {
+                    hits[r]++;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+        ir_compact(insts);
+        // Value numbering leaves dead code behind for the rules.
+        if (!changed && !numbered && pass_enabled(PASS_LVN)) {
+            numbered = true;
+            pass_start(PASS_LVN);
+            changed = number_values(insts, fname);
+            pass_stop(PASS_LVN);
+        }
+    }
+    if (!stats_peephole)
+        return;
+    fprintf(stderr, "peephole: %s: %d instructions removed", fname, before - ir_count_ops(insts));
+    char* sep = " (";
+    for (int r = 0; r < NRULES; r++) {
+        if (!hits[r])
+            continue;
+        fprintf(stderr, "%s%s %d", sep, rules[r].name, hits[r]);
+        sep = ", ";
+    }
+    fprintf(stderr, "%s\n", (*sep == ',') ? ")" : "");
+}
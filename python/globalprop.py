@@ -0,0 +1,131 @@
+import sys, re
+
+# Whole-program constant propagation of globals.
+#
+# The input is every translation unit of the program linked into one
+# assembly file, so a global whose address is never taken and which is
+# never stored to keeps its initial value for the whole run. Loads from
+# such a global are replaced by the value, and the data of a global no
+# longer referenced at all is dropped.
+#
+# The arguments are files (the hand-written .rop code) that may refer to
+# globals by name; globals mentioned there are left alone.
+
+lines = []
+
+while True:
+    try: s = input()
+    except EOFError: break
+    lines.append(s)
+
+def strip(l):
+    return l.split('#', 1)[0].strip()
+
+def split_inst(l):
+    l = ' '.join(strip(l).replace(',', ', ').split())
+    if ' ' not in l: return l, []
+    cmd, args = l.split(' ', 1)
+    return cmd, args.split(', ')
+
+escaped = set()
+for name in sys.argv[1:]:
+    escaped |= set(re.findall(r'[A-Za-z_.$][\w.$]*', open(name).read()))
+
+# The initial bytes of each global in the data segments. A byte is an
+# integer, or a pair (index, target) for the index-th byte of a pointer.
+data = {}
+# The lines holding the data of each global, if they directly follow its
+# label.
+data_lines = {}
+defined = {}
+loads = []
+
+is_data = False
+current = {}  # The global each data segment is in
+seg = 0
+for i, l0 in enumerate(lines):
+    l = strip(l0)
+    if not l: continue
+    if l == '.text':
+        is_data = False
+    elif l == '.data' or l.startswith('.data '):
+        is_data = True
+        seg = 0 if l == '.data' else int(l[6:])
+    elif l.endswith(':'):
+        lbl = l[:-1]
+        defined[lbl] = defined.get(lbl, 0)+1
+        if not lbl.startswith('.'):
+            # Local labels are scoped to the last global label.
+            current = {}
+        if is_data and not lbl.startswith('.'):
+            current[seg] = lbl
+            data[lbl] = []
+            data_lines[lbl] = [i]
+        elif is_data:
+            current.pop(seg, None)
+    elif is_data:
+        lbl = current.get(seg)
+        cmd, arg = (l.split(' ', 1)+[''])[:2]
+        if cmd == '.ptr':
+            escaped |= set(re.findall(r'[A-Za-z_.$][\w.$]*', arg))
+        if lbl is None or cmd in ('.global', '.file', '.loc'):
+            continue
+        if cmd == '.string':
+            s = eval('b'+l0[l0.find('.string')+7:].strip())+b'\0'
+            b = list(s+bytes((-len(s)) % 8))
+        elif cmd == '.ptr':
+            b = [(k, arg) for k in range(8)]
+        elif cmd == '.zero':
+            b = [0]*int(arg)
+        else:
+            n = {'.byte': 1, '.short': 2, '.int': 4, '.long': 8}.get(cmd)
+            if n is None:
+                escaped.add(lbl)
+                continue
+            b = list((int(arg) & (1 << n*8)-1).to_bytes(n, 'little'))
+        data[lbl] += b
+        if data_lines[lbl] and all(not strip(x) for x in lines[data_lines[lbl][-1]+1:i]):
+            data_lines[lbl].append(i)
+        else:
+            data_lines[lbl] = None
+    elif not l.startswith('.'):
+        cmd, args = split_inst(l)
+        for k, arg in enumerate(args):
+            m = re.match(r'\[([^+\-\]]+)([+-]\d+)?\]$', arg)
+            if m and cmd.startswith('load') and k == 1:
+                loads.append((i, cmd, args[0], m.group(1), int(m.group(2) or 0)))
+            else:
+                escaped |= set(re.findall(r'[A-Za-z_.$][\w.$]*', arg))
+
+def value(lbl, off, n):
+    b = data[lbl][off:off+n]
+    if off < 0 or len(b) != n:
+        return None
+    if all(isinstance(x, int) for x in b):
+        v = int.from_bytes(bytes(b), 'little')
+        return str(v-(1 << n*8) if v >> (n*8-1) else v)
+    # A whole pointer to a number or a global label. Local labels cannot be
+    # moved out of their scope.
+    t = b[0][1] if not isinstance(b[0], int) else None
+    if n == 8 and b == [(k, t) for k in range(8)] and re.match(r'(-?\d+|_[\w.$]*)$', t):
+        return t
+    return None
+
+refs = set()
+for i, cmd, reg, lbl, off in loads:
+    v = None
+    if lbl in data and lbl not in escaped and defined[lbl] == 1:
+        v = value(lbl, off, int(cmd[4:])//8)
+    if v is None:
+        refs.add(lbl)
+    else:
+        lines[i] = '\tmov %s, %s'%(reg, v)
+
+for lbl, idx in data_lines.items():
+    if idx and lbl not in escaped and lbl not in refs and defined[lbl] == 1:
+        for i in idx:
+            lines[i] = None
+
+for l in lines:
+    if l is not None:
+        print(l)
@@ -7,19 +7,23 @@ while True:
 
 lines.append(':')
 
-labels = {i[:-1] for i in (i.strip() for i in lines) if i.endswith(':') and not i.startswith('.')}
-labels |= {'A', 'B', 'C', 'SP', 'BP'}
+# Comments may end with a colon too, e.g. source lines with labels.
+def strip(l):
+    return l.split('#', 1)[0].strip()
+
+labels = {i[:-1] for i in (strip(i) for i in lines) if i.endswith(':') and not i.startswith('.')}
+labels |= {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'SP', 'BP'}
 
 lines2 = []
 
 j = 0
 i = 0
 while i < len(lines):
-    l = lines[i].strip()
+    l = strip(lines[i])
     if l.endswith(':') and not l.startswith('.'):
         ncalls = set()
         for ii in range(j, len(lines2)):
-            ll = lines2[ii].strip()
+            ll = strip(lines2[ii])
             if ll.startswith('jmp ') and ll[4:] not in labels and ll[4] != '.':
                 assert ll[4] == '_', ll
                 ncalls.add(ll[5:])
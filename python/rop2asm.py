@@ -31,7 +31,7 @@ while True:
         print('global text_'+l[:-1])
         print('text_'+l)
         print('section .data')
-    elif l.startswith('db ') or l.startswith('dq '):
+    elif l.startswith('db ') or l.startswith('dq ') or l.startswith('times '):
         print(l)
     elif l.startswith('dp '):
         print('dq '+l[3:])
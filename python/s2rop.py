@@ -1,15 +1,22 @@
-import sys, os
+import sys, os, re
 
 reg_map = {
     'A': 'rax',
     'B': 'rcx',
     'C': 'r10',
+    'D': 'r9',
+    'E': 'r12',
+    'F': 'r13',
+    'G': 'r14',
+    'H': 'r15',
     'SP': 'rdi',
     'BP': 'r8'
 }
 conds = {'eq', 'ne', 'lt', 'le', 'gt', 'ge'}
 # rsi is used as a scratch register for some operation
 # r11 is used to back up a register when necessary
+# D-H only hold expression temporaries; moving them around needs the
+# `pop rN` and `mov rax, rN` gadgets for their registers
 
 def make_label(_static_cntr=[0]):
     # all user-provided labels are underscore-prefixed
@@ -39,7 +46,9 @@ def do_exchange_regs(mapping):
             print('mov [rsi], rax')
     cur_rax = 'rax'
     for k, v in items:
-        if v != 'rax' and ' ' not in v and k != 'rax':
+        # rax is popped from its slot too when r11 is loaded, since the
+        # `pop r11` gadget clobbers it
+        if v != 'rax' and ' ' not in v and (k != 'rax' or 'r11' in mapping):
             cur_rax = v
             print('mov rax,', v)
             print('pop rsi')
@@ -236,6 +245,130 @@ def emit_condjump(opcode, dst, a, b, imm=False):
     emit_instr('dp %s+24'%l) # continue as usual
     emit_instr('dp', dst) # branch
 
+def emit_load(bits, reg_dst, reg_addr):
+    reg = {8: 'al', 16: 'ax', 32: 'eax', 64: 'rax'}[bits]
+    emit_binary_op('mov %s, [rdi]'%reg, reg_dst, reg_addr, {'rdi': 'rcx', 'rcx': 'rdi'}, {'rcx': 'rdi', 'rdi': 'rcx'})
+
+def emit_store(bits, reg_src, reg_addr):
+    if bits == 8:
+        emit_binary_op('mov [rax], cl', reg_addr, reg_src)
+    elif bits == 16:
+        emit_binary_op('mov [rdi], cx', reg_addr, reg_src, m1={'rdi': 'rax', 'rax': 'rdi'}, m2={'rax': 'rdi', 'rdi': 'rax'})
+    elif bits == 32:
+        emit_binary_op('mov [rax], ecx', reg_addr, reg_src)
+    elif bits == 64:
+        emit_binary_op('mov [rax], rcx', reg_addr, reg_src)
+
+def emit_icrop(bits, reg):
+    # Sign-extends the low `bits` bits of reg.
+    if bits == 64: return
+    if bits == 32:
+        exchange_regs({'rax': reg, reg: 'rax'})
+        exchange_regs({'r11': 'rdi'})
+        exchange_regs({'rdi': 'rax'})
+        exchange_regs(None)
+        emit_instr('movsxd rax, edi')
+        exchange_regs({'rdi': 'r11'})
+        exchange_regs({reg: 'rax', 'rax': reg})
+    else:
+        reg0 = reg
+        if reg == 'rcx':
+            exchange_regs({'rax': 'rcx', 'rcx': 'rax'})
+            reg = 'rax'
+        exchange_regs({'r11': 'rcx'})
+        emit_load_imm('rcx', 'dq '+str(32-bits))
+        emit_unary_op('shl rax, cl', reg)
+        exchange_regs({'rdi': reg, reg: 'rdi'})
+        exchange_regs(None)
+        emit_instr('sar edi, cl')
+        exchange_regs({'rcx': 'r11'})
+        exchange_regs({'r11': 'rax'})
+        exchange_regs(None)
+        emit_instr('movsxd rax, edi')
+        exchange_regs({'rdi': 'rax'})
+        exchange_regs({'rax': 'r11'})
+        exchange_regs({reg: 'rdi', 'rdi': reg})
+        if reg0 == 'rcx':
+            exchange_regs({'rax': 'rcx', 'rcx': 'rax'})
+
+def is_crop_of(l, reg, bits):
+    # A crop of reg to at most `bits` bits clears whatever an icrop to
+    # `bits` bits would have set.
+    if not l.startswith('crop') or ' ' not in l: return False
+    cmd, arg = l.split(' ', 1)
+    return arg == reg and int(cmd[4:]) <= bits
+
+# Blocks up to this many bytes are moved by unrolled code; larger ones
+# by a loop over their qwords.
+block_move_max = 64
+
+def emit_block_op(cmd, dst, src, n):
+    # memcpy dst, src, n / memset dst, val, n
+    # Moves a qword at a time through r11, then the remaining bytes.
+    # dst and src are advanced along the way and restored at the end.
+    if cmd == 'memset':
+        fill = 'dq '+hex((int(src, 0) & 255) * 0x0101010101010101)
+    def advance(k):
+        emit_binary_op_imm('add rax, rcx', dst, 'dq %d'%k)
+        if cmd == 'memcpy':
+            emit_binary_op_imm('add rax, rcx', src, 'dq %d'%k)
+    def move(sz):
+        if cmd == 'memcpy':
+            emit_load(sz*8, 'r11', src)
+        emit_store(sz*8, 'r11', dst)
+    pos = 0 # how far dst and src are advanced
+    if n > block_move_max:
+        # The loop counts down the qwords in a slot of the chain. rax is
+        # parked in another slot while the counter is in it, and the
+        # conditional jump clobbers r11, so the fill is reloaded each time.
+        count, saved, skip, loop = make_label(), make_label(), make_label(), make_label()
+        exchange_regs(None)
+        emit_instr('pop rsp')
+        emit_instr('dp', skip)
+        emit_instr(count+':')
+        emit_instr('dq 0')
+        emit_instr(saved+':')
+        emit_instr('dq 0')
+        emit_instr(skip+':')
+        def save_rax(slot):
+            exchange_regs(None)
+            emit_instr('pop rsi')
+            emit_instr('dp', slot)
+            emit_instr('mov [rsi], rax')
+        def load_rax(slot):
+            emit_load_imm('rax', 'dp '+slot)
+            exchange_regs(None)
+            emit_instr('mov rax, [rax]')
+        save_rax(saved)
+        emit_load_imm('rax', 'dq %d'%(n // 8))
+        save_rax(count)
+        exchange_regs(None)
+        emit_instr(loop+':')
+        load_rax(saved)
+        if cmd == 'memset':
+            emit_load_imm('r11', fill)
+        move(8)
+        advance(8)
+        save_rax(saved)
+        load_rax(count)
+        emit_binary_op_imm('add rax, rcx', 'rax', 'dq -1')
+        save_rax(count)
+        emit_condjump('ne', loop, 'rax', 'dq 0', imm=True)
+        load_rax(saved)
+        pos = n // 8 * 8
+    if cmd == 'memset' and pos < n:
+        emit_load_imm('r11', fill)
+    off = pos
+    for sz in (8, 4, 2, 1):
+        while n - off >= sz:
+            if off != pos:
+                advance(off-pos)
+                pos = off
+            move(sz)
+            off += sz
+    if pos:
+        advance(-pos)
+
 def format_imm(imm):
     if imm.startswith('.'):
         if imm not in local_labels: local_labels[imm] = make_label()
@@ -243,10 +376,67 @@ def format_imm(imm):
     try: return 'dq '+hex(int(imm, 0))
     except ValueError: return 'dp '+imm
 
+def parse_mem(arg):
+    # "[base+off]", where the base is a register or a label
+    base, off = re.match(r'\[([^+\-\]]+)([+-]\d+)?\]$', arg).groups()
+    return base, int(off or 0)
+
+def format_mem_label(base, off):
+    imm = format_imm(base)
+    return imm+'%+d'%off if off else imm
+
+def emit_mem_addr(reg, arg):
+    base, off = parse_mem(arg)
+    if base in reg_map:
+        emit_mov(reg, reg_map[base])
+        if off:
+            emit_binary_op_imm('add rax, rcx', reg, 'dq %d'%off)
+    else:
+        emit_load_imm(reg, format_mem_label(base, off))
+
+def emit_mem_fast(cmd, args):
+    # Loads to and stores from A that do not need the address in a
+    # register other than rax or rsi. Returns False if there is none.
+    if cmd == 'load64' and args[0] == 'A':
+        emit_mem_addr('rax', args[1])
+        exchange_regs(None)
+        emit_instr('mov rax, [rax]')
+        return True
+    if cmd == 'store64' and args[0] == 'A' and parse_mem(args[1])[0] not in reg_map:
+        exchange_regs(None)
+        emit_instr('pop rsi')
+        emit_instr(format_mem_label(*parse_mem(args[1])))
+        emit_instr('mov [rsi], rax')
+        return True
+    return False
+
+def emit_rmw(cmd, args):
+    # addmN/submN [mem], x: the value is loaded into rax with the address
+    # in rcx, while A waits in r11.
+    bits = int(cmd[4:])
+    instr = 'add rax, rcx' if cmd.startswith('add') else 'sub rax, rcx ; sbb rdx, rcx'
+    exchange_regs({'r11': 'rax'})
+    emit_mem_addr('rcx', args[0])
+    emit_load(bits, 'rax', 'rcx')
+    if args[1] in reg_map:
+        src = reg_map[args[1]]
+        emit_binary_op(instr, 'rax', 'r11' if src == 'rax' else src)
+    else:
+        emit_binary_op_imm(instr, 'rax', format_imm(args[1]))
+    emit_store(bits, 'rax', 'rcx')
+    exchange_regs({'rax': 'r11'})
+
 data_segments = []
 data_partial_words = []
 is_data = -1
 local_labels = {}
+pending_icrop = None
+
+def flush_data_words(seg):
+    assert len(data_partial_words[seg]) % 8 == 0
+    if data_partial_words[seg]:
+        data_segments[seg].append('db '+repr(list(data_partial_words[seg]))[1:-1])
+        data_partial_words[seg] = b''
 
 def emit_nativecall(lbl):
     rdioff = [0]
@@ -367,6 +557,14 @@ while True:
     except EOFError: break
     l = ' '.join(l0.split('#', 1)[0].replace(',', ', ').split())
     if not l: continue
+    if pending_icrop and not any(l.startswith(i) for i in ('.file ', '.loc ')):
+        bits, reg = pending_icrop
+        pending_icrop = None
+        if is_crop_of(l, reg, bits):
+            # "mov eax, [rdi]" already zero-extends.
+            if l == 'crop32 '+reg: continue
+        else:
+            emit_icrop(bits, reg_map[reg])
     if l == '.text':
         is_data = -1
     elif l == '.data' or l.startswith('.data '):
@@ -386,10 +584,7 @@ while True:
             assert lbl.startswith('_')
             local_labels = {k: v for k, v in local_labels.items() if k.startswith('.S')}
         if is_data >= 0:
-            assert len(data_partial_words[is_data]) % 8 == 0
-            if data_partial_words[is_data]:
-                data_segments[is_data].append('db '+repr(list(data_partial_words[is_data]))[1:-1])
-                data_partial_words[is_data] = b''
+            flush_data_words(is_data)
             data_segments[is_data].append(lbl+':')
         else:
             exchange_regs(None)
@@ -416,11 +611,20 @@ while True:
         data_partial_words[is_data] += (int(l[6:]) & 0xffffffffffffffff).to_bytes(8, 'little')
     elif l.startswith('.ptr '):
         assert is_data >= 0
-        assert len(data_partial_words[is_data]) % 8 == 0
-        if data_partial_words[is_data]:
-            data_segments[is_data].append('db '+repr(list(data_partial_words[is_data]))[1:-1])
-        data_partial_words[is_data] = b''
+        flush_data_words(is_data)
         data_segments[is_data].append(format_imm(l[5:]))
+    elif l.startswith('.zero '):
+        assert is_data >= 0
+        n = int(l[6:])
+        # Complete the current word, then emit whole words of zeros as a
+        # single line instead of spelling them out.
+        k = min(n, (-len(data_partial_words[is_data])) % 8)
+        data_partial_words[is_data] += bytes(k)
+        n -= k
+        if n >= 8:
+            flush_data_words(is_data)
+            data_segments[is_data].append('times %d dq 0'%(n // 8))
+        data_partial_words[is_data] += bytes(n % 8)
     elif l.startswith('nativecall '):
         lbl = l[11:]
         emit_nativecall(lbl)
@@ -457,6 +661,17 @@ while True:
         if ' ' in l:
             cmd, args = l.split(' ', 1)
             args = args.split(', ')
+        mem = [i for i, arg in enumerate(args) if arg.startswith('[')]
+        if mem:
+            # B may be clobbered to compute the address.
+            if cmd[:4] in ('addm', 'subm'):
+                emit_rmw(cmd, args)
+                continue
+            if emit_mem_fast(cmd, args):
+                continue
+            assert not cmd.startswith('store') or args[0] != 'B', l
+            emit_mem_addr('rcx', args[mem[0]])
+            args[mem[0]] = 'B'
         if cmd == 'sub' and args[0] == 'SP' and args[1] not in reg_map:
             exchange_regs(None)
             emit_instr('pop rsi')
@@ -479,7 +694,7 @@ while True:
                 emit_binary_op(instr, reg_map[args[0]], reg_map[args[1]])
             else:
                 emit_binary_op_imm(instr, reg_map[args[0]], format_imm(args[1]))
-        elif cmd in ('shl', 'shr'):
+        elif cmd in ('shl', 'shr', 'sar'):
             if args[1] in reg_map:
                 emit_binary_op(cmd+' rax, cl', reg_map[args[0]], reg_map[args[1]])
             else:
@@ -495,63 +710,32 @@ while True:
             if cmd == 'crop64': continue
             bits = int(cmd[4:])
             emit_binary_op_imm('shl rax, cl\nshr rax, cl', reg_map[args[0]], 'dq '+str(64-bits))
-        elif cmd.startswith('icrop') or cmd.startswith('load'):
-            if cmd.startswith('load'):
-                if cmd == 'load8': reg = 'al'
-                elif cmd == 'load16': reg = 'ax'
-                elif cmd == 'load32': reg = 'eax'
-                elif cmd == 'load64': reg = 'rax'
-                emit_binary_op('mov %s, [rdi]'%reg, reg_map[args[0]], reg_map[args[1]], {'rdi': 'rcx', 'rcx': 'rdi'}, {'rcx': 'rdi', 'rdi': 'rcx'})
-                cmd = 'icrop'+cmd[4:]
-            if cmd == 'icrop64': continue
-            elif cmd == 'icrop32':
-                exchange_regs({'r11': 'rdi'})
-                exchange_regs({'rdi': 'rax'})
-                exchange_regs(None)
-                emit_instr('movsxd rax, edi')
-                exchange_regs({'rdi': 'r11'})
-            else:
-                bits = int(cmd[5:])
-                reg = reg_map[args[0]]
-                if reg == 'rcx':
-                    exchange_regs({'rax': 'rcx', 'rcx': 'rax'})
-                    reg = 'rax'
-                exchange_regs({'r11': 'rcx'})
-                emit_load_imm('rcx', 'dq '+str(32-bits))
-                emit_unary_op('shl rax, cl', reg)
-                exchange_regs({'rdi': reg, reg: 'rdi'})
-                exchange_regs(None)
-                emit_instr('sar edi, cl')
-                exchange_regs({'rcx': 'r11'})
-                exchange_regs({'r11': 'rax'})
-                exchange_regs(None)
-                emit_instr('movsxd rax, edi')
-                exchange_regs({'rdi': 'rax'})
-                exchange_regs({'rax': 'r11'})
-                exchange_regs({reg: 'rdi', 'rdi': reg})
-                if reg_map[args[0]] == 'rcx':
-                    exchange_regs({'rax': 'rcx', 'rcx': 'rax'})
+        elif cmd.startswith('icrop'):
+            emit_icrop(int(cmd[5:]), reg_map[args[0]])
+        elif cmd.startswith('load'):
+            emit_load(int(cmd[4:]), reg_map[args[0]], reg_map[args[1]])
+            # The sign extension waits for the next instruction, which may
+            # crop the value instead.
+            if cmd != 'load64':
+                pending_icrop = (int(cmd[4:]), args[0])
         elif cmd in ('idiv', 'imod'):
             post = '\nmov rax, rdx' if cmd == 'imod' else ''
             if args[1] in reg_map:
-                emit_binary_op('cqo ; idiv rsi'+post, reg_map[args[0]], reg_map[args[1]], m1={'rsi': 'rcx', 'rcx': 'rsi'}, m2={'rcx': 'rsi', 'rsi': 'rcx'})
+                emit_binary_op('cqo ; idiv rsi'+post, reg_map[args[0]], reg_map[args[1]], m1={'rsi': 'rcx'})
             else:
                 emit_unary_op('pop rsi\n'+format_imm(args[1])+'\ncqo ; idiv rsi'+post, reg_map[args[0]])
         elif cmd in ('div', 'mod'):
             post = '\nmov rax, rdx' if cmd == 'mod' else '\nsub rax, rcx ; sbb rdx, rcx'
             if args[1] in reg_map:
-                emit_binary_op('pop rdx\ndq 0\ndiv rsi ; add rax, rcx'+post, reg_map[args[0]], reg_map[args[1]], m1={'rsi': 'rcx', 'rcx': 'rsi'}, m2={'rcx': 'rsi', 'rsi': 'rcx'})
+                emit_binary_op('pop rdx\ndq 0\ndiv rsi ; add rax, rcx'+post, reg_map[args[0]], reg_map[args[1]], m1={'rsi': 'rcx'})
             else:
                 emit_unary_op('pop rdx\ndq 0\npop rsi\n'+format_imm(args[1])+'\ndiv rsi ; add rax, rcx'+post, reg_map[args[0]])
         elif cmd.startswith('store'):
-            if cmd == 'store8':
-                emit_binary_op('mov [rax], cl', reg_map[args[1]], reg_map[args[0]])
-            elif cmd == 'store16':
-                emit_binary_op('mov [rdi], cx', reg_map[args[1]], reg_map[args[0]], m1={'rdi': 'rax', 'rax': 'rdi'}, m2={'rax': 'rdi', 'rdi': 'rax'})
-            elif cmd == 'store32':
-                emit_binary_op('mov [rax], ecx', reg_map[args[1]], reg_map[args[0]])
-            elif cmd == 'store64':
-                emit_binary_op('mov [rax], rcx', reg_map[args[1]], reg_map[args[0]])
+            emit_store(int(cmd[5:]), reg_map[args[0]], reg_map[args[1]])
+        elif cmd == 'memcpy':
+            emit_block_op(cmd, reg_map[args[0]], reg_map[args[1]], int(args[2], 0))
+        elif cmd == 'memset':
+            emit_block_op(cmd, reg_map[args[0]], args[1], int(args[2], 0))
         elif cmd in conds:
             if args[1] in reg_map:
                 emit_logic(cmd, reg_map[args[0]], reg_map[args[1]])
@@ -568,6 +752,9 @@ while True:
             assert False, l
     #exchange_regs(None)
 
+if pending_icrop:
+    emit_icrop(pending_icrop[0], reg_map[pending_icrop[1]])
+
 for i in range(len(data_segments)):
     for j in data_segments[i]:
         print(j)
@@ -1,4 +1,4 @@
-import sys
+import sys, re
 
 print('use64')
 
@@ -6,9 +6,111 @@ reg_map = {
     'A': 'rax',
     'B': 'rcx',
     'C': 'rdx',
+    'D': 'r9',
+    'E': 'r12',
+    'F': 'r13',
+    'G': 'r14',
+    'H': 'r15',
     'SP': 'rsp',
     'BP': 'rbp'
 }
+# r12-r15 are callee-saved in the SysV ABI, so the entry wrappers below
+# preserve them for native callers.
+callee_saved = ['r12', 'r13', 'r14', 'r15']
+
+def subreg(reg, bits):
+    if reg[1:].isdigit():
+        return reg+{8: 'b', 16: 'w', 32: 'd'}.get(bits, '')
+    low = reg[1]+'l' if reg[2] == 'x' else reg[1:]+'l'
+    return {8: low, 16: reg[1:], 32: 'e'+reg[1:]}.get(bits, reg)
+
+def mem_operand(arg):
+    # A register holding an address, or a memory operand "[base+off]"
+    # whose base is a register or a label.
+    if arg in reg_map:
+        return '[%s]'%reg_map[arg]
+    base, off = re.match(r'\[([^+\-\]]+)(.*)\]$', arg).groups()
+    if base in reg_map:
+        return '[%s%s]'%(reg_map[base], off)
+    return '[rel %s%s]'%(base, off)
+
+# Blocks up to this size are copied with plain moves; larger ones use the
+# string instructions.
+block_move_max = 64
+
+def block_chunks(n):
+    off = 0
+    for sz in (8, 4, 2, 1):
+        while n - off >= sz:
+            yield off, sz
+            off += sz
+
+def emit_block_op(cmd, dst, arg, n):
+    # rdi, rsi, r10 and r11 are not used by reg_map.
+    if n <= block_move_max:
+        if cmd == 'memset':
+            print('mov r11, %d'%((int(arg, 0) & 255) * 0x0101010101010101))
+        for off, sz in block_chunks(n):
+            if cmd == 'memcpy':
+                print('mov %s, [%s+%d]'%(subreg('r11', sz*8), arg, off))
+            print('mov [%s+%d], %s'%(dst, off, subreg('r11', sz*8)))
+        return
+    print('mov rdi,', dst)
+    if cmd == 'memcpy':
+        print('mov rsi,', arg)
+    print('mov r11, rcx')
+    print('mov rcx,', n)
+    if cmd == 'memcpy':
+        print('rep movsb')
+    else:
+        print('mov r10, rax')
+        print('mov eax,', int(arg, 0) & 255)
+        print('rep stosb')
+        print('mov rax, r10')
+    print('mov rcx, r11')
+
+def find_magic(d, signed):
+    # Returns (m, p) such that x / d == (x * m) >> p for all 64-bit x, with
+    # m small enough for a 64-bit multiply, or None.
+    limit = 1 << (63 if signed else 64)
+    for p in range(64, 128):
+        m = -(-(1 << p) // d)
+        if m >= limit: return None
+        if m * d - (1 << p) <= 1 << (p - 64): return m, p
+
+def emit_div_const(cmd, dst, d):
+    # Division by a constant without a div instruction. Returns False if
+    # there is no cheaper sequence.
+    signed = cmd.startswith('i')
+    is_mod = cmd.endswith('mod')
+    magic = find_magic(d, signed)
+    if not magic: return False
+    m, p = magic
+    # The high half of the product ends up in rdx; rax and rdx are saved
+    # in r10 and r11, and the result is built in rdi.
+    print('mov rsi, %s'%dst)
+    print('mov r10, rax')
+    print('mov r11, rdx')
+    print('mov rax, 0x%x'%m)
+    print('%s rsi'%('imul' if signed else 'mul'))
+    if signed:
+        # A negative quotient is rounded up by one.
+        print('mov rdi, rdx')
+        print('shr rdi, 63')
+        print('sar rdx, %d'%(p - 64))
+        print('add rdx, rdi')
+    else:
+        print('shr rdx, %d'%(p - 64))
+    if is_mod:
+        print('imul rdx, rdx, %d'%d)
+        print('mov rdi, rsi')
+        print('sub rdi, rdx')
+    else:
+        print('mov rdi, rdx')
+    print('mov rax, r10')
+    print('mov rdx, r11')
+    print('mov %s, rdi'%dst)
+    return True
 
 conds = {
     'eq': 'e',
@@ -34,6 +136,8 @@ while True:
         if l.startswith('_'):
             print('global', l[1:-1])
             print(l[1:])
+            for r in callee_saved:
+                print('push', r)
             print('push r9')
             print('push r8')
             print('push rcx')
@@ -42,6 +146,8 @@ while True:
             print('push rdi')
             print('call', l[:-1])
             print('add rsp, 48')
+            for r in reversed(callee_saved):
+                print('pop', r)
             print('mov rax, rcx')
             print('ret')
         print(l)
@@ -82,27 +188,39 @@ while True:
         elif cmd == 'jmp':
             print('jmp', reg_map.get(args[0], args[0]))
         elif cmd in ('shl', 'shr', 'sar'):
-            assert args[1] == 'B'
-            print('%s %s, cl'%(cmd, reg_map[args[0]]))
+            if args[1] == 'B':
+                print('%s %s, cl'%(cmd, reg_map[args[0]]))
+            elif args[1] in reg_map:
+                # The count has to be in cl, which is part of B
+                dst, src = reg_map[args[0]], reg_map[args[1]]
+                if dst == 'rcx':
+                    print('xchg rcx,', src)
+                    print('%s %s, cl'%(cmd, src))
+                    print('xchg rcx,', src)
+                else:
+                    print('push rcx')
+                    print('mov rcx,', src)
+                    print('%s %s, cl'%(cmd, dst))
+                    print('pop rcx')
+            else:
+                print('%s %s, %s'%(cmd, reg_map[args[0]], args[1]))
         elif cmd.startswith('crop') or cmd.startswith('icrop'):
             if cmd in ('crop64', 'icrop64'): continue
-            assert args[0] not in ('SP', 'BP')
+            assert args[0] != 'SP'
             reg0 = reg_map[args[0]]
-            reg = reg0
             sz = int(cmd.split('crop', 1)[1])
+            reg = subreg(reg0, sz)
             asmcmd = 'movsx' if cmd.startswith('i') else 'movzx'
-            if sz == 8:
-                reg = reg[1]+'l'
-            elif sz == 16:
-                reg = reg[1:]
-            elif sz == 32:
-                reg = 'e'+reg[1:]
+            if sz == 32:
                 if asmcmd == 'movsx': asmcmd = 'movsxd'
                 else:
                     asmcmd = 'mov'
                     reg0 = reg
             print('%s %s, %s'%(asmcmd, reg0, reg))
         elif cmd in ('div', 'mod', 'idiv', 'imod'):
+            if args[1] not in reg_map and 1 < int(args[1], 0) < 1 << 31 and \
+                    emit_div_const(cmd, reg_map[args[0]], int(args[1], 0)):
+                continue
             print('push rax')
             print('push rax')
             print('push rdx')
@@ -118,21 +236,15 @@ while True:
             else:
                 print('xor rdx, rdx')
                 print('div rcx')
-            print('mov [rsp+24],', 'rdx' if cmd == 'mod' else 'rax')
+            print('mov [rsp+24],', 'rdx' if cmd.endswith('mod') else 'rax')
             print('pop rcx')
             print('pop rdx')
             print('pop rax')
             print('pop', reg_map[args[0]])
         elif cmd.startswith('store'):
             assert args[0] not in ('SP', 'BP') or cmd == 'store64'
-            reg_src = reg_map[args[0]]
-            if cmd == 'store32':
-                reg_src = 'e'+reg_src[1:]
-            elif cmd == 'store16':
-                reg_src = reg_src[1:]
-            elif cmd == 'store8':
-                reg_src = reg_src[1]+'l'
-            print('mov [%s], %s'%(reg_map[args[1]], reg_src))
+            reg_src = subreg(reg_map[args[0]], int(cmd[5:]))
+            print('mov %s, %s'%(mem_operand(args[1]), reg_src))
         elif cmd.startswith('load'):
             reg_dst = reg_map[args[0]]
             xcmd = 'movsx'
@@ -147,16 +259,31 @@ while True:
             else:
                 xsz = ''
                 xcmd = 'mov'
-            print('%s %s, %s[%s]'%(xcmd, reg_map[args[0]], xsz, reg_map[args[1]]))
+            print('%s %s, %s%s'%(xcmd, reg_map[args[0]], xsz, mem_operand(args[1])))
+        elif cmd[:4] in ('addm', 'subm'):
+            bits = int(cmd[4:])
+            xsz = {8: 'byte', 16: 'word', 32: 'dword', 64: 'qword'}[bits]
+            if args[1] in reg_map:
+                src = subreg(reg_map[args[1]], bits)
+            else:
+                src = int(args[1], 0) & ((1 << min(bits, 32)) - 1)
+                if bits > 32 and src >> 31: src -= 1 << 32
+            print('%s %s %s, %s'%(cmd[:3], xsz, mem_operand(args[0]), src))
         elif cmd in conds:
             assert args[0] not in ('SP', 'BP')
             reg_dst = reg_map[args[0]]
             print('cmp %s, %s'%(reg_dst, reg_map.get(args[1], args[1])))
-            print('set%s %sl'%(conds[cmd], reg_dst[1]))
-            print('movzx %s, %sl'%(reg_dst, reg_dst[1]))
+            print('set%s %s'%(conds[cmd], subreg(reg_dst, 8)))
+            print('movzx %s, %s'%(reg_dst, subreg(reg_dst, 8)))
         elif cmd.startswith('j') and cmd[1:] in conds:
             print('cmp %s, %s'%(reg_map[args[1]], reg_map.get(args[2], args[2])))
             print('j%s %s'%(conds[cmd[1:]], args[0]))
+        elif cmd == 'memcpy':
+            emit_block_op(cmd, reg_map[args[0]], reg_map[args[1]], int(args[2], 0))
+        elif cmd == 'memset':
+            emit_block_op(cmd, reg_map[args[0]], args[1], int(args[2], 0))
+        elif cmd == '.zero':
+            print('times %d db 0'%int(args[0]))
         elif cmd in ('.byte', '.short', '.int', '.long', '.ptr'):
             print({'.byte': 'db', '.short': 'dw', '.int': 'dd', '.long': 'dq', '.ptr': 'dq'}[cmd], args[0])
         elif cmd == '.gadget_addr':
@@ -0,0 +1,459 @@
+// Copyright 2012 Rui Ueyama. Released under the MIT license.
+
+// Sparse conditional constant propagation.
+//
+// Constant folding works on expressions, and value numbering within a
+// basic block. Neither sees that a local assigned a constant before a
+// loop still holds it inside, or that a flag set on every path reaching
+// an if makes one of its branches dead. This pass propagates constants
+// along the control flow of a function, following only the edges that
+// may be taken given what it knows so far: a conditional jump whose
+// operands are constant only lets control flow one way, so what is
+// assigned on the other side does not spoil the values where the two
+// sides meet.
+//
+// Registers are tracked, and so are the slots of the frame when nothing
+// but the function itself can access them (see frame_pointers). A value
+// is a constant, an address in the frame (BP plus an offset) or unknown.
+// Calls leave the frame and E to H alone.
+//
+// Once the values reach a fixpoint, instructions computing a constant are
+// replaced by "mov dst, imm", constant operands that fit in 32 bits
+// become immediates, conditional jumps that always go the same way become
+// jumps or vanish, and the code that is never reached is removed.
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers/sccp.h"
+
+bool stats_sccp = false;
+
+static char* regs[] = { "A", "B", "C", "D", "E", "F", "G", "H", "SP", "BP" };
+#define NREGS (sizeof(regs) / sizeof(*regs))
+
+enum { UNKNOWN, CONST, FRAME };
+
+typedef struct {
+    int kind;
+    long val;  // The constant, or the offset from BP
+} Value;
+
+// A slot of the frame known to hold a constant.
+typedef struct {
+    long off;
+    int size;
+    long val;  // Sign-extended from size bytes, as loads read it
+} Slot;
+
+// What is known at some point of the function.
+typedef struct {
+    bool reached;
+    Value reg[NREGS];
+    Vector* slots;
+} State;
+
+typedef struct {
+    Cfg* cfg;
+    int* fp;  // Registers pointing into the frame, or NULL if it escapes
+    State* in;
+    int* work;
+    int nwork;
+    bool* queued;
+    int nconst, nimm, nbranches, nremoved;
+} SCCP;
+
+static int reg_index(char* s) {
+    for (int i = 0; i < NREGS; i++)
+        if (!strcmp(s, regs[i]))
+            return i;
+    return -1;
+}
+
+static Value unknown() {
+    return (Value){ UNKNOWN, 0 };
+}
+
+static Value constant(long c) {
+    return (Value){ CONST, c };
+}
+
+static bool same_value(Value a, Value b) {
+    return a.kind == b.kind && (a.kind == UNKNOWN || a.val == b.val);
+}
+
+static long sign_extend(long c, int bits) {
+    if (bits >= 64)
+        return c;
+    unsigned long m = 1UL << (bits - 1);
+    unsigned long u = (unsigned long)c & ((1UL << bits) - 1);
+    return (long)((u ^ m) - m);
+}
+
+static Value operand(State* s, char* arg) {
+    long c;
+    if (is_reg(arg))
+        return s->reg[reg_index(arg)];
+    if (is_imm_arg(arg, &c))
+        return constant(c);
+    return unknown();
+}
+
+static void set_reg(State* s, char* reg, Value v) {
+    if (!strcmp(reg, "SP"))
+        v = unknown();
+    s->reg[reg_index(reg)] = v;
+}
+
+static bool fold(char* op, long a, long b, long* r) {
+    unsigned long ua = a, ub = b;
+    if (!strcmp(op, "add")) *r = ua + ub;
+    else if (!strcmp(op, "sub")) *r = ua - ub;
+    else if (!strcmp(op, "mul")) *r = ua * ub;
+    else if (!strcmp(op, "and")) *r = a & b;
+    else if (!strcmp(op, "or")) *r = a | b;
+    else if (!strcmp(op, "xor")) *r = a ^ b;
+    else if (!strcmp(op, "shl")) *r = ua << (b & 63);
+    else if (!strcmp(op, "shr")) *r = ua >> (b & 63);
+    else if (!strcmp(op, "sar")) *r = a >> (b & 63);
+    else if (!strcmp(op, "div") && b) *r = ua / ub;
+    else if (!strcmp(op, "mod") && b) *r = ua % ub;
+    else if (!strcmp(op, "idiv") && b && !(a == LONG_MIN && b == -1)) *r = a / b;
+    else if (!strcmp(op, "imod") && b && !(a == LONG_MIN && b == -1)) *r = a % b;
+    else if (!strcmp(op, "eq")) *r = a == b;
+    else if (!strcmp(op, "ne")) *r = a != b;
+    else if (!strcmp(op, "lt")) *r = a < b;
+    else if (!strcmp(op, "le")) *r = a <= b;
+    else if (!strcmp(op, "gt")) *r = a > b;
+    else if (!strcmp(op, "ge")) *r = a >= b;
+    else return false;
+    return true;
+}
+
+static Value binary(char* op, Value a, Value b) {
+    long r;
+    if (a.kind == CONST && b.kind == CONST)
+        return fold(op, a.val, b.val, &r) ? constant(r) : unknown();
+    if ((!strcmp(op, "mul") || !strcmp(op, "and")) && ((a.kind == CONST && !a.val) || (b.kind == CONST && !b.val)))
+        return constant(0);
+    if (a.kind == FRAME && b.kind == CONST && !strcmp(op, "add"))
+        return (Value){ FRAME, a.val + b.val };
+    if (a.kind == FRAME && b.kind == CONST && !strcmp(op, "sub"))
+        return (Value){ FRAME, a.val - b.val };
+    if (a.kind == CONST && b.kind == FRAME && !strcmp(op, "add"))
+        return (Value){ FRAME, a.val + b.val };
+    return unknown();
+}
+
+static Value unary(char* op, Value a) {
+    int bits;
+    if (a.kind != CONST)
+        return unknown();
+    if ((bits = op_width(op, "icrop")) != 0)
+        return constant(sign_extend(a.val, bits));
+    if ((bits = op_width(op, "crop")) != 0)
+        return constant(bits >= 64 ? a.val : (long)((unsigned long)a.val & ((1UL << bits) - 1)));
+    return constant(~a.val);
+}
+
+// Returns true and sets `off` if the memory operand or address register
+// `arg` is known to point to BP plus `off`. Sets `any` if it may point
+// somewhere else in the frame.
+static bool frame_addr(SCCP* p, State* s, int i, char* arg, long* off, bool* any) {
+    *any = false;
+    if (!p->fp)
+        return false;
+    char* base = is_mem_arg(arg) ? mem_base(arg) : arg;
+    long disp = 0;
+    if (is_mem_arg(arg) && arg[1 + strlen(base)] != ']')
+        disp = strtol(arg + 1 + strlen(base), NULL, 10);
+    if (!is_reg(base))
+        return false;
+    Value v = s->reg[reg_index(base)];
+    if (v.kind == FRAME) {
+        *off = v.val + disp;
+        return true;
+    }
+    // SP itself points below the frame.
+    *any = (p->fp[i] & reg_bit(base)) || (!strcmp(base, "SP") && disp);
+    return false;
+}
+
+static bool overlaps(Slot* s, long off, int size) {
+    return s->off < off + size && off < s->off + s->size;
+}
+
+static Slot* find_slot(State* s, long off, int size) {
+    for (int i = 0; i < vec_len(s->slots); i++) {
+        Slot* slot = vec_get(s->slots, i);
+        if (slot->off == off && slot->size == size)
+            return slot;
+    }
+    return NULL;
+}
+
+static void clobber(State* s, long off, int size) {
+    Vector* slots = make_vector();
+    for (int i = 0; i < vec_len(s->slots); i++) {
+        Slot* slot = vec_get(s->slots, i);
+        if (!overlaps(slot, off, size))
+            vec_push(slots, slot);
+    }
+    s->slots = slots;
+}
+
+// The instruction at index i stores `v` in `size` bytes at `arg`.
+static void store(SCCP* p, State* s, int i, char* arg, int size, Value v) {
+    long off;
+    bool any;
+    if (frame_addr(p, s, i, arg, &off, &any)) {
+        clobber(s, off, size);
+        if (v.kind == CONST) {
+            Slot* slot = malloc(sizeof(Slot));
+            *slot = (Slot){ off, size, sign_extend(v.val, size * 8) };
+            vec_push(s->slots, slot);
+        }
+    } else if (any) {
+        s->slots = make_vector();
+    }
+}
+
+static Value load(SCCP* p, State* s, int i, char* arg, int size) {
+    long off;
+    bool any;
+    if (!frame_addr(p, s, i, arg, &off, &any))
+        return unknown();
+    Slot* slot = find_slot(s, off, size);
+    return slot ? constant(slot->val) : unknown();
+}
+
+// Returns the value the instruction at index i computes into its first
+// operand, or what `s` says it held if it is not written. Updates `s`.
+static Value step(SCCP* p, State* s, int i) {
+    Inst* inst = vec_get(p->cfg->insts, i);
+    char* op = inst->op;
+    char* dst = inst->args[0];
+    Value v = unknown();
+    int size;
+    if (inst->kind != INST_OP || is_cond_jump(inst))
+        return v;
+    if (!strcmp(op, "mov") && !strcmp(dst, "BP") && !strcmp(inst->args[1], "SP")) {
+        v = (Value){ FRAME, 0 };
+    } else if (!strcmp(op, "mov")) {
+        v = operand(s, inst->args[1]);
+    } else if (!strcmp(op, "not") || is_crop_op(op)) {
+        v = unary(op, operand(s, dst));
+    } else if (is_arith_op(op)) {
+        v = binary(op, operand(s, dst), operand(s, inst->args[1]));
+    } else if ((size = op_width(op, "load") / 8) != 0) {
+        v = load(p, s, i, inst->args[1], size);
+    } else if ((size = op_width(op, "store") / 8) != 0) {
+        store(p, s, i, inst->args[1], size, operand(s, dst));
+        v = operand(s, dst);
+        dst = NULL;
+    } else if (is_rmw_op(op)) {
+        size = (op_width(op, "addm") ? op_width(op, "addm") : op_width(op, "subm")) / 8;
+        char* arith = op_width(op, "addm") ? "add" : "sub";
+        Value old = load(p, s, i, dst, size);
+        store(p, s, i, dst, size, binary(arith, old, operand(s, inst->args[1])));
+        dst = NULL;
+    } else if (!strcmp(op, "memcpy") || !strcmp(op, "memset")) {
+        long off;
+        bool any;
+        if (frame_addr(p, s, i, dst, &off, &any))
+            clobber(s, off, atol(inst->args[2]));
+        else if (any)
+            s->slots = make_vector();
+        return v;
+    } else {
+        // A jump, or an instruction that may do anything.
+        if (strcmp(op, "jmp"))
+            for (int r = 0; r < NREGS; r++)
+                s->reg[r] = unknown();
+        return v;
+    }
+    if (has_mem_arg(inst))
+        set_reg(s, "B", unknown());
+    if (!dst)
+        return v;
+    // Slots are relative to BP; they mean something else once it changes.
+    if (!strcmp(dst, "BP"))
+        s->slots = make_vector();
+    set_reg(s, dst, v);
+    return v;
+}
+
+// Evaluates a conditional jump: 1 if it is taken, 0 if not, -1 if unknown.
+static int branch(State* s, Inst* inst) {
+    Value a = operand(s, inst->args[1]);
+    Value b = operand(s, inst->args[2]);
+    long r;
+    if (a.kind != CONST || b.kind != CONST)
+        return -1;
+    fold(inst->op + 1, a.val, b.val, &r);
+    return r;
+}
+
+static State copy_state(State* s) {
+    State r = *s;
+    r.slots = vec_copy(s->slots);
+    return r;
+}
+
+// Merges `s` into what is known on entry of block b.
+static void flow(SCCP* p, Block* b, State* s) {
+    State* in = &p->in[b->id];
+    bool changed = false;
+    if (!in->reached) {
+        *in = copy_state(s);
+        changed = true;
+    } else {
+        for (int r = 0; r < NREGS; r++) {
+            if (in->reg[r].kind != UNKNOWN && !same_value(in->reg[r], s->reg[r])) {
+                in->reg[r] = unknown();
+                changed = true;
+            }
+        }
+        Vector* slots = make_vector();
+        for (int i = 0; i < vec_len(in->slots); i++) {
+            Slot* slot = vec_get(in->slots, i);
+            Slot* other = find_slot(s, slot->off, slot->size);
+            if (other && other->val == slot->val)
+                vec_push(slots, slot);
+        }
+        changed |= vec_len(slots) != vec_len(in->slots);
+        in->slots = slots;
+    }
+    if (changed && !p->queued[b->id]) {
+        p->queued[b->id] = true;
+        p->work[p->nwork++] = b->id;
+    }
+}
+
+static Block* next_block(SCCP* p, Block* b) {
+    return (b->id + 1 < vec_len(p->cfg->blocks)) ? vec_get(p->cfg->blocks, b->id + 1) : NULL;
+}
+
+static void visit(SCCP* p, Block* b) {
+    State s = copy_state(&p->in[b->id]);
+    for (int i = b->begin; i < b->end; i++)
+        step(p, &s, i);
+    Inst* last = block_last(p->cfg, b);
+    if (is_cond_jump(last)) {
+        int taken = branch(&s, last);
+        if (taken != 0)
+            flow(p, map_get(p->cfg->labels, last->args[0]), &s);
+        if (taken != 1 && next_block(p, b))
+            flow(p, next_block(p, b), &s);
+        return;
+    }
+    if (inst_is(last, "jmp") && !map_get(p->cfg->labels, last->args[0])) {
+        // A call returns to the next block, with E to H preserved.
+        for (char* r = "ABCD"; *r; r++)
+            s.reg[*r - 'A'] = unknown();
+    }
+    for (int i = 0; i < vec_len(b->succs); i++)
+        flow(p, vec_get(b->succs, i), &s);
+}
+
+// Can the instruction be replaced by "mov dst, imm" if it computes a
+// constant?
+static bool is_pure(Inst* inst) {
+    char* op = inst->op;
+    if (!strcmp(op, "mov") || !strcmp(op, "not") || is_crop_op(op) || is_arith_op(op) || op_width(op, "load"))
+        return strcmp(inst->args[0], "SP") && strcmp(inst->args[0], "BP");
+    return false;
+}
+
+// Returns true if the second operand of the instruction is a register
+// that may be replaced by an immediate.
+static bool takes_imm(Inst* inst) {
+    return is_arith_op(inst->op) && is_reg(inst->args[1]) && strcmp(inst->args[0], "SP") && strcmp(inst->args[0], "BP");
+}
+
+static void rewrite_block(SCCP* p, Block* b) {
+    Vector* insts = p->cfg->insts;
+    State s = copy_state(&p->in[b->id]);
+    for (int i = b->begin; i < b->end; i++) {
+        Inst* inst = vec_get(insts, i);
+        if (inst->kind != INST_OP)
+            continue;
+        if (is_cond_jump(inst)) {
+            int taken = branch(&s, inst);
+            Value v = operand(&s, inst->args[2]);
+            if (taken == 1) {
+                vec_set(insts, i, make_inst("jmp", 1, inst->args[0]));
+                p->nbranches++;
+            } else if (taken == 0) {
+                vec_set(insts, i, NULL);
+                p->nbranches++;
+            } else if (is_reg(inst->args[2]) && v.kind == CONST && is_imm(v.val)) {
+                vec_set(insts, i, make_inst(inst->op, 3, inst->args[0], inst->args[1], format("%ld", v.val)));
+                p->nimm++;
+            }
+            continue;
+        }
+        Value src = takes_imm(inst) ? operand(&s, inst->args[1]) : unknown();
+        Value v = step(p, &s, i);
+        long c;
+        if (is_pure(inst) && v.kind == CONST) {
+            if (!inst_is(inst, "mov") || !is_imm_arg(inst->args[1], &c) || c != v.val) {
+                vec_set(insts, i, make_inst("mov", 2, inst->args[0], format("%ld", v.val)));
+                p->nconst++;
+            }
+        } else if (src.kind == CONST && is_imm(src.val)) {
+            vec_set(insts, i, make_inst(inst->op, 2, inst->args[0], format("%ld", src.val)));
+            p->nimm++;
+        }
+    }
+}
+
+bool propagate_constants(Vector* insts, Map* addr_taken, char* fname) {
+    SCCP p = { make_cfg(insts, addr_taken) };
+    if (p.cfg->indirect)
+        return false;
+    int n = vec_len(p.cfg->blocks);
+    p.fp = frame_pointers(p.cfg);
+    p.in = calloc(n, sizeof(State));
+    p.work = malloc(n * sizeof(int));
+    p.queued = calloc(n, sizeof(bool));
+    State entry = { true };
+    for (int r = 0; r < NREGS; r++)
+        entry.reg[r] = unknown();
+    entry.slots = make_vector();
+    // Labels other than local ones may be entered from anywhere.
+    for (int i = 0; i < n; i++) {
+        Block* b = vec_get(p.cfg->blocks, i);
+        char* label = block_label(p.cfg, b);
+        if (i == 0 || (label && label[0] != '.'))
+            flow(&p, b, &entry);
+    }
+    while (p.nwork > 0) {
+        int b = p.work[--p.nwork];
+        p.queued[b] = false;
+        visit(&p, vec_get(p.cfg->blocks, b));
+    }
+    for (int i = 0; i < n; i++) {
+        Block* b = vec_get(p.cfg->blocks, i);
+        if (p.in[i].reached) {
+            rewrite_block(&p, b);
+            continue;
+        }
+        for (int j = b->begin; j < b->end; j++) {
+            Inst* inst = vec_get(insts, j);
+            if (inst->kind == INST_OP) {
+                vec_set(insts, j, NULL);
+                p.nremoved++;
+            }
+        }
+    }
+    ir_compact(insts);
+    free(p.fp);
+    free(p.in);
+    free(p.work);
+    free(p.queued);
+    if (stats_sccp)
+        fprintf(stderr, "sccp: %s: %d constants, %d immediates, %d branches folded, %d instructions unreachable\n",
+                fname, p.nconst, p.nimm, p.nbranches, p.nremoved);
+    return p.nconst || p.nimm || p.nbranches || p.nremoved;
+}
@@ -0,0 +1,56 @@
+// Struct copies and zero fills, of sizes moved unrolled and in a loop.
+
+struct Big { long a[512]; char t[5]; };
+struct Small { long a[2]; char t[3]; };
+
+struct Big x, y;
+struct Small s, u;
+
+void copy_big(struct Big* dst, struct Big* src) {
+    *dst = *src;
+}
+
+int fill_small(void) {
+    char c[13] = { 1 };
+    for (int i = 1; i < 13; i++)
+        if (c[i])
+            return 1;
+    return c[0] != 1;
+}
+
+int fill_big(void) {
+    long z[300] = { 0, 5 };
+    for (int i = 2; i < 300; i++)
+        if (z[i])
+            return 1;
+    return z[1] != 5;
+}
+
+int main() {
+    for (int i = 0; i < 512; i++)
+        x.a[i] = i * 3 + 1;
+    for (int i = 0; i < 5; i++)
+        x.t[i] = i + 7;
+    y = x;
+    for (int i = 0; i < 512; i++)
+        if (y.a[i] != i * 3 + 1)
+            return 1;
+    for (int i = 0; i < 5; i++)
+        if (y.t[i] != i + 7)
+            return 2;
+    y.a[7] = 0;
+    y.t[4] = 0;
+    copy_big(&y, &x);
+    if (y.a[7] != 22 || y.t[4] != 11)
+        return 3;
+    s.a[1] = 42;
+    s.t[2] = 9;
+    u = s;
+    if (u.a[1] != 42 || u.t[2] != 9)
+        return 4;
+    if (fill_small())
+        return 5;
+    if (fill_big())
+        return 6;
+    return 0;
+}
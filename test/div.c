@@ -0,0 +1,113 @@
+// Division and modulo by constants, checked against division by volatiles.
+
+#define LIMIT 0x7fffffffffffffffL
+
+volatile long vd[] = { 2, 3, 5, 7, 8, 10, 641, 1 << 20, 1000000007, 1 << 30 };
+
+long values[] = {
+    0, 1, 2, 3, 7, 8, 9, 100, 641, 1000000006, 1000000007, 123456789012345,
+    LIMIT, LIMIT - 1, -1, -2, -3, -7, -8, -9, -100, -641, -123456789012345,
+    -LIMIT, -LIMIT - 1,
+};
+
+#define N (sizeof(values) / sizeof(values[0]))
+
+long sdiv(long x, int i) {
+    switch (i) {
+        case 0: return x / 2;
+        case 1: return x / 3;
+        case 2: return x / 5;
+        case 3: return x / 7;
+        case 4: return x / 8;
+        case 5: return x / 10;
+        case 6: return x / 641;
+        case 7: return x / (1 << 20);
+        case 8: return x / 1000000007;
+        default: return x / (1 << 30);
+    }
+}
+
+long smod(long x, int i) {
+    switch (i) {
+        case 0: return x % 2;
+        case 1: return x % 3;
+        case 2: return x % 5;
+        case 3: return x % 7;
+        case 4: return x % 8;
+        case 5: return x % 10;
+        case 6: return x % 641;
+        case 7: return x % (1 << 20);
+        case 8: return x % 1000000007;
+        default: return x % (1 << 30);
+    }
+}
+
+unsigned long udiv(unsigned long x, int i) {
+    switch (i) {
+        case 0: return x / 2;
+        case 1: return x / 3;
+        case 2: return x / 5;
+        case 3: return x / 7;
+        case 4: return x / 8;
+        case 5: return x / 10;
+        case 6: return x / 641;
+        case 7: return x / (1 << 20);
+        case 8: return x / 1000000007;
+        default: return x / (1 << 30);
+    }
+}
+
+unsigned long umod(unsigned long x, int i) {
+    switch (i) {
+        case 0: return x % 2;
+        case 1: return x % 3;
+        case 2: return x % 5;
+        case 3: return x % 7;
+        case 4: return x % 8;
+        case 5: return x % 10;
+        case 6: return x % 641;
+        case 7: return x % (1 << 20);
+        case 8: return x % 1000000007;
+        default: return x % (1 << 30);
+    }
+}
+
+// 32-bit operands, which are extended before the division.
+int idiv8(int x) {
+    return x / 8;
+}
+
+int imod8(int x) {
+    return x % 8;
+}
+
+unsigned udiv7(unsigned x) {
+    return x / 7;
+}
+
+int imod10(int x) {
+    return x % 10;
+}
+
+int main() {
+    for (int i = 0; i < 10; i++) {
+        long d = vd[i];
+        for (int j = 0; j < N; j++) {
+            long x = values[j];
+            if (sdiv(x, i) != x / d || smod(x, i) != x % d)
+                return 1;
+            if (udiv(x, i) != (unsigned long)x / d || umod(x, i) != (unsigned long)x % d)
+                return 2;
+        }
+    }
+    for (int j = 0; j < N; j++) {
+        int x = values[j];
+        int d8 = vd[4], d10 = vd[5];
+        unsigned d7 = vd[3];
+        if (idiv8(x) != x / d8 || imod8(x) != x % d8 || imod10(x) != x % d10)
+            return 3;
+        if (udiv7(x) != (unsigned)x / d7)
+            return 4;
+    }
+    return 0;
+}
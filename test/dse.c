@@ -0,0 +1,77 @@
+// Stores dead store elimination must keep, and stores it removes.
+
+long* saved;
+
+void save(long* p) {
+    saved = p;
+}
+
+long read_saved() {
+    return *saved;
+}
+
+// The store of 5 is overwritten, but read_saved reads it first.
+long before_call() {
+    long x = 0;
+    save(&x);
+    x = 5;
+    long r = read_saved();
+    x = 6;
+    return r * 10 + read_saved();
+}
+
+// a[2] is read through p, which points to it if i is 2.
+long before_pointer_read(int i) {
+    long a[4] = { 0 };
+    long* p = &a[i];
+    a[2] = 7;
+    long r = *p;
+    a[2] = 8;
+    return r * 10 + a[2];
+}
+
+// The same through a pointer to volatile.
+long before_volatile_read(int i) {
+    long a[4] = { 0 };
+    volatile long* p = &a[i];
+    a[1] = 3;
+    long r = *p;
+    a[1] = 4;
+    return r * 10 + a[1];
+}
+
+// Both stores to a volatile local are done, whether anything reads them
+// or not.
+long volatile_local(long v) {
+    volatile long x = v;
+    x = v + 1;
+    return x;
+}
+
+// The first stores of a[0] and of b are dead.
+long dead_store(long v) {
+    long a[2];
+    a[0] = v * 3;
+    a[0] = v + 1;
+    a[1] = a[0] * 2;
+    struct {
+        long x, y;
+    } b = { 0 };
+    b.x = v;
+    b.y = a[1];
+    return b.x * 100 + b.y;
+}
+
+int main() {
+    if (before_call() != 56)
+        return 1;
+    if (before_pointer_read(2) != 78 || before_pointer_read(1) != 8)
+        return 2;
+    if (before_volatile_read(1) != 34 || before_volatile_read(2) != 4)
+        return 3;
+    if (volatile_local(4) != 5)
+        return 4;
+    if (dead_store(4) != 4 * 100 + 10)
+        return 5;
+    return 0;
+}
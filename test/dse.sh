@@ -0,0 +1,28 @@
+#!/bin/bash
+# Which stores of test/dse.c dead store elimination removes at -O2: none
+# of those read later by a call, through a pointer or by a volatile
+# access, and the dead ones in dead_store. test/dse.c checks the results
+# at every level.
+
+self="$(cd "$(dirname "$0")" && pwd)"
+dir="$(mktemp -d)"
+trap 'rm -rf "$dir"' EXIT
+
+failure() {
+    echo "FAIL: test/dse.sh: $1"
+    exit 1
+}
+
+"$self/../8cc" -O2 -fno-inline -fstats-dse -S -o "$dir/dse.s" "$self/dse.c" 2> "$dir/stats" || failure "build"
+
+for f in before_call before_pointer_read; do
+    grep -q "^dse: $f: 0 dead stores" "$dir/stats" || failure "a store of $f was removed"
+done
+grep -q "^dse: dead_store: [1-9][0-9]* dead stores" "$dir/stats" || failure "no dead store removed in dead_store"
+# Functions accessing volatile objects are left to DCE.
+for f in before_volatile_read volatile_local; do
+    grep -q "^dse: $f:" "$dir/stats" && failure "$f was optimized"
+done
+n=$(sed -n '/^_volatile_local:/,/^_dead_store:/p' "$dir/dse.s" | grep -c 'store64 A, \[BP-8\]')
+[ "$n" == 2 ] || failure "volatile_local stores x $n times"
+exit 0
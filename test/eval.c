@@ -0,0 +1,90 @@
+// Calls evaluated at compile time, and calls left to run time.
+//
+//   ./8cc -O2 -fstats-eval -S -o eval.s test/eval.c
+
+int zero = 0;
+int one = 1;
+int two = 2;
+int three = 3;
+int big = 100;
+int million = 1000000;
+
+static unsigned hash(char* s) {
+    unsigned h = 5381;
+    while (*s)
+        h = h * 33 + *s++;
+    return h;
+}
+
+static long spin(long n) {
+    long s = 0;
+    for (long i = 0; i < n; i++)
+        s += i & 7;
+    return s;
+}
+
+static int nest(int n) {
+    return n ? nest(n - 1) + 2 : 0;
+}
+
+// Larger than the interpreter takes, but not than the ROP stack.
+static int huge(int n) {
+    char buf[20000];
+    buf[19999] = 3;
+    buf[n] = 1;
+    return buf[19999] + buf[n];
+}
+
+static int quotient(int a, int b) {
+    return a / b;
+}
+
+struct Point { int x, y; };
+
+static int local_writes(int n) {
+    int a[4] = { 0 };
+    struct Point p = { 1, 2 };
+    int* q = a + 1;
+    struct Point* pp = &p;
+    *q = n;
+    q[1] = n * 2;
+    pp->y += n;
+    (*pp).x = a[2];
+    return a[1] + a[2] + p.x * 10 + p.y * 100;
+}
+
+static int post_inc_target(int n) {
+    int a[3] = { 3, 113, 7 };
+    int* p = a;
+    *p++ += n;
+    return a[0] * 100 + a[1] + (int)(p - a) * 1000;
+}
+
+static int pre_inc_target(int n) {
+    int a[3] = { 1, 2, 3 };
+    int* p = a;
+    ++*p++;
+    return a[0] + a[1] * 10 + (int)(p - a) * 100 + n;
+}
+
+int main() {
+    if (hash("abc") != hash((char*)"abc" + zero) || hash("abc") != 193485963)
+        return 1;
+    if (spin(1000000) != spin(million))
+        return 2;
+    if (nest(100) != nest(big) || nest(100) != 200)
+        return 3;
+    if (huge(1) != huge(one) || huge(1) != 4)
+        return 4;
+    if (zero && quotient(1, 0))
+        return 5;
+    if (quotient(7, 2) != quotient(7, two))
+        return 6;
+    if (local_writes(3) != local_writes(three) || local_writes(3) != 10 * 6 + 3 + 6 + 500)
+        return 7;
+    if (post_inc_target(10) != post_inc_target(10 + zero))
+        return 8;
+    if (pre_inc_target(0) != pre_inc_target(zero))
+        return 9;
+    return 0;
+}
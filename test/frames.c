@@ -0,0 +1,139 @@
+// Frames addressed relative to SP, and leaf functions without a frame.
+
+#include <stdarg.h>
+
+// A leaf without locals in memory: no frame at all.
+long leaf(long a, long b, long c) {
+    return a * 100 + b * 10 + c;
+}
+
+long sum(int n, ...) {
+    va_list ap;
+    va_start(ap, n);
+    long s = 0;
+    for (int i = 0; i < n; i++)
+        s = s * 10 + va_arg(ap, long);
+    va_end(ap);
+    return s;
+}
+
+// Reads its arguments through a copy of the va_list, after a call.
+long sum_twice(int n, ...) {
+    va_list ap, aq;
+    va_start(ap, n);
+    va_copy(aq, ap);
+    long s = leaf(va_arg(ap, long), 0, 0);
+    for (int i = 0; i < n; i++)
+        s += va_arg(aq, long);
+    return s;
+}
+
+// Passes its own arguments on, with SP moved by the pushes.
+long forward(long a, long b) {
+    return sum(3, a, b, leaf(a, b, 0));
+}
+
+long nested(long a, long b) {
+    return leaf(leaf(a, b, 1), leaf(b, a, 2), leaf(leaf(1, 2, 3), a, b));
+}
+
+void fill(char* p, int n, char c) {
+    for (int i = 0; i < n; i++)
+        p[i] = c + i;
+}
+
+long checksum(char* p, int n) {
+    long s = 0;
+    for (int i = 0; i < n; i++)
+        s = s * 31 + p[i];
+    return s;
+}
+
+// A buffer in the frame, filled by a callee and then indexed at an
+// offset only known at run time.
+long buffer(int n, int at) {
+    char buf[300];
+    fill(buf, n, 'a');
+    char* p = buf + at;
+    return checksum(buf, n) + *p;
+}
+
+// Two buffers whose addresses are passed in one call, along with a
+// nested call.
+long two_buffers(int n) {
+    char a[40], b[24];
+    fill(a, 40, 'A');
+    fill(b, 24, '0');
+    return leaf(checksum(a, n), checksum(b, n > 24 ? 24 : n), (a[n] - 'A') + (b[n % 24] - '0'));
+}
+
+struct big {
+    long x[6];
+};
+
+struct big make_big(long v) {
+    struct big b;
+    for (int i = 0; i < 6; i++)
+        b.x[i] = v + i;
+    return b;
+}
+
+long use_big(struct big* b, long k) {
+    return b->x[0] + b->x[5] * k;
+}
+
+// Structs returned by value, copied through the frame.
+long by_value(long v) {
+    struct big b = make_big(v), c;
+    c = make_big(v * 2);
+    return use_big(&b, 2) + use_big(&c, 3);
+}
+
+// The address of a local passed down and written through while a call
+// is in progress.
+void store_twice(long* p, long (*f)(long, long, long)) {
+    *p = f(*p, 1, 2);
+    *p += f(0, 0, *p % 7);
+}
+
+long through_pointer(long v) {
+    long x = v;
+    store_twice(&x, leaf);
+    return x;
+}
+
+long recurse(int n, long acc) {
+    long local[2] = { acc, n };
+    if (n == 0)
+        return local[0];
+    return recurse(n - 1, local[0] * 2 + local[1]) + local[1];
+}
+
+int main() {
+    if (leaf(1, 2, 3) != 123)
+        return 1;
+    if (sum(4, 1L, 2L, 3L, 4L) != 1234 || sum(0) != 0)
+        return 2;
+    if (sum_twice(3, 7L, 8L, 9L) != 700 + 24)
+        return 3;
+    if (forward(5, 6) != 5 * 100 + 6 * 10 + 560)
+        return 4;
+    if (nested(1, 2) != 121 * 100 + 212 * 10 + (123 * 100 + 10 + 2))
+        return 5;
+    char ref[300];
+    fill(ref, 300, 'a');
+    if (buffer(300, 299) != checksum(ref, 300) + ref[299] || buffer(5, 2) != checksum(ref, 5) + 'c')
+        return 6;
+    char a[40], b[24];
+    fill(a, 40, 'A');
+    fill(b, 24, '0');
+    if (two_buffers(30) != leaf(checksum(a, 30), checksum(b, 24), 30 + 6))
+        return 7;
+    if (by_value(10) != (10 + 15 * 2) + (20 + 25 * 3))
+        return 8;
+    if (through_pointer(4) != 412 + 412 % 7)
+        return 9;
+    if (recurse(3, 1) != 25 + 1 + 2 + 3)
+        return 10;
+    return 0;
+}
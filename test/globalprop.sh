@@ -0,0 +1,35 @@
+#!/bin/bash
+# Whole-program propagation of globals by python/globalprop.py, over the
+# translation units in test/globalprop/. Builds them with rop-yasm-8cc,
+# checks which loads were folded and which data was dropped, then runs
+# the program. Needs yasm, like the other tests.
+
+self="$(cd "$(dirname "$0")" && pwd)"
+dir="$(mktemp -d)"
+trap 'rm -rf "$dir"' EXIT
+
+failure() {
+    echo "FAIL: test/globalprop.sh: $1"
+    exit 1
+}
+
+cd "$dir"
+bash "$self/../python/rop-yasm-8cc" prop.o -O2 "$self/globalprop/data.c" "$self/globalprop/main.c" \
+    "$self/globalprop/named.rop" || failure "build"
+
+# The loads are there before propagation, as memory operands.
+for g in never_stored stored taken_in_data taken_in_code named_in_rop; do
+    grep -q "load32 A, \[_$g\]" temp/linked.s || failure "no load of $g to start with"
+done
+# Never stored to: the load is folded, and the data goes with it.
+grep -q "_never_stored" temp/prop.s && failure "never_stored is still referenced"
+# Stored to, address taken by .ptr or in code, or named in a .rop file.
+for g in stored taken_in_data taken_in_code named_in_rop; do
+    grep -q "load32 A, \[_$g\]" temp/prop.s || failure "the load of $g was folded"
+    grep -q "^_$g:" temp/prop.s || failure "the data of $g was dropped"
+done
+# Never referenced at all.
+grep -q "^_unused:" temp/prop.s && failure "the data of unused was kept"
+
+cc -no-pie -o prop prop.o && ./prop || failure "wrong result"
+exit 0
@@ -0,0 +1,10 @@
+// Globals for test/globalprop.sh, used by main.c in another translation
+// unit.
+
+int never_stored = 5;
+int stored = 1;
+int taken_in_data = 2;
+int taken_in_code = 3;
+int named_in_rop = 4;
+int unused = 6;
+int* ptr = &taken_in_data;
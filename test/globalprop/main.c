@@ -0,0 +1,30 @@
+// Reads the globals of data.c. Exits with 0 if they have the values they
+// are given at run time, whichever of their loads were folded.
+
+extern int never_stored, stored, taken_in_data, taken_in_code, named_in_rop;
+extern int* ptr;
+
+void set(void) {
+    stored = 10;
+}
+
+int* addr(void) {
+    return &taken_in_code;
+}
+
+int main() {
+    set();
+    *ptr = 20;
+    *addr() = 30;
+    if (never_stored != 5)
+        return 1;
+    if (stored != 10)
+        return 2;
+    if (taken_in_data != 20)
+        return 3;
+    if (taken_in_code != 30)
+        return 4;
+    if (named_in_rop != 4)
+        return 5;
+    return 0;
+}
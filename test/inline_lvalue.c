@@ -0,0 +1,30 @@
+// Calls inlined into the lvalue of a compound assignment or of ++ and --.
+
+long ga0[8];
+long k = 1;
+int n;
+
+static long idx(long a) {
+    if (a > 3)
+        return 0;
+    return a;
+}
+
+static long count(long a) {
+    n++;
+    return a;
+}
+
+int main() {
+    ga0[idx(k)] += 5;
+    ga0[idx(k + 1)]++;
+    --ga0[idx(k + 2)];
+    ga0[idx(k + 3)] <<= idx(k);
+    ga0[4] += idx(k + 5) + 7;
+    ga0[count(5)] -= count(3);
+    if (ga0[1] * 10 + ga0[2] != 51)
+        return 1;
+    if (ga0[3] != -1 || ga0[0] != 0 || ga0[4] != 7 || ga0[5] != -3)
+        return 2;
+    return 0;
+}
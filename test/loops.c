@@ -0,0 +1,56 @@
+// Loop invariants and induction variables moved out of loops.
+
+unsigned short g = 7;
+long a[16];
+
+long invariant(int n) {
+    long s = 0;
+    for (int i = 0; i < n; i++)
+        s += g * 3 + a[2];
+    return s;
+}
+
+long invariant_wide(int n) {
+    long s = 0;
+    for (int i = 0; i < n; i++)
+        s += g + 4185936205u;
+    return s;
+}
+
+// a[i] and a[i + 1] walk the array with the same step.
+long strided(int n) {
+    long s = 0;
+    for (int i = 0; i < n; i++)
+        s += a[i] * 2 + a[i + 1];
+    return s;
+}
+
+long stride_wide(int n) {
+    long s = 0;
+    for (long i = 0; i < n; i++)
+        s += i * 0x100000001;
+    return s;
+}
+
+long step_wide(int n) {
+    long s = 0;
+    for (long i = 0; i < 0xc0000000L * n; i += 0xc0000000L)
+        s += i;
+    return s;
+}
+
+int main() {
+    for (int i = 0; i < 16; i++)
+        a[i] = i;
+    if (invariant(5) != 5 * (7 * 3 + 2) || invariant(0))
+        return 1;
+    if (invariant_wide(3) != 3 * (7 + 4185936205L))
+        return 2;
+    if (strided(10) != 2 * 45 + 55)
+        return 3;
+    if (stride_wide(3) != 3 * 0x100000001)
+        return 4;
+    if (step_wide(2) != 0xc0000000L || step_wide(5) != 10 * 0xc0000000L)
+        return 5;
+    return 0;
+}
@@ -0,0 +1,99 @@
+// Values numbered within a basic block, and reused only while valid.
+
+long g;
+int h[4];
+
+long redefined(long a, long b, long c) {
+    long x = a * b + c;
+    a = a + 1;
+    long y = a * b + c;
+    b = x;
+    return x * 1000 + y * 10 + a * b + c;
+}
+
+long redefined_index(long* a, int i) {
+    long x = a[i] + a[i + 1];
+    i++;
+    long y = a[i] + a[i + 1];
+    return x * 100 + y;
+}
+
+// The second a[i] reads what the store through p wrote, if p is &a[i].
+long stored_in_between(long* a, int i, long* p) {
+    long x = a[i] * 2;
+    *p = 7;
+    long y = a[i] * 2;
+    return x * 100 + y;
+}
+
+long store_alias(long* p, long* q) {
+    *p = 1;
+    *q = 2;
+    return *p;
+}
+
+long global_alias(long* p) {
+    g = 1;
+    *p = 2;
+    return g;
+}
+
+int local_alias(int v) {
+    int x = v;
+    int* p = &x;
+    *p = v * 3;
+    return x;
+}
+
+// The store of a byte changes only part of what the wider load reads.
+int narrower_alias(char* p) {
+    h[1] = 0x01020304;
+    p[0] = 0x7f;
+    return h[1];
+}
+
+// The store to a[1] is past the end of the int at a[0] but not of b.
+long wider_alias(long* b) {
+    int* a = (int*)b;
+    b[0] = 0;
+    a[1] = 5;
+    return b[0];
+}
+
+struct pair {
+    int x, y;
+};
+
+int field_alias(struct pair* s, int* p) {
+    s->x = 1;
+    s->y = 2;
+    *p = 3;
+    return s->x * 10 + s->y;
+}
+
+int main() {
+    if (redefined(2, 3, 4) != 10 * 1000 + 13 * 10 + 3 * 10 + 4)
+        return 1;
+    long a[4] = { 1, 2, 4, 8 };
+    if (redefined_index(a, 1) != 6 * 100 + 12)
+        return 2;
+    if (stored_in_between(a, 2, &a[2]) != 8 * 100 + 14)
+        return 3;
+    if (stored_in_between(a, 0, &a[1]) != 2 * 100 + 2)
+        return 4;
+    long l;
+    if (store_alias(&l, &l) != 2 || store_alias(&l, &a[0]) != 1)
+        return 5;
+    if (global_alias(&g) != 2 || global_alias(&l) != 1)
+        return 6;
+    if (local_alias(5) != 15)
+        return 7;
+    if (narrower_alias((char*)&h[1]) != 0x0102037f || narrower_alias((char*)&h[2]) != 0x01020304)
+        return 8;
+    if (wider_alias(&l) != 5L << 32)
+        return 9;
+    struct pair s;
+    if (field_alias(&s, &s.x) != 32 || field_alias(&s, &s.y) != 13 || field_alias(&s, &h[0]) != 12)
+        return 10;
+    return 0;
+}
@@ -0,0 +1,158 @@
+// Scalar locals and parameters kept in registers.
+
+int calls;
+
+long identity(long x) {
+    calls++;
+    return x;
+}
+
+// Each variable is used often in the loop, so it is promoted.
+long widths(int n) {
+    unsigned char uc = 250;
+    signed char sc = 120;
+    unsigned short us = 65530;
+    short ss = 32760;
+    for (int i = 0; i < n; i++) {
+        uc += 3;
+        sc += 3;
+        us += 3;
+        ss += 3;
+    }
+    // Unsigned values compare and shift as unsigned, signed ones as signed.
+    if (uc > 200 || sc > 0 || us > 60000 || ss > 0)
+        return -1;
+    return uc * 1000000000L + (sc + 128) * 1000000L + us * 1000L + (ss + 32768);
+}
+
+long unsigned_ops(unsigned n) {
+    unsigned u = 0;
+    unsigned long ul = 0;
+    for (unsigned i = 0; i < n; i++) {
+        u -= 7;
+        ul -= 7;
+    }
+    return (u >> 28) * 100000 + (ul >> 60) * 1000 + (u / 3) % 1000;
+}
+
+long incdec(int n) {
+    int a = 0, b = 0, c = 0;
+    for (int i = 0; i < n; i++) {
+        a = b++ + ++c;
+        c *= 2;
+        b -= c % 3;
+    }
+    return a * 10000L + b * 100 + c;
+}
+
+long ref_incdec(int n) {
+    int v[3] = { 0, 0, 0 };
+    int* p = v;
+    for (int i = 0; i < n; i++) {
+        p[0] = p[1]++ + ++p[2];
+        p[2] *= 2;
+        p[1] -= p[2] % 3;
+    }
+    return p[0] * 10000L + p[1] * 100 + p[2];
+}
+
+// Values live across calls, including through a function pointer.
+long across_calls(long a, long b, long (*f)(long)) {
+    long x = a * 3, y = b * 5, z = a + b;
+    for (int i = 0; i < 4; i++) {
+        x = f(x) + y;
+        y = identity(y) - z;
+        z += f(i);
+    }
+    return x * 10000 + y * 100 + z;
+}
+
+long ref_across_calls(long a, long b) {
+    long x = a * 3, y = b * 5, z = a + b;
+    for (int i = 0; i < 4; i++) {
+        x = x + y;
+        y = y - z;
+        z += i;
+    }
+    return x * 10000 + y * 100 + z;
+}
+
+long fib(int n) {
+    long a = n, r = 0;
+    if (a < 2)
+        return a;
+    for (int i = 1; i <= 2; i++)
+        r += fib(n - i);
+    return r + a - n;
+}
+
+// More frequently used variables than registers to keep them in.
+long many(int n) {
+    long v0 = 1, v1 = 2, v2 = 3, v3 = 4, v4 = 5, v5 = 6, v6 = 7;
+    for (int i = 0; i < n; i++) {
+        v0 += v6;
+        v1 += v0;
+        v2 += v1;
+        v3 += v2;
+        v4 += v3;
+        v5 += v4;
+        v6 += v5 % 5;
+    }
+    return v0 + v1 * 3 + v2 * 5 + v3 * 7 + v4 * 11 + v5 * 13 + v6 * 17;
+}
+
+void set(long* p, long v) {
+    *p = v;
+}
+
+// x escapes, y does not; both are used often.
+long escaped(int n) {
+    long x = 0, y = 0;
+    for (int i = 0; i < n; i++) {
+        set(&x, x + i);
+        y += x;
+    }
+    return x * 1000 + y;
+}
+
+char* advance(char* p, int n) {
+    char* q = p;
+    for (int i = 0; i < n; i++)
+        q++;
+    return q;
+}
+
+int main() {
+    // 250 + 3 * 3 wraps to 3, 120 + 9 to -127, 65530 + 9 to 3, 32760 + 9
+    // to -32767.
+    if (widths(3) != 3 * 1000000000L + 1 * 1000000L + 3 * 1000L + 1)
+        return 1;
+    unsigned u = -7 * 5;
+    unsigned long ul = -7L * 5;
+    if (unsigned_ops(5) != (u >> 28) * 100000 + (ul >> 60) * 1000 + (u / 3) % 1000)
+        return 2;
+    for (int n = 0; n < 6; n++)
+        if (incdec(n) != ref_incdec(n))
+            return 3;
+    if (across_calls(2, 3, identity) != ref_across_calls(2, 3) || calls != 12)
+        return 4;
+    if (fib(15) != 610)
+        return 5;
+    long v0 = 1, v1 = 2, v2 = 3, v3 = 4, v4 = 5, v5 = 6, v6 = 7;
+    long* v[7] = { &v0, &v1, &v2, &v3, &v4, &v5, &v6 };
+    for (int i = 0; i < 10; i++) {
+        *v[0] += *v[6];
+        for (int j = 1; j < 6; j++)
+            *v[j] += *v[j - 1];
+        *v[6] += *v[5] % 5;
+    }
+    if (many(10) != v0 + v1 * 3 + v2 * 5 + v3 * 7 + v4 * 11 + v5 * 13 + v6 * 17)
+        return 6;
+    // x ends as 0 + 1 + 2 + 3 = 6, y as 0 + 1 + 3 + 6.
+    if (escaped(4) != 6 * 1000 + 10)
+        return 7;
+    char s[8];
+    if (advance(s, 5) != s + 5)
+        return 8;
+    return 0;
+}
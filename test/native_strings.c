@@ -0,0 +1,20 @@
+// String literals of functions calling native functions, moved after them.
+
+int strcmp(char* a, char* b);
+long strlen(char* s);
+int sprintf(char* buf, char* fmt, ...);
+
+char buf[32];
+
+static int check(char* s) {
+    return strcmp(s, "hi 5");
+}
+
+int main() {
+    sprintf(buf, "hi %d", 5);
+    if (check(buf))
+        return 1;
+    if (strlen("four") != 4)
+        return 2;
+    return 0;
+}
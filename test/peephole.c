@@ -0,0 +1,23 @@
+// Immediates of adjacent adds and subs merged into one by the peephole pass.
+
+long sub_twice(long x) {
+    return x - 0x40000000 - 0x40000000;
+}
+
+long add_then_sub(long x) {
+    return x + 0x40000000 - -0x40000000;
+}
+
+long merged(long x) {
+    return x + 0x40000000 - 0x3fffffff - 2;
+}
+
+int main() {
+    if (sub_twice(0) != -0x80000000L || sub_twice(0x80000000L) != 0)
+        return 1;
+    if (add_then_sub(0) != 0x80000000L || add_then_sub(-0x80000000L) != 0)
+        return 2;
+    if (merged(5) != 4)
+        return 3;
+    return 0;
+}
@@ -0,0 +1,53 @@
+// Constants propagated along the control flow.
+
+static int wide_cases(unsigned x) {
+    switch (x) {
+    case 0: return 1;
+    case 0x7fffffff: return 2;
+    case 0x80000000: return 3;
+    case 0xffffffff: return 4;
+    }
+    return 0;
+}
+
+static long wide_shift(int n) {
+    long s = 0;
+    for (int i = 0; i < n; i++)
+        s += (long)i << 33;
+    return s;
+}
+
+static long wide_operands(long x) {
+    long k = 0x100000000;
+    long m = -0x80000001L;
+    if (x == k)
+        return (x >> 1) + m;
+    return x - m;
+}
+
+// The flag is set on every path to the if, so only one branch is live.
+static int flag(int x) {
+    int f;
+    if (x > 0)
+        f = 1;
+    else
+        f = 1;
+    int r = 0;
+    for (int i = 0; i < 3; i++)
+        r += f ? 2 : 100;
+    return r;
+}
+
+int main() {
+    if (wide_cases(0) != 1 || wide_cases(0x7fffffff) != 2 || wide_cases(0x80000000) != 3)
+        return 1;
+    if (wide_cases(0xffffffff) != 4 || wide_cases(1) || wide_cases(0x80000001))
+        return 2;
+    if (wide_shift(4) != 6L << 33)
+        return 3;
+    if (wide_operands(0x100000000) != -1 || wide_operands(1) != 0x80000002)
+        return 4;
+    if (flag(1) != 6 || flag(-1) != 6)
+        return 5;
+    return 0;
+}
@@ -0,0 +1,133 @@
+// Locals of disjoint blocks sharing stack slots.
+
+long* saved;
+
+void fill(long* p, int n, long v) {
+    for (int i = 0; i < n; i++)
+        p[i] = v + i;
+}
+
+void save(long* p) {
+    saved = p;
+}
+
+long sum(long* p, int n) {
+    long s = 0;
+    for (int i = 0; i < n; i++)
+        s += p[i];
+    return s;
+}
+
+// x is declared outside the blocks, but only used in the first one.
+long declared_outside() {
+    long x;
+    long* p;
+    {
+        p = &x;
+        *p = 7;
+    }
+    {
+        long y[4];
+        fill(y, 4, 100);
+        if (sum(y, 4) != 406)
+            return -1;
+    }
+    return *p;
+}
+
+// Each block saves the address of its array in a global and reads it
+// back through that after writing another array of its own.
+long siblings() {
+    long r = 0;
+    {
+        long a[4];
+        fill(a, 4, 10);
+        save(a);
+        long b[4];
+        fill(b, 4, 20);
+        r += sum(saved, 4) * 1000 + sum(b, 4);
+    }
+    {
+        long c[8];
+        fill(c, 8, 30);
+        save(c);
+        long d[2];
+        fill(d, 2, 40);
+        r += sum(saved, 8) * 1000 + sum(d, 2);
+    }
+    return r;
+}
+
+// An outer array, reached through a pointer, outlives the blocks nested
+// in the loop.
+long outer_live(int n) {
+    long keep[4];
+    fill(keep, 4, 1);
+    long* p = keep;
+    long r = 0;
+    for (int i = 0; i < n; i++) {
+        long t[4];
+        fill(t, 4, i * 10);
+        if (i % 2) {
+            long u[6];
+            fill(u, 6, -1);
+            r += sum(u, 6);
+        } else {
+            long v[3];
+            fill(v, 3, -2);
+            r += sum(v, 3);
+        }
+        r += sum(t, 4) + sum(p, 4);
+    }
+    return r;
+}
+
+long by_case(int k) {
+    long r = 0;
+    switch (k) {
+        case 0: {
+            long a[3];
+            fill(a, 3, 5);
+            save(a);
+            r = sum(saved, 3);
+            break;
+        }
+        case 1: {
+            long b[5];
+            fill(b, 5, 6);
+            save(b);
+            r = sum(saved, 5);
+            break;
+        }
+    }
+    return r;
+}
+
+// A statement expression with an array of its own, while the array of
+// the enclosing block is live.
+long in_expression() {
+    long a[4];
+    fill(a, 4, 50);
+    save(a);
+    long r = ({
+        long t[4];
+        fill(t, 4, 60);
+        sum(t, 4);
+    });
+    return r * 1000 + sum(saved, 4);
+}
+
+int main() {
+    if (declared_outside() != 7)
+        return 1;
+    if (siblings() != (46 * 1000 + 86) + (268 * 1000 + 81))
+        return 2;
+    // Sums of t: 6 and 46, of u: 9, of v: -3, of keep: 10.
+    if (outer_live(2) != (-3 + 6 + 10) + (9 + 46 + 10))
+        return 3;
+    if (by_case(0) != 18 || by_case(1) != 40 || by_case(2) != 0)
+        return 4;
+    if (in_expression() != 246 * 1000 + 206)
+        return 5;
+    return 0;
+}
@@ -0,0 +1,101 @@
+// Switch lowering: jump tables, binary search and tests one by one.
+
+#define LONG_MAX 0x7fffffffffffffffL
+#define LONG_MIN (-LONG_MAX - 1)
+
+// Sparse, with a span that does not fit in a long.
+static int extremes(long x) {
+    switch (x) {
+    case LONG_MIN: return 1;
+    case 0: return 2;
+    case 1: return 3;
+    case LONG_MAX: return 4;
+    }
+    return 0;
+}
+
+// Dense, with a table ending at LONG_MAX.
+static int top(long x) {
+    switch (x) {
+    case LONG_MAX - 4: return 1;
+    case LONG_MAX - 3: return 2;
+    case LONG_MAX - 1: return 3;
+    case LONG_MAX: return 4;
+    }
+    return 0;
+}
+
+// Dense, with a table starting at LONG_MIN.
+static int bottom(long x) {
+    switch (x) {
+    case LONG_MIN: return 1;
+    case LONG_MIN + 1 ... LONG_MIN + 2: return 2;
+    case LONG_MIN + 3: return 3;
+    default: return 0;
+    }
+}
+
+static int table(int x) {
+    switch (x) {
+    case 0: return 10;
+    case 1: return 11;
+    case 2: return 12;
+    case 4: return 14;
+    case 5 ... 7: return 15;
+    default: return -1;
+    }
+}
+
+// Searched, with cases above LONG_MAX that sort below the others.
+int unsigned_cases(unsigned long x) {
+    switch (x) {
+    case 1: return 10;
+    case 2: return 20;
+    case 100: return 30;
+    case 5000: return 40;
+    case 0xFFFFFFFFFFFFFFFFUL: return 50;
+    case 0x8000000000000000UL: return 60;
+    }
+    return -1;
+}
+
+int unsigned_int_cases(unsigned x) {
+    switch (x) {
+    case 1: return 10;
+    case 2: return 20;
+    case 100: return 30;
+    case 5000: return 40;
+    case 0xFFFFFFFFU: return 50;
+    case 0x80000000U: return 60;
+    }
+    return -1;
+}
+
+unsigned long all_ones = 0xFFFFFFFFFFFFFFFFUL;
+
+int main() {
+    if (extremes(LONG_MIN) != 1 || extremes(0) != 2 || extremes(1) != 3 || extremes(LONG_MAX) != 4)
+        return 1;
+    if (extremes(-1) || extremes(2) || extremes(LONG_MAX - 1) || extremes(LONG_MIN + 1))
+        return 2;
+    if (top(LONG_MAX - 4) != 1 || top(LONG_MAX - 3) != 2 || top(LONG_MAX - 1) != 3 || top(LONG_MAX) != 4)
+        return 3;
+    if (top(LONG_MAX - 2) || top(LONG_MAX - 5) || top(0) || top(LONG_MIN))
+        return 4;
+    if (bottom(LONG_MIN) != 1 || bottom(LONG_MIN + 2) != 2 || bottom(LONG_MIN + 3) != 3)
+        return 5;
+    if (bottom(LONG_MIN + 4) || bottom(LONG_MAX) || bottom(0))
+        return 6;
+    if (table(0) != 10 || table(2) != 12 || table(3) != -1 || table(6) != 15 || table(8) != -1 || table(-1) != -1)
+        return 7;
+    // The constant argument lets the call be evaluated at compile time.
+    if (unsigned_cases(0xFFFFFFFFFFFFFFFFUL) != 50 || unsigned_cases(all_ones) != 50)
+        return 8;
+    if (unsigned_cases(0x8000000000000000UL) != 60 || unsigned_cases(100) != 30 || unsigned_cases(3) != -1 ||
+        unsigned_cases(all_ones - 1) != -1)
+        return 9;
+    if (unsigned_int_cases(0xFFFFFFFFU) != 50 || unsigned_int_cases(all_ones) != 50 ||
+        unsigned_int_cases(0x80000000U) != 60 || unsigned_int_cases(5000) != 40 || unsigned_int_cases(0) != -1)
+        return 10;
+    return 0;
+}
@@ -0,0 +1,110 @@
+// Calls in tail position turned into jumps, also in the inliner's copies.
+
+int atoi(char* s);
+
+int is_odd(unsigned n);
+
+int is_even(unsigned n) {
+    if (n == 0)
+        return 1;
+    return is_odd(n - 1);
+}
+
+int is_odd(unsigned n) {
+    if (n == 0)
+        return 0;
+    return is_even(n - 1);
+}
+
+long pong(unsigned n, long acc);
+
+// pong takes as many arguments as ping, and ping passes them in the
+// other order.
+long ping(unsigned n, long acc) {
+    if (n == 0)
+        return acc;
+    return pong(n - 1, acc + n);
+}
+
+long pong(unsigned n, long acc) {
+    if (n == 0)
+        return acc;
+    return ping(n, acc);
+}
+
+long steps;
+
+void walk(unsigned n) {
+    if (n == 0)
+        return;
+    steps++;
+    walk(n - 1);
+}
+
+// Functions returning nothing, ending with the call.
+void tock(unsigned n);
+
+void tick(unsigned n) {
+    if (n == 0)
+        return;
+    steps++;
+    tock(n - 1);
+}
+
+void tock(unsigned n) {
+    if (n == 0)
+        return;
+    steps += 2;
+    tick(n - 1);
+}
+
+// Fewer arguments than the caller has parameters.
+long gcd(long a, long b) {
+    if (b == 0)
+        return a;
+    return gcd(b, a % b);
+}
+
+long gcd3(long a, long b, long c) {
+    return gcd(gcd(a, b), c);
+}
+
+// More arguments than the caller has parameters: not a tail call.
+long add3(long a, long b, long c) {
+    return a + b + c;
+}
+
+long twice(long a) {
+    return add3(a, a, 0);
+}
+
+// The result is converted to the return type of the caller.
+int wide(int n) {
+    return n + 256;
+}
+
+char narrow(int n) {
+    return wide(n);
+}
+
+int main(int argc, char** argv) {
+    unsigned n = (argc > 1) ? atoi(argv[1]) : 1000;
+    if (!is_even(n) || is_odd(n) || !is_odd(n + 1))
+        return 1;
+    if (ping(n, 0) != (long)n * (n + 1) / 2)
+        return 2;
+    walk(n);
+    if (steps != n)
+        return 3;
+    steps = 0;
+    tick(n & ~1);
+    if (steps != (n & ~1) / 2 * 3)
+        return 4;
+    if (gcd3(84, 120, 30) != 6)
+        return 5;
+    if (twice(21) != 42)
+        return 6;
+    if (narrow(10) != 10)
+        return 7;
+    return 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/bash
+# The recursion of test/tail_calls.c, deep enough to overflow the stack
+# unless the calls in tail position are turned into jumps. Checks that it
+# does overflow with -fno-tail-calls, so that the depth is enough. Needs
+# yasm, like the other tests.
+
+self="$(cd "$(dirname "$0")" && pwd)"
+dir="$(mktemp -d)"
+trap 'rm -rf "$dir"' EXIT
+
+failure() {
+    echo "FAIL: test/tail_calls.sh: $1"
+    exit 1
+}
+
+depth=10000000
+ulimit -s 8192
+
+for o in -O2 -O3 -Os "-O2 -fno-tail-calls"; do
+    bash "$self/../python/x86_64-yasm-8cc" "$dir/tail.o" $o "$self/tail_calls.c" || failure "build $o"
+    cc -no-pie -o "$dir/tail" "$dir/tail.o" 2> /dev/null || failure "link $o"
+    if [ "$o" == "-O2 -fno-tail-calls" ]; then
+        { "$dir/tail" $depth; } > /dev/null 2>&1 && failure "no overflow without tail calls"
+    else
+        "$dir/tail" $depth || failure "wrong result or overflow at $o"
+    fi
+done
+exit 0
@@ -0,0 +1,110 @@
+// Counted loops unrolled at -O3, for trip counts that do not divide evenly.
+
+long a[32];
+
+long up(int n) {
+    long s = 0;
+    for (int i = 0; i < n; i++)
+        s = s * 3 + a[i];
+    return s;
+}
+
+long down(int n) {
+    long s = 0;
+    for (int i = n; i > 0; i--)
+        s = s * 3 + a[i];
+    return s;
+}
+
+long from(int lo, int hi) {
+    long s = 0;
+    for (int i = lo; i <= hi; i++)
+        s = s * 3 + a[i];
+    return s;
+}
+
+long step3(int n) {
+    long s = 0;
+    for (int i = 0; i < n; i += 3)
+        s = s * 3 + a[i];
+    return s;
+}
+
+// Each iteration depends on the one before.
+void prefix(int n) {
+    for (int i = 1; i < n; i++)
+        a[i] += a[i - 1];
+}
+
+// Constant trip counts, unrolled fully.
+long none() {
+    long s = 1;
+    for (int i = 0; i < 0; i++)
+        s += a[i];
+    return s;
+}
+
+long once() {
+    long s = 1;
+    for (int i = 0; i < 1; i++)
+        s += a[i] * 5;
+    return s;
+}
+
+long five() {
+    long s = 0;
+    for (int i = 0; i < 5; i++)
+        s = s * 3 + a[i];
+    return s;
+}
+
+// The references step by a variable, so that they are not unrolled.
+long ref_up(int lo, int hi, int step) {
+    long s = 0;
+    for (int i = lo; i <= hi; i += step)
+        s = s * 3 + a[i];
+    return s;
+}
+
+long ref_down(int n, int step) {
+    long s = 0;
+    for (int i = n; i > 0; i -= step)
+        s = s * 3 + a[i];
+    return s;
+}
+
+void reset() {
+    for (int i = 0; i < 32; i++)
+        a[i] = i * 7 % 11;
+}
+
+int main() {
+    reset();
+    for (int n = 0; n <= 13; n++) {
+        if (up(n) != ref_up(0, n - 1, 1))
+            return 1;
+        if (down(n) != ref_down(n, 1))
+            return 2;
+        if (from(n, 13) != ref_up(n, 13, 1) || from(13 - n, 13) != ref_up(13 - n, 13, 1))
+            return 3;
+        if (step3(n) != ref_up(0, n - 1, 3))
+            return 4;
+    }
+    if (up(0) || down(0) || step3(0) || from(1, 0))
+        return 5;
+    if (up(1) != a[0] || down(1) != a[1] || step3(1) != a[0] || from(7, 7) != a[7])
+        return 6;
+    if (none() != 1 || once() != 1 + a[0] * 5 || five() != ref_up(0, 4, 1))
+        return 7;
+    for (int n = 0; n <= 9; n++) {
+        reset();
+        prefix(n);
+        long s = 0;
+        for (int i = 0; i < 32; i++) {
+            s += i * 7 % 11;
+            if (a[i] != (i < n ? s : i * 7 % 11))
+                return 8;
+        }
+    }
+    return 0;
+}